@@ -0,0 +1,615 @@
+#ifndef __HIREDIS_EPOLL_H__
+#define __HIREDIS_EPOLL_H__
+
+/*
+ * Built-in event loop for Linux, with no dependency besides the library
+ * itself. It drives any number of redisAsyncContext and
+ * redisClusterAsyncContext and supports the command timeouts of both.
+ *
+ * Two backends are available: epoll, and io_uring where the kernel supports
+ * it. With io_uring the changes of interest of all connections made while
+ * handling events are queued and submitted together with the next wait, so
+ * an iteration of the loop costs a single system call.
+ *
+ *     redisEpollLoop *loop = redisEpollLoopCreate(REDIS_EPOLL_BACKEND_AUTO);
+ *     redisClusterEpollAttach(acc, loop);
+ *     ...
+ *     redisEpollLoopRun(loop);
+ */
+
+#include <sys/epoll.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../hiredis.h"
+#include "../async.h"
+#include "../hircluster.h"
+#include "../hiwheel.h"
+#include "../hiuring.h"
+
+#define REDIS_EPOLL_BACKEND_AUTO        0   /* io_uring when available, else epoll */
+#define REDIS_EPOLL_BACKEND_EPOLL       1
+#define REDIS_EPOLL_BACKEND_IO_URING    2
+
+#define REDIS_EPOLL_READ        0x1
+#define REDIS_EPOLL_WRITE       0x2
+
+#define REDIS_EPOLL_MAX_EVENTS  256
+#define REDIS_EPOLL_TICK_USEC   1000
+
+struct redisEpollLoop;
+
+/* Handler of a plain file descriptor watched with redisEpollWatchFd(). */
+typedef void (redisEpollFdHandler)(void *privdata);
+
+typedef struct redisEpollEvents {
+    struct redisEpollLoop *loop;
+    redisAsyncContext *context;
+    redisEpollFdHandler *handler;   /* set instead of context for plain fds */
+    void *privdata;
+    int fd;
+    uint32_t slot;
+    uint32_t token;     /* renewed on every io_uring registration */
+    int mask;           /* events the context is waiting for */
+    int armed;          /* events registered with the backend */
+    int dirty;          /* registration needs an update, on the dirty list */
+    uint32_t dirty_pos; /* index in the dirty list */
+    struct hiwheel_timer timer;
+} redisEpollEvents;
+
+typedef struct redisEpollLoop {
+    int backend;
+    int epfd;
+    struct hiuring *ring;
+    int stop;
+    uint32_t next_token;
+    struct hiwheel timers;
+
+    /* Attached contexts. Events carry the slot and token of their context
+     * instead of a pointer, so late events of a freed context are dropped. */
+    redisEpollEvents **slots;
+    uint32_t nslots;
+    uint32_t used;
+
+    /* Contexts whose registration is updated on the next wait: all the
+     * changes with io_uring, the ones epoll_ctl() failed on with epoll. An
+     * entry is on the list at most once, so nslots entries are enough. */
+    redisEpollEvents **dirty;
+    uint32_t ndirty;
+} redisEpollLoop;
+
+static inline int64_t redisEpollNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t redisEpollNextToken(redisEpollLoop *loop) {
+    if (++loop->next_token == 0)
+        loop->next_token = 1;
+    return loop->next_token;
+}
+
+static uint64_t redisEpollData(redisEpollEvents *e) {
+    return ((uint64_t)e->token << 32) | e->slot;
+}
+
+static redisEpollEvents *redisEpollLookup(redisEpollLoop *loop, uint64_t data) {
+    uint32_t slot = (uint32_t)data;
+    redisEpollEvents *e;
+
+    if (slot >= loop->nslots)
+        return NULL;
+
+    e = loop->slots[slot];
+    if (e == NULL || e->token != (uint32_t)(data >> 32))
+        return NULL;
+
+    return e;
+}
+
+static void redisEpollAddTimer(redisEpollLoop *loop, struct hiwheel_timer *t, struct timeval tv) {
+    int64_t now = redisEpollNow();
+
+    /* An empty wheel is not kept up to date */
+    if (loop->timers.count == 0)
+        hiwheel_advance(&loop->timers, now);
+
+    hiwheel_add(&loop->timers, t, now + (int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+static void redisEpollAddDirty(redisEpollEvents *e) {
+    redisEpollLoop *loop = e->loop;
+
+    if (e->dirty)
+        return;
+
+    e->dirty = 1;
+    e->dirty_pos = loop->ndirty;
+    loop->dirty[loop->ndirty++] = e;
+}
+
+static void redisEpollDelDirty(redisEpollEvents *e) {
+    redisEpollLoop *loop = e->loop;
+    redisEpollEvents *last;
+
+    if (!e->dirty)
+        return;
+
+    last = loop->dirty[--loop->ndirty];
+    loop->dirty[e->dirty_pos] = last;
+    last->dirty_pos = e->dirty_pos;
+    e->dirty = 0;
+}
+
+/* Bring the epoll registration of e in line with its mask. Returns -1 when
+ * epoll_ctl() failed, leaving the registration as it was. */
+static int redisEpollCtl(redisEpollEvents *e) {
+    redisEpollLoop *loop = e->loop;
+    struct epoll_event ev;
+    int op;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((e->mask & REDIS_EPOLL_READ) ? EPOLLIN : 0) |
+                ((e->mask & REDIS_EPOLL_WRITE) ? EPOLLOUT : 0);
+    ev.data.u64 = redisEpollData(e);
+
+    if (e->armed == 0)
+        op = EPOLL_CTL_ADD;
+    else if (e->mask == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(loop->epfd, op, e->fd, &ev) == -1) {
+        /* The kernel disagrees on whether the fd is registered, e.g. after
+         * it was closed and reused behind the context: go with it. */
+        if (errno == EEXIST && op == EPOLL_CTL_ADD)
+            op = EPOLL_CTL_MOD;
+        else if (errno == ENOENT && op == EPOLL_CTL_MOD)
+            op = EPOLL_CTL_ADD;
+        else if (errno != ENOENT || op != EPOLL_CTL_DEL)
+            return -1;
+
+        if (op != EPOLL_CTL_DEL && epoll_ctl(loop->epfd, op, e->fd, &ev) == -1)
+            return -1;
+    }
+
+    e->armed = e->mask;
+    return 0;
+}
+
+static void redisEpollUpdate(redisEpollEvents *e) {
+    if (e->mask == e->armed)
+        return;
+
+    /* io_uring registrations go with the next wait, failed epoll ones are
+     * retried there. */
+    if (e->loop->backend == REDIS_EPOLL_BACKEND_IO_URING || redisEpollCtl(e) == -1)
+        redisEpollAddDirty(e);
+}
+
+static void redisEpollAddRead(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->mask |= REDIS_EPOLL_READ;
+    redisEpollUpdate(e);
+}
+
+static void redisEpollDelRead(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->mask &= ~REDIS_EPOLL_READ;
+    redisEpollUpdate(e);
+}
+
+static void redisEpollAddWrite(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->mask |= REDIS_EPOLL_WRITE;
+    redisEpollUpdate(e);
+}
+
+static void redisEpollDelWrite(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->mask &= ~REDIS_EPOLL_WRITE;
+    redisEpollUpdate(e);
+}
+
+static void redisEpollTimeout(struct hiwheel_timer *t, void *privdata) {
+    ((void)t);
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    redisAsyncHandleTimeout(e->context);
+}
+
+static void redisEpollSetTimeout(void *privdata, struct timeval tv) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    redisEpollAddTimer(e->loop, &e->timer, tv);
+}
+
+static void redisEpollCleanup(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    redisEpollLoop *loop;
+
+    if (!e)
+        return;
+
+    loop = e->loop;
+
+    if (e->armed) {
+        if (loop->backend == REDIS_EPOLL_BACKEND_IO_URING) {
+            /* The pending poll holds a reference to the socket: cancel it
+             * right away rather than with the next wait. */
+            if (hiuring_prep_poll_remove(loop->ring, redisEpollData(e), 0) == -EBUSY) {
+                hiuring_submit(loop->ring);
+                hiuring_prep_poll_remove(loop->ring, redisEpollData(e), 0);
+            }
+            hiuring_submit(loop->ring);
+        } else {
+            /* Fails when the fd was already closed, which unregistered it */
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+        }
+    }
+
+    redisEpollDelDirty(e);
+
+    hiwheel_del(&loop->timers, &e->timer);
+
+    loop->slots[e->slot] = NULL;
+    loop->used--;
+
+    hi_free(e);
+}
+
+static inline redisEpollLoop *redisEpollLoopCreate(int backend) {
+    redisEpollLoop *loop;
+
+    loop = (redisEpollLoop*)hi_calloc(1, sizeof(*loop));
+    if (loop == NULL)
+        return NULL;
+
+    loop->epfd = -1;
+
+    if (backend != REDIS_EPOLL_BACKEND_EPOLL) {
+        loop->ring = hiuring_create(REDIS_EPOLL_MAX_EVENTS);
+        if (loop->ring != NULL) {
+            loop->backend = REDIS_EPOLL_BACKEND_IO_URING;
+        } else if (backend == REDIS_EPOLL_BACKEND_IO_URING) {
+            hi_free(loop);
+            return NULL;
+        }
+    }
+
+    if (loop->ring == NULL) {
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd == -1) {
+            hi_free(loop);
+            return NULL;
+        }
+        loop->backend = REDIS_EPOLL_BACKEND_EPOLL;
+    }
+
+    hiwheel_init(&loop->timers, redisEpollNow(), REDIS_EPOLL_TICK_USEC);
+
+    return loop;
+}
+
+/* Contexts must have been freed before the loop. */
+static inline void redisEpollLoopFree(redisEpollLoop *loop) {
+    if (loop == NULL)
+        return;
+
+    if (loop->ring != NULL)
+        hiuring_destroy(loop->ring);
+    if (loop->epfd != -1)
+        close(loop->epfd);
+
+    hi_free(loop->slots);
+    hi_free(loop->dirty);
+    hi_free(loop);
+}
+
+static inline void redisEpollLoopStop(redisEpollLoop *loop) {
+    loop->stop = 1;
+}
+
+static void redisEpollDispatch(redisEpollLoop *loop, uint64_t data, int readable, int writable) {
+    redisEpollEvents *e;
+
+    e = redisEpollLookup(loop, data);
+    if (e != NULL && e->handler != NULL) {
+        if (readable)
+            e->handler(e->privdata);
+        return;
+    }
+
+    if (e != NULL && readable && (e->mask & REDIS_EPOLL_READ))
+        redisAsyncHandleRead(e->context);
+
+    /* The read handler may have freed the context */
+    e = redisEpollLookup(loop, data);
+    if (e != NULL && writable && (e->mask & REDIS_EPOLL_WRITE))
+        redisAsyncHandleWrite(e->context);
+}
+
+static int redisEpollPollEpoll(redisEpollLoop *loop, int64_t wait_usec) {
+    struct epoll_event events[REDIS_EPOLL_MAX_EVENTS];
+    redisEpollEvents *e;
+    int timeout_ms, n, i;
+    uint32_t ev, d;
+
+    /* Retry the registrations epoll_ctl() failed on. A context that still
+     * can not be watched is handed the events it waits for, so that its own
+     * read or write reports the error instead of it hanging. */
+    for (d = loop->ndirty; d > 0 && loop->ndirty > 0; d--) {
+        e = loop->dirty[0];
+        redisEpollDelDirty(e);
+        if (e->mask == e->armed || redisEpollCtl(e) == 0)
+            continue;
+
+        if (e->context != NULL)
+            redisEpollDispatch(loop, redisEpollData(e),
+                               e->mask & REDIS_EPOLL_READ, e->mask & REDIS_EPOLL_WRITE);
+    }
+
+    if (loop->ndirty > 0 && (wait_usec < 0 || wait_usec > REDIS_EPOLL_TICK_USEC))
+        wait_usec = REDIS_EPOLL_TICK_USEC;
+
+    timeout_ms = wait_usec < 0 ? -1 : (int)((wait_usec + 999) / 1000);
+
+    n = epoll_wait(loop->epfd, events, REDIS_EPOLL_MAX_EVENTS, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; i++) {
+        ev = events[i].events;
+        redisEpollDispatch(loop, events[i].data.u64,
+                           ev & (EPOLLIN | EPOLLERR | EPOLLHUP),
+                           ev & (EPOLLOUT | EPOLLERR | EPOLLHUP));
+    }
+
+    return n;
+}
+
+static int redisEpollPollUring(redisEpollLoop *loop, int64_t wait_usec) {
+    struct hiuring_cqe cqes[REDIS_EPOLL_MAX_EVENTS];
+    redisEpollEvents *e;
+    unsigned n, i, mask;
+    uint32_t d;
+    int ret;
+
+    /* Queue the registration changes made since the last wait */
+    for (d = 0; d < loop->ndirty; d++) {
+        e = loop->dirty[d];
+        e->dirty = 0;
+        if (e->mask == e->armed)
+            continue;
+
+        if (e->armed) {
+            while (hiuring_prep_poll_remove(loop->ring, redisEpollData(e), 0) == -EBUSY)
+                hiuring_submit(loop->ring);
+            e->armed = 0;
+        }
+
+        if (e->mask) {
+            e->token = redisEpollNextToken(loop);
+            mask = ((e->mask & REDIS_EPOLL_READ) ? HIURING_POLL_IN : 0) |
+                   ((e->mask & REDIS_EPOLL_WRITE) ? HIURING_POLL_OUT : 0);
+            while (hiuring_prep_poll_add(loop->ring, e->fd, mask, redisEpollData(e)) == -EBUSY)
+                hiuring_submit(loop->ring);
+            e->armed = e->mask;
+        }
+    }
+    loop->ndirty = 0;
+
+    ret = hiuring_submit_and_wait(loop->ring, 1, wait_usec);
+    if (ret < 0 && ret != -EINTR && ret != -ETIME)
+        return -1;
+
+    n = hiuring_reap(loop->ring, cqes, REDIS_EPOLL_MAX_EVENTS);
+    for (i = 0; i < n; i++) {
+        e = redisEpollLookup(loop, cqes[i].user_data);
+        if (e == NULL)
+            continue;
+
+        /* Polls are one shot: register again on the next wait */
+        e->armed = 0;
+        redisEpollUpdate(e);
+
+        if (cqes[i].res == -ECANCELED)
+            continue;
+
+        mask = cqes[i].res < 0 ? (HIURING_POLL_ERR) : (unsigned)cqes[i].res;
+        redisEpollDispatch(loop, cqes[i].user_data,
+                           mask & (HIURING_POLL_IN | HIURING_POLL_ERR | HIURING_POLL_HUP),
+                           mask & (HIURING_POLL_OUT | HIURING_POLL_ERR | HIURING_POLL_HUP));
+    }
+
+    return (int)n;
+}
+
+/* Wait for events for at most timeout_usec (-1 for no limit besides the
+ * pending timers) and handle them. Returns the number of I/O events
+ * handled, or -1 on error. */
+static inline int redisEpollLoopRunOnce(redisEpollLoop *loop, int64_t timeout_usec) {
+    int64_t wait_usec;
+    int n;
+
+    wait_usec = hiwheel_next_timeout(&loop->timers);
+    if (wait_usec < 0 || (timeout_usec >= 0 && timeout_usec < wait_usec))
+        wait_usec = timeout_usec;
+
+    if (loop->backend == REDIS_EPOLL_BACKEND_IO_URING)
+        n = redisEpollPollUring(loop, wait_usec);
+    else
+        n = redisEpollPollEpoll(loop, wait_usec);
+
+    hiwheel_advance(&loop->timers, redisEpollNow());
+
+    return n;
+}
+
+/* Run until redisEpollLoopStop() is called or there is nothing left to
+ * wait for. */
+static inline int redisEpollLoopRun(redisEpollLoop *loop) {
+    loop->stop = 0;
+
+    while (!loop->stop && (loop->used > 0 || loop->timers.count > 0)) {
+        if (redisEpollLoopRunOnce(loop, -1) < 0)
+            return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+static redisEpollEvents *redisEpollNewEvents(redisEpollLoop *loop, int fd) {
+    redisEpollEvents *e, **slots;
+    uint32_t slot, nslots;
+
+    for (slot = 0; slot < loop->nslots; slot++) {
+        if (loop->slots[slot] == NULL)
+            break;
+    }
+
+    if (slot == loop->nslots) {
+        nslots = loop->nslots ? loop->nslots * 2 : 16;
+
+        /* Both arrays hold at least nslots entries: the one grown first
+         * stays larger when the second realloc fails, and nslots only
+         * grows once both did. */
+        slots = (redisEpollEvents**)hi_realloc(loop->dirty, nslots * sizeof(*slots));
+        if (slots == NULL)
+            return NULL;
+        loop->dirty = slots;
+
+        slots = (redisEpollEvents**)hi_realloc(loop->slots, nslots * sizeof(*slots));
+        if (slots == NULL)
+            return NULL;
+        memset(slots + loop->nslots, 0, (nslots - loop->nslots) * sizeof(*slots));
+        loop->slots = slots;
+
+        loop->nslots = nslots;
+    }
+
+    e = (redisEpollEvents*)hi_calloc(1, sizeof(*e));
+    if (e == NULL)
+        return NULL;
+
+    e->loop = loop;
+    e->fd = fd;
+    e->slot = slot;
+    e->token = redisEpollNextToken(loop);
+    hiwheel_timer_init(&e->timer, redisEpollTimeout, e);
+
+    loop->slots[slot] = e;
+    loop->used++;
+
+    return e;
+}
+
+/* Call handler on the loop whenever fd is readable, until
+ * redisEpollUnwatchFd(). Used to wake the loop up from other threads, e.g.
+ * with an eventfd. */
+static inline redisEpollEvents *redisEpollWatchFd(redisEpollLoop *loop, int fd,
+                                           redisEpollFdHandler *handler, void *privdata) {
+    redisEpollEvents *e;
+
+    e = redisEpollNewEvents(loop, fd);
+    if (e == NULL)
+        return NULL;
+
+    e->handler = handler;
+    e->privdata = privdata;
+    e->mask = REDIS_EPOLL_READ;
+    redisEpollUpdate(e);
+
+    return e;
+}
+
+static inline void redisEpollUnwatchFd(redisEpollEvents *e) {
+    redisEpollCleanup(e);
+}
+
+static inline int redisEpollAttach(redisAsyncContext *ac, redisEpollLoop *loop) {
+    redisContext *c = &(ac->c);
+    redisEpollEvents *e;
+
+    /* Nothing should be attached when something is already attached */
+    if (ac->ev.data != NULL)
+        return REDIS_ERR;
+
+    /* Create container for context and r/w events */
+    e = redisEpollNewEvents(loop, c->fd);
+    if (e == NULL)
+        return REDIS_ERR;
+
+    e->context = ac;
+
+    /* Register functions to start/stop listening for events */
+    ac->ev.addRead = redisEpollAddRead;
+    ac->ev.delRead = redisEpollDelRead;
+    ac->ev.addWrite = redisEpollAddWrite;
+    ac->ev.delWrite = redisEpollDelWrite;
+    ac->ev.cleanup = redisEpollCleanup;
+    ac->ev.scheduleTimer = redisEpollSetTimeout;
+    ac->ev.data = e;
+
+    return REDIS_OK;
+}
+
+/* Cluster support: every node connection is attached to the loop, and the
+ * loop drives the timer of the command deadlines. */
+
+typedef struct redisClusterEpollTimer {
+    redisEpollLoop *loop;
+    redisClusterAsyncContext *acc;
+    struct hiwheel_timer timer;
+} redisClusterEpollTimer;
+
+static int redisEpollAttach_link(redisAsyncContext *ac, void *loop) {
+    return redisEpollAttach(ac, (redisEpollLoop *)loop);
+}
+
+static void redisClusterEpollTimerHandler(struct hiwheel_timer *t, void *privdata) {
+    ((void)t);
+    redisClusterEpollTimer *ct = (redisClusterEpollTimer*)privdata;
+    redisClusterAsyncHandleTimer(ct->acc);
+}
+
+static void redisClusterEpollScheduleTimer(void *privdata, struct timeval tv) {
+    redisClusterEpollTimer *ct = (redisClusterEpollTimer*)privdata;
+    redisEpollAddTimer(ct->loop, &ct->timer, tv);
+}
+
+static void redisClusterEpollTimerCleanup(void *privdata) {
+    redisClusterEpollTimer *ct = (redisClusterEpollTimer*)privdata;
+    hiwheel_del(&ct->loop->timers, &ct->timer);
+    hi_free(ct);
+}
+
+static inline int redisClusterEpollAttach(redisClusterAsyncContext *acc, redisEpollLoop *loop) {
+    redisClusterEpollTimer *ct;
+
+    if (acc == NULL || loop == NULL)
+        return REDIS_ERR;
+
+    acc->adapter = loop;
+    acc->attach_fn = redisEpollAttach_link;
+
+    if (acc->timer.data == NULL) {
+        ct = (redisClusterEpollTimer*)hi_calloc(1, sizeof(*ct));
+        if (ct == NULL)
+            return REDIS_ERR;
+
+        ct->loop = loop;
+        ct->acc = acc;
+        hiwheel_timer_init(&ct->timer, redisClusterEpollTimerHandler, ct);
+
+        acc->timer.data = ct;
+        acc->timer.schedule = redisClusterEpollScheduleTimer;
+        acc->timer.cleanup = redisClusterEpollTimerCleanup;
+    }
+
+    return REDIS_OK;
+}
+
+#endif
@@ -185,6 +185,20 @@ static int redisLibeventAttach_link(redisAsyncContext *ac, void *base)
     return redisLibeventAttach(ac, (struct event_base *)base);
 }
 
+static void redisClusterLibeventTimerHandler(evutil_socket_t fd, short event, void *arg) {
+    ((void)fd);
+    ((void)event);
+    redisClusterAsyncHandleTimer((redisClusterAsyncContext *)arg);
+}
+
+static void redisClusterLibeventScheduleTimer(void *privdata, struct timeval tv) {
+    evtimer_add((struct event *)privdata, &tv);
+}
+
+static void redisClusterLibeventTimerCleanup(void *privdata) {
+    event_free((struct event *)privdata);
+}
+
 static int redisClusterLibeventAttach(redisClusterAsyncContext *acc, struct event_base *base) {
 
     if(acc == NULL || base == NULL)
@@ -195,6 +209,19 @@ static int redisClusterLibeventAttach(redisClusterAsyncContext *acc, struct even
     acc->adapter = base;
     acc->attach_fn = redisLibeventAttach_link;
 
+    /* Timer driving the per command deadlines */
+    if(acc->timer.data == NULL)
+    {
+        acc->timer.data = evtimer_new(base, redisClusterLibeventTimerHandler, acc);
+        if(acc->timer.data == NULL)
+        {
+            return REDIS_ERR;
+        }
+
+        acc->timer.schedule = redisClusterLibeventScheduleTimer;
+        acc->timer.cleanup = redisClusterLibeventTimerCleanup;
+    }
+
     return REDIS_OK;
 }
 
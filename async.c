@@ -100,7 +100,7 @@ static dictType callbackDict = {
 
 static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     redisAsyncContext *ac;
-    dict *channels = NULL, *patterns = NULL;
+    dict *channels = NULL, *patterns = NULL, *schannels = NULL;
 
     channels = dictCreate(&callbackDict,NULL);
     if (channels == NULL)
@@ -110,6 +110,10 @@ static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     if (patterns == NULL)
         goto oom;
 
+    schannels = dictCreate(&callbackDict,NULL);
+    if (schannels == NULL)
+        goto oom;
+
     ac = hi_realloc(c,sizeof(redisAsyncContext));
     if (ac == NULL)
         goto oom;
@@ -140,15 +144,27 @@ static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
 
     ac->replies.head = NULL;
     ac->replies.tail = NULL;
+    ac->replies.len = 0;
     ac->sub.invalid.head = NULL;
     ac->sub.invalid.tail = NULL;
+    ac->sub.invalid.len = 0;
     ac->sub.channels = channels;
     ac->sub.patterns = patterns;
+    ac->sub.schannels = schannels;
+
+    ac->batch.corked = 0;
+    ac->batch.max_bytes = 0;
+    ac->batch.max_latency = 0;
+    ac->batch.since = 0;
+    ac->batch.timer = 0;
+
+    memset(&ac->flow, 0, sizeof(ac->flow));
 
     return ac;
 oom:
     if (channels) dictRelease(channels);
     if (patterns) dictRelease(patterns);
+    if (schannels) dictRelease(schannels);
     return NULL;
 }
 
@@ -262,6 +278,7 @@ static int __redisPushCallback(redisCallbackList *list, redisCallback *source) {
     if (list->tail != NULL)
         list->tail->next = cb;
     list->tail = cb;
+    list->len++;
     return REDIS_OK;
 }
 
@@ -276,11 +293,35 @@ static int __redisShiftCallback(redisCallbackList *list, redisCallback *target)
         if (target != NULL)
             memcpy(target,cb,sizeof(*cb));
         hi_free(cb);
+        list->len--;
         return REDIS_OK;
     }
     return REDIS_ERR;
 }
 
+/* Update the flow control state after the number of pending replies or the
+ * size of the output buffer changed, notifying the user on every transition. */
+static void __redisAsyncFlowCheck(redisAsyncContext *ac) {
+    redisFlowLimits *l = &ac->flow.limits;
+    size_t pending = ac->replies.len + ac->sub.invalid.len;
+    size_t buffered = sdslen(ac->c.obuf);
+
+    if (!ac->flow.paused) {
+        if ((l->high_pending && pending >= l->high_pending) ||
+            (l->high_bytes && buffered >= l->high_bytes))
+        {
+            ac->flow.paused = 1;
+            if (ac->flow.fn) ac->flow.fn(ac, 1);
+        }
+    } else if ((!l->high_pending || pending <= l->low_pending) &&
+               (!l->high_bytes || buffered <= l->low_bytes))
+    {
+        ac->flow.paused = 0;
+        if (ac->err == REDIS_ERR_BACKPRESSURE) __redisAsyncCopyError(ac);
+        if (ac->flow.fn) ac->flow.fn(ac, 0);
+    }
+}
+
 static void __redisRunCallback(redisAsyncContext *ac, redisCallback *cb, redisReply *reply) {
     redisContext *c = &(ac->c);
     if (cb->fn != NULL) {
@@ -336,6 +377,17 @@ static void __redisAsyncFree(redisAsyncContext *ac) {
         dictRelease(ac->sub.patterns);
     }
 
+    if (ac->sub.schannels) {
+        it = dictGetIterator(ac->sub.schannels);
+        if (it != NULL) {
+            while ((de = dictNext(it)) != NULL)
+                __redisRunCallback(ac,dictGetEntryVal(de),NULL);
+            dictReleaseIterator(it);
+        }
+
+        dictRelease(ac->sub.schannels);
+    }
+
     /* Signal event lib to clean up */
     _EL_CLEANUP(ac);
 
@@ -416,12 +468,26 @@ void redisAsyncDisconnect(redisAsyncContext *ac) {
         __redisAsyncDisconnect(ac);
 }
 
+/* Whether str is the name of a sharded pub/sub command or message type:
+ * SSUBSCRIBE, SUNSUBSCRIBE or SMESSAGE. Their channels are kept apart from
+ * the regular ones, the same name may be used by both. */
+static int __redisIsShardedVariant(const char *str, size_t len) {
+    if (len < 2 || tolower(str[0]) != 's')
+        return 0;
+
+    str++;
+    len--;
+    return (len == 9 && strncasecmp(str,"subscribe",9) == 0) ||
+           (len == 11 && strncasecmp(str,"unsubscribe",11) == 0) ||
+           (len == 7 && strncasecmp(str,"message",7) == 0);
+}
+
 static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply, redisCallback *dstcb) {
     redisContext *c = &(ac->c);
     dict *callbacks;
     redisCallback *cb;
     dictEntry *de;
-    int pvariant;
+    int pvariant, svariant;
     char *stype;
     sds sname;
 
@@ -432,9 +498,12 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
         assert(reply->element[0]->type == REDIS_REPLY_STRING);
         stype = reply->element[0]->str;
         pvariant = (tolower(stype[0]) == 'p') ? 1 : 0;
+        svariant = __redisIsShardedVariant(stype,reply->element[0]->len);
 
         if (pvariant)
             callbacks = ac->sub.patterns;
+        else if (svariant)
+            callbacks = ac->sub.schannels;
         else
             callbacks = ac->sub.channels;
 
@@ -449,14 +518,14 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
             cb = dictGetEntryVal(de);
 
             /* If this is an subscribe reply decrease pending counter. */
-            if (strcasecmp(stype+pvariant,"subscribe") == 0) {
+            if (strcasecmp(stype+pvariant+svariant,"subscribe") == 0) {
                 cb->pending_subs -= 1;
             }
 
             memcpy(dstcb,cb,sizeof(*dstcb));
 
             /* If this is an unsubscribe message, remove it. */
-            if (strcasecmp(stype+pvariant,"unsubscribe") == 0) {
+            if (strcasecmp(stype+pvariant+svariant,"unsubscribe") == 0) {
                 if (cb->pending_subs == 0)
                     dictDelete(callbacks,sname);
 
@@ -467,7 +536,8 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
                 /* Unset subscribed flag only when no pipelined pending subscribe. */
                 if (reply->element[2]->integer == 0
                     && dictSize(ac->sub.channels) == 0
-                    && dictSize(ac->sub.patterns) == 0)
+                    && dictSize(ac->sub.patterns) == 0
+                    && dictSize(ac->sub.schannels) == 0)
                     c->flags &= ~REDIS_SUBSCRIBED;
             }
         }
@@ -496,12 +566,14 @@ static int redisIsSubscribeReply(redisReply *reply) {
         return 0;
     }
 
-    /* Get the string/len moving past 'p' if needed */
-    off = tolower(reply->element[0]->str[0]) == 'p';
+    /* Get the string/len moving past 'p' or 's' if needed */
+    off = tolower(reply->element[0]->str[0]) == 'p' ||
+          __redisIsShardedVariant(reply->element[0]->str, reply->element[0]->len);
     str = reply->element[0]->str + off;
     len = reply->element[0]->len - off;
 
     return !strncasecmp(str, "subscribe", len) ||
+           !strncasecmp(str, "unsubscribe", len) ||
            !strncasecmp(str, "message", len);
 
 }
@@ -591,6 +663,10 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
         }
     }
 
+    /* Replies were consumed: maybe we can accept commands again. */
+    if (ac->flow.paused)
+        __redisAsyncFlowCheck(ac);
+
     /* Disconnect when there was an error reading the reply */
     if (status != REDIS_OK)
         __redisAsyncDisconnect(ac);
@@ -629,6 +705,64 @@ static int __redisAsyncHandleConnect(redisAsyncContext *ac) {
     }
 }
 
+static long long __redisAsyncUsecNow(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+/* Arm the event library timer for the rest of the latency limit, so that
+ * commands buffered by a context nothing else happens on are still flushed.
+ * Left to the command timeout when that one expires first: the single timer
+ * of the context can not wait for both, and the command timeout is armed
+ * again once the latency limit has fired. */
+static void __redisAsyncBatchTimer(redisAsyncContext *ac, long long elapsed) {
+    struct timeval *timeout = ac->c.command_timeout;
+    long long remaining = ac->batch.max_latency - elapsed;
+    struct timeval tv;
+
+    if (ac->batch.timer || ac->ev.scheduleTimer == NULL)
+        return;
+
+    if (timeout && (timeout->tv_sec || timeout->tv_usec) &&
+        ((long long)timeout->tv_sec)*1000000 + timeout->tv_usec <= remaining)
+        return;
+
+    tv.tv_sec = remaining / 1000000;
+    tv.tv_usec = remaining % 1000000;
+    ac->ev.scheduleTimer(ac->ev.data, tv);
+    ac->batch.timer = 1;
+}
+
+/* Called for a corked context after a command was buffered or when the event
+ * loop hands us control. Schedules a write once one of the batch limits has
+ * been reached, otherwise keeps the commands in the output buffer and makes
+ * sure the timer flushes them once the latency limit is reached. */
+static void __redisAsyncBatchCheck(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    size_t buffered = sdslen(c->obuf);
+    long long elapsed = 0;
+
+    if (buffered == 0) {
+        ac->batch.since = 0;
+        return;
+    }
+
+    if (ac->batch.since == 0)
+        ac->batch.since = __redisAsyncUsecNow();
+    else if (ac->batch.max_latency)
+        elapsed = __redisAsyncUsecNow() - ac->batch.since;
+
+    if ((ac->batch.max_bytes && buffered >= ac->batch.max_bytes) ||
+        (ac->batch.max_latency && elapsed >= ac->batch.max_latency))
+    {
+        _EL_ADD_WRITE(ac);
+    } else if (ac->batch.max_latency) {
+        __redisAsyncBatchTimer(ac, elapsed);
+    }
+}
+
 void redisAsyncRead(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
 
@@ -637,6 +771,12 @@ void redisAsyncRead(redisAsyncContext *ac) {
     } else {
         /* Always re-schedule reads */
         _EL_ADD_READ(ac);
+
+        /* Give a corked context the chance to honor its latency limit
+         * before the callbacks run (they may free the context). */
+        if (ac->batch.corked)
+            __redisAsyncBatchCheck(ac);
+
         redisProcessCallbacks(ac);
     }
 }
@@ -667,10 +807,15 @@ void redisAsyncWrite(redisAsyncContext *ac) {
         __redisAsyncDisconnect(ac);
     } else {
         /* Continue writing when not done, stop writing otherwise */
-        if (!done)
+        if (!done) {
             _EL_ADD_WRITE(ac);
-        else
+        } else {
             _EL_DEL_WRITE(ac);
+            ac->batch.since = 0;
+        }
+
+        if (ac->flow.paused)
+            __redisAsyncFlowCheck(ac);
 
         /* Always schedule reads after writes */
         _EL_ADD_READ(ac);
@@ -696,6 +841,23 @@ void redisAsyncHandleTimeout(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     redisCallback cb;
 
+    if (ac->batch.timer) {
+        /* The latency limit of a corked context, not a timeout: nothing
+         * rearmed the timer for the command timeout since. It is armed
+         * again, unless the batch timer took its place once more, for the
+         * replies still pending to time out. */
+        ac->batch.timer = 0;
+        if (sdslen(c->obuf) > 0) {
+            if (ac->batch.corked)
+                __redisAsyncBatchCheck(ac);
+            else
+                _EL_ADD_WRITE(ac);
+        }
+        if (!ac->batch.timer)
+            refreshTimeout(ac);
+        return;
+    }
+
     if ((c->flags & REDIS_CONNECTED) && ac->replies.head == NULL) {
         /* Nothing to do - just an idle timeout */
         return;
@@ -745,7 +907,7 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
     struct dict *cbdict;
     dictEntry *de;
     redisCallback *existcb;
-    int pvariant, hasnext;
+    int pvariant, svariant, hasnext;
     const char *cstr, *astr;
     size_t clen, alen;
     const char *p;
@@ -765,8 +927,20 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
     assert(p != NULL);
     hasnext = (p[0] == '$');
     pvariant = (tolower(cstr[0]) == 'p') ? 1 : 0;
-    cstr += pvariant;
-    clen -= pvariant;
+    svariant = __redisIsShardedVariant(cstr,clen);
+    cstr += pvariant + svariant;
+    clen -= pvariant + svariant;
+
+    /* Shed load while above the high watermarks. (P|S)UNSUBSCRIBE and QUIT
+     * only reduce it and always go through. The error is not the one of the
+     * connection: it is left alone, and ac->err restored on resume. */
+    if (ac->flow.paused && strncasecmp(cstr,"unsubscribe\r\n",13) != 0 &&
+        strncasecmp(cstr,"quit\r\n",6) != 0)
+    {
+        ac->err = REDIS_ERR_BACKPRESSURE;
+        ac->errstr = "Too many pending commands";
+        return REDIS_ERR;
+    }
 
     if (hasnext && strncasecmp(cstr,"subscribe\r\n",11) == 0) {
         c->flags |= REDIS_SUBSCRIBED;
@@ -779,6 +953,8 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
 
             if (pvariant)
                 cbdict = ac->sub.patterns;
+            else if (svariant)
+                cbdict = ac->sub.schannels;
             else
                 cbdict = ac->sub.channels;
 
@@ -794,11 +970,11 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
             if (ret == 0) sdsfree(sname);
         }
     } else if (strncasecmp(cstr,"unsubscribe\r\n",13) == 0) {
-        /* It is only useful to call (P)UNSUBSCRIBE when the context is
+        /* It is only useful to call (P|S)UNSUBSCRIBE when the context is
          * subscribed to one or more channels or patterns. */
         if (!(c->flags & REDIS_SUBSCRIBED)) return REDIS_ERR;
 
-        /* (P)UNSUBSCRIBE does not have its own response: every channel or
+        /* (P|S)UNSUBSCRIBE does not have its own response: every channel or
          * pattern that is unsubscribed will receive a message. This means we
          * should not append a callback function for this command. */
      } else if(strncasecmp(cstr,"monitor\r\n",9) == 0) {
@@ -816,8 +992,14 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
 
     __redisAppendCommand(c,cmd,len);
 
-    /* Always schedule a write when the write buffer is non-empty */
-    _EL_ADD_WRITE(ac);
+    /* Always schedule a write when the write buffer is non-empty, unless
+     * the caller asked us to coalesce writes. */
+    if (ac->batch.corked)
+        __redisAsyncBatchCheck(ac);
+    else
+        _EL_ADD_WRITE(ac);
+
+    __redisAsyncFlowCheck(ac);
 
     return REDIS_OK;
 oom:
@@ -890,3 +1072,85 @@ int redisAsyncSetTimeout(redisAsyncContext *ac, struct timeval tv) {
 
     return REDIS_OK;
 }
+
+/* Stop scheduling a write for every command. Commands keep accumulating in
+ * the output buffer until redisAsyncFlush()/redisAsyncUncork() is called or
+ * one of the limits set with redisAsyncSetBatchLimits() is reached. A write
+ * event that is already pending (e.g. while connecting) still drains the
+ * buffer. */
+int redisAsyncCork(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+
+    if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING))
+        return REDIS_ERR;
+
+    ac->batch.corked = 1;
+    return REDIS_OK;
+}
+
+/* Leave batching mode and flush whatever was buffered. */
+int redisAsyncUncork(redisAsyncContext *ac) {
+    ac->batch.corked = 0;
+    return redisAsyncFlush(ac);
+}
+
+/* Write the output buffer now instead of waiting for the event loop. When
+ * called from a reply callback, or before the connection is established, the
+ * write is scheduled on the event loop instead. Errors are reported through
+ * the disconnect callback, just like errors on loop driven writes. */
+int redisAsyncFlush(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+
+    if (c->err || (c->flags & REDIS_FREEING))
+        return REDIS_ERR;
+
+    if (sdslen(c->obuf) == 0)
+        return REDIS_OK;
+
+    if (!(c->flags & REDIS_CONNECTED) || (c->flags & REDIS_IN_CALLBACK)) {
+        _EL_ADD_WRITE(ac);
+        return REDIS_OK;
+    }
+
+    c->funcs->async_write(ac);
+    return REDIS_OK;
+}
+
+/* Limits for a corked context: a write is scheduled as soon as the output
+ * buffer holds max_bytes, or when the oldest buffered command has waited
+ * max_latency. A zero value disables the corresponding limit. The latency
+ * limit is enforced with the timer of the event library, when the adapter
+ * has one, and checked whenever a command is added or a read event is
+ * handled. */
+int redisAsyncSetBatchLimits(redisAsyncContext *ac, size_t max_bytes, struct timeval max_latency) {
+    ac->batch.max_bytes = max_bytes;
+    ac->batch.max_latency = ((long long)max_latency.tv_sec)*1000000 + max_latency.tv_usec;
+    return REDIS_OK;
+}
+
+/* Set the flow control watermarks. Once the number of replies the context is
+ * still waiting for reaches high_pending, or its output buffer reaches
+ * high_bytes, the context is paused: the redisAsync*Command functions return
+ * REDIS_ERR with ac->err set to REDIS_ERR_BACKPRESSURE, without touching the
+ * connection, until both have drained to low_pending and low_bytes.
+ * (P|S)UNSUBSCRIBE and QUIT are still accepted. */
+int redisAsyncSetFlowLimits(redisAsyncContext *ac, const redisFlowLimits *limits) {
+    if (limits == NULL ||
+        (limits->high_pending && limits->low_pending > limits->high_pending) ||
+        (limits->high_bytes && limits->low_bytes > limits->high_bytes))
+        return REDIS_ERR;
+
+    ac->flow.limits = *limits;
+    __redisAsyncFlowCheck(ac);
+    return REDIS_OK;
+}
+
+redisFlowCallback *redisAsyncSetFlowCallback(redisAsyncContext *ac, redisFlowCallback *fn) {
+    redisFlowCallback *old = ac->flow.fn;
+    ac->flow.fn = fn;
+    return old;
+}
+
+int redisAsyncIsPaused(const redisAsyncContext *ac) {
+    return ac->flow.paused;
+}
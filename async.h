@@ -52,6 +52,7 @@ typedef struct redisCallback {
 /* List of callbacks for either regular replies or pub/sub */
 typedef struct redisCallbackList {
     redisCallback *head, *tail;
+    size_t len;
 } redisCallbackList;
 
 /* Connection callback prototypes */
@@ -59,6 +60,20 @@ typedef void (redisDisconnectCallback)(const struct redisAsyncContext*, int stat
 typedef void (redisConnectCallback)(const struct redisAsyncContext*, int status);
 typedef void(redisTimerCallback)(void *timer, void *privdata);
 
+/* Flow control. The callback is called with paused=1 when a high watermark
+ * is crossed and with paused=0 once everything is back under the low
+ * watermarks. It must not free or disconnect the context. */
+typedef void (redisFlowCallback)(struct redisAsyncContext*, int paused);
+
+/* Watermarks on the number of replies still expected and on the size of the
+ * output buffer. A zero high watermark disables that limit. */
+typedef struct redisFlowLimits {
+    size_t low_pending;
+    size_t high_pending;
+    size_t low_bytes;
+    size_t high_bytes;
+} redisFlowLimits;
+
 /* Context for an async connection to Redis */
 typedef struct redisAsyncContext {
     /* Hold the regular context, so it can be realloc'ed. */
@@ -106,10 +121,31 @@ typedef struct redisAsyncContext {
         redisCallbackList invalid;
         struct dict *channels;
         struct dict *patterns;
+        struct dict *schannels; /* sharded channels (SSUBSCRIBE) */
     } sub;
 
     /* Any configured RESP3 PUSH handler */
     redisAsyncPushFn *push_cb;
+
+    /* Write coalescing. While corked, appending a command does not ask the
+     * event library for a write event, so commands issued back to back end
+     * up in the output buffer and go out in a single write. */
+    struct {
+        int corked;
+        size_t max_bytes; /* Flush once the output buffer reaches this size (0 = no limit) */
+        long long max_latency; /* Flush once the oldest buffered command is this old, in usec (0 = no limit) */
+        long long since; /* Time the first not yet flushed command was buffered, in usec */
+        int timer; /* The event library timer is armed for max_latency */
+    } batch;
+
+    /* Flow control. While paused, new commands are refused (but the
+     * unsubscribe commands and QUIT) until the pending replies and the
+     * output buffer drain below the low watermarks. */
+    struct {
+        redisFlowLimits limits;
+        int paused;
+        redisFlowCallback *fn;
+    } flow;
 } redisAsyncContext;
 
 /* Functions that proxy to hiredis */
@@ -124,6 +160,17 @@ int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallba
 
 redisAsyncPushFn *redisAsyncSetPushCallback(redisAsyncContext *ac, redisAsyncPushFn *fn);
 int redisAsyncSetTimeout(redisAsyncContext *ac, struct timeval tv);
+
+/* Flow control: see the "Backpressure" section of the README. */
+int redisAsyncSetFlowLimits(redisAsyncContext *ac, const redisFlowLimits *limits);
+redisFlowCallback *redisAsyncSetFlowCallback(redisAsyncContext *ac, redisFlowCallback *fn);
+int redisAsyncIsPaused(const redisAsyncContext *ac);
+
+/* Write coalescing: see the "Batching writes" section of the README. */
+int redisAsyncCork(redisAsyncContext *ac);
+int redisAsyncUncork(redisAsyncContext *ac);
+int redisAsyncFlush(redisAsyncContext *ac);
+int redisAsyncSetBatchLimits(redisAsyncContext *ac, size_t max_bytes, struct timeval max_latency);
 void redisAsyncDisconnect(redisAsyncContext *ac);
 void redisAsyncFree(redisAsyncContext *ac);
 
@@ -60,6 +60,7 @@ static inline void refreshTimeout(redisAsyncContext *ctx) {
     #define REDIS_EL_TIMER(ac, tvp) \
         if ((ac)->ev.scheduleTimer && REDIS_TIMER_ISSET(tvp)) { \
             (ac)->ev.scheduleTimer((ac)->ev.data, *(tvp)); \
+            (ac)->batch.timer = 0; \
         }
 
     if (ctx->c.flags & REDIS_CONNECTED) {
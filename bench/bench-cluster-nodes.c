@@ -0,0 +1,516 @@
+/*
+ * Compare parse_cluster_nodes() with the previous, sdssplitlen() based
+ * parser on a synthetic CLUSTER NODES reply.
+ *
+ *   bench-cluster-nodes [masters [replicas-per-master [iterations]]]
+ *
+ * The defaults give a 400 nodes cluster: 200 masters with one replica
+ * each, every master owning a few slot ranges.
+ */
+#include "hircluster.c"
+
+#include <time.h>
+
+#ifdef BENCH_COUNT_ALLOCS
+/* Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc. */
+static unsigned long bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs ++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs ++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs ++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+/*
+ * The previous parser of the "cluster nodes" reply, splitting every line
+ * and field in sds strings: the baseline parse_cluster_nodes() is compared
+ * with.
+ */
+static dict *
+parse_cluster_nodes_old(redisClusterContext *cc, 
+    char *str, int str_len, int flags)
+{
+    int ret;
+    dict *nodes = NULL;
+    dict *nodes_name = NULL;
+    cluster_node *master, *slave;
+    cluster_slot *slot;
+    char *pos, *start, *end, *line_start, *line_end;
+    char *role;
+    int role_len;
+    uint8_t myself = 0;
+    int slot_start, slot_end;
+    sds *part = NULL, *slot_start_end = NULL;
+    int count_part = 0, count_slot_start_end = 0;
+    int k;
+    int len;
+
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    if(nodes == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "out of memory");
+        goto error;
+    }
+
+    start = str;
+    end = start + str_len;
+    
+    line_start = start;
+
+    for(pos = start; pos < end; pos ++){
+        if(*pos == '\n'){
+            line_end = pos - 1;
+            len = line_end - line_start;
+            
+            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+
+            if(part == NULL || count_part < 8){
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "split cluster nodes error");
+                goto error;
+            }
+
+            //the address string is ":0", skip this node.
+            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0){
+                sdsfreesplitres(part, count_part);
+                count_part = 0;
+                part = NULL;
+                
+                start = pos + 1;
+                line_start = start;
+                pos = start;
+                
+                continue;
+            }
+
+            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0){
+                role_len = sdslen(part[2]) - 7;
+                role = part[2] + 7;
+                myself = 1;
+            }else{
+                role_len = sdslen(part[2]);
+                role = part[2];
+            }
+
+            //add master node
+            if(role_len >= 6 && memcmp(role, "master", 6) == 0){
+                if(count_part < 8){
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                        "Master node parts number error: less than 8.");
+                    goto error;
+                }
+                
+                master = node_get_with_nodes(cc, 
+                    part, count_part, REDIS_ROLE_MASTER);
+                if(master == NULL){
+                    goto error;
+                }
+
+                ret = dictAdd(nodes, 
+                    sdsnewlen(master->addr, sdslen(master->addr)), master);
+                if(ret != DICT_OK){
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                        "The address already exists in the nodes");
+                    cluster_node_deinit(master);
+                    hi_free(master);
+                    goto error;
+                }
+
+                if(flags & HIRCLUSTER_FLAG_ADD_SLAVE){
+                    ret = cluster_master_slave_mapping_with_name(cc, 
+                        &nodes_name, master, master->name);
+                    if(ret != REDIS_OK){
+                        cluster_node_deinit(master);
+                        hi_free(master);
+                        goto error;
+                    }
+                }
+
+                if(myself) master->myself = 1;
+                
+                for(k = 8; k < count_part; k ++){
+                    slot_start_end = sdssplitlen(part[k], 
+                        sdslen(part[k]), "-", 1, &count_slot_start_end);
+                    
+                    if(slot_start_end == NULL){
+                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                            "split slot start end error(NULL)");
+                        goto error;
+                    }else if(count_slot_start_end == 1){
+                        slot_start = 
+                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
+                        slot_end = slot_start;
+                    }else if(count_slot_start_end == 2){
+                        slot_start = 
+                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
+                        slot_end = 
+                            hi_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
+                    }else{
+                        //add open slot for master
+                        if(flags & HIRCLUSTER_FLAG_ADD_OPENSLOT && 
+                            count_slot_start_end == 3 && 
+                            sdslen(slot_start_end[0]) > 1 &&
+                            sdslen(slot_start_end[1]) == 1 && 
+                            sdslen(slot_start_end[2]) > 1 && 
+                            slot_start_end[0][0] == '[' && 
+                            slot_start_end[2][sdslen(slot_start_end[2])-1] == ']'){
+                            
+                            copen_slot *oslot, **oslot_elem;
+                            
+                            sdsrange(slot_start_end[0], 1, -1);
+                            sdsrange(slot_start_end[2], 0, -2);
+                            
+                            if(slot_start_end[1][0] == '>'){
+                                oslot = cluster_open_slot_create(
+                                    hi_atoi(slot_start_end[0],
+                                    sdslen(slot_start_end[0])), 
+                                    1, slot_start_end[2], master);
+                                if(oslot == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "create open slot error");
+                                    goto error;
+                                }
+ 
+                                if(master->migrating == NULL){
+                                    master->migrating = hiarray_create(1, sizeof(oslot));
+                                    if(master->migrating == NULL){
+                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                            "create migrating array error");
+                                        cluster_open_slot_destroy(oslot);
+                                        goto error;
+                                    }
+                                }
+
+                                oslot_elem = hiarray_push(master->migrating);
+                                if(oslot_elem == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "Push migrating array error: out of memory");
+                                    cluster_open_slot_destroy(oslot);
+                                    goto error;
+                                }
+
+                                *oslot_elem = oslot;
+                            }else if(slot_start_end[1][0] == '<'){
+                                oslot = cluster_open_slot_create(hi_atoi(slot_start_end[0],
+                                    sdslen(slot_start_end[0])), 0, slot_start_end[2],
+                                    master);
+                                if(oslot == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "create open slot error");
+                                    goto error;
+                                }
+
+                                if(master->importing == NULL){
+                                    master->importing = hiarray_create(1, sizeof(oslot));
+                                    if(master->importing == NULL){
+                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                            "create migrating array error");
+                                        cluster_open_slot_destroy(oslot);
+                                        goto error;
+                                    }
+                                }
+
+                                oslot_elem = hiarray_push(master->importing);
+                                if(oslot_elem == NULL){
+                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                        "push migrating array error: out of memory");
+                                    cluster_open_slot_destroy(oslot);
+                                    goto error;
+                                }
+
+                                *oslot_elem = oslot;
+                            }
+                        }
+                        
+                        slot_start = -1;
+                        slot_end = -1;
+                    }
+                    
+                    sdsfreesplitres(slot_start_end, count_slot_start_end);
+                    count_slot_start_end = 0;
+                    slot_start_end = NULL;
+
+                    if(slot_start < 0 || slot_end < 0 || 
+                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS){
+                        continue;
+                    }
+
+                    slot = cluster_slot_create(master);
+                    if(slot == NULL){
+                        __redisClusterSetError(cc,REDIS_ERR_OOM,
+                            "Out of memory");
+                        goto error;
+                    }
+                    
+                    slot->start = (uint32_t)slot_start;
+                    slot->end = (uint32_t)slot_end;                    
+                }
+
+            }
+            //add slave node, unless it is failing (fail or fail?)
+            else if((flags & HIRCLUSTER_FLAG_ADD_SLAVE) && 
+                (role_len >= 5 && memcmp(role, "slave", 5) == 0) &&
+                strstr(role, "fail") == NULL){
+                slave = node_get_with_nodes(cc, part, 
+                    count_part, REDIS_ROLE_SLAVE);
+                if(slave == NULL){
+                    goto error;
+                }
+
+                ret = cluster_master_slave_mapping_with_name(cc, 
+                    &nodes_name, slave, part[3]);
+                if(ret != REDIS_OK){
+                    cluster_node_deinit(slave);
+                    hi_free(slave);
+                    goto error;
+                }
+
+                if(myself) slave->myself = 1;
+            }
+
+            if(myself == 1){
+                myself = 0;
+            }
+
+            sdsfreesplitres(part, count_part);
+            count_part = 0;
+            part = NULL;
+            
+            start = pos + 1;
+            line_start = start;
+            pos = start;
+        }
+    }
+
+    if(nodes_name != NULL){
+        dictRelease(nodes_name);
+    }
+    
+    return nodes;
+
+error:
+        
+    if(part != NULL){
+        sdsfreesplitres(part, count_part);
+        count_part = 0;
+        part = NULL;
+    }
+
+    if(slot_start_end != NULL){
+        sdsfreesplitres(slot_start_end, count_slot_start_end);
+        count_slot_start_end = 0;
+        slot_start_end = NULL;
+    }
+
+    if(nodes != NULL){
+        dictRelease(nodes);
+    }
+
+    if(nodes_name != NULL){
+        dictRelease(nodes_name);
+    }
+    
+    return NULL;
+}
+
+typedef dict *bench_parse_fn(redisClusterContext *cc, char *str,
+    int str_len, int flags);
+
+static sds bench_reply(int masters, int replicas)
+{
+    sds reply = sdsempty();
+    int i, j, slot = 0, per, start;
+
+    per = REDIS_CLUSTER_SLOTS/masters;
+
+    for(i = 0; i < masters; i ++)
+    {
+        reply = sdscatprintf(reply,
+            "%08x%032x 10.0.%d.%d:6379@16379 %smaster - 0 1700000000000 %d connected",
+            i, i, i/250, i%250 + 1, i == 0 ? "myself," : "", i + 1);
+
+        /* Split the share in a range, a few single slots and a range. */
+        start = slot;
+        slot = i == masters - 1 ? REDIS_CLUSTER_SLOTS : slot + per;
+        if(slot - start > 8)
+        {
+            reply = sdscatprintf(reply, " %d-%d %d %d %d-%d", start,
+                start + (slot - start)/2 - 1, start + (slot - start)/2,
+                start + (slot - start)/2 + 1, start + (slot - start)/2 + 2,
+                slot - 1);
+        }
+        else
+        {
+            reply = sdscatprintf(reply, " %d-%d", start, slot - 1);
+        }
+
+        reply = sdscat(reply, "\n");
+
+        for(j = 0; j < replicas; j ++)
+        {
+            reply = sdscatprintf(reply,
+                "%08x%032x 10.1.%d.%d:6379@16379 slave %08x%032x 0 1700000000000 %d connected\n",
+                i, j + 1, i/250, i%250 + 1, i, i, i + 1);
+        }
+    }
+
+    return reply;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void bench_run(const char *name, bench_parse_fn *parse,
+    redisClusterContext *cc, sds reply, int iterations)
+{
+    dict *nodes;
+    double start, elapsed;
+    unsigned long allocs = 0;
+    int i;
+
+#ifdef BENCH_COUNT_ALLOCS
+    allocs = bench_allocs;
+#endif
+
+    start = bench_now();
+    for(i = 0; i < iterations; i ++)
+    {
+        nodes = parse(cc, reply, sdslen(reply), cc->flags);
+        if(nodes == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", name, cc->errstr);
+            exit(1);
+        }
+
+        dictRelease(nodes);
+    }
+    elapsed = bench_now() - start;
+
+#ifdef BENCH_COUNT_ALLOCS
+    allocs = bench_allocs - allocs;
+#endif
+
+    printf("%-8s %10.1f us/parse %10.1f MB/s", name,
+        elapsed*1e6/iterations,
+        (double)sdslen(reply)*iterations/elapsed/1e6);
+#ifdef BENCH_COUNT_ALLOCS
+    printf(" %10lu allocs/parse", allocs/iterations);
+#endif
+    printf("\n");
+}
+
+/* Both parsers must build the same nodes. */
+static int bench_check(redisClusterContext *cc, sds reply)
+{
+    dict *a, *b;
+    dictIterator *it;
+    dictEntry *de, *other;
+    cluster_node *na, *nb;
+    int ok = 1;
+
+    a = parse_cluster_nodes(cc, reply, sdslen(reply), cc->flags);
+    b = parse_cluster_nodes_old(cc, reply, sdslen(reply), cc->flags);
+    if(a == NULL || b == NULL || dictSize(a) != dictSize(b))
+    {
+        ok = 0;
+        goto done;
+    }
+
+    it = dictGetIterator(a);
+    while(ok && (de = dictNext(it)) != NULL)
+    {
+        na = dictGetEntryVal(de);
+        other = dictFind(b, dictGetEntryKey(de));
+        if(other == NULL)
+        {
+            ok = 0;
+            break;
+        }
+
+        nb = dictGetEntryVal(other);
+        ok = sdscmp(na->name, nb->name) == 0 &&
+            sdscmp(na->host, nb->host) == 0 && na->port == nb->port &&
+            na->myself == nb->myself &&
+            listLength(na->slots) == listLength(nb->slots) &&
+            (na->slaves == NULL ? 0 : listLength(na->slaves)) ==
+            (nb->slaves == NULL ? 0 : listLength(nb->slaves));
+    }
+    dictReleaseIterator(it);
+
+done:
+
+    if(a != NULL)
+    {
+        dictRelease(a);
+    }
+
+    if(b != NULL)
+    {
+        dictRelease(b);
+    }
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    redisClusterContext *cc;
+    sds reply;
+    int masters, replicas, iterations;
+
+    masters = argc > 1 ? atoi(argv[1]) : 200;
+    replicas = argc > 2 ? atoi(argv[2]) : 1;
+    iterations = argc > 3 ? atoi(argv[3]) : 200;
+    if(masters <= 0 || masters > REDIS_CLUSTER_SLOTS || replicas < 0 ||
+        iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [masters [replicas-per-master [iterations]]]\n",
+            argv[0]);
+        return 1;
+    }
+
+    cc = redisClusterContextInit();
+    redisClusterSetOptionParseSlaves(cc);
+
+    reply = bench_reply(masters, replicas);
+
+    printf("%d masters, %d replicas each, %zu bytes\n", masters, replicas,
+        sdslen(reply));
+
+    if(!bench_check(cc, reply))
+    {
+        fprintf(stderr, "the parsers disagree\n");
+        return 1;
+    }
+
+    bench_run("old", parse_cluster_nodes_old, cc, reply, iterations);
+    bench_run("new", parse_cluster_nodes, cc, reply, iterations);
+
+    sdsfree(reply);
+    redisClusterFree(cc);
+
+    return 0;
+}
@@ -0,0 +1,756 @@
+/*
+ * Drive a cluster with the synchronous or the asynchronous API and report
+ * the throughput, the CPU and the allocations per command of the client,
+ * and its latency percentiles.
+ *
+ *   bench-cluster [-a addrs | -N nodes [-l usec]] [-A] [-c clients]
+ *                 [-n requests] [-P depth] [-r keys] [-z theta] [-d bytes]
+ *                 [-w percent] [-f percent [-k keys]]
+ *
+ * Without -a, the cluster is served in process (mock-cluster.h), so that
+ * runs on the same box compare. Every client is a thread with a context of
+ * its own, sending -n commands -P at a time (a pipeline of that depth, or
+ * as many commands in flight with -A): GET, SET for -w percent of them and
+ * MGET of -k keys for -f percent, the keys being drawn uniformly from -r
+ * keys, or along a zipfian distribution with -z. The keys are written
+ * first. CPU time and allocations are counted in the client threads only.
+ */
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "hircluster.h"
+#include "adapters/libevent.h"
+#include "mock-cluster.h"
+
+#ifdef BENCH_COUNT_ALLOCS
+/* Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, counted by
+ * thread so that the mock nodes are left out. */
+static __thread unsigned long bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs ++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs ++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs ++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+#define BENCH_KEY_LEN       32
+#define BENCH_MAX_KEYS      256     /* of a MGET */
+#define BENCH_PRELOAD       1000    /* SET pipelined while writing the keys */
+
+/*
+ * Latency histogram, HdrHistogram style: exact below BENCH_HIST_SUB ns,
+ * then BENCH_HIST_SUB/2 buckets by power of two, so within 1/64 (1.6%) of
+ * the value recorded.
+ */
+#define BENCH_HIST_BITS     7
+#define BENCH_HIST_SUB      (1 << BENCH_HIST_BITS)
+#define BENCH_HIST_HALF     (BENCH_HIST_SUB/2)
+#define BENCH_HIST_LEN      (BENCH_HIST_SUB + (64 - BENCH_HIST_BITS)*BENCH_HIST_HALF)
+
+struct bench_hist {
+    uint64_t counts[BENCH_HIST_LEN];
+    uint64_t total;
+    uint64_t max;
+};
+
+enum bench_op {
+    BENCH_GET,
+    BENCH_SET,
+    BENCH_MGET
+};
+
+struct bench_config {
+    const char *addrs;
+    int async;
+    int clients;
+    long requests;              /* per client */
+    int depth;
+    long keys;
+    double theta;               /* zipfian, 0 for uniform */
+    size_t value_len;
+    int writes;                 /* percent */
+    int multi;                  /* percent */
+    int multi_keys;
+
+    char *value;
+    double zeta_n, zeta_2, alpha, eta;
+};
+
+/* What a command of a client sent, for its reply. */
+struct bench_request {
+    struct bench_client *client;
+    uint64_t start;
+};
+
+struct bench_client {
+    struct bench_config *cfg;
+    pthread_t thread;
+    uint64_t rand;
+    struct bench_hist hist;
+
+    long sent, done, errors;
+    unsigned long allocs;
+    double cpu;                 /* s */
+    const char *err;
+
+    /* The command being built. */
+    int argc;
+    const char *argv[BENCH_MAX_KEYS + 1];
+    size_t argvlen[BENCH_MAX_KEYS + 1];
+    char keys[BENCH_MAX_KEYS][BENCH_KEY_LEN];
+
+    redisClusterAsyncContext *acc;
+    struct bench_request *requests;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static double bench_thread_cpu(void)
+{
+    struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+    if(getrusage(RUSAGE_THREAD, &ru) < 0)
+#else
+    if(getrusage(RUSAGE_SELF, &ru) < 0)
+#endif
+    {
+        return 0;
+    }
+
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+
+static int bench_hist_index(uint64_t v)
+{
+    int msb, shift;
+
+    if(v < BENCH_HIST_SUB)
+    {
+        return (int)v;
+    }
+
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - (BENCH_HIST_BITS - 1);
+
+    return BENCH_HIST_SUB + (shift - 1)*BENCH_HIST_HALF +
+        (int)(v >> shift) - BENCH_HIST_HALF;
+}
+
+/* The highest value of bucket i. */
+static uint64_t bench_hist_value(int i)
+{
+    int shift;
+
+    if(i < BENCH_HIST_SUB)
+    {
+        return (uint64_t)i;
+    }
+
+    i -= BENCH_HIST_SUB;
+    shift = i/BENCH_HIST_HALF + 1;
+
+    return (((uint64_t)(i%BENCH_HIST_HALF + BENCH_HIST_HALF) + 1) << shift) - 1;
+}
+
+static void bench_hist_record(struct bench_hist *h, uint64_t v)
+{
+    h->counts[bench_hist_index(v)] ++;
+    h->total ++;
+    if(v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+static void bench_hist_merge(struct bench_hist *to, const struct bench_hist *h)
+{
+    int i;
+
+    for(i = 0; i < BENCH_HIST_LEN; i ++)
+    {
+        to->counts[i] += h->counts[i];
+    }
+
+    to->total += h->total;
+    if(h->max > to->max)
+    {
+        to->max = h->max;
+    }
+}
+
+static uint64_t bench_hist_percentile(const struct bench_hist *h, double p)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if(h->total == 0)
+    {
+        return 0;
+    }
+
+    rank = (uint64_t)ceil(p/100*h->total);
+    if(rank == 0)
+    {
+        rank = 1;
+    }
+
+    for(i = 0; i < BENCH_HIST_LEN; i ++)
+    {
+        seen += h->counts[i];
+        if(seen >= rank)
+        {
+            return bench_hist_value(i) < h->max ? bench_hist_value(i) : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+/* xorshift64* */
+static uint64_t bench_rand(struct bench_client *c)
+{
+    c->rand ^= c->rand >> 12;
+    c->rand ^= c->rand << 25;
+    c->rand ^= c->rand >> 27;
+
+    return c->rand*0x2545f4914f6cdd1dULL;
+}
+
+static double bench_rand01(struct bench_client *c)
+{
+    return (bench_rand(c) >> 11)*(1.0/9007199254740992.0);
+}
+
+static double bench_zeta(long n, double theta)
+{
+    double sum = 0;
+    long i;
+
+    for(i = 1; i <= n; i ++)
+    {
+        sum += 1/pow((double)i, theta);
+    }
+
+    return sum;
+}
+
+/* Gray et al., "Quickly generating billion-record synthetic databases",
+ * as YCSB draws its keys. */
+static void bench_zipf_init(struct bench_config *cfg)
+{
+    cfg->zeta_n = bench_zeta(cfg->keys, cfg->theta);
+    cfg->zeta_2 = bench_zeta(2, cfg->theta);
+    cfg->alpha = 1/(1 - cfg->theta);
+    cfg->eta = (1 - pow(2.0/cfg->keys, 1 - cfg->theta))/
+        (1 - cfg->zeta_2/cfg->zeta_n);
+}
+
+static long bench_key(struct bench_client *c)
+{
+    struct bench_config *cfg = c->cfg;
+    double u, uz;
+    long k;
+
+    if(cfg->theta <= 0)
+    {
+        return (long)(bench_rand(c)%(uint64_t)cfg->keys);
+    }
+
+    u = bench_rand01(c);
+    uz = u*cfg->zeta_n;
+    if(uz < 1)
+    {
+        return 0;
+    }
+    if(uz < 1 + pow(0.5, cfg->theta))
+    {
+        return 1;
+    }
+
+    k = (long)(cfg->keys*pow(cfg->eta*u - cfg->eta + 1, cfg->alpha));
+
+    return k < cfg->keys ? k : cfg->keys - 1;
+}
+
+static void bench_set_key(struct bench_client *c, int i, long key)
+{
+    c->argvlen[i + 1] = (size_t)snprintf(c->keys[i], BENCH_KEY_LEN,
+        "bench:%ld", key);
+    c->argv[i + 1] = c->keys[i];
+}
+
+/* Draw the next command into argc, argv and argvlen. */
+static void bench_next(struct bench_client *c)
+{
+    struct bench_config *cfg = c->cfg;
+    int p, i;
+
+    p = (int)(bench_rand(c)%100);
+
+    if(p < cfg->multi)
+    {
+        c->argv[0] = "MGET";
+        c->argvlen[0] = 4;
+        for(i = 0; i < cfg->multi_keys; i ++)
+        {
+            bench_set_key(c, i, bench_key(c));
+        }
+        c->argc = cfg->multi_keys + 1;
+    }
+    else if(p < cfg->multi + cfg->writes)
+    {
+        c->argv[0] = "SET";
+        c->argvlen[0] = 3;
+        bench_set_key(c, 0, bench_key(c));
+        c->argv[2] = cfg->value;
+        c->argvlen[2] = cfg->value_len;
+        c->argc = 3;
+    }
+    else
+    {
+        c->argv[0] = "GET";
+        c->argvlen[0] = 3;
+        bench_set_key(c, 0, bench_key(c));
+        c->argc = 2;
+    }
+}
+
+static void bench_reply(struct bench_client *c, redisReply *reply,
+    uint64_t start)
+{
+    bench_hist_record(&c->hist, bench_now() - start);
+    c->done ++;
+
+    if(reply == NULL || reply->type == REDIS_REPLY_ERROR)
+    {
+        c->errors ++;
+    }
+}
+
+static redisClusterContext *bench_context(struct bench_config *cfg)
+{
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    redisClusterSetOptionAddNodes(cc, cfg->addrs);
+    if(!cfg->async && redisClusterConnect2(cc) != REDIS_OK)
+    {
+        fprintf(stderr, "connect: %s\n", cc->errstr);
+        redisClusterFree(cc);
+        return NULL;
+    }
+
+    return cc;
+}
+
+static void bench_run_sync(struct bench_client *c, redisClusterContext *cc)
+{
+    redisReply *reply;
+    uint64_t start;
+    int i, depth;
+
+    while(c->done < c->cfg->requests)
+    {
+        depth = c->cfg->depth;
+        if(depth > c->cfg->requests - c->done)
+        {
+            depth = (int)(c->cfg->requests - c->done);
+        }
+
+        start = bench_now();
+
+        if(depth == 1)
+        {
+            bench_next(c);
+            reply = redisClusterCommandArgv(cc, c->argc, c->argv, c->argvlen);
+            bench_reply(c, reply, start);
+            if(reply != NULL)
+            {
+                freeReplyObject(reply);
+            }
+            continue;
+        }
+
+        for(i = 0; i < depth; i ++)
+        {
+            bench_next(c);
+            redisClusterAppendCommandArgv(cc, c->argc, c->argv, c->argvlen);
+        }
+
+        for(i = 0; i < depth; i ++)
+        {
+            reply = NULL;
+            redisClusterGetReply(cc, (void **)&reply);
+            bench_reply(c, reply, start);
+            if(reply != NULL)
+            {
+                freeReplyObject(reply);
+            }
+        }
+
+        redisClusterReset(cc);
+    }
+}
+
+static void bench_send_async(struct bench_client *c, struct bench_request *r);
+
+static void bench_async_callback(redisClusterAsyncContext *acc, void *reply,
+    void *privdata)
+{
+    struct bench_request *r = privdata;
+    struct bench_client *c = r->client;
+
+    bench_reply(c, reply, r->start);
+
+    if(c->sent < c->cfg->requests)
+    {
+        bench_send_async(c, r);
+    }
+    else if(c->done == c->cfg->requests)
+    {
+        redisClusterAsyncDisconnect(acc);
+    }
+}
+
+static void bench_send_async(struct bench_client *c, struct bench_request *r)
+{
+    bench_next(c);
+    c->sent ++;
+    r->start = bench_now();
+
+    if(redisClusterAsyncCommandArgv(c->acc, bench_async_callback, r, c->argc,
+        c->argv, c->argvlen) != REDIS_OK)
+    {
+        /* Not sent, no callback: counted as answered in error. */
+        bench_reply(c, NULL, r->start);
+        if(c->done == c->cfg->requests)
+        {
+            redisClusterAsyncDisconnect(c->acc);
+        }
+    }
+}
+
+static void bench_run_async(struct bench_client *c, redisClusterContext *cc)
+{
+    struct event_base *base;
+    int i;
+
+    base = event_base_new();
+    c->acc = redisClusterAsyncConnect2(cc);
+    if(base == NULL || c->acc == NULL || c->acc->err)
+    {
+        c->err = "async connect failed";
+        if(base != NULL)
+        {
+            event_base_free(base);
+        }
+        return;
+    }
+
+    redisClusterLibeventAttach(c->acc, base);
+
+    c->requests = calloc(c->cfg->depth, sizeof(*c->requests));
+    for(i = 0; i < c->cfg->depth && c->sent < c->cfg->requests; i ++)
+    {
+        c->requests[i].client = c;
+        bench_send_async(c, &c->requests[i]);
+    }
+
+    event_base_dispatch(base);
+
+    redisClusterAsyncFree(c->acc);
+    event_base_free(base);
+    free(c->requests);
+}
+
+static void *bench_client_run(void *arg)
+{
+    struct bench_client *c = arg;
+    redisClusterContext *cc;
+    unsigned long allocs = 0;
+    double cpu;
+
+    cc = bench_context(c->cfg);
+    if(cc == NULL)
+    {
+        c->err = "connect failed";
+        return NULL;
+    }
+
+    cpu = bench_thread_cpu();
+#ifdef BENCH_COUNT_ALLOCS
+    allocs = bench_allocs;
+#endif
+
+    if(c->cfg->async)
+    {
+        bench_run_async(c, cc);
+    }
+    else
+    {
+        bench_run_sync(c, cc);
+        redisClusterFree(cc);
+    }
+
+    c->cpu = bench_thread_cpu() - cpu;
+#ifdef BENCH_COUNT_ALLOCS
+    c->allocs = bench_allocs - allocs;
+#else
+    (void)allocs;
+#endif
+
+    return NULL;
+}
+
+/* Write every key once, for the reads to find values of the size set. */
+static int bench_preload(struct bench_config *cfg)
+{
+    redisClusterContext *cc;
+    redisReply *reply;
+    char key[BENCH_KEY_LEN];
+    long i, j, n;
+    int ok = 1;
+
+    cc = redisClusterContextInit();
+    redisClusterSetOptionAddNodes(cc, cfg->addrs);
+    if(redisClusterConnect2(cc) != REDIS_OK)
+    {
+        fprintf(stderr, "connect: %s\n", cc->errstr);
+        redisClusterFree(cc);
+        return 0;
+    }
+
+    for(i = 0; ok && i < cfg->keys; i += n)
+    {
+        n = cfg->keys - i < BENCH_PRELOAD ? cfg->keys - i : BENCH_PRELOAD;
+        for(j = 0; j < n; j ++)
+        {
+            snprintf(key, sizeof(key), "bench:%ld", i + j);
+            redisClusterAppendCommand(cc, "SET %s %b", key, cfg->value,
+                cfg->value_len);
+        }
+
+        for(j = 0; j < n; j ++)
+        {
+            reply = NULL;
+            if(redisClusterGetReply(cc, (void **)&reply) != REDIS_OK ||
+                reply->type == REDIS_REPLY_ERROR)
+            {
+                fprintf(stderr, "preload: %s\n",
+                    reply != NULL ? reply->str : cc->errstr);
+                ok = 0;
+            }
+
+            if(reply != NULL)
+            {
+                freeReplyObject(reply);
+            }
+        }
+
+        redisClusterReset(cc);
+    }
+
+    redisClusterFree(cc);
+
+    return ok;
+}
+
+static void bench_usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-a addrs | -N nodes [-l usec]] [-A] [-c clients]\n"
+        "       [-n requests] [-P depth] [-r keys] [-z theta] [-d bytes]\n"
+        "       [-w percent] [-f percent [-k keys]]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config cfg;
+    struct bench_client *clients;
+    struct bench_hist *hist;
+    struct mock_cluster *mc = NULL;
+    unsigned long allocs = 0;
+    long done = 0, errors = 0;
+    double cpu = 0, elapsed;
+    uint64_t start;
+    int opt, nodes = 3, latency = 0, i, failed = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.clients = 1;
+    cfg.requests = 100000;
+    cfg.depth = 1;
+    cfg.keys = 100000;
+    cfg.value_len = 64;
+    cfg.writes = 10;
+    cfg.multi_keys = 10;
+
+    while((opt = getopt(argc, argv, "a:N:l:Ac:n:P:r:z:d:w:f:k:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'a': cfg.addrs = optarg; break;
+        case 'N': nodes = atoi(optarg); break;
+        case 'l': latency = atoi(optarg); break;
+        case 'A': cfg.async = 1; break;
+        case 'c': cfg.clients = atoi(optarg); break;
+        case 'n': cfg.requests = atol(optarg); break;
+        case 'P': cfg.depth = atoi(optarg); break;
+        case 'r': cfg.keys = atol(optarg); break;
+        case 'z': cfg.theta = atof(optarg); break;
+        case 'd': cfg.value_len = (size_t)atol(optarg); break;
+        case 'w': cfg.writes = atoi(optarg); break;
+        case 'f': cfg.multi = atoi(optarg); break;
+        case 'k': cfg.multi_keys = atoi(optarg); break;
+        default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(nodes <= 0 || latency < 0 || cfg.clients <= 0 || cfg.requests <= 0 ||
+        cfg.depth <= 0 || cfg.keys <= 1 || cfg.theta < 0 || cfg.theta >= 1 ||
+        cfg.writes < 0 || cfg.multi < 0 || cfg.writes + cfg.multi > 100 ||
+        cfg.multi_keys <= 0 || cfg.multi_keys > BENCH_MAX_KEYS)
+    {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    /* Keys of several slots are only split by the synchronous API. */
+    if(cfg.async && cfg.multi > 0)
+    {
+        fprintf(stderr, "-f needs the synchronous API\n");
+        return 1;
+    }
+
+    if(cfg.addrs == NULL)
+    {
+        mc = mock_cluster_start(nodes, 0);
+        if(mc == NULL)
+        {
+            fprintf(stderr, "cannot start the mock cluster\n");
+            return 1;
+        }
+        cfg.addrs = mock_cluster_addrs(mc);
+    }
+
+    cfg.value = malloc(cfg.value_len + 1);
+    memset(cfg.value, 'x', cfg.value_len);
+    cfg.value[cfg.value_len] = '\0';
+
+    if(cfg.theta > 0)
+    {
+        bench_zipf_init(&cfg);
+    }
+
+    if(!bench_preload(&cfg))
+    {
+        mock_cluster_stop(mc);
+        return 1;
+    }
+
+    /* Injected once the keys are written. */
+    if(mc != NULL && latency > 0)
+    {
+        mock_cluster_latency(mc, -1, (unsigned int)latency);
+    }
+
+    printf("%s API, %s, %d clients, depth %d, %ld keys %s, %zu bytes values, "
+        "%d%% SET, %d%% MGET of %d keys\n",
+        cfg.async ? "async" : "sync", mc != NULL ? "mock cluster" : cfg.addrs,
+        cfg.clients, cfg.depth, cfg.keys, cfg.theta > 0 ? "zipfian" : "uniform",
+        cfg.value_len, cfg.writes, cfg.multi, cfg.multi_keys);
+
+    clients = calloc(cfg.clients, sizeof(*clients));
+    hist = calloc(1, sizeof(*hist));
+
+    start = bench_now();
+    for(i = 0; i < cfg.clients; i ++)
+    {
+        clients[i].cfg = &cfg;
+        clients[i].rand = 0x9e3779b97f4a7c15ULL*(uint64_t)(i + 1);
+        pthread_create(&clients[i].thread, NULL, bench_client_run, &clients[i]);
+    }
+
+    for(i = 0; i < cfg.clients; i ++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        if(clients[i].err != NULL)
+        {
+            fprintf(stderr, "client %d: %s\n", i, clients[i].err);
+            failed = 1;
+        }
+
+        bench_hist_merge(hist, &clients[i].hist);
+        done += clients[i].done;
+        errors += clients[i].errors;
+        cpu += clients[i].cpu;
+        allocs += clients[i].allocs;
+    }
+    elapsed = (bench_now() - start)/1e9;
+
+    if(done > 0)
+    {
+        printf("%12s %10s", "ops/s", "cpu us/op");
+#ifdef BENCH_COUNT_ALLOCS
+        printf(" %10s", "allocs/op");
+#endif
+        printf(" %10s %10s %10s %10s %8s\n", "p50 us", "p99 us", "p999 us",
+            "max us", "errors");
+
+        printf("%12.0f %10.2f", done/elapsed, cpu*1e6/done);
+#ifdef BENCH_COUNT_ALLOCS
+        printf(" %10.1f", (double)allocs/done);
+#endif
+        printf(" %10.1f %10.1f %10.1f %10.1f %8ld\n",
+            bench_hist_percentile(hist, 50)/1e3,
+            bench_hist_percentile(hist, 99)/1e3,
+            bench_hist_percentile(hist, 99.9)/1e3, hist->max/1e3, errors);
+    }
+
+    free(hist);
+    free(clients);
+    free(cfg.value);
+    mock_cluster_stop(mc);
+
+    return failed;
+}
@@ -0,0 +1,849 @@
+/*
+ * Time the hot paths of a command, without any server: the reply reader
+ * (redisReaderGetReply), the command parser (redis_parse_cmd), the
+ * formatters (redisvFormatCommand, redisFormatCommandArgv) and the slot
+ * hashing (keyHashSlot, crc16).
+ *
+ *   bench-micro [-t ms] [-r replies] [-q requests] [case...]
+ *
+ * Every case runs for -t ms (500 by default) and reports ns/op, MB/s of
+ * input and allocations per op. The inputs are synthetic, plus recorded
+ * traffic when given: -r a file of replies as a server sent them (a
+ * capture of the server to client stream), -q a file of commands as
+ * clients send them (an append only file does). The cases named run, all
+ * of them by default; -l lists them.
+ */
+#include "hircluster.c"
+
+#define BENCH_CHUNK     (16*1024)   /* fed to the reader at a time */
+#define BENCH_VALUE_LEN 64
+
+#ifdef BENCH_COUNT_ALLOCS
+/* Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc. */
+static unsigned long bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs ++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs ++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs ++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+/* Requests, as argument vectors and formatted. */
+struct bench_requests {
+    int count;
+    int *argc;
+    const char ***argv;
+    size_t **argvlen;
+    sds *cmds;
+    sds *keys;                  /* the first key of every command */
+    int nkeys;
+    int skipped;
+};
+
+struct bench_case {
+    const char *name;
+    long (*run)(struct bench_case *bc);   /* one round, the ops it did */
+    size_t bytes;                         /* of input in a round */
+
+    sds replies;
+    redisReader *reader;
+
+    struct bench_requests *requests;
+
+    const char *format;                   /* of redisFormatCommand */
+};
+
+/* Keeps the results from being optimized out. */
+static volatile unsigned long bench_sink;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static long bench_reader(struct bench_case *bc)
+{
+    void *reply;
+    size_t off, len;
+    long n = 0;
+
+    /* Fed the way redisBufferRead() does, a read at a time. */
+    for(off = 0; off < sdslen(bc->replies); off += len)
+    {
+        len = sdslen(bc->replies) - off;
+        if(len > BENCH_CHUNK)
+        {
+            len = BENCH_CHUNK;
+        }
+
+        if(redisReaderFeed(bc->reader, bc->replies + off, len) != REDIS_OK)
+        {
+            return -1;
+        }
+
+        for(;;)
+        {
+            reply = NULL;
+            if(redisReaderGetReply(bc->reader, &reply) != REDIS_OK)
+            {
+                return -1;
+            }
+
+            if(reply == NULL)
+            {
+                break;
+            }
+
+            freeReplyObject(reply);
+            n ++;
+        }
+    }
+
+    return n;
+}
+
+static long bench_parse(struct bench_case *bc)
+{
+    struct bench_requests *rq = bc->requests;
+    struct cmd *command;
+    int i;
+
+    for(i = 0; i < rq->count; i ++)
+    {
+        command = command_get();
+        if(command == NULL)
+        {
+            return -1;
+        }
+
+        command->cmd = rq->cmds[i];
+        command->clen = (uint32_t)sdslen(rq->cmds[i]);
+        redis_parse_cmd(command);
+        if(command->result != CMD_PARSE_OK)
+        {
+            command->cmd = NULL;
+            command_destroy(command);
+            return -1;
+        }
+
+        bench_sink += hiarray_n(command->keys);
+
+        command->cmd = NULL;
+        command_destroy(command);
+    }
+
+    return rq->count;
+}
+
+static long bench_format_argv(struct bench_case *bc)
+{
+    struct bench_requests *rq = bc->requests;
+    char *cmd;
+    int i, len;
+
+    for(i = 0; i < rq->count; i ++)
+    {
+        len = redisFormatCommandArgv(&cmd, rq->argc[i], rq->argv[i],
+            rq->argvlen[i]);
+        if(len < 0)
+        {
+            return -1;
+        }
+
+        bench_sink += len;
+        redisFreeCommand(cmd);
+    }
+
+    return rq->count;
+}
+
+static long bench_format(struct bench_case *bc)
+{
+    struct bench_requests *rq = bc->requests;
+    char value[BENCH_VALUE_LEN];
+    char *cmd;
+    int i, len;
+
+    memset(value, 'x', sizeof(value));
+
+    /* The arguments of the synthetic commands: a key, a value. */
+    for(i = 0; i < rq->nkeys; i ++)
+    {
+        len = redisFormatCommand(&cmd, bc->format, rq->keys[i],
+            value, sizeof(value));
+        if(len < 0)
+        {
+            return -1;
+        }
+
+        bench_sink += len;
+        redisFreeCommand(cmd);
+    }
+
+    return rq->nkeys;
+}
+
+static long bench_slot(struct bench_case *bc)
+{
+    struct bench_requests *rq = bc->requests;
+    unsigned long sum = 0;
+    int i;
+
+    for(i = 0; i < rq->nkeys; i ++)
+    {
+        sum += keyHashSlot(rq->keys[i], (int)sdslen(rq->keys[i]));
+    }
+
+    bench_sink += sum;
+
+    return rq->nkeys;
+}
+
+static long bench_crc16(struct bench_case *bc)
+{
+    struct bench_requests *rq = bc->requests;
+    unsigned long sum = 0;
+    int i;
+
+    for(i = 0; i < rq->nkeys; i ++)
+    {
+        sum += crc16(rq->keys[i], (int)sdslen(rq->keys[i]));
+    }
+
+    bench_sink += sum;
+
+    return rq->nkeys;
+}
+
+static sds bench_bulk(sds s, const char *str, size_t len)
+{
+    s = sdscatprintf(s, "$%zu\r\n", len);
+    s = sdscatlen(s, str, len);
+    return sdscatlen(s, "\r\n", 2);
+}
+
+/* The replies kinds a cluster client reads most. */
+static sds bench_replies(const char *kind)
+{
+    char value[16*1024];
+    sds s = sdsempty();
+    long i, j, n;
+
+    memset(value, 'x', sizeof(value));
+
+    if(!strcmp(kind, "status"))
+    {
+        for(n = 0; n < 1000; n ++)
+        {
+            s = sdscat(s, "+OK\r\n");
+        }
+    }
+    else if(!strcmp(kind, "integer"))
+    {
+        for(n = 0; n < 1000; n ++)
+        {
+            s = sdscatprintf(s, ":%ld\r\n", n*7919);
+        }
+    }
+    else if(!strcmp(kind, "bulk"))
+    {
+        for(n = 0; n < 1000; n ++)
+        {
+            s = bench_bulk(s, value, BENCH_VALUE_LEN);
+        }
+    }
+    else if(!strcmp(kind, "bulk-16k"))
+    {
+        for(n = 0; n < 64; n ++)
+        {
+            s = bench_bulk(s, value, sizeof(value));
+        }
+    }
+    else if(!strcmp(kind, "mget"))
+    {
+        /* MGET of 10 keys, a missing one. */
+        for(n = 0; n < 100; n ++)
+        {
+            s = sdscat(s, "*10\r\n");
+            for(i = 0; i < 10; i ++)
+            {
+                s = i == 9 ? sdscat(s, "$-1\r\n") :
+                    bench_bulk(s, value, BENCH_VALUE_LEN);
+            }
+        }
+    }
+    else
+    {
+        /* CLUSTER SLOTS of 16 masters with a replica each. */
+        for(n = 0; n < 16; n ++)
+        {
+            s = sdscat(s, "*16\r\n");
+            for(i = 0; i < 16; i ++)
+            {
+                s = sdscatprintf(s, "*4\r\n:%ld\r\n:%ld\r\n", i*1024,
+                    i*1024 + 1023);
+                for(j = 0; j < 2; j ++)
+                {
+                    s = sdscatprintf(s,
+                        "*3\r\n$10\r\n10.0.0.%ld\r\n:6379\r\n$40\r\n%08lx%032lx\r\n",
+                        i*2 + j + 100, i, j);
+                }
+            }
+        }
+    }
+
+    return s;
+}
+
+/* The replies in s, -1 when they do not parse. */
+static long bench_count_replies(sds s)
+{
+    redisReader *reader;
+    void *reply;
+    long n = 0;
+
+    reader = redisReaderCreate();
+    reader->maxbuf = 0;
+    if(redisReaderFeed(reader, s, sdslen(s)) != REDIS_OK)
+    {
+        redisReaderFree(reader);
+        return -1;
+    }
+
+    for(;;)
+    {
+        reply = NULL;
+        if(redisReaderGetReply(reader, &reply) != REDIS_OK)
+        {
+            n = -1;
+            break;
+        }
+
+        if(reply == NULL)
+        {
+            break;
+        }
+
+        freeReplyObject(reply);
+        n ++;
+    }
+
+    /* A reply left half read. */
+    if(n >= 0 && reader->len > reader->pos)
+    {
+        n = -1;
+    }
+
+    redisReaderFree(reader);
+
+    return n;
+}
+
+static void bench_requests_free(struct bench_requests *rq)
+{
+    int i, j;
+
+    if(rq == NULL)
+    {
+        return;
+    }
+
+    for(i = 0; i < rq->count; i ++)
+    {
+        for(j = 0; j < rq->argc[i]; j ++)
+        {
+            sdsfree((sds)rq->argv[i][j]);
+        }
+        free(rq->argv[i]);
+        free(rq->argvlen[i]);
+        sdsfree(rq->cmds[i]);
+    }
+
+    for(i = 0; i < rq->nkeys; i ++)
+    {
+        sdsfree(rq->keys[i]);
+    }
+
+    free(rq->argc);
+    free(rq->argv);
+    free(rq->argvlen);
+    free(rq->cmds);
+    free(rq->keys);
+    free(rq);
+}
+
+/* Commands the parser rejects (not for a cluster) are left out. */
+static int bench_requests_add(struct bench_requests *rq, int argc,
+    const char **argv, const size_t *argvlen)
+{
+    struct cmd *command;
+    struct keypos *kp;
+    sds cmd = NULL, key = NULL;
+    int i, n = rq->count + 1, ok;
+
+    if(redisFormatSdsCommandArgv(&cmd, argc, argv, argvlen) < 0)
+    {
+        return 0;
+    }
+
+    command = command_get();
+    if(command == NULL)
+    {
+        sdsfree(cmd);
+        return 0;
+    }
+
+    command->cmd = cmd;
+    command->clen = (uint32_t)sdslen(cmd);
+    redis_parse_cmd(command);
+    ok = command->result == CMD_PARSE_OK;
+    if(ok && hiarray_n(command->keys) > 0)
+    {
+        kp = hiarray_get(command->keys, 0);
+        key = sdsnewlen(kp->start, kp->end - kp->start);
+    }
+    command->cmd = NULL;
+    command_destroy(command);
+
+    if(!ok)
+    {
+        sdsfree(cmd);
+        rq->skipped ++;
+        return 1;
+    }
+
+    rq->argc = realloc(rq->argc, n*sizeof(*rq->argc));
+    rq->argv = realloc(rq->argv, n*sizeof(*rq->argv));
+    rq->argvlen = realloc(rq->argvlen, n*sizeof(*rq->argvlen));
+    rq->cmds = realloc(rq->cmds, n*sizeof(*rq->cmds));
+    rq->keys = realloc(rq->keys, n*sizeof(*rq->keys));
+
+    rq->argc[rq->count] = argc;
+    rq->argv[rq->count] = malloc(argc*sizeof(char *));
+    rq->argvlen[rq->count] = malloc(argc*sizeof(size_t));
+    for(i = 0; i < argc; i ++)
+    {
+        rq->argv[rq->count][i] = sdsnewlen(argv[i], argvlen[i]);
+        rq->argvlen[rq->count][i] = argvlen[i];
+    }
+
+    rq->cmds[rq->count] = cmd;
+    if(key != NULL)
+    {
+        rq->keys[rq->nkeys ++] = key;
+    }
+
+    rq->count ++;
+
+    return 1;
+}
+
+static struct bench_requests *bench_requests_synthetic(void)
+{
+    struct bench_requests *rq;
+    char key[10][32], value[BENCH_VALUE_LEN];
+    const char *argv[11];
+    size_t argvlen[11];
+    int i, j;
+
+    rq = calloc(1, sizeof(*rq));
+    memset(value, 'x', sizeof(value));
+
+    /* GET, SET and MGET of 10 keys; a third of the keys with a tag. */
+    for(i = 0; i < 1000; i ++)
+    {
+        for(j = 0; j < 10; j ++)
+        {
+            argvlen[j + 1] = (size_t)snprintf(key[j], sizeof(key[j]),
+                (i + j)%3 ? "key:%d" : "{user:%d}:profile", i*10 + j);
+            argv[j + 1] = key[j];
+        }
+
+        switch(i%3)
+        {
+        case 0:
+            argv[0] = "GET";
+            argvlen[0] = 3;
+            bench_requests_add(rq, 2, argv, argvlen);
+            break;
+        case 1:
+            argv[0] = "SET";
+            argvlen[0] = 3;
+            argv[2] = value;
+            argvlen[2] = sizeof(value);
+            bench_requests_add(rq, 3, argv, argvlen);
+            break;
+        default:
+            argv[0] = "MGET";
+            argvlen[0] = 4;
+            bench_requests_add(rq, 11, argv, argvlen);
+            break;
+        }
+    }
+
+    return rq;
+}
+
+/* The commands of a file as clients send them, NULL when it has none. */
+static struct bench_requests *bench_requests_load(sds s)
+{
+    struct bench_requests *rq;
+    redisReader *reader;
+    redisReply *reply;
+    const char **argv;
+    size_t *argvlen, i;
+    int ok = 1;
+
+    rq = calloc(1, sizeof(*rq));
+    reader = redisReaderCreate();
+    reader->maxbuf = 0;
+    redisReaderFeed(reader, s, sdslen(s));
+
+    while(ok)
+    {
+        reply = NULL;
+        if(redisReaderGetReply(reader, (void **)&reply) != REDIS_OK ||
+            reply == NULL)
+        {
+            break;
+        }
+
+        /* MULTI/EXEC and SELECT of an append only file included. */
+        if(reply->type == REDIS_REPLY_ARRAY && reply->elements > 0)
+        {
+            argv = malloc(reply->elements*sizeof(*argv));
+            argvlen = malloc(reply->elements*sizeof(*argvlen));
+            for(i = 0; i < reply->elements; i ++)
+            {
+                argv[i] = reply->element[i]->str;
+                argvlen[i] = reply->element[i]->len;
+            }
+
+            ok = bench_requests_add(rq, (int)reply->elements, argv, argvlen);
+
+            free(argv);
+            free(argvlen);
+        }
+
+        freeReplyObject(reply);
+    }
+
+    redisReaderFree(reader);
+
+    if(rq->count == 0)
+    {
+        bench_requests_free(rq);
+        return NULL;
+    }
+
+    return rq;
+}
+
+static sds bench_load_file(const char *path)
+{
+    FILE *fp;
+    sds s;
+    char buf[BENCH_CHUNK];
+    size_t n;
+
+    fp = fopen(path, "rb");
+    if(fp == NULL)
+    {
+        return NULL;
+    }
+
+    s = sdsempty();
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        s = sdscatlen(s, buf, n);
+    }
+    fclose(fp);
+
+    return s;
+}
+
+static size_t bench_requests_bytes(struct bench_requests *rq, int keys)
+{
+    size_t bytes = 0;
+    int i;
+
+    for(i = 0; i < (keys ? rq->nkeys : rq->count); i ++)
+    {
+        bytes += sdslen(keys ? rq->keys[i] : rq->cmds[i]);
+    }
+
+    return bytes;
+}
+
+static void bench_run(struct bench_case *bc, double duration)
+{
+    double start, elapsed;
+    unsigned long allocs = 0;
+    long ops = 0, rounds = 0, n;
+
+    /* Warm up: caches, and the allocator. */
+    if(bc->run(bc) < 0)
+    {
+        fprintf(stderr, "%s: failed\n", bc->name);
+        return;
+    }
+
+#ifdef BENCH_COUNT_ALLOCS
+    allocs = bench_allocs;
+#endif
+
+    start = bench_now();
+    do
+    {
+        n = bc->run(bc);
+        if(n < 0)
+        {
+            fprintf(stderr, "%s: failed\n", bc->name);
+            return;
+        }
+
+        ops += n;
+        rounds ++;
+        elapsed = bench_now() - start;
+    }
+    while(elapsed < duration);
+
+#ifdef BENCH_COUNT_ALLOCS
+    allocs = bench_allocs - allocs;
+#endif
+
+    printf("%-22s %10.1f %10.1f", bc->name, elapsed*1e9/ops,
+        (double)bc->bytes*rounds/elapsed/1e6);
+#ifdef BENCH_COUNT_ALLOCS
+    printf(" %10.2f", (double)allocs/ops);
+#else
+    (void)allocs;
+#endif
+    printf("\n");
+}
+
+static int bench_selected(const char *name, int argc, char **argv)
+{
+    int i;
+
+    if(argc == 0)
+    {
+        return 1;
+    }
+
+    for(i = 0; i < argc; i ++)
+    {
+        /* A case, or the cases of a group ("reader"...). */
+        if(!strcmp(argv[i], name) ||
+            (!strncmp(argv[i], name, strlen(argv[i])) &&
+            name[strlen(argv[i])] == '-'))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *kinds[] = {
+        "status", "integer", "bulk", "bulk-16k", "mget", "cluster-slots"
+    };
+    struct bench_case cases[32], *bc;
+    struct bench_requests *synthetic, *recorded = NULL;
+    const char *replies_path = NULL, *requests_path = NULL;
+    sds recorded_replies = NULL, s;
+    double duration = 0.5;
+    int opt, ncases = 0, list = 0, i, k;
+    char names[32][32];
+
+    while((opt = getopt(argc, argv, "t:r:q:l")) != -1)
+    {
+        switch(opt)
+        {
+        case 't': duration = atoi(optarg)/1e3; break;
+        case 'r': replies_path = optarg; break;
+        case 'q': requests_path = optarg; break;
+        case 'l': list = 1; break;
+        default:
+            fprintf(stderr,
+                "usage: %s [-t ms] [-r replies] [-q requests] [-l] [case...]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+
+    if(duration <= 0)
+    {
+        fprintf(stderr, "-t must be positive\n");
+        return 1;
+    }
+
+    memset(cases, 0, sizeof(cases));
+
+    for(i = 0; i < (int)(sizeof(kinds)/sizeof(kinds[0])); i ++)
+    {
+        bc = &cases[ncases ++];
+        snprintf(names[i], sizeof(names[i]), "reader-%s", kinds[i]);
+        bc->name = names[i];
+        bc->run = bench_reader;
+        bc->replies = bench_replies(kinds[i]);
+        bc->bytes = sdslen(bc->replies);
+    }
+
+    if(replies_path != NULL)
+    {
+        recorded_replies = bench_load_file(replies_path);
+        if(recorded_replies == NULL ||
+            bench_count_replies(recorded_replies) <= 0)
+        {
+            fprintf(stderr, "%s: no replies read\n", replies_path);
+            return 1;
+        }
+
+        bc = &cases[ncases ++];
+        bc->name = "reader-recorded";
+        bc->run = bench_reader;
+        bc->replies = recorded_replies;
+        bc->bytes = sdslen(bc->replies);
+    }
+
+    synthetic = bench_requests_synthetic();
+
+    if(requests_path != NULL)
+    {
+        s = bench_load_file(requests_path);
+        recorded = s != NULL ? bench_requests_load(s) : NULL;
+        sdsfree(s);
+        if(recorded == NULL)
+        {
+            fprintf(stderr, "%s: no commands read\n", requests_path);
+            return 1;
+        }
+
+        printf("%s: %d commands, %d left out (not for a cluster)\n",
+            requests_path, recorded->count, recorded->skipped);
+    }
+
+    for(k = 0; k < 2; k ++)
+    {
+        struct bench_requests *rq = k == 0 ? synthetic : recorded;
+        if(rq == NULL)
+        {
+            continue;
+        }
+
+        bc = &cases[ncases ++];
+        bc->name = k == 0 ? "parse" : "parse-recorded";
+        bc->run = bench_parse;
+        bc->requests = rq;
+        bc->bytes = bench_requests_bytes(rq, 0);
+
+        bc = &cases[ncases ++];
+        bc->name = k == 0 ? "format-argv" : "format-argv-recorded";
+        bc->run = bench_format_argv;
+        bc->requests = rq;
+        bc->bytes = bench_requests_bytes(rq, 0);
+
+        if(rq->nkeys == 0)
+        {
+            continue;
+        }
+
+        bc = &cases[ncases ++];
+        bc->name = k == 0 ? "slot" : "slot-recorded";
+        bc->run = bench_slot;
+        bc->requests = rq;
+        bc->bytes = bench_requests_bytes(rq, 1);
+
+        bc = &cases[ncases ++];
+        bc->name = k == 0 ? "slot-crc16" : "slot-crc16-recorded";
+        bc->run = bench_crc16;
+        bc->requests = rq;
+        bc->bytes = bench_requests_bytes(rq, 1);
+    }
+
+    /* redisvFormatCommand, on the keys of the synthetic commands. */
+    bc = &cases[ncases ++];
+    bc->name = "format-get";
+    bc->run = bench_format;
+    bc->requests = synthetic;
+    bc->format = "GET %s";
+    bc->bytes = bench_requests_bytes(synthetic, 1);
+
+    bc = &cases[ncases ++];
+    bc->name = "format-set";
+    bc->run = bench_format;
+    bc->requests = synthetic;
+    bc->format = "SET %s %b";
+    bc->bytes = bench_requests_bytes(synthetic, 1) +
+        (size_t)synthetic->nkeys*BENCH_VALUE_LEN;
+
+    if(list)
+    {
+        for(i = 0; i < ncases; i ++)
+        {
+            printf("%s\n", cases[i].name);
+        }
+        return 0;
+    }
+
+    printf("%-22s %10s %10s", "case", "ns/op", "MB/s");
+#ifdef BENCH_COUNT_ALLOCS
+    printf(" %10s", "allocs/op");
+#endif
+    printf("\n");
+
+    for(i = 0; i < ncases; i ++)
+    {
+        bc = &cases[i];
+        if(!bench_selected(bc->name, argc - optind, argv + optind))
+        {
+            continue;
+        }
+
+        if(bc->run == bench_reader)
+        {
+            bc->reader = redisReaderCreate();
+        }
+
+        bench_run(bc, duration);
+
+        if(bc->reader != NULL)
+        {
+            redisReaderFree(bc->reader);
+            bc->reader = NULL;
+        }
+    }
+
+    for(i = 0; i < ncases; i ++)
+    {
+        sdsfree(cases[i].replies);
+    }
+    bench_requests_free(synthetic);
+    bench_requests_free(recorded);
+
+    return 0;
+}
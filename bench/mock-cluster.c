@@ -0,0 +1,2096 @@
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "hiredis.h"
+#include "hisha1.h"
+#include "mock-cluster.h"
+#include "dict.c"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif
+
+#define MOCK_READ_LEN   (16 * 1024)
+
+/* What a command did with its connection. */
+#define MOCK_OK         0
+#define MOCK_CLOSE      -1
+#define MOCK_QUEUED     1           /* the request kept, until EXEC */
+
+/* The invalidations of the tracked keys, see CLIENT TRACKING. */
+#define MOCK_INVALIDATE "__redis__:invalidate"
+
+uint16_t crc16(const char *buf, int len);
+
+struct mock_client;
+static int mock_client_write(struct mock_client *c);
+
+struct mock_client {
+    int fd;
+    redisReader *reader;
+    sds obuf;
+    int asking;                     /* ASKING came before the command */
+    long long id;                   /* CLIENT ID */
+    int proto;                      /* 2, or 3 after HELLO 3 */
+    int authenticated;
+
+    /* MULTI: the commands queued until EXEC, which aborts when one of
+     * them was refused, or when a watched key changed value. */
+    int multi;
+    int multi_error;
+    redisReply **queued;
+    size_t nqueued;
+    sds *watched;                   /* key, value at WATCH (NULL: none) */
+    size_t nwatched;
+
+    int tracking;                   /* CLIENT TRACKING on REDIRECT id */
+    long long redirect;
+    int invalidations;              /* subscribed to MOCK_INVALIDATE */
+    sds *schannels;                 /* SSUBSCRIBE */
+    size_t nschannels;
+
+    struct mock_client *next;
+};
+
+struct mock_node {
+    struct mock_cluster *mc;
+    int index;
+    int fd;                         /* listening */
+    int wake[2];                    /* written to stop or drop the clients */
+    pthread_t thread;
+    int started;
+
+    sds host;                       /* as the topology gives it */
+    int port;
+    sds addr;
+    char id[41];
+
+    struct mock_client *clients;
+    int nclients;
+    sds key;                        /* looked up in the store */
+
+    /* Under the lock of the cluster. */
+    mock_fault fault;
+    long fault_count;               /* -1 for every command */
+    unsigned int latency;           /* us */
+    int drop;
+    int moved;                      /* slots moved: check the schannels */
+    dict *scripts;                  /* SCRIPT LOAD: sds sha1 -> sds body */
+    struct mock_node_stats stats;
+};
+
+struct mock_cluster {
+    pthread_mutex_t lock;
+    int flags;
+    int nnodes;
+    struct mock_node *nodes;
+    sds addrs;
+
+    /* Under the lock. */
+    int stop;
+    int16_t owner[MOCK_CLUSTER_SLOTS];
+    int16_t importing[MOCK_CLUSTER_SLOTS];  /* node migrated to, or -1 */
+    dict *store;                            /* sds key -> sds value */
+    sds password;                           /* requirepass, or NULL */
+    long long next_id;
+};
+
+static unsigned int mock_store_hash(const void *key)
+{
+    return dictGenHashFunction(key, (int)sdslen((sds)key));
+}
+
+static int mock_store_compare(void *privdata, const void *key1,
+    const void *key2)
+{
+    DICT_NOTUSED(privdata);
+
+    return sdslen((sds)key1) == sdslen((sds)key2) &&
+        memcmp(key1, key2, sdslen((sds)key1)) == 0;
+}
+
+static void mock_store_free(void *privdata, void *obj)
+{
+    DICT_NOTUSED(privdata);
+
+    sdsfree(obj);
+}
+
+static dictType mock_store_type = {
+    mock_store_hash,
+    NULL,
+    NULL,
+    mock_store_compare,
+    mock_store_free,
+    mock_store_free
+};
+
+/* Same as the server: the hash tag only, when there is a non empty one. */
+static int mock_key_slot(const char *key, size_t len)
+{
+    size_t s, e;
+
+    for(s = 0; s < len; s ++)
+    {
+        if(key[s] == '{')
+        {
+            break;
+        }
+    }
+
+    if(s < len)
+    {
+        for(e = s + 1; e < len; e ++)
+        {
+            if(key[e] == '}')
+            {
+                break;
+            }
+        }
+
+        if(e < len && e != s + 1)
+        {
+            key += s + 1;
+            len = e - s - 1;
+        }
+    }
+
+    return crc16(key, (int)len) & (MOCK_CLUSTER_SLOTS - 1);
+}
+
+static sds mock_reply_bulk(sds obuf, const char *str, size_t len)
+{
+    obuf = sdscatprintf(obuf, "$%zu\r\n", len);
+    obuf = sdscatlen(obuf, str, len);
+    return sdscatlen(obuf, "\r\n", 2);
+}
+
+static sds mock_reply_value(sds obuf, sds value)
+{
+    if(value == NULL)
+    {
+        return sdscatlen(obuf, "$-1\r\n", 5);
+    }
+
+    return mock_reply_bulk(obuf, value, sdslen(value));
+}
+
+/* The header of a message the server sends on its own: a push under
+ * RESP3. */
+static sds mock_reply_push(struct mock_client *c, sds obuf, size_t n)
+{
+    return sdscatprintf(obuf, "%c%zu\r\n", c->proto == 3 ? '>' : '*', n);
+}
+
+/* The header of a map of n pairs, a flat array of them under RESP2. */
+static sds mock_reply_map(struct mock_client *c, sds obuf, size_t n)
+{
+    if(c->proto == 3)
+    {
+        return sdscatprintf(obuf, "%%%zu\r\n", n);
+    }
+
+    return sdscatprintf(obuf, "*%zu\r\n", n*2);
+}
+
+/*
+ * Tell the clients of node tracking keys that key changed, that they all
+ * did with a NULL key (FLUSHALL). Every key written counts, read by them or
+ * not, and only the clients of node are told, through the client they
+ * redirect to. Under the lock, from the thread of node.
+ */
+static void mock_node_invalidate(struct mock_node *node, const char *key,
+    size_t len)
+{
+    struct mock_client *c, *to;
+
+    for(c = node->clients; c != NULL; c = c->next)
+    {
+        if(!c->tracking)
+        {
+            continue;
+        }
+
+        for(to = node->clients; to != NULL && to->id != c->redirect;
+            to = to->next);
+
+        if(to == NULL || !to->invalidations)
+        {
+            continue;
+        }
+
+        to->obuf = mock_reply_push(to, to->obuf, 3);
+        to->obuf = mock_reply_bulk(to->obuf, "message", 7);
+        to->obuf = mock_reply_bulk(to->obuf, MOCK_INVALIDATE,
+            strlen(MOCK_INVALIDATE));
+        if(key == NULL)
+        {
+            to->obuf = sdscat(to->obuf, to->proto == 3 ? "_\r\n" : "*-1\r\n");
+        }
+        else
+        {
+            to->obuf = sdscat(to->obuf, "*1\r\n");
+            to->obuf = mock_reply_bulk(to->obuf, key, len);
+        }
+
+        /* Ahead of the reply to the write, as the server does. */
+        mock_client_write(to);
+    }
+}
+
+static sds mock_store_get(struct mock_node *node, redisReply *key)
+{
+    dictEntry *de;
+
+    node->key = sdscpylen(node->key, key->str, key->len);
+    de = dictFind(node->mc->store, node->key);
+
+    return de == NULL ? NULL : dictGetEntryVal(de);
+}
+
+static void mock_store_set(struct mock_node *node, redisReply *key,
+    const char *value, size_t len)
+{
+    dictEntry *de;
+
+    mock_node_invalidate(node, key->str, key->len);
+
+    node->key = sdscpylen(node->key, key->str, key->len);
+    de = dictFind(node->mc->store, node->key);
+    if(de != NULL)
+    {
+        sdsfree(dictGetEntryVal(de));
+        dictGetEntryVal(de) = sdsnewlen(value, len);
+        return;
+    }
+
+    dictAdd(node->mc->store, sdsnewlen(key->str, key->len),
+        sdsnewlen(value, len));
+}
+
+static int mock_store_del(struct mock_node *node, redisReply *key)
+{
+    node->key = sdscpylen(node->key, key->str, key->len);
+    if(dictDelete(node->mc->store, node->key) != DICT_OK)
+    {
+        return 0;
+    }
+
+    mock_node_invalidate(node, key->str, key->len);
+
+    return 1;
+}
+
+/*
+ * Whether node serves the keys of req, from argument first on, every step
+ * arguments, asking when ASKING came right before. When it does not, the
+ * error is replied, or MOCK_CLOSE returned for a connection to drop. Under
+ * the lock.
+ */
+static int mock_node_route(struct mock_node *node, struct mock_client *c,
+    redisReply *req, size_t first, size_t step, int asking, int *served)
+{
+    struct mock_cluster *mc = node->mc;
+    struct mock_node *to;
+    size_t i;
+    int slot, owner, importing;
+
+    *served = 0;
+
+    if(node->fault != MOCK_FAULT_NONE && node->fault_count != 0)
+    {
+        if(node->fault_count > 0)
+        {
+            node->fault_count --;
+        }
+        node->stats.faults ++;
+
+        switch(node->fault)
+        {
+        case MOCK_FAULT_TRYAGAIN:
+            c->obuf = sdscat(c->obuf,
+                "-TRYAGAIN Multiple keys request during rehashing of slot\r\n");
+            return MOCK_OK;
+        case MOCK_FAULT_CLUSTERDOWN:
+            c->obuf = sdscat(c->obuf,
+                "-CLUSTERDOWN The cluster is down\r\n");
+            return MOCK_OK;
+        default:
+            return MOCK_CLOSE;
+        }
+    }
+
+    slot = mock_key_slot(req->element[first]->str, req->element[first]->len);
+    for(i = first + step; i < req->elements; i += step)
+    {
+        if(mock_key_slot(req->element[i]->str, req->element[i]->len) != slot)
+        {
+            c->obuf = sdscat(c->obuf,
+                "-CROSSSLOT Keys in request don't hash to the same slot\r\n");
+            return MOCK_OK;
+        }
+    }
+
+    owner = mc->owner[slot];
+    importing = mc->importing[slot];
+
+    if(owner == node->index && importing < 0)
+    {
+        *served = 1;
+        return MOCK_OK;
+    }
+
+    if(importing == node->index && asking)
+    {
+        *served = 1;
+        return MOCK_OK;
+    }
+
+    node->stats.redirects ++;
+
+    if(owner == node->index)
+    {
+        to = &mc->nodes[importing];
+        c->obuf = sdscatprintf(c->obuf, "-ASK %d %s:%d\r\n", slot, to->host,
+            to->port);
+    }
+    else
+    {
+        to = &mc->nodes[owner];
+        c->obuf = sdscatprintf(c->obuf, "-MOVED %d %s:%d\r\n", slot, to->host,
+            to->port);
+    }
+
+    return MOCK_OK;
+}
+
+static sds mock_cluster_slots(struct mock_cluster *mc, sds obuf)
+{
+    struct mock_node *node;
+    sds body = sdsempty();
+    int start, end, count = 0;
+
+    for(start = 0; start < MOCK_CLUSTER_SLOTS; start = end + 1)
+    {
+        for(end = start; end + 1 < MOCK_CLUSTER_SLOTS &&
+            mc->owner[end + 1] == mc->owner[start]; end ++);
+
+        node = &mc->nodes[mc->owner[start]];
+        body = sdscatprintf(body, "*3\r\n:%d\r\n:%d\r\n*3\r\n", start, end);
+        body = mock_reply_bulk(body, node->host, sdslen(node->host));
+        body = sdscatprintf(body, ":%d\r\n", node->port);
+        body = mock_reply_bulk(body, node->id, strlen(node->id));
+        count ++;
+    }
+
+    obuf = sdscatprintf(obuf, "*%d\r\n", count);
+    obuf = sdscatsds(obuf, body);
+    sdsfree(body);
+
+    return obuf;
+}
+
+static sds mock_cluster_nodes_reply(struct mock_cluster *mc,
+    struct mock_node *self, sds obuf)
+{
+    struct mock_node *node;
+    sds body = sdsempty();
+    int i, start, end;
+
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        node = &mc->nodes[i];
+        body = sdscatprintf(body, "%s %s:%d@0 %smaster - 0 0 %d connected",
+            node->id, node->host, node->port, node == self ? "myself," : "",
+            i + 1);
+
+        for(start = 0; start < MOCK_CLUSTER_SLOTS; start = end + 1)
+        {
+            for(end = start; end + 1 < MOCK_CLUSTER_SLOTS &&
+                mc->owner[end + 1] == mc->owner[start]; end ++);
+
+            if(mc->owner[start] != i)
+            {
+                continue;
+            }
+
+            if(start == end)
+            {
+                body = sdscatprintf(body, " %d", start);
+            }
+            else
+            {
+                body = sdscatprintf(body, " %d-%d", start, end);
+            }
+        }
+
+        body = sdscatlen(body, "\n", 1);
+    }
+
+    obuf = mock_reply_bulk(obuf, body, sdslen(body));
+    sdsfree(body);
+
+    return obuf;
+}
+
+/* CLUSTER SHARDS, as Redis 7 answers it: a shard per node serving slots,
+ * of that node alone. */
+static sds mock_cluster_shards(struct mock_cluster *mc, struct mock_client *c,
+    sds obuf)
+{
+    struct mock_node *node;
+    sds body = sdsempty(), ranges = sdsempty();
+    int i, start, end, count = 0, nranges;
+
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        node = &mc->nodes[i];
+        sdsclear(ranges);
+        nranges = 0;
+
+        for(start = 0; start < MOCK_CLUSTER_SLOTS; start = end + 1)
+        {
+            for(end = start; end + 1 < MOCK_CLUSTER_SLOTS &&
+                mc->owner[end + 1] == mc->owner[start]; end ++);
+
+            if(mc->owner[start] == i)
+            {
+                ranges = sdscatprintf(ranges, ":%d\r\n:%d\r\n", start, end);
+                nranges ++;
+            }
+        }
+
+        if(nranges == 0)
+        {
+            continue;
+        }
+
+        body = mock_reply_map(c, body, 2);
+        body = mock_reply_bulk(body, "slots", 5);
+        body = sdscatprintf(body, "*%d\r\n", nranges*2);
+        body = sdscatsds(body, ranges);
+        body = mock_reply_bulk(body, "nodes", 5);
+        body = sdscat(body, "*1\r\n");
+        body = mock_reply_map(c, body, 7);
+        body = mock_reply_bulk(body, "id", 2);
+        body = mock_reply_bulk(body, node->id, strlen(node->id));
+        body = mock_reply_bulk(body, "port", 4);
+        body = sdscatprintf(body, ":%d\r\n", node->port);
+        body = mock_reply_bulk(body, "ip", 2);
+        body = mock_reply_bulk(body, node->host, sdslen(node->host));
+        body = mock_reply_bulk(body, "endpoint", 8);
+        body = mock_reply_bulk(body, node->host, sdslen(node->host));
+        body = mock_reply_bulk(body, "role", 4);
+        body = mock_reply_bulk(body, "master", 6);
+        body = mock_reply_bulk(body, "replication-offset", 18);
+        body = sdscat(body, ":0\r\n");
+        body = mock_reply_bulk(body, "health", 6);
+        body = mock_reply_bulk(body, "online", 6);
+        count ++;
+    }
+
+    obuf = sdscatprintf(obuf, "*%d\r\n", count);
+    obuf = sdscatsds(obuf, body);
+    sdsfree(body);
+    sdsfree(ranges);
+
+    return obuf;
+}
+
+/* CONFIG GET of the few parameters clients ask for, no glob pattern. */
+static sds mock_config_get(struct mock_client *c, sds obuf, const char *name)
+{
+    static const char *config[] = {
+        "cluster-enabled", "yes",
+        "cluster-node-timeout", "15000",
+        NULL
+    };
+    int i;
+
+    for(i = 0; config[i] != NULL; i += 2)
+    {
+        if(!strcasecmp(config[i], name))
+        {
+            obuf = mock_reply_map(c, obuf, 1);
+            obuf = mock_reply_bulk(obuf, config[i], strlen(config[i]));
+            return mock_reply_bulk(obuf, config[i + 1], strlen(config[i + 1]));
+        }
+    }
+
+    return mock_reply_map(c, obuf, 0);
+}
+
+/* Whether password is the one of the cluster, c being authenticated if
+ * so. */
+static int mock_client_auth(struct mock_cluster *mc, struct mock_client *c,
+    redisReply *password)
+{
+    if(mc->password == NULL || sdslen(mc->password) != password->len ||
+        memcmp(mc->password, password->str, password->len) != 0)
+    {
+        return 0;
+    }
+
+    c->authenticated = 1;
+
+    return 1;
+}
+
+/* HELLO [protover [AUTH username password] [SETNAME name]]. RESP3 is
+ * refused with MOCK_CLUSTER_RESP2. */
+static void mock_client_hello(struct mock_node *node, struct mock_client *c,
+    redisReply *req)
+{
+    struct mock_cluster *mc = node->mc;
+    long proto = c->proto;
+    size_t i;
+
+    if(req->elements >= 2)
+    {
+        proto = strtol(req->element[1]->str, NULL, 10);
+        if((proto != 2 && proto != 3) ||
+            (proto == 3 && (mc->flags & MOCK_CLUSTER_RESP2)))
+        {
+            c->obuf = sdscat(c->obuf, 
+                "-NOPROTO unsupported protocol version\r\n");
+            return;
+        }
+    }
+
+    for(i = 2; i < req->elements; i ++)
+    {
+        if(!strcasecmp(req->element[i]->str, "AUTH") && 
+            i + 2 < req->elements)
+        {
+            if(!mock_client_auth(mc, c, req->element[i + 2]))
+            {
+                c->obuf = sdscat(c->obuf, "-WRONGPASS invalid "
+                    "username-password pair or user is disabled.\r\n");
+                return;
+            }
+            i += 2;
+        }
+        else if(!strcasecmp(req->element[i]->str, "SETNAME") &&
+            i + 1 < req->elements)
+        {
+            i ++;
+        }
+        else
+        {
+            c->obuf = sdscatprintf(c->obuf,
+                "-ERR Syntax error in HELLO option '%s'\r\n",
+                req->element[i]->str);
+            return;
+        }
+    }
+
+    if(mc->password != NULL && !c->authenticated)
+    {
+        c->obuf = sdscat(c->obuf, "-NOAUTH HELLO must be called with the "
+            "client already authenticated, otherwise the HELLO <proto> AUTH "
+            "<user> <pass> option can be used to authenticate the client and "
+            "select the RESP protocol version at the same time\r\n");
+        return;
+    }
+
+    c->proto = (int)proto;
+
+    c->obuf = mock_reply_map(c, c->obuf, 6);
+    c->obuf = mock_reply_bulk(c->obuf, "server", 6);
+    c->obuf = mock_reply_bulk(c->obuf, "redis", 5);
+    c->obuf = mock_reply_bulk(c->obuf, "version", 7);
+    c->obuf = mock_reply_bulk(c->obuf, "7.0.0", 5);
+    c->obuf = mock_reply_bulk(c->obuf, "proto", 5);
+    c->obuf = sdscatprintf(c->obuf, ":%d\r\n", c->proto);
+    c->obuf = mock_reply_bulk(c->obuf, "id", 2);
+    c->obuf = sdscatprintf(c->obuf, ":%lld\r\n", c->id);
+    c->obuf = mock_reply_bulk(c->obuf, "mode", 4);
+    c->obuf = mock_reply_bulk(c->obuf, "cluster", 7);
+    c->obuf = mock_reply_bulk(c->obuf, "role", 4);
+    c->obuf = mock_reply_bulk(c->obuf, "master", 6);
+}
+
+/* CLIENT TRACKING on|off [REDIRECT id] [BCAST] [PREFIX prefix]...: the
+ * invalidations only go to a client redirected to, see
+ * mock_node_invalidate. */
+static void mock_client_tracking(struct mock_client *c, redisReply *req)
+{
+    long long redirect = -1;
+    size_t i;
+    int on;
+
+    on = !strcasecmp(req->element[2]->str, "on");
+    if(!on && strcasecmp(req->element[2]->str, "off"))
+    {
+        c->obuf = sdscat(c->obuf, "-ERR syntax error\r\n");
+        return;
+    }
+
+    for(i = 3; i < req->elements; i ++)
+    {
+        if(!strcasecmp(req->element[i]->str, "REDIRECT") && 
+            i + 1 < req->elements)
+        {
+            redirect = strtoll(req->element[++ i]->str, NULL, 10);
+        }
+        else if(!strcasecmp(req->element[i]->str, "PREFIX") &&
+            i + 1 < req->elements)
+        {
+            i ++;
+        }
+        else if(strcasecmp(req->element[i]->str, "BCAST") &&
+            strcasecmp(req->element[i]->str, "OPTIN") &&
+            strcasecmp(req->element[i]->str, "OPTOUT") &&
+            strcasecmp(req->element[i]->str, "NOLOOP"))
+        {
+            c->obuf = sdscat(c->obuf, "-ERR syntax error\r\n");
+            return;
+        }
+    }
+
+    c->tracking = on;
+    c->redirect = redirect;
+    c->obuf = sdscat(c->obuf, "+OK\r\n");
+}
+
+static void mock_client_unwatch(struct mock_client *c)
+{
+    size_t i;
+
+    for(i = 0; i < c->nwatched; i ++)
+    {
+        sdsfree(c->watched[i]);
+    }
+
+    free(c->watched);
+    c->watched = NULL;
+    c->nwatched = 0;
+}
+
+/* Keep key with its value, for EXEC to check that it did not change. */
+static int mock_client_watch(struct mock_node *node, struct mock_client *c,
+    redisReply *key)
+{
+    sds *watched, value;
+
+    watched = realloc(c->watched, sizeof(*watched)*(c->nwatched + 2));
+    if(watched == NULL)
+    {
+        return MOCK_CLOSE;
+    }
+
+    value = mock_store_get(node, key);
+
+    c->watched = watched;
+    c->watched[c->nwatched ++] = sdsnewlen(key->str, key->len);
+    c->watched[c->nwatched ++] = value == NULL ? NULL : sdsdup(value);
+
+    return MOCK_OK;
+}
+
+/* Whether the watched keys kept their value: the server tells any write
+ * apart, the mock only the ones that change the value. */
+static int mock_client_watched_same(struct mock_node *node,
+    struct mock_client *c)
+{
+    dictEntry *de;
+    sds value;
+    size_t i;
+
+    for(i = 0; i < c->nwatched; i += 2)
+    {
+        de = dictFind(node->mc->store, c->watched[i]);
+        value = de == NULL ? NULL : dictGetEntryVal(de);
+
+        if((value == NULL) != (c->watched[i + 1] == NULL) ||
+            (value != NULL && sdscmp(value, c->watched[i + 1]) != 0))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Out of MULTI, the queued commands dropped and the keys unwatched. */
+static void mock_client_discard(struct mock_client *c)
+{
+    size_t i;
+
+    for(i = 0; i < c->nqueued; i ++)
+    {
+        freeReplyObject(c->queued[i]);
+    }
+
+    free(c->queued);
+    c->queued = NULL;
+    c->nqueued = 0;
+    c->multi = 0;
+    c->multi_error = 0;
+    c->asking = 0;
+    mock_client_unwatch(c);
+}
+
+/* Where the keys of the command name are: from argument *first on, every
+ * *step arguments. 0 for a command without keys. */
+static int mock_command_keys(const char *name, size_t argc, size_t *first,
+    size_t *step)
+{
+    if(argc < 2)
+    {
+        return 0;
+    }
+
+    *first = 1;
+
+    if(!strcasecmp(name, "GET") || !strcasecmp(name, "SET") ||
+        !strcasecmp(name, "INCR"))
+    {
+        *step = argc;
+    }
+    else if(!strcasecmp(name, "DEL") || !strcasecmp(name, "EXISTS") ||
+        !strcasecmp(name, "MGET"))
+    {
+        *step = 1;
+    }
+    else if(!strcasecmp(name, "MSET"))
+    {
+        *step = 2;
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Queue req of c in MULTI until EXEC, refusing it, which aborts the
+ * transaction, when its keys are not served here. Under the lock. */
+static int mock_client_queue(struct mock_node *node, struct mock_client *c,
+    redisReply *req, int asking)
+{
+    redisReply **queued;
+    size_t first, step;
+    int served, ret;
+
+    if(mock_command_keys(req->element[0]->str, req->elements, &first, &step))
+    {
+        ret = mock_node_route(node, c, req, first, step, asking, &served);
+        if(ret != MOCK_OK || !served)
+        {
+            c->multi_error = 1;
+            return ret;
+        }
+    }
+
+    queued = realloc(c->queued, sizeof(*queued)*(c->nqueued + 1));
+    if(queued == NULL)
+    {
+        return MOCK_CLOSE;
+    }
+
+    c->queued = queued;
+    c->queued[c->nqueued ++] = req;
+    c->obuf = sdscat(c->obuf, "+QUEUED\r\n");
+
+    return MOCK_QUEUED;
+}
+
+static int mock_client_sindex(struct mock_client *c, redisReply *channel)
+{
+    size_t i;
+
+    for(i = 0; i < c->nschannels; i ++)
+    {
+        if(sdslen(c->schannels[i]) == channel->len &&
+            memcmp(c->schannels[i], channel->str, channel->len) == 0)
+        {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+static void mock_client_sunsubscribe(struct mock_client *c, size_t i)
+{
+    c->obuf = mock_reply_push(c, c->obuf, 3);
+    c->obuf = mock_reply_bulk(c->obuf, "sunsubscribe", 12);
+    c->obuf = mock_reply_bulk(c->obuf, c->schannels[i],
+        sdslen(c->schannels[i]));
+
+    sdsfree(c->schannels[i]);
+    c->schannels[i] = c->schannels[-- c->nschannels];
+
+    c->obuf = sdscatprintf(c->obuf, ":%zu\r\n", c->nschannels);
+}
+
+/* Unsubscribe the clients of node from the sharded channels of the slots
+ * it lost, as the server does. Under the lock, from the thread of node. */
+static void mock_node_sunsubscribe_moved(struct mock_node *node)
+{
+    struct mock_client *c;
+    size_t i;
+    int slot;
+
+    for(c = node->clients; c != NULL; c = c->next)
+    {
+        for(i = 0; i < c->nschannels; )
+        {
+            slot = mock_key_slot(c->schannels[i], sdslen(c->schannels[i]));
+            if(node->mc->owner[slot] == node->index)
+            {
+                i ++;
+                continue;
+            }
+
+            mock_client_sunsubscribe(c, i);
+        }
+
+        mock_client_write(c);
+    }
+}
+
+/* Run the command req of c. Under the lock. */
+static int mock_node_command(struct mock_node *node, struct mock_client *c,
+    redisReply *req)
+{
+    struct mock_cluster *mc = node->mc;
+    const char *name;
+    sds value;
+    size_t argc, i;
+    long long n;
+    char *end;
+    int served, ret = MOCK_OK, asking;
+
+    argc = req->elements;
+    name = req->element[0]->str;
+
+    node->stats.commands ++;
+
+    /* ASKING only holds for the command right after it, or for the
+     * transaction that command starts. */
+    asking = c->asking;
+    if(!c->multi && strcasecmp(name, "MULTI"))
+    {
+        c->asking = 0;
+    }
+
+#define MOCK_ARITY(cond) do {                                               \
+    if(!(cond))                                                             \
+    {                                                                       \
+        c->obuf = sdscatprintf(c->obuf,                                     \
+            "-ERR wrong number of arguments for '%s' command\r\n", name);   \
+        return MOCK_OK;                                                     \
+    }                                                                       \
+} while(0)
+
+#define MOCK_ROUTE(first, step) do {                                        \
+    ret = mock_node_route(node, c, req, first, step, asking, &served);      \
+    if(ret != MOCK_OK || !served)                                           \
+    {                                                                       \
+        return ret;                                                         \
+    }                                                                       \
+} while(0)
+
+    if(mc->password != NULL && !c->authenticated &&
+        strcasecmp(name, "AUTH") && strcasecmp(name, "HELLO"))
+    {
+        c->obuf = sdscat(c->obuf, "-NOAUTH Authentication required.\r\n");
+        return MOCK_OK;
+    }
+
+    if(c->multi && strcasecmp(name, "EXEC") && strcasecmp(name, "DISCARD") &&
+        strcasecmp(name, "MULTI") && strcasecmp(name, "WATCH"))
+    {
+        return mock_client_queue(node, c, req, asking);
+    }
+
+    if(!strcasecmp(name, "PING"))
+    {
+        if(argc > 1)
+        {
+            c->obuf = mock_reply_bulk(c->obuf, req->element[1]->str,
+                req->element[1]->len);
+        }
+        else
+        {
+            c->obuf = sdscat(c->obuf, "+PONG\r\n");
+        }
+    }
+    else if(!strcasecmp(name, "ECHO"))
+    {
+        MOCK_ARITY(argc == 2);
+        c->obuf = mock_reply_bulk(c->obuf, req->element[1]->str,
+            req->element[1]->len);
+    }
+    else if(!strcasecmp(name, "ASKING"))
+    {
+        c->asking = 1;
+        c->obuf = sdscat(c->obuf, "+OK\r\n");
+    }
+    else if(!strcasecmp(name, "READONLY") || !strcasecmp(name, "READWRITE"))
+    {
+        c->obuf = sdscat(c->obuf, "+OK\r\n");
+    }
+    else if(!strcasecmp(name, "CLUSTER"))
+    {
+        MOCK_ARITY(argc >= 2);
+        if(!strcasecmp(req->element[1]->str, "SLOTS"))
+        {
+            c->obuf = mock_cluster_slots(mc, c->obuf);
+        }
+        else if(!strcasecmp(req->element[1]->str, "NODES"))
+        {
+            c->obuf = mock_cluster_nodes_reply(mc, node, c->obuf);
+        }
+        else if(!strcasecmp(req->element[1]->str, "KEYSLOT") && argc == 3)
+        {
+            c->obuf = sdscatprintf(c->obuf, ":%d\r\n",
+                mock_key_slot(req->element[2]->str, req->element[2]->len));
+        }
+        else if(!strcasecmp(req->element[1]->str, "SHARDS") &&
+            (mc->flags & MOCK_CLUSTER_SHARDS))
+        {
+            c->obuf = mock_cluster_shards(mc, c, c->obuf);
+        }
+        else
+        {
+            /* As Redis 6.2 does, before CLUSTER SHARDS */
+            c->obuf = sdscatprintf(c->obuf,
+                "-ERR unknown subcommand '%s'. Try CLUSTER HELP.\r\n",
+                req->element[1]->str);
+        }
+    }
+    else if(!strcasecmp(name, "HELLO"))
+    {
+        mock_client_hello(node, c, req);
+    }
+    else if(!strcasecmp(name, "AUTH"))
+    {
+        MOCK_ARITY(argc == 2 || argc == 3);
+        if(mc->password == NULL)
+        {
+            c->obuf = sdscat(c->obuf, "-ERR AUTH <password> called without "
+                "any password configured for the default user. Are you sure "
+                "your configuration is correct?\r\n");
+        }
+        else if(!mock_client_auth(mc, c, req->element[argc - 1]))
+        {
+            c->obuf = sdscat(c->obuf, "-WRONGPASS invalid username-password "
+                "pair or user is disabled.\r\n");
+        }
+        else
+        {
+            c->obuf = sdscat(c->obuf, "+OK\r\n");
+        }
+    }
+    else if(!strcasecmp(name, "CONFIG"))
+    {
+        MOCK_ARITY(argc >= 2);
+        if(!strcasecmp(req->element[1]->str, "GET") && argc == 3)
+        {
+            c->obuf = mock_config_get(c, c->obuf, req->element[2]->str);
+        }
+        else
+        {
+            c->obuf = sdscatprintf(c->obuf,
+                "-ERR unknown subcommand '%s'. Try CONFIG HELP.\r\n",
+                req->element[1]->str);
+        }
+    }
+    else if(!strcasecmp(name, "CLIENT"))
+    {
+        MOCK_ARITY(argc >= 2);
+        if(!strcasecmp(req->element[1]->str, "ID") && argc == 2)
+        {
+            c->obuf = sdscatprintf(c->obuf, ":%lld\r\n", c->id);
+        }
+        else if(!strcasecmp(req->element[1]->str, "TRACKING") && argc >= 3)
+        {
+            mock_client_tracking(c, req);
+        }
+        else
+        {
+            c->obuf = sdscatprintf(c->obuf,
+                "-ERR unknown subcommand '%s'. Try CLIENT HELP.\r\n",
+                req->element[1]->str);
+        }
+    }
+    else if(!strcasecmp(name, "SCRIPT"))
+    {
+        char sha[HISHA1_HEX_LEN + 1];
+
+        MOCK_ARITY(argc >= 2);
+        if(!strcasecmp(req->element[1]->str, "LOAD") && argc == 3)
+        {
+            hisha1_hex(req->element[2]->str, req->element[2]->len, sha);
+            value = sdsnew(sha);
+            if(dictFind(node->scripts, value) == NULL)
+            {
+                dictAdd(node->scripts, value,
+                    sdsnewlen(req->element[2]->str, req->element[2]->len));
+            }
+            else
+            {
+                sdsfree(value);
+            }
+            c->obuf = mock_reply_bulk(c->obuf, sha, HISHA1_HEX_LEN);
+        }
+        else if(!strcasecmp(req->element[1]->str, "FLUSH"))
+        {
+            _dictClear(node->scripts);
+            c->obuf = sdscat(c->obuf, "+OK\r\n");
+        }
+        else
+        {
+            c->obuf = sdscatprintf(c->obuf,
+                "-ERR unknown subcommand '%s'. Try SCRIPT HELP.\r\n",
+                req->element[1]->str);
+        }
+    }
+    else if(!strcasecmp(name, "EVALSHA"))
+    {
+        dictEntry *de;
+
+        MOCK_ARITY(argc >= 3);
+        n = strtoll(req->element[2]->str, &end, 10);
+        if(*end != '\0' || n < 0 || (size_t)n > argc - 3)
+        {
+            c->obuf = sdscat(c->obuf,
+                "-ERR Number of keys can't be greater than number of args\r\n");
+            return MOCK_OK;
+        }
+        if(n > 0)
+        {
+            MOCK_ROUTE(3, 1);
+        }
+
+        value = sdsnewlen(req->element[1]->str, req->element[1]->len);
+        sdstolower(value);
+        de = dictFind(node->scripts, value);
+        sdsfree(value);
+
+        /* There is no Lua here: a script returns its own body. */
+        if(de == NULL)
+        {
+            c->obuf = sdscat(c->obuf,
+                "-NOSCRIPT No matching script. Please use EVAL.\r\n");
+        }
+        else
+        {
+            c->obuf = mock_reply_value(c->obuf, dictGetEntryVal(de));
+        }
+    }
+    else if(!strcasecmp(name, "MULTI"))
+    {
+        if(c->multi)
+        {
+            c->obuf = sdscat(c->obuf, "-ERR MULTI calls can not be nested\r\n");
+        }
+        else
+        {
+            c->multi = 1;
+            c->obuf = sdscat(c->obuf, "+OK\r\n");
+        }
+    }
+    else if(!strcasecmp(name, "EXEC"))
+    {
+        redisReply **queued;
+        size_t nqueued;
+
+        if(!c->multi)
+        {
+            c->obuf = sdscat(c->obuf, "-ERR EXEC without MULTI\r\n");
+        }
+        else if(c->multi_error)
+        {
+            mock_client_discard(c);
+            c->obuf = sdscat(c->obuf, "-EXECABORT Transaction discarded "
+                "because of previous errors.\r\n");
+        }
+        else if(!mock_client_watched_same(node, c))
+        {
+            mock_client_discard(c);
+            c->obuf = sdscat(c->obuf, "*-1\r\n");
+        }
+        else
+        {
+            queued = c->queued;
+            nqueued = c->nqueued;
+            c->queued = NULL;
+            c->nqueued = 0;
+            mock_client_discard(c);
+
+            c->obuf = sdscatprintf(c->obuf, "*%zu\r\n", nqueued);
+            for(i = 0; i < nqueued; i ++)
+            {
+                if(ret == MOCK_OK)
+                {
+                    c->asking = asking;
+                    ret = mock_node_command(node, c, queued[i]);
+                }
+                freeReplyObject(queued[i]);
+            }
+            c->asking = 0;
+            free(queued);
+        }
+    }
+    else if(!strcasecmp(name, "DISCARD"))
+    {
+        if(!c->multi)
+        {
+            c->obuf = sdscat(c->obuf, "-ERR DISCARD without MULTI\r\n");
+        }
+        else
+        {
+            mock_client_discard(c);
+            c->obuf = sdscat(c->obuf, "+OK\r\n");
+        }
+    }
+    else if(!strcasecmp(name, "WATCH"))
+    {
+        MOCK_ARITY(argc >= 2);
+        if(c->multi)
+        {
+            c->obuf = sdscat(c->obuf,
+                "-ERR WATCH inside MULTI is not allowed\r\n");
+            return MOCK_OK;
+        }
+
+        MOCK_ROUTE(1, 1);
+        for(i = 1; i < argc && ret == MOCK_OK; i ++)
+        {
+            ret = mock_client_watch(node, c, req->element[i]);
+        }
+        c->obuf = sdscat(c->obuf, "+OK\r\n");
+    }
+    else if(!strcasecmp(name, "UNWATCH"))
+    {
+        mock_client_unwatch(c);
+        c->obuf = sdscat(c->obuf, "+OK\r\n");
+    }
+    else if(!strcasecmp(name, "SUBSCRIBE"))
+    {
+        /* For the invalidations: nothing else is published. */
+        MOCK_ARITY(argc >= 2);
+        for(i = 1; i < argc; i ++)
+        {
+            if(!strcmp(req->element[i]->str, MOCK_INVALIDATE))
+            {
+                c->invalidations = 1;
+            }
+
+            c->obuf = mock_reply_push(c, c->obuf, 3);
+            c->obuf = mock_reply_bulk(c->obuf, "subscribe", 9);
+            c->obuf = mock_reply_bulk(c->obuf, req->element[i]->str,
+                req->element[i]->len);
+            c->obuf = sdscatprintf(c->obuf, ":%zu\r\n", i);
+        }
+    }
+    else if(!strcasecmp(name, "SSUBSCRIBE"))
+    {
+        sds *schannels;
+
+        MOCK_ARITY(argc >= 2);
+        MOCK_ROUTE(1, 1);
+        for(i = 1; i < argc; i ++)
+        {
+            if(mock_client_sindex(c, req->element[i]) < 0)
+            {
+                schannels = realloc(c->schannels,
+                    sizeof(*schannels)*(c->nschannels + 1));
+                if(schannels == NULL)
+                {
+                    return MOCK_CLOSE;
+                }
+
+                c->schannels = schannels;
+                c->schannels[c->nschannels ++] = sdsnewlen(
+                    req->element[i]->str, req->element[i]->len);
+            }
+
+            c->obuf = mock_reply_push(c, c->obuf, 3);
+            c->obuf = mock_reply_bulk(c->obuf, "ssubscribe", 10);
+            c->obuf = mock_reply_bulk(c->obuf, req->element[i]->str,
+                req->element[i]->len);
+            c->obuf = sdscatprintf(c->obuf, ":%zu\r\n", c->nschannels);
+        }
+    }
+    else if(!strcasecmp(name, "SUNSUBSCRIBE"))
+    {
+        int index;
+
+        for(i = 1; i < argc; i ++)
+        {
+            index = mock_client_sindex(c, req->element[i]);
+            if(index >= 0)
+            {
+                mock_client_sunsubscribe(c, (size_t)index);
+                continue;
+            }
+
+            c->obuf = mock_reply_push(c, c->obuf, 3);
+            c->obuf = mock_reply_bulk(c->obuf, "sunsubscribe", 12);
+            c->obuf = mock_reply_bulk(c->obuf, req->element[i]->str,
+                req->element[i]->len);
+            c->obuf = sdscatprintf(c->obuf, ":%zu\r\n", c->nschannels);
+        }
+
+        if(argc == 1)
+        {
+            while(c->nschannels > 0)
+            {
+                mock_client_sunsubscribe(c, 0);
+            }
+        }
+    }
+    else if(!strcasecmp(name, "SPUBLISH"))
+    {
+        struct mock_client *to;
+
+        MOCK_ARITY(argc == 3);
+        MOCK_ROUTE(1, argc);
+        n = 0;
+        for(to = node->clients; to != NULL; to = to->next)
+        {
+            if(mock_client_sindex(to, req->element[1]) < 0)
+            {
+                continue;
+            }
+
+            to->obuf = mock_reply_push(to, to->obuf, 3);
+            to->obuf = mock_reply_bulk(to->obuf, "smessage", 8);
+            to->obuf = mock_reply_bulk(to->obuf, req->element[1]->str,
+                req->element[1]->len);
+            to->obuf = mock_reply_bulk(to->obuf, req->element[2]->str,
+                req->element[2]->len);
+            if(to != c)
+            {
+                mock_client_write(to);
+            }
+            n ++;
+        }
+        c->obuf = sdscatprintf(c->obuf, ":%lld\r\n", n);
+    }
+    else if(!strcasecmp(name, "GET"))
+    {
+        MOCK_ARITY(argc == 2);
+        MOCK_ROUTE(1, argc);
+        c->obuf = mock_reply_value(c->obuf,
+            mock_store_get(node, req->element[1]));
+    }
+    else if(!strcasecmp(name, "SET"))
+    {
+        MOCK_ARITY(argc == 3);
+        MOCK_ROUTE(1, argc);
+        mock_store_set(node, req->element[1], req->element[2]->str,
+            req->element[2]->len);
+        c->obuf = sdscat(c->obuf, "+OK\r\n");
+    }
+    else if(!strcasecmp(name, "INCR"))
+    {
+        char buf[32];
+
+        MOCK_ARITY(argc == 2);
+        MOCK_ROUTE(1, argc);
+        value = mock_store_get(node, req->element[1]);
+        n = 0;
+        if(value != NULL)
+        {
+            errno = 0;
+            n = strtoll(value, &end, 10);
+            if(sdslen(value) == 0 || *end != '\0' || errno != 0)
+            {
+                c->obuf = sdscat(c->obuf,
+                    "-ERR value is not an integer or out of range\r\n");
+                return MOCK_OK;
+            }
+        }
+
+        n ++;
+        snprintf(buf, sizeof(buf), "%lld", n);
+        mock_store_set(node, req->element[1], buf, strlen(buf));
+        c->obuf = sdscatprintf(c->obuf, ":%lld\r\n", n);
+    }
+    else if(!strcasecmp(name, "DEL") || !strcasecmp(name, "EXISTS"))
+    {
+        MOCK_ARITY(argc >= 2);
+        MOCK_ROUTE(1, 1);
+        n = 0;
+        for(i = 1; i < argc; i ++)
+        {
+            if(name[0] == 'D' || name[0] == 'd')
+            {
+                n += mock_store_del(node, req->element[i]);
+            }
+            else
+            {
+                n += mock_store_get(node, req->element[i]) != NULL;
+            }
+        }
+        c->obuf = sdscatprintf(c->obuf, ":%lld\r\n", n);
+    }
+    else if(!strcasecmp(name, "MGET"))
+    {
+        MOCK_ARITY(argc >= 2);
+        MOCK_ROUTE(1, 1);
+        c->obuf = sdscatprintf(c->obuf, "*%zu\r\n", argc - 1);
+        for(i = 1; i < argc; i ++)
+        {
+            c->obuf = mock_reply_value(c->obuf,
+                mock_store_get(node, req->element[i]));
+        }
+    }
+    else if(!strcasecmp(name, "MSET"))
+    {
+        MOCK_ARITY(argc >= 3 && argc % 2 == 1);
+        MOCK_ROUTE(1, 2);
+        for(i = 1; i < argc; i += 2)
+        {
+            mock_store_set(node, req->element[i], req->element[i + 1]->str,
+                req->element[i + 1]->len);
+        }
+        c->obuf = sdscat(c->obuf, "+OK\r\n");
+    }
+    else if(!strcasecmp(name, "DBSIZE"))
+    {
+        c->obuf = sdscatprintf(c->obuf, ":%lu\r\n", mc->store->used);
+    }
+    else if(!strcasecmp(name, "FLUSHALL") || !strcasecmp(name, "FLUSHDB"))
+    {
+        _dictClear(mc->store);
+        mock_node_invalidate(node, NULL, 0);
+        c->obuf = sdscat(c->obuf, "+OK\r\n");
+    }
+    else
+    {
+        c->obuf = sdscatprintf(c->obuf, "-ERR unknown command '%s'\r\n", name);
+    }
+
+#undef MOCK_ARITY
+#undef MOCK_ROUTE
+
+    return ret;
+}
+
+static void mock_client_free(struct mock_client *c)
+{
+    size_t i;
+
+    mock_client_discard(c);
+    for(i = 0; i < c->nschannels; i ++)
+    {
+        sdsfree(c->schannels[i]);
+    }
+    free(c->schannels);
+
+    close(c->fd);
+    redisReaderFree(c->reader);
+    sdsfree(c->obuf);
+    free(c);
+}
+
+/* Send what can be of the output buffer. */
+static int mock_client_write(struct mock_client *c)
+{
+    ssize_t n;
+
+    while(sdslen(c->obuf) > 0)
+    {
+        n = send(c->fd, c->obuf, sdslen(c->obuf), MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK ?
+                MOCK_OK : MOCK_CLOSE;
+        }
+
+        sdsrange(c->obuf, n, -1);
+    }
+
+    return MOCK_OK;
+}
+
+static int mock_client_read(struct mock_node *node, struct mock_client *c)
+{
+    struct mock_cluster *mc = node->mc;
+    char buf[MOCK_READ_LEN];
+    struct timespec ts;
+    redisReply *req;
+    unsigned int latency;
+    ssize_t n;
+    size_t i;
+    int ret = MOCK_OK;
+
+    n = recv(c->fd, buf, sizeof(buf), 0);
+    if(n <= 0)
+    {
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+            errno == EINTR) ? MOCK_OK : MOCK_CLOSE;
+    }
+
+    if(redisReaderFeed(c->reader, buf, (size_t)n) != REDIS_OK)
+    {
+        return MOCK_CLOSE;
+    }
+
+    pthread_mutex_lock(&mc->lock);
+    latency = node->latency;
+    pthread_mutex_unlock(&mc->lock);
+
+    if(latency > 0)
+    {
+        ts.tv_sec = latency/1000000;
+        ts.tv_nsec = (long)(latency%1000000)*1000;
+        while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    }
+
+    for(;;)
+    {
+        req = NULL;
+        if(redisReaderGetReply(c->reader, (void **)&req) != REDIS_OK)
+        {
+            return MOCK_CLOSE;
+        }
+
+        if(req == NULL)
+        {
+            break;
+        }
+
+        /* Commands only, as clients send them. */
+        if(req->type != REDIS_REPLY_ARRAY || req->elements == 0)
+        {
+            freeReplyObject(req);
+            return MOCK_CLOSE;
+        }
+
+        for(i = 0; i < req->elements; i ++)
+        {
+            if(req->element[i]->type != REDIS_REPLY_STRING)
+            {
+                freeReplyObject(req);
+                return MOCK_CLOSE;
+            }
+        }
+
+        pthread_mutex_lock(&mc->lock);
+        ret = mock_node_command(node, c, req);
+        pthread_mutex_unlock(&mc->lock);
+
+        if(ret == MOCK_QUEUED)
+        {
+            ret = MOCK_OK;
+        }
+        else
+        {
+            freeReplyObject(req);
+        }
+
+        if(ret != MOCK_OK)
+        {
+            return ret;
+        }
+    }
+
+    return mock_client_write(c);
+}
+
+static void mock_node_accept(struct mock_node *node)
+{
+    struct mock_client *c;
+    int fd, yes = 1;
+
+    fd = accept(node->fd, NULL, NULL);
+    if(fd < 0)
+    {
+        return;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if(c == NULL || (c->reader = redisReaderCreate()) == NULL ||
+        (c->obuf = sdsempty()) == NULL)
+    {
+        if(c != NULL)
+        {
+            if(c->reader != NULL)
+            {
+                redisReaderFree(c->reader);
+            }
+            free(c);
+        }
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(!(node->mc->flags & MOCK_CLUSTER_UNIX))
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+
+    c->fd = fd;
+    c->proto = 2;
+    c->redirect = -1;
+    c->next = node->clients;
+    node->clients = c;
+    node->nclients ++;
+
+    pthread_mutex_lock(&node->mc->lock);
+    c->id = ++ node->mc->next_id;
+    node->stats.connections ++;
+    pthread_mutex_unlock(&node->mc->lock);
+}
+
+static void mock_node_drop(struct mock_node *node)
+{
+    struct mock_client *c;
+
+    while((c = node->clients) != NULL)
+    {
+        node->clients = c->next;
+        mock_client_free(c);
+    }
+
+    node->nclients = 0;
+}
+
+static void *mock_node_run(void *arg)
+{
+    struct mock_node *node = arg;
+    struct mock_cluster *mc = node->mc;
+    struct mock_client *c, **pc;
+    struct pollfd *pfd = NULL, *grown;
+    int npfd = 0, n, i, stop, drop, moved;
+    char buf[64];
+
+    for(;;)
+    {
+        if(npfd < node->nclients + 2)
+        {
+            grown = realloc(pfd, sizeof(*pfd)*(node->nclients + 16));
+            if(grown == NULL)
+            {
+                break;
+            }
+            pfd = grown;
+            npfd = node->nclients + 16;
+        }
+
+        pfd[0].fd = node->wake[0];
+        pfd[0].events = POLLIN;
+        pfd[1].fd = node->fd;
+        pfd[1].events = POLLIN;
+        for(c = node->clients, n = 2; c != NULL; c = c->next, n ++)
+        {
+            pfd[n].fd = c->fd;
+            pfd[n].events = POLLIN | (sdslen(c->obuf) > 0 ? POLLOUT : 0);
+            pfd[n].revents = 0;
+        }
+
+        if(poll(pfd, n, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        if(pfd[0].revents & POLLIN)
+        {
+            while(read(node->wake[0], buf, sizeof(buf)) > 0);
+
+            pthread_mutex_lock(&mc->lock);
+            stop = mc->stop;
+            drop = node->drop;
+            node->drop = 0;
+            moved = node->moved;
+            node->moved = 0;
+            if(moved && !stop && !drop)
+            {
+                mock_node_sunsubscribe_moved(node);
+            }
+            pthread_mutex_unlock(&mc->lock);
+
+            if(stop)
+            {
+                break;
+            }
+
+            if(drop)
+            {
+                mock_node_drop(node);
+                continue;
+            }
+        }
+
+        /* The clients polled, in the order they were listed. */
+        for(pc = &node->clients, i = 2; *pc != NULL && i < n; i ++)
+        {
+            c = *pc;
+
+            if(pfd[i].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                if(mock_client_read(node, c) != MOCK_OK)
+                {
+                    *pc = c->next;
+                    node->nclients --;
+                    mock_client_free(c);
+                    continue;
+                }
+            }
+            else if((pfd[i].revents & POLLOUT) &&
+                mock_client_write(c) != MOCK_OK)
+            {
+                *pc = c->next;
+                node->nclients --;
+                mock_client_free(c);
+                continue;
+            }
+
+            pc = &c->next;
+        }
+
+        /* Accepted last, for the clients to stay in the order polled. */
+        if(pfd[1].revents & POLLIN)
+        {
+            mock_node_accept(node);
+        }
+    }
+
+    mock_node_drop(node);
+    free(pfd);
+
+    return NULL;
+}
+
+static void mock_node_wake(struct mock_node *node)
+{
+    ssize_t n;
+
+    n = write(node->wake[1], "", 1);
+    (void)n;
+}
+
+static int mock_node_listen(struct mock_cluster *mc, struct mock_node *node)
+{
+    static int seq;
+    struct sockaddr_in sin;
+    struct sockaddr_un sun;
+    socklen_t len;
+    int yes = 1;
+
+    if(mc->flags & MOCK_CLUSTER_UNIX)
+    {
+        node->host = sdscatprintf(sdsempty(), "/tmp/mock-cluster-%d-%d-%d.sock",
+            (int)getpid(), __sync_fetch_and_add(&seq, 1), node->index);
+        node->port = 0;
+        node->addr = sdsdup(node->host);
+
+        if(sdslen(node->host) >= sizeof(sun.sun_path))
+        {
+            return -1;
+        }
+
+        node->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(node->fd < 0)
+        {
+            return -1;
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        memcpy(sun.sun_path, node->host, sdslen(node->host));
+        unlink(node->host);
+        if(bind(node->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        node->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(node->fd < 0)
+        {
+            return -1;
+        }
+
+        setsockopt(node->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = 0;
+        len = sizeof(sin);
+        if(bind(node->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+            getsockname(node->fd, (struct sockaddr *)&sin, &len) < 0)
+        {
+            return -1;
+        }
+
+        node->host = sdsnew("127.0.0.1");
+        node->port = ntohs(sin.sin_port);
+        node->addr = sdscatprintf(sdsempty(), "%s:%d", node->host, node->port);
+    }
+
+    if(listen(node->fd, 511) < 0)
+    {
+        return -1;
+    }
+
+    fcntl(node->fd, F_SETFL, fcntl(node->fd, F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+struct mock_cluster *mock_cluster_start(int nodes, int flags)
+{
+    struct mock_cluster *mc;
+    struct mock_node *node;
+    int i;
+
+    if(nodes <= 0 || nodes > MOCK_CLUSTER_SLOTS)
+    {
+        return NULL;
+    }
+
+    mc = calloc(1, sizeof(*mc));
+    if(mc == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&mc->lock, NULL);
+    mc->flags = flags;
+    mc->store = dictCreate(&mock_store_type, NULL);
+    mc->addrs = sdsempty();
+    mc->nodes = calloc(nodes, sizeof(*mc->nodes));
+    if(mc->nodes == NULL)
+    {
+        mock_cluster_stop(mc);
+        return NULL;
+    }
+
+    for(i = 0; i < MOCK_CLUSTER_SLOTS; i ++)
+    {
+        mc->owner[i] = (int16_t)((long)i*nodes/MOCK_CLUSTER_SLOTS);
+        mc->importing[i] = -1;
+    }
+
+    for(i = 0; i < nodes; i ++)
+    {
+        node = &mc->nodes[i];
+        node->mc = mc;
+        node->index = i;
+        node->fd = -1;
+        node->wake[0] = node->wake[1] = -1;
+        node->key = sdsempty();
+        node->scripts = dictCreate(&mock_store_type, NULL);
+        snprintf(node->id, sizeof(node->id), "%040x", i + 1);
+        mc->nnodes ++;
+
+        if(mock_node_listen(mc, node) < 0 || pipe(node->wake) < 0)
+        {
+            mock_cluster_stop(mc);
+            return NULL;
+        }
+
+        fcntl(node->wake[0], F_SETFL, fcntl(node->wake[0], F_GETFL) | O_NONBLOCK);
+
+        if(pthread_create(&node->thread, NULL, mock_node_run, node) != 0)
+        {
+            mock_cluster_stop(mc);
+            return NULL;
+        }
+        node->started = 1;
+
+        mc->addrs = sdscatprintf(mc->addrs, "%s%s", i > 0 ? "," : "",
+            node->addr);
+    }
+
+    return mc;
+}
+
+void mock_cluster_stop(struct mock_cluster *mc)
+{
+    struct mock_node *node;
+    int i;
+
+    if(mc == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&mc->lock);
+    mc->stop = 1;
+    pthread_mutex_unlock(&mc->lock);
+
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        node = &mc->nodes[i];
+        if(node->started)
+        {
+            mock_node_wake(node);
+            pthread_join(node->thread, NULL);
+        }
+
+        if(node->fd >= 0)
+        {
+            close(node->fd);
+        }
+        if(node->wake[0] >= 0)
+        {
+            close(node->wake[0]);
+            close(node->wake[1]);
+        }
+        if(node->host != NULL && (mc->flags & MOCK_CLUSTER_UNIX))
+        {
+            unlink(node->host);
+        }
+
+        sdsfree(node->host);
+        sdsfree(node->addr);
+        sdsfree(node->key);
+        if(node->scripts != NULL)
+        {
+            dictRelease(node->scripts);
+        }
+    }
+
+    if(mc->store != NULL)
+    {
+        dictRelease(mc->store);
+    }
+    sdsfree(mc->addrs);
+    sdsfree(mc->password);
+    free(mc->nodes);
+    pthread_mutex_destroy(&mc->lock);
+    free(mc);
+}
+
+int mock_cluster_nodes(struct mock_cluster *mc)
+{
+    return mc->nnodes;
+}
+
+const char *mock_cluster_addrs(struct mock_cluster *mc)
+{
+    return mc->addrs;
+}
+
+const char *mock_cluster_node_addr(struct mock_cluster *mc, int node)
+{
+    if(node < 0 || node >= mc->nnodes)
+    {
+        return NULL;
+    }
+
+    return mc->nodes[node].addr;
+}
+
+int mock_cluster_node_port(struct mock_cluster *mc, int node)
+{
+    if(node < 0 || node >= mc->nnodes)
+    {
+        return -1;
+    }
+
+    return mc->nodes[node].port;
+}
+
+int mock_cluster_slot_node(struct mock_cluster *mc, int slot)
+{
+    int node;
+
+    if(slot < 0 || slot >= MOCK_CLUSTER_SLOTS)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mc->lock);
+    node = mc->owner[slot];
+    pthread_mutex_unlock(&mc->lock);
+
+    return node;
+}
+
+int mock_cluster_move_slots(struct mock_cluster *mc, int start, int end,
+    int node)
+{
+    int slot, i;
+
+    if(start < 0 || end >= MOCK_CLUSTER_SLOTS || start > end ||
+        node < 0 || node >= mc->nnodes)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mc->lock);
+    for(slot = start; slot <= end; slot ++)
+    {
+        mc->owner[slot] = (int16_t)node;
+        mc->importing[slot] = -1;
+    }
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        mc->nodes[i].moved = 1;
+    }
+    pthread_mutex_unlock(&mc->lock);
+
+    /* For the nodes to drop the subscribers of the slots they lost. */
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        mock_node_wake(&mc->nodes[i]);
+    }
+
+    return 0;
+}
+
+int mock_cluster_migrate_slots(struct mock_cluster *mc, int start, int end,
+    int node)
+{
+    int slot;
+
+    if(start < 0 || end >= MOCK_CLUSTER_SLOTS || start > end ||
+        node < -1 || node >= mc->nnodes)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mc->lock);
+    for(slot = start; slot <= end; slot ++)
+    {
+        mc->importing[slot] = (int16_t)(node == mc->owner[slot] ? -1 : node);
+    }
+    pthread_mutex_unlock(&mc->lock);
+
+    return 0;
+}
+
+void mock_cluster_fault(struct mock_cluster *mc, int node, mock_fault fault,
+    long count)
+{
+    int i;
+
+    pthread_mutex_lock(&mc->lock);
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        if(node < 0 || node == i)
+        {
+            mc->nodes[i].fault = count == 0 ? MOCK_FAULT_NONE : fault;
+            mc->nodes[i].fault_count = count;
+        }
+    }
+    pthread_mutex_unlock(&mc->lock);
+}
+
+void mock_cluster_latency(struct mock_cluster *mc, int node,
+    unsigned int usec)
+{
+    int i;
+
+    pthread_mutex_lock(&mc->lock);
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        if(node < 0 || node == i)
+        {
+            mc->nodes[i].latency = usec;
+        }
+    }
+    pthread_mutex_unlock(&mc->lock);
+}
+
+void mock_cluster_disconnect(struct mock_cluster *mc, int node)
+{
+    int i;
+
+    pthread_mutex_lock(&mc->lock);
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        if(node < 0 || node == i)
+        {
+            mc->nodes[i].drop = 1;
+        }
+    }
+    pthread_mutex_unlock(&mc->lock);
+
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        if(node < 0 || node == i)
+        {
+            mock_node_wake(&mc->nodes[i]);
+        }
+    }
+}
+
+void mock_cluster_password(struct mock_cluster *mc, const char *password)
+{
+    pthread_mutex_lock(&mc->lock);
+    sdsfree(mc->password);
+    mc->password = password == NULL ? NULL : sdsnew(password);
+    pthread_mutex_unlock(&mc->lock);
+}
+
+void mock_cluster_flush(struct mock_cluster *mc)
+{
+    pthread_mutex_lock(&mc->lock);
+    _dictClear(mc->store);
+    pthread_mutex_unlock(&mc->lock);
+}
+
+void mock_cluster_script_flush(struct mock_cluster *mc, int node)
+{
+    int i;
+
+    pthread_mutex_lock(&mc->lock);
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        if(node < 0 || node == i)
+        {
+            _dictClear(mc->nodes[i].scripts);
+        }
+    }
+    pthread_mutex_unlock(&mc->lock);
+}
+
+void mock_cluster_stats(struct mock_cluster *mc, int node,
+    struct mock_node_stats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&mc->lock);
+    for(i = 0; i < mc->nnodes; i ++)
+    {
+        if(node < 0 || node == i)
+        {
+            stats->connections += mc->nodes[i].stats.connections;
+            stats->commands += mc->nodes[i].stats.commands;
+            stats->redirects += mc->nodes[i].stats.redirects;
+            stats->faults += mc->nodes[i].stats.faults;
+        }
+    }
+    pthread_mutex_unlock(&mc->lock);
+}
@@ -0,0 +1,96 @@
+#ifndef __MOCK_CLUSTER_H_
+#define __MOCK_CLUSTER_H_
+
+#include <stdint.h>
+
+/*
+ * A Redis Cluster impersonated in process, for the benchmarks and tests
+ * that need a reproducible cluster on a single box: every node is a thread
+ * serving RESP on a loopback port (or a Unix socket), the nodes sharing the
+ * slot table and an in-memory key space.
+ *
+ * The nodes answer PING, ECHO, ASKING, READONLY, READWRITE, CLUSTER SLOTS,
+ * CLUSTER NODES, CLUSTER KEYSLOT, GET, SET, INCR, DEL, EXISTS, MGET, MSET,
+ * DBSIZE and FLUSHALL, the key commands of a slot another node owns being
+ * redirected (MOVED, or ASK while the slot migrates), and keys of several
+ * slots refused (CROSSSLOT), like the server does. Faults and latency are
+ * injected on demand, from any thread.
+ *
+ * For the tests of the client, they also answer HELLO (RESP3 included),
+ * AUTH, CONFIG GET cluster-node-timeout, MULTI, EXEC, DISCARD, WATCH,
+ * UNWATCH, SSUBSCRIBE, SUNSUBSCRIBE, SPUBLISH, CLIENT ID and CLIENT
+ * TRACKING with REDIRECT, a client subscribed to __redis__:invalidate
+ * getting the keys written on its node. The subscribers of the sharded
+ * channels of slots that move away are unsubscribed, as Redis 7 does.
+ * Messages only reach the clients of the node they are published on.
+ * SCRIPT LOAD and SCRIPT FLUSH work on the scripts of their node; there is
+ * no Lua, EVALSHA of a script loaded on the node returns its body, and
+ * NOSCRIPT otherwise.
+ */
+
+#define MOCK_CLUSTER_SLOTS  16384
+
+/* Nodes listening on Unix sockets instead of loopback ports. The topology
+ * then names the node by the path of its socket, with port 0. */
+#define MOCK_CLUSTER_UNIX   (1 << 0)
+/* CLUSTER SHARDS answered, as Redis 7 does. Without it the nodes answer it
+ * with the error of Redis 6.2. Not for Unix sockets, which have no port. */
+#define MOCK_CLUSTER_SHARDS (1 << 1)
+/* HELLO 3 refused (NOPROTO), like a server or a proxy speaking RESP2 only. */
+#define MOCK_CLUSTER_RESP2  (1 << 2)
+
+typedef enum mock_fault {
+    MOCK_FAULT_NONE,
+    MOCK_FAULT_TRYAGAIN,        /* -TRYAGAIN */
+    MOCK_FAULT_CLUSTERDOWN,     /* -CLUSTERDOWN */
+    MOCK_FAULT_DISCONNECT       /* the connection closed, no reply */
+} mock_fault;
+
+struct mock_node_stats {
+    uint64_t connections;
+    uint64_t commands;
+    uint64_t redirects;         /* MOVED and ASK */
+    uint64_t faults;
+};
+
+struct mock_cluster;
+
+/* The slots are spread evenly over the nodes. NULL on error. */
+struct mock_cluster *mock_cluster_start(int nodes, int flags);
+void mock_cluster_stop(struct mock_cluster *mc);
+
+int mock_cluster_nodes(struct mock_cluster *mc);
+/* "host:port,host:port...", for redisClusterSetOptionAddNodes(). */
+const char *mock_cluster_addrs(struct mock_cluster *mc);
+/* "host:port" of a node, or the path of its socket. */
+const char *mock_cluster_node_addr(struct mock_cluster *mc, int node);
+int mock_cluster_node_port(struct mock_cluster *mc, int node);
+
+int mock_cluster_slot_node(struct mock_cluster *mc, int slot);
+/* Hand the slots over to node: the others answer MOVED for their keys. */
+int mock_cluster_move_slots(struct mock_cluster *mc, int start, int end, int node);
+/* Start migrating the slots to node: their owner answers ASK for their
+ * keys, that node serves them after ASKING. A node of -1 ends the
+ * migration, the slots staying with their owner. */
+int mock_cluster_migrate_slots(struct mock_cluster *mc, int start, int end, int node);
+
+/* Fail the next count key commands of node (all of them with -1, all the
+ * nodes with a node of -1), a count of 0 clearing the fault. */
+void mock_cluster_fault(struct mock_cluster *mc, int node, mock_fault fault, long count);
+/* Hold every batch of commands node reads for usec microseconds. */
+void mock_cluster_latency(struct mock_cluster *mc, int node, unsigned int usec);
+/* Close the connections of node (of all the nodes with -1) now. */
+void mock_cluster_disconnect(struct mock_cluster *mc, int node);
+
+/* Require AUTH, or HELLO with AUTH, before any other command of the
+ * connections not authenticated yet; NULL to stop. */
+void mock_cluster_password(struct mock_cluster *mc, const char *password);
+
+void mock_cluster_flush(struct mock_cluster *mc);
+/* Forget the scripts loaded on node (on all the nodes with -1), as a
+ * restart does. */
+void mock_cluster_script_flush(struct mock_cluster *mc, int node);
+/* The counters of node, summed over the nodes with -1. */
+void mock_cluster_stats(struct mock_cluster *mc, int node, struct mock_node_stats *stats);
+
+#endif
@@ -104,6 +104,7 @@ static const struct {
         {CMD_REQ_REDIS_GETRANGE, 8, "getrange"},
         {CMD_REQ_REDIS_SETRANGE, 8, "setrange"},
         {CMD_REQ_REDIS_SMEMBERS, 8, "smembers"},
+        {CMD_REQ_REDIS_SPUBLISH, 8, "spublish"},
         {CMD_REQ_REDIS_ZREVRANK, 8, "zrevrank"},
         {CMD_REQ_REDIS_PEXPIREAT, 9, "pexpireat"},
         {CMD_REQ_REDIS_RPOPLPUSH, 9, "rpoplpush"},
@@ -223,6 +224,8 @@ redis_arg1(struct cmd *r)
 
     case CMD_REQ_REDIS_SISMEMBER:
 
+    case CMD_REQ_REDIS_SPUBLISH:
+
     case CMD_REQ_REDIS_ZRANK:
     case CMD_REQ_REDIS_ZREVRANK:
     case CMD_REQ_REDIS_ZSCORE:
@@ -1259,7 +1262,8 @@ struct cmd *command_get()
         return NULL;
     }
         
-    command->id = ++cmd_id;
+    /* The loops of a redisClusterAsyncPool take ids concurrently. */
+    command->id = __atomic_add_fetch(&cmd_id, 1, __ATOMIC_RELAXED);
     command->result = CMD_PARSE_OK;
     command->errstr = NULL;
     command->type = CMD_UNKNOWN;
@@ -0,0 +1,876 @@
+#include "fmacros.h"
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "hicache.h"
+#include "command.h"
+#include "hiarray.h"
+#include "dict.c"
+
+#define HICACHE_CHANNEL     "__redis__:invalidate"
+
+/* Forward declarations of hiredis.c functions */
+void __redisSetError(redisContext *c, int type, const char *str);
+
+struct hicache_entry {
+    sds                  cmd;       /* formatted command, the lookup key */
+    sds                  key;       /* the key it reads */
+    redisReply           *reply;
+    size_t               size;      /* bytes accounted for */
+    struct hicache_entry *prev;     /* LRU list, most recent first */
+    struct hicache_entry *next;
+    struct hicache_entry *key_next; /* next reply of the same key */
+};
+
+struct redisCache {
+    size_t               max_bytes;
+    dict                 *entries;  /* command -> entry */
+    dict                 *keys;     /* key -> its most recent entry */
+    struct hicache_entry *head;
+    struct hicache_entry *tail;
+
+    int                  bcast;
+    int                  nprefixes;
+    sds                  *prefixes;
+
+    /* Single node, see redisCacheAttach */
+    redisContext         *c;
+    redisContext         *inv;
+    long long            inv_id;
+    int                  tracking;
+
+    redisCacheStats      stats;
+};
+
+static unsigned int
+hicache_hash(const void *key)
+{
+    return dictGenHashFunction((const unsigned char *)key, sdslen((const sds)key));
+}
+
+static int
+hicache_compare(void *privdata, const void *key1, const void *key2)
+{
+    size_t l1, l2;
+    DICT_NOTUSED(privdata);
+
+    l1 = sdslen((const sds)key1);
+    l2 = sdslen((const sds)key2);
+    if (l1 != l2) return 0;
+    return memcmp(key1, key2, l1) == 0;
+}
+
+static void
+hicache_key_free(void *privdata, void *key)
+{
+    DICT_NOTUSED(privdata);
+
+    sdsfree(key);
+}
+
+/* The key is the command of the entry. */
+static dictType hicacheEntriesDictType = {
+    hicache_hash,               /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    hicache_compare,            /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+static dictType hicacheKeysDictType = {
+    hicache_hash,               /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    hicache_compare,            /* key compare */
+    hicache_key_free,           /* key destructor */
+    NULL                        /* val destructor */
+};
+
+redisCache *
+redisCacheCreate(size_t max_bytes)
+{
+    redisCache *cache;
+
+    if (max_bytes == 0) {
+        return NULL;
+    }
+
+    cache = hi_calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->max_bytes = max_bytes;
+    cache->inv_id = -1;
+
+    cache->entries = dictCreate(&hicacheEntriesDictType, NULL);
+    cache->keys = dictCreate(&hicacheKeysDictType, NULL);
+    if (cache->entries == NULL || cache->keys == NULL) {
+        redisCacheFree(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void
+redisCacheFree(redisCache *cache)
+{
+    int i;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->entries != NULL && cache->keys != NULL) {
+        redisCacheFlush(cache);
+    }
+
+    if (cache->entries != NULL) {
+        dictRelease(cache->entries);
+    }
+
+    if (cache->keys != NULL) {
+        dictRelease(cache->keys);
+    }
+
+    for (i = 0; i < cache->nprefixes; i++) {
+        sdsfree(cache->prefixes[i]);
+    }
+    hi_free(cache->prefixes);
+
+    if (cache->inv != NULL) {
+        redisFree(cache->inv);
+    }
+
+    hi_free(cache);
+}
+
+int
+redisCacheSetBroadcast(redisCache *cache, int nprefixes, const char **prefixes)
+{
+    int i;
+
+    if (cache == NULL || nprefixes < 0 || cache->bcast ||
+        cache->tracking || dictSize(cache->entries) != 0) {
+        return REDIS_ERR;
+    }
+
+    if (nprefixes > 0) {
+        cache->prefixes = hi_calloc(nprefixes, sizeof(sds));
+        if (cache->prefixes == NULL) {
+            return REDIS_ERR;
+        }
+
+        for (i = 0; i < nprefixes; i++) {
+            cache->prefixes[i] = sdsnew(prefixes[i]);
+            if (cache->prefixes[i] == NULL) {
+                cache->nprefixes = i;
+                return REDIS_ERR;
+            }
+        }
+    }
+
+    cache->nprefixes = nprefixes;
+    cache->bcast = 1;
+
+    return REDIS_OK;
+}
+
+/* Read only commands of a single key whose reply only depends on it. */
+static int
+hicache_cacheable(cmd_type_t type)
+{
+    switch (type) {
+    case CMD_REQ_REDIS_EXISTS:
+    case CMD_REQ_REDIS_TYPE:
+
+    case CMD_REQ_REDIS_GET:
+    case CMD_REQ_REDIS_GETBIT:
+    case CMD_REQ_REDIS_GETRANGE:
+    case CMD_REQ_REDIS_STRLEN:
+    case CMD_REQ_REDIS_BITCOUNT:
+
+    case CMD_REQ_REDIS_HEXISTS:
+    case CMD_REQ_REDIS_HGET:
+    case CMD_REQ_REDIS_HGETALL:
+    case CMD_REQ_REDIS_HKEYS:
+    case CMD_REQ_REDIS_HLEN:
+    case CMD_REQ_REDIS_HMGET:
+    case CMD_REQ_REDIS_HVALS:
+
+    case CMD_REQ_REDIS_LINDEX:
+    case CMD_REQ_REDIS_LLEN:
+    case CMD_REQ_REDIS_LRANGE:
+
+    case CMD_REQ_REDIS_SCARD:
+    case CMD_REQ_REDIS_SISMEMBER:
+    case CMD_REQ_REDIS_SMEMBERS:
+
+    case CMD_REQ_REDIS_ZCARD:
+    case CMD_REQ_REDIS_ZCOUNT:
+    case CMD_REQ_REDIS_ZLEXCOUNT:
+    case CMD_REQ_REDIS_ZRANGE:
+    case CMD_REQ_REDIS_ZRANGEBYLEX:
+    case CMD_REQ_REDIS_ZRANGEBYSCORE:
+    case CMD_REQ_REDIS_ZRANK:
+    case CMD_REQ_REDIS_ZREVRANGE:
+    case CMD_REQ_REDIS_ZREVRANGEBYSCORE:
+    case CMD_REQ_REDIS_ZREVRANK:
+    case CMD_REQ_REDIS_ZSCORE:
+        return 1;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/* The key read by command, if its reply may be cached. */
+static int
+hicache_command_key(redisCache *cache, struct cmd *command, const char **key,
+                    size_t *len)
+{
+    struct keypos *kp;
+    int i;
+
+    if (command == NULL || command->result != CMD_PARSE_OK ||
+        command->keys == NULL || hiarray_n(command->keys) != 1 ||
+        !hicache_cacheable(command->type)) {
+        return 0;
+    }
+
+    kp = hiarray_get(command->keys, 0);
+    *key = kp->start;
+    *len = (size_t)(kp->end - kp->start);
+
+    /* Broadcast tracking only reports the keys with these prefixes. */
+    if (cache->bcast && cache->nprefixes > 0) {
+        for (i = 0; i < cache->nprefixes; i++) {
+            if (sdslen(cache->prefixes[i]) <= *len &&
+                memcmp(cache->prefixes[i], *key, sdslen(cache->prefixes[i])) == 0) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    return 1;
+}
+
+static redisReply *
+hicache_reply_dup(const redisReply *r, size_t *size)
+{
+    redisReply *d;
+    size_t i;
+
+    d = hi_calloc(1, sizeof(*d));
+    if (d == NULL) {
+        return NULL;
+    }
+
+    *size += sizeof(*d);
+
+    d->type = r->type;
+    d->integer = r->integer;
+    d->dval = r->dval;
+    d->len = r->len;
+    memcpy(d->vtype, r->vtype, sizeof(d->vtype));
+
+    if (r->str != NULL) {
+        d->str = hi_malloc(r->len + 1);
+        if (d->str == NULL) {
+            freeReplyObject(d);
+            return NULL;
+        }
+
+        memcpy(d->str, r->str, r->len);
+        d->str[r->len] = '\0';
+        *size += r->len + 1;
+    }
+
+    if (r->element != NULL && r->elements > 0) {
+        d->element = hi_calloc(r->elements, sizeof(redisReply *));
+        if (d->element == NULL) {
+            freeReplyObject(d);
+            return NULL;
+        }
+
+        d->elements = r->elements;
+        *size += r->elements * sizeof(redisReply *);
+
+        for (i = 0; i < r->elements; i++) {
+            d->element[i] = hicache_reply_dup(r->element[i], size);
+            if (d->element[i] == NULL) {
+                freeReplyObject(d);
+                return NULL;
+            }
+        }
+    }
+
+    return d;
+}
+
+static void
+hicache_lru_unlink(redisCache *cache, struct hicache_entry *e)
+{
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        cache->head = e->next;
+    }
+
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        cache->tail = e->prev;
+    }
+
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void
+hicache_lru_push(redisCache *cache, struct hicache_entry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = e;
+    } else {
+        cache->tail = e;
+    }
+    cache->head = e;
+}
+
+static void
+hicache_remove(redisCache *cache, struct hicache_entry *e)
+{
+    struct hicache_entry **p;
+    dictEntry *de;
+
+    de = dictFind(cache->keys, e->key);
+    if (de != NULL) {
+        if (dictGetEntryVal(de) == e && e->key_next == NULL) {
+            dictDelete(cache->keys, e->key);
+        } else if (dictGetEntryVal(de) == e) {
+            de->val = e->key_next;
+        } else {
+            for (p = (struct hicache_entry **)&de->val; *p != NULL; p = &(*p)->key_next) {
+                if (*p == e) {
+                    *p = e->key_next;
+                    break;
+                }
+            }
+        }
+    }
+
+    dictDelete(cache->entries, e->cmd);
+    hicache_lru_unlink(cache, e);
+
+    cache->stats.bytes -= e->size;
+    cache->stats.entries--;
+
+    sdsfree(e->cmd);
+    sdsfree(e->key);
+    freeReplyObject(e->reply);
+    hi_free(e);
+}
+
+void
+redisCacheFlush(redisCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->head != NULL) {
+        cache->stats.flushes++;
+    }
+
+    while (cache->head != NULL) {
+        hicache_remove(cache, cache->head);
+    }
+}
+
+void
+redisCacheGetStats(redisCache *cache, redisCacheStats *stats)
+{
+    if (cache == NULL || stats == NULL) {
+        return;
+    }
+
+    *stats = cache->stats;
+}
+
+redisReply *
+redisCacheGet(redisCache *cache, struct cmd *command)
+{
+    struct hicache_entry *e;
+    const char *key;
+    size_t keylen, size = 0;
+    dictEntry *de;
+    sds cmd;
+
+    if (cache == NULL || !hicache_command_key(cache, command, &key, &keylen)) {
+        return NULL;
+    }
+
+    cmd = sdsnewlen(command->cmd, command->clen);
+    if (cmd == NULL) {
+        return NULL;
+    }
+
+    de = dictFind(cache->entries, cmd);
+    sdsfree(cmd);
+
+    if (de == NULL) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    e = dictGetEntryVal(de);
+    hicache_lru_unlink(cache, e);
+    hicache_lru_push(cache, e);
+
+    cache->stats.hits++;
+
+    return hicache_reply_dup(e->reply, &size);
+}
+
+void
+redisCacheSet(redisCache *cache, struct cmd *command, const redisReply *reply)
+{
+    struct hicache_entry *e;
+    const char *key;
+    size_t keylen;
+    dictEntry *de;
+
+    if (cache == NULL || reply == NULL || reply->type == REDIS_REPLY_ERROR ||
+        !hicache_command_key(cache, command, &key, &keylen)) {
+        return;
+    }
+
+    e = hi_calloc(1, sizeof(*e));
+    if (e == NULL) {
+        return;
+    }
+
+    e->size = sizeof(*e) + command->clen + keylen;
+    e->cmd = sdsnewlen(command->cmd, command->clen);
+    e->key = sdsnewlen(key, keylen);
+    e->reply = e->cmd && e->key ? hicache_reply_dup(reply, &e->size) : NULL;
+    if (e->reply == NULL || e->size > cache->max_bytes) {
+        goto error;
+    }
+
+    de = dictFind(cache->entries, e->cmd);
+    if (de != NULL) {
+        hicache_remove(cache, dictGetEntryVal(de));
+    }
+
+    if (dictAdd(cache->entries, e->cmd, e) != DICT_OK) {
+        goto error;
+    }
+
+    de = dictFind(cache->keys, e->key);
+    if (de != NULL) {
+        e->key_next = dictGetEntryVal(de);
+        de->val = e;
+    } else {
+        key = sdsdup(e->key);
+        if (key == NULL || dictAdd(cache->keys, (void *)key, e) != DICT_OK) {
+            sdsfree((sds)key);
+            dictDelete(cache->entries, e->cmd);
+            goto error;
+        }
+    }
+
+    hicache_lru_push(cache, e);
+    cache->stats.bytes += e->size;
+    cache->stats.entries++;
+
+    while (cache->stats.bytes > cache->max_bytes && cache->tail != NULL) {
+        cache->stats.evictions++;
+        hicache_remove(cache, cache->tail);
+    }
+
+    return;
+
+error:
+    sdsfree(e->cmd);
+    sdsfree(e->key);
+    freeReplyObject(e->reply);
+    hi_free(e);
+}
+
+static void
+hicache_invalidate(redisCache *cache, const char *key, size_t len)
+{
+    dictEntry *de;
+    sds name;
+
+    name = sdsnewlen(key, len);
+    if (name == NULL) {
+        redisCacheFlush(cache);
+        return;
+    }
+
+    while ((de = dictFind(cache->keys, name)) != NULL) {
+        cache->stats.invalidations++;
+        hicache_remove(cache, dictGetEntryVal(de));
+    }
+
+    sdsfree(name);
+}
+
+/* message __redis__:invalidate <keys>, the keys being nil on FLUSHALL. */
+static void
+hicache_process(redisCache *cache, redisReply *r)
+{
+    redisReply *keys;
+    size_t i;
+
+    if ((r->type != REDIS_REPLY_ARRAY && r->type != REDIS_REPLY_PUSH) ||
+        r->elements != 3 || r->element[0]->type != REDIS_REPLY_STRING ||
+        strcasecmp(r->element[0]->str, "message") != 0 ||
+        r->element[1]->type != REDIS_REPLY_STRING ||
+        strcmp(r->element[1]->str, HICACHE_CHANNEL) != 0) {
+        return;
+    }
+
+    keys = r->element[2];
+    if (keys->type != REDIS_REPLY_ARRAY && keys->type != REDIS_REPLY_SET) {
+        redisCacheFlush(cache);
+        return;
+    }
+
+    for (i = 0; i < keys->elements; i++) {
+        if (keys->element[i]->type == REDIS_REPLY_STRING) {
+            hicache_invalidate(cache, keys->element[i]->str, keys->element[i]->len);
+        }
+    }
+}
+
+int
+redisCachePoll(redisCache *cache, redisContext *inv)
+{
+    struct pollfd pfd;
+    void *reply;
+    int n;
+
+    if (cache == NULL) {
+        return REDIS_ERR;
+    }
+
+    if (inv == NULL || inv->err) {
+        redisCacheFlush(cache);
+        return REDIS_ERR;
+    }
+
+    for (;;) {
+        if (redisGetReplyFromReader(inv, &reply) != REDIS_OK) {
+            redisCacheFlush(cache);
+            return REDIS_ERR;
+        }
+
+        if (reply != NULL) {
+            hicache_process(cache, reply);
+            freeReplyObject(reply);
+            continue;
+        }
+
+        pfd.fd = inv->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        n = poll(&pfd, 1, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        if (redisBufferRead(inv) != REDIS_OK) {
+            redisCacheFlush(cache);
+            return REDIS_ERR;
+        }
+    }
+
+    return REDIS_OK;
+}
+
+long long
+redisCacheListen(redisContext *inv)
+{
+    redisReply *reply;
+    long long id;
+
+    if (inv == NULL || inv->err) {
+        return -1;
+    }
+
+    /* Replies only, whatever the protocol. */
+    redisSetPushCallback(inv, NULL);
+
+    reply = redisCommand(inv, "CLIENT ID");
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+        freeReplyObject(reply);
+        return -1;
+    }
+
+    id = reply->integer;
+    freeReplyObject(reply);
+
+    reply = redisCommand(inv, "SUBSCRIBE %s", HICACHE_CHANNEL);
+    if (reply == NULL || (reply->type != REDIS_REPLY_ARRAY &&
+        reply->type != REDIS_REPLY_PUSH)) {
+        freeReplyObject(reply);
+        return -1;
+    }
+
+    freeReplyObject(reply);
+
+    return id;
+}
+
+int
+redisCacheTrack(redisCache *cache, redisContext *c, long long id)
+{
+    const char **argv;
+    redisReply *reply;
+    char idstr[32];
+    int argc = 0, i, ret = REDIS_ERR;
+
+    if (cache == NULL || c == NULL || c->err || id < 0) {
+        return REDIS_ERR;
+    }
+
+    argv = hi_calloc(6 + 2 * cache->nprefixes, sizeof(char *));
+    if (argv == NULL) {
+        return REDIS_ERR;
+    }
+
+    snprintf(idstr, sizeof(idstr), "%lld", id);
+
+    argv[argc++] = "CLIENT";
+    argv[argc++] = "TRACKING";
+    argv[argc++] = "on";
+    argv[argc++] = "REDIRECT";
+    argv[argc++] = idstr;
+    if (cache->bcast) {
+        argv[argc++] = "BCAST";
+        for (i = 0; i < cache->nprefixes; i++) {
+            argv[argc++] = "PREFIX";
+            argv[argc++] = cache->prefixes[i];
+        }
+    }
+
+    reply = redisCommandArgv(c, argc, argv, NULL);
+    if (reply != NULL && reply->type == REDIS_REPLY_STATUS) {
+        ret = REDIS_OK;
+    }
+
+    freeReplyObject(reply);
+    hi_free(argv);
+
+    return ret;
+}
+
+/* Open the connection receiving the invalidations, if needed, and turn
+ * tracking on for the attached context. */
+static int
+hicache_attach(redisCache *cache)
+{
+    redisContext *c = cache->c, *inv;
+    long long id;
+
+    if (cache->tracking) {
+        return REDIS_OK;
+    }
+
+    if (c->err) {
+        return REDIS_ERR;
+    }
+
+    if (cache->inv == NULL) {
+        if (c->connection_type == REDIS_CONN_UNIX) {
+            inv = c->connect_timeout ?
+                redisConnectUnixWithTimeout(c->unix_sock.path, *c->connect_timeout) :
+                redisConnectUnix(c->unix_sock.path);
+        } else {
+            inv = c->connect_timeout ?
+                redisConnectWithTimeout(c->tcp.host, c->tcp.port, *c->connect_timeout) :
+                redisConnect(c->tcp.host, c->tcp.port);
+        }
+
+        id = redisCacheListen(inv);
+        if (id < 0) {
+            redisFree(inv);
+            return REDIS_ERR;
+        }
+
+        cache->inv = inv;
+        cache->inv_id = id;
+    }
+
+    if (redisCacheTrack(cache, c, cache->inv_id) != REDIS_OK) {
+        return REDIS_ERR;
+    }
+
+    cache->tracking = 1;
+
+    return REDIS_OK;
+}
+
+/* Tracking is over: what the cache holds may be stale. */
+static void
+hicache_detach(redisCache *cache)
+{
+    cache->tracking = 0;
+    redisCacheFlush(cache);
+
+    if (cache->inv != NULL && cache->inv->err) {
+        redisFree(cache->inv);
+        cache->inv = NULL;
+        cache->inv_id = -1;
+    }
+}
+
+int
+redisCacheAttach(redisCache *cache, redisContext *c)
+{
+    if (cache == NULL || c == NULL || c->connection_type == REDIS_CONN_USERFD ||
+        (cache->c != NULL && cache->c != c)) {
+        return REDIS_ERR;
+    }
+
+    cache->c = c;
+
+    return hicache_attach(cache);
+}
+
+void *
+redisCacheFormattedCommand(redisCache *cache, redisContext *c, const char *cmd,
+                           size_t len)
+{
+    struct cmd *command;
+    redisReply *reply = NULL;
+    int tracked;
+
+    if (cache == NULL || c != cache->c) {
+        if (redisAppendFormattedCommand(c, cmd, len) != REDIS_OK ||
+            redisGetReply(c, (void **)&reply) != REDIS_OK) {
+            return NULL;
+        }
+        return reply;
+    }
+
+    /* Tracking stopped with a lost connection, start it again once the
+     * context is reconnected. */
+    if (!cache->tracking && c->err == 0) {
+        hicache_attach(cache);
+    }
+
+    tracked = cache->tracking;
+    if (tracked && redisCachePoll(cache, cache->inv) != REDIS_OK) {
+        hicache_detach(cache);
+        tracked = 0;
+    }
+
+    command = command_get();
+    if (command == NULL) {
+        __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+        return NULL;
+    }
+
+    command->cmd = (char *)cmd;
+    command->clen = (uint32_t)len;
+    redis_parse_cmd(command);
+
+    if (tracked && (reply = redisCacheGet(cache, command)) != NULL) {
+        goto done;
+    }
+
+    if (redisAppendFormattedCommand(c, cmd, len) != REDIS_OK ||
+        redisGetReply(c, (void **)&reply) != REDIS_OK) {
+        reply = NULL;
+        if (cache->tracking) {
+            hicache_detach(cache);
+        }
+        goto done;
+    }
+
+    if (tracked) {
+        redisCacheSet(cache, command, reply);
+    }
+
+done:
+    command->cmd = NULL;
+    command_destroy(command);
+
+    return reply;
+}
+
+void *
+redisCachevCommand(redisCache *cache, redisContext *c, const char *format,
+                   va_list ap)
+{
+    char *cmd;
+    void *reply;
+    int len;
+
+    len = redisvFormatCommand(&cmd, format, ap);
+    if (len == -1) {
+        __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+        return NULL;
+    } else if (len == -2) {
+        __redisSetError(c, REDIS_ERR_OTHER, "Invalid format string");
+        return NULL;
+    }
+
+    reply = redisCacheFormattedCommand(cache, c, cmd, len);
+    hi_free(cmd);
+
+    return reply;
+}
+
+void *
+redisCacheCommand(redisCache *cache, redisContext *c, const char *format, ...)
+{
+    va_list ap;
+    void *reply;
+
+    va_start(ap, format);
+    reply = redisCachevCommand(cache, c, format, ap);
+    va_end(ap);
+
+    return reply;
+}
+
+void *
+redisCacheCommandArgv(redisCache *cache, redisContext *c, int argc,
+                      const char **argv, const size_t *argvlen)
+{
+    sds cmd;
+    void *reply;
+    long long len;
+
+    len = redisFormatSdsCommandArgv(&cmd, argc, argv, argvlen);
+    if (len == -1) {
+        __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+        return NULL;
+    }
+
+    reply = redisCacheFormattedCommand(cache, c, cmd, (size_t)len);
+    sdsfree(cmd);
+
+    return reply;
+}
@@ -0,0 +1,83 @@
+#ifndef __HICACHE_H_
+#define __HICACHE_H_
+
+#include <stdint.h>
+#include <stdarg.h>
+
+#include "hiredis.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cmd;
+struct redisCache;
+
+/* Client side cache of read only, single key commands (GET, HGET, HGETALL,
+ * LRANGE, ZSCORE...), server assisted through CLIENT TRACKING.
+ *
+ * Replies are kept by command, and dropped when the server reports that
+ * their key changed. Invalidations are redirected to a connection of their
+ * own (CLIENT TRACKING on REDIRECT), subscribed to __redis__:invalidate,
+ * which works whatever the protocol of the tracked connection; under RESP3
+ * they arrive as push messages. That connection is read without blocking
+ * before every lookup, so a hit costs no round trip. A lost connection,
+ * tracked or redirected to, flushes the cache.
+ *
+ * The cache is bounded in bytes (replies and commands, approximately) and
+ * evicts the least recently used replies first. It is not thread safe and
+ * belongs to a single context. */
+typedef struct redisCache redisCache;
+
+typedef struct redisCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;     /* replies dropped by the server */
+    uint64_t evictions;         /* replies dropped for room */
+    uint64_t flushes;
+    size_t entries;
+    size_t bytes;
+} redisCacheStats;
+
+redisCache *redisCacheCreate(size_t max_bytes);
+void redisCacheFree(redisCache *cache);
+
+/* Track every key with the given prefixes (all keys when nprefixes is 0)
+ * instead of the keys read: the server keeps no state per key, but
+ * invalidates more. Only the keys with one of the prefixes are cached.
+ * Must be called before the cache is in use. */
+int redisCacheSetBroadcast(redisCache *cache, int nprefixes, const char **prefixes);
+
+void redisCacheFlush(redisCache *cache);
+void redisCacheGetStats(redisCache *cache, redisCacheStats *stats);
+
+/* Single node: cache the commands sent on c through redisCacheCommand. The
+ * connection receiving the invalidations is opened to the same server. */
+int redisCacheAttach(redisCache *cache, redisContext *c);
+
+/* Like redisCommand, the reply of a cached command being a copy. */
+void *redisCacheFormattedCommand(redisCache *cache, redisContext *c, const char *cmd, size_t len);
+void *redisCachevCommand(redisCache *cache, redisContext *c, const char *format, va_list ap);
+void *redisCacheCommand(redisCache *cache, redisContext *c, const char *format, ...);
+void *redisCacheCommandArgv(redisCache *cache, redisContext *c, int argc, const char **argv, const size_t *argvlen);
+
+/* Lower level, for clients doing their own routing (cluster). */
+
+/* Subscribe inv, a connection of its own, to the invalidations. Returns
+ * its client id, -1 on error. */
+long long redisCacheListen(redisContext *inv);
+/* Turn tracking on for c, its invalidations going to client id. */
+int redisCacheTrack(redisCache *cache, redisContext *c, long long id);
+/* Apply the invalidations inv received so far, without blocking. Returns
+ * REDIS_ERR, with the cache flushed, when inv is lost. */
+int redisCachePoll(redisCache *cache, redisContext *inv);
+/* A copy of the cached reply of command, NULL when there is none. */
+redisReply *redisCacheGet(redisCache *cache, struct cmd *command);
+/* Keep a copy of the reply of command, if it may be cached. */
+void redisCacheSet(redisCache *cache, struct cmd *command, const redisReply *reply);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
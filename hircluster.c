@@ -2,24 +2,44 @@
 #include "fmacros.h"
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "hircluster.h"
 #include "hiutil.h"
 #include "adlist.h"
 #include "hiarray.h"
+#include "hiwheel.h"
+#include "hisha1.h"
+#include "hicache.h"
+#include "hiredis_uring.h"
+#include "net.h"
 #include "command.h"
 #include "dict.c"
 
 #define REDIS_COMMAND_CLUSTER_NODES "CLUSTER NODES"
 #define REDIS_COMMAND_CLUSTER_SLOTS "CLUSTER SLOTS"
+#define REDIS_COMMAND_CLUSTER_SHARDS "CLUSTER SHARDS"
 #define REDIS_COMMAND_AUTH "AUTH"
 #define REDIS_COMMAND_AUTH_OK "OK"
+#define REDIS_COMMAND_HELLO "HELLO"
+#define REDIS_DEFAULT_USER "default"
 
 #define REDIS_COMMAND_ASKING "ASKING"
 #define REDIS_COMMAND_PING "PING"
+#define REDIS_COMMAND_SCRIPT_LOAD "SCRIPT LOAD"
+
+#define REDIS_ERROR_NOSCRIPT "NOSCRIPT"
 
 #define REDIS_PROTOCOL_ASKING "*1\r\n$6\r\nASKING\r\n"
 
@@ -31,6 +51,12 @@
 
 #define CLUSTER_DEFAULT_MAX_REDIRECT_COUNT 5
 
+#define CLUSTER_DEFAULT_BREAKER_THRESHOLD 0
+#define CLUSTER_DEFAULT_BACKOFF_MIN_USEC 100000LL
+#define CLUSTER_DEFAULT_BACKOFF_MAX_USEC 10000000LL
+
+#define CLUSTER_DEADLINE_TICK_USEC 1000
+
 typedef struct cluster_async_data
 {
     redisClusterAsyncContext *acc;
@@ -38,6 +64,9 @@ typedef struct cluster_async_data
     redisClusterCallbackFn *callback;
     int retry_count;
     void *privdata;
+    struct hiwheel_timer deadline;
+    int timed_out;      /* callback already ran with a timeout error */
+    int script_loaded;  /* sent again after loading its script */
 }cluster_async_data;
 
 typedef enum CLUSTER_ERR_TYPE{
@@ -54,6 +83,9 @@ static void cluster_node_deinit(cluster_node *node);
 static void cluster_slot_destroy(cluster_slot *slot);
 static void cluster_open_slot_destroy(copen_slot *oslot);
 static int redisClusterAuth(redisClusterContext *cc, redisContext *c);
+static void cluster_async_health_soon(redisClusterAsyncContext *acc);
+static void cluster_node_con_replaced(redisClusterContext *cc,
+    cluster_node *node);
 
 void listClusterNodeDestructor(void *val)
 {
@@ -127,6 +159,28 @@ dictType clusterNodesRefDictType = {
     NULL                        /* val destructor */
 };
 
+/* Registered Lua scripts, mapping their SHA1 digest 
+ * (lower case hex) to their body. */
+dictType clusterScriptsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictSdsDestructor           /* val destructor */
+};
+
+/* Sharded pub/sub subscriptions by channel, 
+ * the key belongs to the subscription. */
+dictType clusterSubscriptionsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
 
 void listCommandFree(void *command)
 {
@@ -140,6 +194,27 @@ void __redisSetError(redisContext *c, int type, const char *str);
 /* Forward declaration of function in hiredis.c */
 int __redisAppendCommand(redisContext *c, const char *cmd, size_t len);
 
+/* Start TLS on c, a connection just opened for cc, when cc has an SSL
+ * context. On failure the error is left in c. */
+static int cluster_ssl_initiate(redisClusterContext *cc, redisContext *c)
+{
+    if(cc->ssl == NULL || c == NULL || c->err)
+    {
+        return REDIS_OK;
+    }
+
+    if(cc->ssl_init_fn(c, cc->ssl) != REDIS_OK)
+    {
+        if(c->err == 0)
+        {
+            __redisSetError(c, REDIS_ERR_OTHER, "SSL initiation failed");
+        }
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
 /* Helper function for the redisClusterCommand* family of functions.
  *
  * Write a formatted command to the output buffer. If the given context is
@@ -272,9 +347,23 @@ static int cluster_node_init(cluster_node *node)
     node->myself = 0;
     node->slaves = NULL;
     node->con = NULL;
+    node->con_generation = 0;
     node->acon = NULL;
+    node->sub_acon = NULL;
     node->slots = NULL;
     node->failure_count = 0;
+    node->breaker_failures = 0;
+    node->lost_acon = NULL;
+    node->breaker = REDIS_BREAKER_CLOSED;
+    node->retry_time = 0;
+    node->backoff = 0;
+    node->ping_sent = 0;
+    node->latency = 0;
+    node->down = 0;
+    node->config_epoch = 0;
+    node->inv_con = NULL;
+    node->inv_id = -1;
+    node->tracking = 0;
     node->data = NULL;
     node->migrating = NULL;
     node->importing = NULL;
@@ -282,6 +371,71 @@ static int cluster_node_init(cluster_node *node)
     return REDIS_OK;
 }
 
+/* Whether a connection to node may be opened now. While its breaker is
+ * open the node fails fast; once the backoff is over a single attempt goes
+ * through, and its outcome closes or reopens the breaker. */
+static int cluster_node_breaker_allow(cluster_node *node)
+{
+    if(node->breaker != REDIS_BREAKER_OPEN)
+    {
+        return 1;
+    }
+
+    if(hi_usec_now() < node->retry_time)
+    {
+        return 0;
+    }
+
+    node->breaker = REDIS_BREAKER_HALF_OPEN;
+
+    return 1;
+}
+
+static void cluster_node_breaker_success(cluster_node *node)
+{
+    node->failure_count = 0;
+    node->breaker_failures = 0;
+    node->breaker = REDIS_BREAKER_CLOSED;
+    node->backoff = 0;
+}
+
+static void cluster_node_breaker_failure(redisClusterContext *cc,
+    cluster_node *node)
+{
+    int64_t backoff;
+
+    node->breaker_failures ++;
+
+    if(cc->breaker_threshold == 0 || node->breaker == REDIS_BREAKER_OPEN)
+    {
+        return;
+    }
+
+    if(node->breaker == REDIS_BREAKER_HALF_OPEN)
+    {
+        backoff = node->backoff*2;
+        if(backoff > cc->backoff_max)
+        {
+            backoff = cc->backoff_max;
+        }
+    }
+    else if(node->breaker_failures >= cc->breaker_threshold)
+    {
+        backoff = cc->backoff_min;
+    }
+    else
+    {
+        return;
+    }
+
+    /* Half of it at random, so that the clients that lost the node at the
+     * same time do not all come back at the same time. */
+    node->backoff = backoff;
+    node->retry_time = hi_usec_now() + backoff/2 +
+        random()%(backoff/2 + 1);
+    node->breaker = REDIS_BREAKER_OPEN;
+}
+
 static void cluster_node_deinit(cluster_node *node)
 {   
     copen_slot **oslot;
@@ -308,6 +462,16 @@ static void cluster_node_deinit(cluster_node *node)
         redisAsyncFree(node->acon);
     }
 
+    if(node->sub_acon != NULL)
+    {
+        redisAsyncFree(node->sub_acon);
+    }
+
+    if(node->inv_con != NULL)
+    {
+        redisFree(node->inv_con);
+    }
+
     if(node->slots != NULL)
     {
         listRelease(node->slots);
@@ -595,6 +759,7 @@ static cluster_node *node_get_with_nodes(
     node->host = ip_port[0];
     node->port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
     node->role = role;
+    node->config_epoch = strtoull(node_infos[6], NULL, 10);
 
     sdsfree(ip_port[1]);
     free(ip_port);
@@ -625,6 +790,9 @@ static void cluster_nodes_swap_ctx(dict *nodes_f, dict *nodes_t)
     cluster_node *node_f, *node_t;
     redisContext *c;
     redisAsyncContext *ac;
+    long long inv_id;
+    uint64_t generation;
+    int tracking;
 
     if(nodes_f == NULL || nodes_t == NULL){
         return;
@@ -643,10 +811,40 @@ static void cluster_nodes_swap_ctx(dict *nodes_f, dict *nodes_t)
         }
 
         node_f = dictGetEntryVal(de_f);
+
+        /* The breaker follows the address, not the route. */
+        node_t->failure_count = node_f->failure_count;
+        node_t->breaker_failures = node_f->breaker_failures;
+        node_t->lost_acon = node_f->lost_acon;
+        node_t->breaker = node_f->breaker;
+        node_t->retry_time = node_f->retry_time;
+        node_t->backoff = node_f->backoff;
+        node_t->ping_sent = node_f->ping_sent;
+        node_t->latency = node_f->latency;
+        node_t->down = node_f->down;
+
         if(node_f->con != NULL){
             c = node_f->con;
             node_f->con = node_t->con;
             node_t->con = c;
+
+            generation = node_f->con_generation;
+            node_f->con_generation = node_t->con_generation;
+            node_t->con_generation = generation;
+
+            tracking = node_f->tracking;
+            node_f->tracking = node_t->tracking;
+            node_t->tracking = tracking;
+        }
+
+        if(node_f->inv_con != NULL){
+            c = node_f->inv_con;
+            node_f->inv_con = node_t->inv_con;
+            node_t->inv_con = c;
+
+            inv_id = node_f->inv_id;
+            node_f->inv_id = node_t->inv_id;
+            node_t->inv_id = inv_id;
         }
 
         if(node_f->acon != NULL){
@@ -658,6 +856,16 @@ static void cluster_nodes_swap_ctx(dict *nodes_f, dict *nodes_t)
             if (node_f->acon)
                 node_f->acon->data = node_f;
         }
+
+        if(node_f->sub_acon != NULL){
+            ac = node_f->sub_acon;
+            node_f->sub_acon = node_t->sub_acon;
+            node_t->sub_acon = ac;
+
+            node_t->sub_acon->data = node_t;
+            if (node_f->sub_acon)
+                node_f->sub_acon->data = node_f;
+        }
     }
 
     dictReleaseIterator(di);
@@ -975,283 +1183,352 @@ error:
     return NULL;
 }
 
+/* The fields of a "cluster nodes" line before the slots. */
+#define CLUSTER_NODES_FIELDS    8
+
+/* A field of a "cluster nodes" line, in place in the reply. */
+typedef struct cluster_nodes_field
+{
+    const char *str;
+    int len;
+}cluster_nodes_field;
+
+/**
+  * Return a new node with the fields of a "cluster nodes" line. The address
+  * field is ip:port, optionally followed by @cport and ,hostname; the last
+  * ':' separates the port so that IPv6 addresses work.
+  */
+static cluster_node *
+node_get_with_fields(redisClusterContext *cc,
+    const cluster_nodes_field *field, uint8_t role)
+{
+    const char *addr = field[1].str, *addr_end, *colon = NULL, *p;
+    cluster_node *node;
+    uint64_t epoch = 0;
+    int port;
+
+    for(addr_end = addr; addr_end < addr + field[1].len &&
+        *addr_end != '@' && *addr_end != ','; addr_end ++){
+        if(*addr_end == ':'){
+            colon = addr_end;
+        }
+    }
+
+    port = colon == NULL ? -1 : hi_atoi(colon + 1, (addr_end - colon - 1));
+    if(!hi_valid_port(port)){
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "split ip port error");
+        return NULL;
+    }
+
+    for(p = field[6].str; p < field[6].str + field[6].len &&
+        *p >= '0' && *p <= '9'; p ++){
+        epoch = epoch*10 + (uint64_t)(*p - '0');
+    }
+
+    node = hi_alloc(sizeof(cluster_node));
+    if(node == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+
+    cluster_node_init(node);
+
+    node->name = sdsnewlen(field[0].str, field[0].len);
+    node->addr = sdsnewlen(addr, addr_end - addr);
+    node->host = sdsnewlen(addr, colon - addr);
+    node->port = port;
+    node->role = role;
+    node->config_epoch = epoch;
+
+    if(role == REDIS_ROLE_MASTER){
+        node->slots = listCreate();
+        if(node->slots != NULL){
+            node->slots->free = listClusterSlotDestructor;
+        }
+    }
+
+    if(node->name == NULL || node->addr == NULL || node->host == NULL ||
+        (role == REDIS_ROLE_MASTER && node->slots == NULL)){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        listClusterNodeDestructor(node);
+        return NULL;
+    }
+
+    return node;
+}
+
+/**
+  * Add an open slot field of a "cluster nodes" line to master:
+  * "[slot->-name]" when migrating, "[slot-<-name]" when importing. Fields
+  * of another form are ignored.
+  */
+static int
+cluster_nodes_add_open_slot(redisClusterContext *cc, cluster_node *master,
+    const char *str, int len, sds *name)
+{
+    struct hiarray **slots;
+    copen_slot *oslot, **oslot_elem;
+    const char *dash;
+    int slot_num, migrate;
+
+    if(len < 6 || str[0] != '[' || str[len - 1] != ']'){
+        return REDIS_OK;
+    }
+
+    dash = memchr(str, '-', len);
+    if(dash == NULL || str + len - dash < 4 || dash[2] != '-' ||
+        (dash[1] != '>' && dash[1] != '<')){
+        return REDIS_OK;
+    }
+
+    slot_num = hi_atoi(str + 1, (dash - str - 1));
+    if(slot_num < 0 || slot_num >= REDIS_CLUSTER_SLOTS){
+        return REDIS_OK;
+    }
+
+    migrate = dash[1] == '>';
+    slots = migrate ? &master->migrating : &master->importing;
+
+    *name = sdscpylen(*name, dash + 3, str + len - 1 - (dash + 3));
+    if(*name == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    oslot = cluster_open_slot_create((uint32_t)slot_num, migrate, *name, master);
+    if(oslot == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "create open slot error");
+        return REDIS_ERR;
+    }
+
+    if(*slots == NULL){
+        *slots = hiarray_create(1, sizeof(oslot));
+        if(*slots == NULL){
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "create open slot array error");
+            cluster_open_slot_destroy(oslot);
+            return REDIS_ERR;
+        }
+    }
+
+    oslot_elem = hiarray_push(*slots);
+    if(oslot_elem == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "Push open slot array error: out of memory");
+        cluster_open_slot_destroy(oslot);
+        return REDIS_ERR;
+    }
+
+    *oslot_elem = oslot;
+
+    return REDIS_OK;
+}
+
+/**
+  * Add a slot field of a "cluster nodes" line to master: "slot" or
+  * "start-end". Malformed ranges are ignored.
+  */
+static int
+cluster_nodes_add_slots(redisClusterContext *cc, cluster_node *master,
+    const char *str, int len, int flags, sds *name)
+{
+    cluster_slot *slot;
+    const char *dash;
+    int start, end;
+
+    if(len > 0 && str[0] == '['){
+        if(flags & HIRCLUSTER_FLAG_ADD_OPENSLOT){
+            return cluster_nodes_add_open_slot(cc, master, str, len, name);
+        }
+
+        return REDIS_OK;
+    }
+
+    dash = memchr(str, '-', len);
+    if(dash == NULL){
+        start = hi_atoi(str, len);
+        end = start;
+    }else{
+        start = hi_atoi(str, (dash - str));
+        end = hi_atoi(dash + 1, (str + len - dash - 1));
+    }
+
+    if(start < 0 || end < 0 || start > end || end >= REDIS_CLUSTER_SLOTS){
+        return REDIS_OK;
+    }
+
+    slot = cluster_slot_create(master);
+    if(slot == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "Out of memory");
+        return REDIS_ERR;
+    }
+
+    slot->start = (uint32_t)start;
+    slot->end = (uint32_t)end;
+
+    return REDIS_OK;
+}
+
 /**
   * Parse the "cluster nodes" command reply to nodes dict.
+  *
+  * Single pass over the reply: lines and fields are only delimited in
+  * place, the allocations left are those of the nodes and slots built.
   */
 dict *
 parse_cluster_nodes(redisClusterContext *cc, 
     char *str, int str_len, int flags)
 {
-    int ret;
     dict *nodes = NULL;
     dict *nodes_name = NULL;
-    cluster_node *master, *slave;
-    cluster_slot *slot;
-    char *pos, *start, *end, *line_start, *line_end;
-    char *role;
-    int role_len;
-    uint8_t myself = 0;
-    int slot_start, slot_end;
-    sds *part = NULL, *slot_start_end = NULL;
-    int count_part = 0, count_slot_start_end = 0;
-    int k;
-    int len;
+    cluster_nodes_field field[CLUSTER_NODES_FIELDS];
+    cluster_node *node;
+    const char *line, *eol, *end, *p, *tok, *flags_end;
+    sds name = NULL;
+    uint8_t role;
+    int myself, failing;
+    int nfield, len;
 
     nodes = dictCreate(&clusterNodesDictType, NULL);
-    if(nodes == NULL){
+    name = sdsempty();
+    if(nodes == NULL || name == NULL){
         __redisClusterSetError(cc,REDIS_ERR_OOM,
             "out of memory");
         goto error;
     }
 
-    start = str;
-    end = start + str_len;
-    
-    line_start = start;
+    end = str + str_len;
 
-    for(pos = start; pos < end; pos ++){
-        if(*pos == '\n'){
-            line_end = pos - 1;
-            len = line_end - line_start;
-            
-            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+    for(line = str; line < end; line = eol + 1){
+        eol = memchr(line, '\n', end - line);
+        if(eol == NULL){
+            eol = end;
+        }
 
-            if(part == NULL || count_part < 8){
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "split cluster nodes error");
-                goto error;
+        nfield = 0;
+        p = line;
+        while(nfield < CLUSTER_NODES_FIELDS && p < eol){
+            tok = p;
+            while(p < eol && *p != ' '){
+                p ++;
             }
 
-            //the address string is ":0", skip this node.
-            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0){
-                sdsfreesplitres(part, count_part);
-                count_part = 0;
-                part = NULL;
-                
-                start = pos + 1;
-                line_start = start;
-                pos = start;
-                
-                continue;
+            field[nfield].str = tok;
+            field[nfield].len = (int)(p - tok);
+            nfield ++;
+
+            if(p < eol){
+                p ++;
             }
+        }
 
-            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0){
-                role_len = sdslen(part[2]) - 7;
-                role = part[2] + 7;
+        if(nfield < CLUSTER_NODES_FIELDS){
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "split cluster nodes error");
+            goto error;
+        }
+
+        //the address is ":0" (noaddr), skip this node.
+        if(field[1].len >= 2 && memcmp(field[1].str, ":0", 2) == 0 &&
+            (field[1].len == 2 || field[1].str[2] == '@')){
+            continue;
+        }
+
+        role = REDIS_ROLE_NULL;
+        myself = 0;
+        failing = 0;
+        flags_end = field[2].str + field[2].len;
+        for(tok = field[2].str; tok < flags_end; tok += len + 1){
+            p = memchr(tok, ',', flags_end - tok);
+            len = (int)((p == NULL ? flags_end : p) - tok);
+
+            if(len == 6 && memcmp(tok, "myself", 6) == 0){
                 myself = 1;
-            }else{
-                role_len = sdslen(part[2]);
-                role = part[2];
+            }else if(len == 6 && memcmp(tok, "master", 6) == 0){
+                role = REDIS_ROLE_MASTER;
+            }else if(len == 5 && memcmp(tok, "slave", 5) == 0){
+                role = REDIS_ROLE_SLAVE;
+            }else if((len == 4 && memcmp(tok, "fail", 4) == 0) ||
+                (len == 5 && memcmp(tok, "fail?", 5) == 0)){
+                failing = 1;
             }
+        }
 
-            //add master node
-            if(role_len >= 6 && memcmp(role, "master", 6) == 0){
-                if(count_part < 8){
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "Master node parts number error: less than 8.");
+        //add master node
+        if(role == REDIS_ROLE_MASTER){
+            node = node_get_with_fields(cc, field, REDIS_ROLE_MASTER);
+            if(node == NULL){
+                goto error;
+            }
+
+            if(dictAdd(nodes, 
+                sdsnewlen(node->addr, sdslen(node->addr)), node) != DICT_OK){
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "The address already exists in the nodes");
+                listClusterNodeDestructor(node);
+                goto error;
+            }
+
+            node->myself = (uint8_t)myself;
+
+            //from now on node belongs to nodes.
+            if((flags & HIRCLUSTER_FLAG_ADD_SLAVE) &&
+                cluster_master_slave_mapping_with_name(cc, 
+                    &nodes_name, node, node->name) != REDIS_OK){
+                goto error;
+            }
+
+            for(p = field[7].str + field[7].len; p < eol; ){
+                p ++;
+                tok = p;
+                while(p < eol && *p != ' '){
+                    p ++;
+                }
+
+                if(p > tok && cluster_nodes_add_slots(cc, node, tok,
+                    (int)(p - tok), flags, &name) != REDIS_OK){
                     goto error;
                 }
-                
-                master = node_get_with_nodes(cc, 
-                    part, count_part, REDIS_ROLE_MASTER);
-                if(master == NULL){
-                    goto error;
-                }
-
-                ret = dictAdd(nodes, 
-                    sdsnewlen(master->addr, sdslen(master->addr)), master);
-                if(ret != DICT_OK){
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "The address already exists in the nodes");
-                    cluster_node_deinit(master);
-                    hi_free(master);
-                    goto error;
-                }
-
-                if(flags & HIRCLUSTER_FLAG_ADD_SLAVE){
-                    ret = cluster_master_slave_mapping_with_name(cc, 
-                        &nodes_name, master, master->name);
-                    if(ret != REDIS_OK){
-                        cluster_node_deinit(master);
-                        hi_free(master);
-                        goto error;
-                    }
-                }
-
-                if(myself) master->myself = 1;
-                
-                for(k = 8; k < count_part; k ++){
-                    slot_start_end = sdssplitlen(part[k], 
-                        sdslen(part[k]), "-", 1, &count_slot_start_end);
-                    
-                    if(slot_start_end == NULL){
-                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                            "split slot start end error(NULL)");
-                        goto error;
-                    }else if(count_slot_start_end == 1){
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
-                        slot_end = slot_start;
-                    }else if(count_slot_start_end == 2){
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
-                        slot_end = 
-                            hi_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
-                    }else{
-                        //add open slot for master
-                        if(flags & HIRCLUSTER_FLAG_ADD_OPENSLOT && 
-                            count_slot_start_end == 3 && 
-                            sdslen(slot_start_end[0]) > 1 &&
-                            sdslen(slot_start_end[1]) == 1 && 
-                            sdslen(slot_start_end[2]) > 1 && 
-                            slot_start_end[0][0] == '[' && 
-                            slot_start_end[2][sdslen(slot_start_end[2])-1] == ']'){
-                            
-                            copen_slot *oslot, **oslot_elem;
-                            
-                            sdsrange(slot_start_end[0], 1, -1);
-                            sdsrange(slot_start_end[2], 0, -2);
-                            
-                            if(slot_start_end[1][0] == '>'){
-                                oslot = cluster_open_slot_create(
-                                    hi_atoi(slot_start_end[0],
-                                    sdslen(slot_start_end[0])), 
-                                    1, slot_start_end[2], master);
-                                if(oslot == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "create open slot error");
-                                    goto error;
-                                }
- 
-                                if(master->migrating == NULL){
-                                    master->migrating = hiarray_create(1, sizeof(oslot));
-                                    if(master->migrating == NULL){
-                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                            "create migrating array error");
-                                        cluster_open_slot_destroy(oslot);
-                                        goto error;
-                                    }
-                                }
-
-                                oslot_elem = hiarray_push(master->migrating);
-                                if(oslot_elem == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "Push migrating array error: out of memory");
-                                    cluster_open_slot_destroy(oslot);
-                                    goto error;
-                                }
-
-                                *oslot_elem = oslot;
-                            }else if(slot_start_end[1][0] == '<'){
-                                oslot = cluster_open_slot_create(hi_atoi(slot_start_end[0],
-                                    sdslen(slot_start_end[0])), 0, slot_start_end[2],
-                                    master);
-                                if(oslot == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "create open slot error");
-                                    goto error;
-                                }
-
-                                if(master->importing == NULL){
-                                    master->importing = hiarray_create(1, sizeof(oslot));
-                                    if(master->importing == NULL){
-                                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                            "create migrating array error");
-                                        cluster_open_slot_destroy(oslot);
-                                        goto error;
-                                    }
-                                }
-
-                                oslot_elem = hiarray_push(master->importing);
-                                if(oslot_elem == NULL){
-                                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                        "push migrating array error: out of memory");
-                                    cluster_open_slot_destroy(oslot);
-                                    goto error;
-                                }
-
-                                *oslot_elem = oslot;
-                            }
-                        }
-                        
-                        slot_start = -1;
-                        slot_end = -1;
-                    }
-                    
-                    sdsfreesplitres(slot_start_end, count_slot_start_end);
-                    count_slot_start_end = 0;
-                    slot_start_end = NULL;
-
-                    if(slot_start < 0 || slot_end < 0 || 
-                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS){
-                        continue;
-                    }
-
-                    slot = cluster_slot_create(master);
-                    if(slot == NULL){
-                        __redisClusterSetError(cc,REDIS_ERR_OOM,
-                            "Out of memory");
-                        goto error;
-                    }
-                    
-                    slot->start = (uint32_t)slot_start;
-                    slot->end = (uint32_t)slot_end;                    
-                }
-
             }
-            //add slave node
-            else if((flags & HIRCLUSTER_FLAG_ADD_SLAVE) && 
-                (role_len >= 5 && memcmp(role, "slave", 5) == 0)){
-                slave = node_get_with_nodes(cc, part, 
-                    count_part, REDIS_ROLE_SLAVE);
-                if(slave == NULL){
-                    goto error;
-                }
+        }
+        //add slave node, unless it is failing (fail or fail?)
+        else if(role == REDIS_ROLE_SLAVE && 
+            (flags & HIRCLUSTER_FLAG_ADD_SLAVE) && !failing){
+            node = node_get_with_fields(cc, field, REDIS_ROLE_SLAVE);
+            if(node == NULL){
+                goto error;
+            }
 
-                ret = cluster_master_slave_mapping_with_name(cc, 
-                    &nodes_name, slave, part[3]);
-                if(ret != REDIS_OK){
-                    cluster_node_deinit(slave);
-                    hi_free(slave);
-                    goto error;
-                }
+            node->myself = (uint8_t)myself;
 
-                if(myself) slave->myself = 1;
+            name = sdscpylen(name, field[3].str, field[3].len);
+            if(name == NULL){
+                __redisClusterSetError(cc,REDIS_ERR_OOM,
+                    "Out of memory");
+                listClusterNodeDestructor(node);
+                goto error;
             }
 
-            if(myself == 1){
-                myself = 0;
+            if(cluster_master_slave_mapping_with_name(cc, 
+                &nodes_name, node, name) != REDIS_OK){
+                listClusterNodeDestructor(node);
+                goto error;
             }
-
-            sdsfreesplitres(part, count_part);
-            count_part = 0;
-            part = NULL;
-            
-            start = pos + 1;
-            line_start = start;
-            pos = start;
         }
     }
 
     if(nodes_name != NULL){
         dictRelease(nodes_name);
     }
+
+    sdsfree(name);
     
     return nodes;
 
 error:
-        
-    if(part != NULL){
-        sdsfreesplitres(part, count_part);
-        count_part = 0;
-        part = NULL;
-    }
-
-    if(slot_start_end != NULL){
-        sdsfreesplitres(slot_start_end, count_slot_start_end);
-        count_slot_start_end = 0;
-        slot_start_end = NULL;
-    }
 
     if(nodes != NULL){
         dictRelease(nodes);
@@ -1260,3192 +1537,7369 @@ error:
     if(nodes_name != NULL){
         dictRelease(nodes_name);
     }
+
+    sdsfree(name);
     
     return NULL;
 }
 
 /**
-  * Update route with the "cluster nodes" or "cluster slots" command reply.
+  * Return the value of field name in a "cluster shards" key/value reply,
+  * an array in RESP2 and a map in RESP3.
   */
-static int 
-cluster_update_route_by_addr(redisClusterContext *cc, 
-    const char *ip, int port)
+static redisReply *
+cluster_shards_field(redisReply *info, const char *name)
 {
-    redisContext *c = NULL;
-    redisReply *reply = NULL;
-    dict *nodes = NULL;
-    struct hiarray *slots = NULL;
-    cluster_node *master;
-    cluster_slot *slot, **slot_elem;
-    dictIterator *dit = NULL;
-    dictEntry *den;
-    listIter *lit = NULL;
-    listNode *lnode;
-    cluster_node *table[REDIS_CLUSTER_SLOTS];
-    uint32_t j, k;
+    redisReply *key;
+    size_t i;
 
-    if(cc == NULL){
-        return REDIS_ERR;
+    if(info->type != REDIS_REPLY_ARRAY && info->type != REDIS_REPLY_MAP){
+        return NULL;
     }
 
-    if(ip == NULL || port <= 0){
-        __redisClusterSetError(cc,
-            REDIS_ERR_OTHER,"Ip or port error!");
-        goto error;
+    for(i = 0; i + 1 < info->elements; i += 2){
+        key = info->element[i];
+        if((key->type == REDIS_REPLY_STRING || key->type == REDIS_REPLY_STATUS) &&
+            strcmp(key->str, name) == 0){
+            return info->element[i + 1];
+        }
     }
 
-    if(cc->connect_timeout){
-        c = redisConnectWithTimeout(ip, port, *cc->connect_timeout);
-    }else{
-        c = redisConnect(ip, port);
+    return NULL;
+}
+
+static int
+cluster_shards_string(redisReply *value)
+{
+    return value != NULL && value->len > 0 &&
+        (value->type == REDIS_REPLY_STRING || value->type == REDIS_REPLY_STATUS);
+}
+
+/**
+  * Is reply the error of a server without "cluster shards" (before 7)?
+  * Redis 5 to 6.2 answer "unknown subcommand", older ones "wrong cluster
+  * subcommand".
+  */
+static int
+cluster_reply_unknown_subcommand(redisReply *reply)
+{
+    return reply->type == REDIS_REPLY_ERROR &&
+        (strncasecmp(reply->str, "ERR unknown subcommand", 22) == 0 ||
+        strncasecmp(reply->str, "ERR wrong cluster subcommand", 28) == 0);
+}
+
+/**
+  * Is reply a "cluster shards" reply, rather than a "cluster slots" one?
+  */
+static int
+cluster_reply_is_shards(redisReply *reply)
+{
+    redisReply *shard;
+
+    if(reply->type != REDIS_REPLY_ARRAY || reply->elements == 0){
+        return 0;
     }
-        
-    if (c == NULL){
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "Init redis context error(return NULL)");
-        goto error;
-    }else if(c->err){
-        __redisClusterSetError(cc,c->err,c->errstr);
-        goto error;
+
+    shard = reply->element[0];
+    if(shard->type == REDIS_REPLY_MAP){
+        return 1;
     }
 
-    if (cc->timeout) {
-        redisSetTimeout(c, *cc->timeout);
+    return shard->type == REDIS_REPLY_ARRAY && shard->elements > 0 &&
+        shard->element[0]->type == REDIS_REPLY_STRING;
+}
+
+/**
+  * Return a new node with a node of the "cluster shards" command reply.
+  * The endpoint is preferred over the ip, as clients are told to do.
+  */
+static cluster_node *node_get_with_shards(
+    redisClusterContext *cc, redisReply *info, uint8_t role)
+{
+    redisReply *id, *host, *port;
+    cluster_node *node;
+
+    id = cluster_shards_field(info, "id");
+
+    host = cluster_shards_field(info, "endpoint");
+    if(!cluster_shards_string(host) || strcmp(host->str, "?") == 0){
+        host = cluster_shards_field(info, "ip");
     }
 
-    if (REDIS_OK != redisClusterAuth(cc, c)) {
-        goto error;
+    port = cluster_shards_field(info, "port");
+    if(port == NULL){
+        port = cluster_shards_field(info, "tls-port");
     }
 
-    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS){
-        reply = redisCommand(c, REDIS_COMMAND_CLUSTER_SLOTS);
-        if(reply == NULL){
-            if (c->err == REDIS_ERR_TIMEOUT) {
-                __redisClusterSetError(cc,c->err,
-                    "Command(cluster slots) reply error(socket timeout)");
-            } else {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster slots) reply error(NULL).");
-            }
-            goto error;
-        }else if(reply->type != REDIS_REPLY_ARRAY){
-            if(reply->type == REDIS_REPLY_ERROR){
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    reply->str);
-            }else{
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster slots) reply error: type is not array.");
-            }
-            
-            goto error;
-        }
+    if(!cluster_shards_string(host) || port == NULL ||
+        port->type != REDIS_REPLY_INTEGER || !hi_valid_port((int)port->integer)){
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "Command(cluster shards) reply error: "
+            "node address is not correct.");
+        return NULL;
+    }
 
-        nodes = parse_cluster_slots(cc, reply, cc->flags);
-    } else {
-        reply = redisCommand(c, REDIS_COMMAND_CLUSTER_NODES);
-        if(reply == NULL){
-            if (c->err == REDIS_ERR_TIMEOUT) {
-                __redisClusterSetError(cc,c->err,
-                    "Command(cluster nodes) reply error(socket timeout)");
-            } else {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster nodes) reply error(NULL).");
-            }
-            goto error;
-        }else if(reply->type != REDIS_REPLY_STRING){
-            if(reply->type == REDIS_REPLY_ERROR){
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    reply->str);
-            }else{
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "Command(cluster nodes) reply error: type is not string.");
-            }
-            
-            goto error;
+    node = hi_alloc(sizeof(cluster_node));
+    if(node == NULL){
+        __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+        return NULL;
+    }
+
+    cluster_node_init(node);
+
+    if(role == REDIS_ROLE_MASTER){
+        node->slots = listCreate();
+        if(node->slots == NULL){
+            hi_free(node);
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "slots for node listCreate error");
+            return NULL;
         }
 
-        nodes = parse_cluster_nodes(cc, reply->str, reply->len, cc->flags);
+        node->slots->free = listClusterSlotDestructor;
     }
 
-    if(nodes == NULL){
-        goto error;
-    }
-    
-    memset(table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
-    
-    slots = hiarray_create(dictSize(nodes), sizeof(cluster_slot*));
-    if(slots == NULL){
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "Slots array create failed: out of memory");
-        goto error;
+    if(cluster_shards_string(id)){
+        node->name = sdsnewlen(id->str, id->len);
     }
-    
-    dit = dictGetIterator(nodes);
-    if(dit == NULL){
+
+    node->host = sdsnewlen(host->str, host->len);
+    node->addr = sdsnewlen(host->str, host->len);
+    node->addr = sdscatfmt(node->addr, ":%i", (int)port->integer);
+    node->port = (int)port->integer;
+    node->role = role;
+
+    return node;
+}
+
+/**
+  * Parse the "cluster shards" command reply to nodes dict. Replicas that
+  * are not online (loading, failed) are left out. A shard still listing its
+  * failed master next to the promoted replica is served by the online one,
+  * a failed master is never used.
+  */
+static dict *
+parse_cluster_shards(redisClusterContext *cc, redisReply *reply, int flags)
+{
+    int ret;
+    dict *nodes = NULL;
+    redisReply *shard, *ranges, *members, *info, *role, *health;
+    redisReply *start, *end, *primary;
+    cluster_node *master, *slave;
+    cluster_slot *slot;
+    size_t i, j;
+
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    if(nodes == NULL){
         __redisClusterSetError(cc,REDIS_ERR_OOM,
-            "Dict get iterator failed: out of memory");
+            "out of memory");
         goto error;
     }
-    
-    while((den = dictNext(dit))){
-        master = dictGetEntryVal(den);
-        if(master->role != REDIS_ROLE_MASTER){
-            __redisClusterSetError(cc,REDIS_ERR_OOM,
-                "Node role must be master");
+
+    for(i = 0; i < reply->elements; i ++){
+        shard = reply->element[i];
+
+        ranges = cluster_shards_field(shard, "slots");
+        members = cluster_shards_field(shard, "nodes");
+        if(ranges == NULL || ranges->type != REDIS_REPLY_ARRAY ||
+            ranges->elements % 2 != 0 ||
+            members == NULL || members->type != REDIS_REPLY_ARRAY){
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "Command(cluster shards) reply error: "
+                "shard is not correct.");
             goto error;
         }
 
-        if(master->slots == NULL){
-            continue;
-        }
-        
-        lit = listGetIterator(master->slots, AL_START_HEAD);
-        if(lit == NULL){
-            __redisClusterSetError(cc, REDIS_ERR_OOM,
-                "List get iterator failed: out of memory");
+        //the master first, the replicas are attached to it: an online
+        //one, else one not failed (loading).
+        primary = NULL;
+        for(j = 0; j < members->elements; j ++){
+            info = members->element[j];
+
+            role = cluster_shards_field(info, "role");
+            if(!cluster_shards_string(role) || strcmp(role->str, "master") != 0){
+                continue;
+            }
+
+            health = cluster_shards_field(info, "health");
+            if(cluster_shards_string(health) && strcmp(health->str, "fail") == 0){
+                continue;
+            }
+
+            if(primary == NULL){
+                primary = info;
+            }
+
+            if(cluster_shards_string(health) && strcmp(health->str, "online") == 0){
+                primary = info;
+                break;
+            }
+        }
+
+        //no master left in this shard: its slots are not served.
+        if(primary == NULL){
+            continue;
+        }
+
+        master = node_get_with_shards(cc, primary, REDIS_ROLE_MASTER);
+        if(master == NULL){
             goto error;
         }
-        
-        while((lnode = listNext(lit))){
-            slot = listNodeValue(lnode);
-            if(slot->start > slot->end || 
-                slot->end >= REDIS_CLUSTER_SLOTS){
-                __redisClusterSetError(cc, REDIS_ERR_OTHER,
-                    "Slot region for node is error");
+
+        ret = dictAdd(nodes, 
+            sdsnewlen(master->addr, sdslen(master->addr)), master);
+        if(ret != DICT_OK){
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "The address already exists in the nodes");
+            cluster_node_deinit(master);
+            hi_free(master);
+            goto error;
+        }
+
+        for(j = 0; j < ranges->elements; j += 2){
+            start = ranges->element[j];
+            end = ranges->element[j + 1];
+            if(start->type != REDIS_REPLY_INTEGER || 
+                end->type != REDIS_REPLY_INTEGER ||
+                start->integer < 0 || start->integer > end->integer ||
+                end->integer >= REDIS_CLUSTER_SLOTS){
+                __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                    "Command(cluster shards) reply error: "
+                    "slot range is not correct.");
                 goto error;
             }
-            
-            slot_elem = hiarray_push(slots);
-            *slot_elem = slot;
+
+            slot = cluster_slot_create(master);
+            if(slot == NULL){
+                __redisClusterSetError(cc,REDIS_ERR_OOM,
+                    "Out of memory");
+                goto error;
+            }
+
+            slot->start = (uint32_t)start->integer;
+            slot->end = (uint32_t)end->integer;
         }
 
-        listReleaseIterator(lit);
-    }
+        if(!(flags & HIRCLUSTER_FLAG_ADD_SLAVE)){
+            continue;
+        }
 
-    dictReleaseIterator(dit);
+        for(j = 0; j < members->elements; j ++){
+            info = members->element[j];
 
-    hiarray_sort(slots, cluster_slot_start_cmp);
-    for(j = 0; j < hiarray_n(slots); j ++){
-        slot_elem = hiarray_get(slots, j);
-        
-        for(k = (*slot_elem)->start; k <= (*slot_elem)->end; k ++){
-            if(table[k] != NULL){
-                __redisClusterSetError(cc, REDIS_ERR_OTHER,
-                    "Diffent node hold a same slot");
+            role = cluster_shards_field(info, "role");
+            health = cluster_shards_field(info, "health");
+            if(!cluster_shards_string(role) || strcmp(role->str, "replica") != 0 ||
+                !cluster_shards_string(health) || strcmp(health->str, "online") != 0){
+                continue;
+            }
+
+            slave = node_get_with_shards(cc, info, REDIS_ROLE_SLAVE);
+            if(slave == NULL){
                 goto error;
             }
-            
-            table[k] = (*slot_elem)->node;
+
+            if(master->slaves == NULL){
+                master->slaves = listCreate();
+                if(master->slaves == NULL){
+                    __redisClusterSetError(cc,REDIS_ERR_OOM,
+                        "Out of memory");
+                    listClusterNodeDestructor(slave);
+                    goto error;
+                }
+
+                master->slaves->free = 
+                    listClusterNodeDestructor;
+            }
+
+            listAddNodeTail(master->slaves, slave);
         }
     }
-    
-    cluster_nodes_swap_ctx(cc->nodes, nodes);
-    if(cc->nodes != NULL){
-        dictRelease(cc->nodes);
-        cc->nodes = NULL;
-    }
-    cc->nodes = nodes;
 
-    if(cc->slots != NULL)
-    {
-        cc->slots->nelem = 0;
-        hiarray_destroy(cc->slots);
-        cc->slots = NULL;
+    if(dictSize(nodes) == 0){
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "Command(cluster shards) reply error: no master.");
+        goto error;
     }
-    cc->slots = slots;
 
-    memcpy(cc->table, table, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
-    cc->route_version ++;
-    
-    freeReplyObject(reply);
+    return nodes;
 
-    if(c != NULL){
-        redisFree(c);
+error:
+
+    if(nodes != NULL){
+        dictRelease(nodes);
     }
-    
-    return REDIS_OK;
 
-error:
+    return NULL;
+}
 
-    if(dit != NULL){
-        dictReleaseIterator(dit);
+/**
+  * Fetch the topology over c: the "cluster slots" reply with
+  * HIRCLUSTER_FLAG_ROUTE_USE_SLOTS, otherwise "cluster shards" when the
+  * server has it, falling back to "cluster nodes". Open slots are only
+  * known from "cluster nodes", so HIRCLUSTER_FLAG_ADD_OPENSLOT and
+  * HIRCLUSTER_FLAG_ROUTE_USE_NODES go straight to it. Returns NULL with the
+  * error of cc set on failure.
+  */
+static redisReply *
+cluster_route_query(redisClusterContext *cc, redisContext *c)
+{
+    redisReply *reply = NULL;
+
+    if (cc->timeout) {
+        redisSetTimeout(c, *cc->timeout);
     }
 
-    if(lit != NULL){
-        listReleaseIterator(lit);    
+    if (REDIS_OK != redisClusterAuth(cc, c)) {
+        goto error;
     }
 
-    if(slots != NULL)
-    {
-        if(slots == cc->slots)
-        {
-            cc->slots = NULL;
+    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS){
+        reply = redisCommand(c, REDIS_COMMAND_CLUSTER_SLOTS);
+        if(reply == NULL){
+            if (c->err == REDIS_ERR_TIMEOUT) {
+                __redisClusterSetError(cc,c->err,
+                    "Command(cluster slots) reply error(socket timeout)");
+            } else {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "Command(cluster slots) reply error(NULL).");
+            }
+            goto error;
+        }else if(reply->type != REDIS_REPLY_ARRAY){
+            if(reply->type == REDIS_REPLY_ERROR){
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    reply->str);
+            }else{
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "Command(cluster slots) reply error: type is not array.");
+            }
+            
+            goto error;
         }
-        
-        slots->nelem = 0;
-        hiarray_destroy(slots);
-    }
+    } else {
+        if(!(cc->flags & (HIRCLUSTER_FLAG_ADD_OPENSLOT|HIRCLUSTER_FLAG_ROUTE_USE_NODES)) &&
+            !cc->route_no_shards){
+            reply = redisCommand(c, REDIS_COMMAND_CLUSTER_SHARDS);
+            if(reply == NULL){
+                if (c->err == REDIS_ERR_TIMEOUT) {
+                    __redisClusterSetError(cc,c->err,
+                        "Command(cluster shards) reply error(socket timeout)");
+                } else {
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                        "Command(cluster shards) reply error(NULL).");
+                }
+                goto error;
+            }else if(reply->type == REDIS_REPLY_ARRAY){
+                return reply;
+            }else if(reply->type != REDIS_REPLY_ERROR ||
+                !cluster_reply_unknown_subcommand(reply)){
+                //NOAUTH, LOADING, a failover...: the server may well have
+                //the subcommand, try again with the next refresh.
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    reply->type == REDIS_REPLY_ERROR ? reply->str :
+                    "Command(cluster shards) reply error: type is not array.");
+                goto error;
+            }
 
-    if(nodes != NULL){
-        if(nodes == cc->nodes){
-            cc->nodes = NULL;
+            //unknown subcommand before Redis 7: not asked again.
+            cc->route_no_shards = 1;
+            freeReplyObject(reply);
+            reply = NULL;
         }
 
-        dictRelease(nodes);
+        reply = redisCommand(c, REDIS_COMMAND_CLUSTER_NODES);
+        if(reply == NULL){
+            if (c->err == REDIS_ERR_TIMEOUT) {
+                __redisClusterSetError(cc,c->err,
+                    "Command(cluster nodes) reply error(socket timeout)");
+            } else {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "Command(cluster nodes) reply error(NULL).");
+            }
+            goto error;
+        }else if(reply->type != REDIS_REPLY_STRING){
+            if(reply->type == REDIS_REPLY_ERROR){
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    reply->str);
+            }else{
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "Command(cluster nodes) reply error: type is not string.");
+            }
+            
+            goto error;
+        }
     }
 
+    return reply;
+
+error:
+
     if(reply != NULL){
         freeReplyObject(reply);
-        reply = NULL;
     }
 
-    if(c != NULL){
-        redisFree(c);
-    }
-    
-    return REDIS_ERR;
+    return NULL;
 }
 
-
 /**
-  * Update route with the "cluster nodes" command reply.
+  * Switch the slots to a new node vector, owned by the context from now on,
+  * and refresh the pointer view of the table.
   */
-static int 
-cluster_update_route_with_nodes_old(redisClusterContext *cc, 
-    const char *ip, int port)
+static void
+cluster_table_install(redisClusterContext *cc, cluster_node **vector,
+    uint32_t count, const uint16_t *index)
 {
-    int ret;
-    redisContext *c = NULL;
-    redisReply *reply = NULL;
-    struct hiarray *slots = NULL;
-    dict *nodes = NULL;
-    dict *nodes_name = NULL;
-    cluster_node *master, *slave;
-    cluster_slot **slot;
-    char *pos, *start, *end, *line_start, *line_end;
-    char *role;
-    int role_len;
-    uint8_t myself = 0;
-    int slot_start, slot_end;
-    sds *part = NULL, *slot_start_end = NULL;
-    int count_part = 0, count_slot_start_end = 0;
-    int j, k;
-    int len;
-    cluster_node *table[REDIS_CLUSTER_SLOTS] = {NULL};
+    uint32_t k;
 
-    if(cc == NULL)
+    if(cc->node_vector != NULL)
     {
-        return REDIS_ERR;
+        hi_free(cc->node_vector);
     }
 
-    if(ip == NULL || port <= 0)
-    {
-        __redisClusterSetError(cc,
-            REDIS_ERR_OTHER,"ip or port error!");
-        goto error;
-    }
+    cc->node_vector = vector;
+    cc->node_count = count;
+    memcpy(cc->slot_index, index, sizeof(cc->slot_index));
 
-    if(cc->connect_timeout)
-    {
-        c = redisConnectWithTimeout(ip, port, *cc->connect_timeout);
-    }
-    else
-    {
-        c = redisConnect(ip, port);
-    }
-        
-    if (c == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "init redis context error(return NULL)");
-        goto error;
-    }
-    else if(c->err)
+    for(k = 0; k < REDIS_CLUSTER_SLOTS; k ++)
     {
-        __redisClusterSetError(cc,c->err,c->errstr);
-        goto error;
-    }
-
-    if (REDIS_OK != redisClusterAuth(cc, c)) {
-        goto error;
+        cc->table[k] = index[k] == REDIS_CLUSTER_NODE_NONE ?
+            NULL : vector[index[k]];
     }
+}
 
-    reply = redisCommand(c, REDIS_COMMAND_CLUSTER_NODES);
+/**
+  * Same as cluster_table_install() from a table of node pointers.
+  */
+static int
+cluster_table_install_view(redisClusterContext *cc, cluster_node **view)
+{
+    cluster_node **vector;
+    uint16_t index[REDIS_CLUSTER_SLOTS];
+    uint32_t count = 0, i, k;
 
-    if(reply == NULL)
+    vector = hi_alloc(dictSize(cc->nodes)*sizeof(cluster_node *));
+    if(vector == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "command(cluster nodes) reply error(NULL)");
-        goto error;
+        return REDIS_ERR;
     }
-    else if(reply->type != REDIS_REPLY_STRING)
+
+    for(k = 0; k < REDIS_CLUSTER_SLOTS; k ++)
     {
-        if(reply->type == REDIS_REPLY_ERROR)
+        if(view[k] == NULL)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                reply->str);
+            index[k] = REDIS_CLUSTER_NODE_NONE;
+            continue;
         }
-        else
+
+        if(k > 0 && view[k] == view[k - 1])
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "command(cluster nodes) reply error(type is not string)");
+            index[k] = index[k - 1];
+            continue;
         }
-        
-        goto error;
-    }
 
-    nodes = dictCreate(&clusterNodesDictType, NULL);
+        for(i = 0; i < count && vector[i] != view[k]; i ++);
+        if(i == count)
+        {
+            vector[count ++] = view[k];
+        }
+
+        index[k] = (uint16_t)i;
+    }
+
+    cluster_table_install(cc, vector, count, index);
+
+    return REDIS_OK;
+}
+
+/**
+  * Does any slot go to another node than in the installed route? Compared
+  * by address, the nodes of the two routes being different objects.
+  */
+static int
+cluster_route_moves_slots(redisClusterContext *cc, cluster_node **vector,
+    const uint16_t *index)
+{
+    cluster_node *from, *to, *last_from = NULL, *last_to = NULL;
+    uint32_t k;
+
+    if(cc->node_vector == NULL){
+        return 0;
+    }
+
+    for(k = 0; k < REDIS_CLUSTER_SLOTS; k ++){
+        from = cc->slot_index[k] == REDIS_CLUSTER_NODE_NONE ? NULL :
+            cc->node_vector[cc->slot_index[k]];
+        to = index[k] == REDIS_CLUSTER_NODE_NONE ? NULL : vector[index[k]];
+
+        if((from == last_from && to == last_to) || (from == NULL && to == NULL)){
+            continue;
+        }
+
+        if(from == NULL || to == NULL || strcmp(from->addr, to->addr) != 0){
+            return 1;
+        }
+
+        last_from = from;
+        last_to = to;
+    }
+
+    return 0;
+}
+
+/**
+  * Install a parsed set of masters as the route: build the slots and the
+  * table, keep the connections of the nodes that are still there and free
+  * the others. The nodes dict is owned by the context afterwards, or
+  * released on error.
+  */
+static int
+cluster_route_install(redisClusterContext *cc, dict *nodes)
+{
+    struct hiarray *slots = NULL;
+    cluster_node *master;
+    cluster_slot *slot, **slot_elem;
+    dictIterator *dit = NULL;
+    dictEntry *den;
+    listIter *lit = NULL;
+    listNode *lnode;
+    cluster_node **vector = NULL;
+    uint32_t count = 0;
+    uint16_t index[REDIS_CLUSTER_SLOTS];
+    uint32_t k;
+
+    memset(index, 0xff, sizeof(index));
     
-    slots = hiarray_create(10, sizeof(cluster_slot*));
-    if(slots == NULL)
-    {
+    slots = hiarray_create(dictSize(nodes), sizeof(cluster_slot*));
+    if(slots == NULL){
         __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "array create error");
+            "Slots array create failed: out of memory");
         goto error;
     }
 
-    start = reply->str;
-    end = start + reply->len;
+    vector = hi_alloc(dictSize(nodes)*sizeof(cluster_node *));
+    if(vector == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "Node vector create failed: out of memory");
+        goto error;
+    }
     
-    line_start = start;
+    dit = dictGetIterator(nodes);
+    if(dit == NULL){
+        __redisClusterSetError(cc,REDIS_ERR_OOM,
+            "Dict get iterator failed: out of memory");
+        goto error;
+    }
+    
+    while((den = dictNext(dit))){
+        master = dictGetEntryVal(den);
+        if(master->role != REDIS_ROLE_MASTER){
+            __redisClusterSetError(cc,REDIS_ERR_OOM,
+                "Node role must be master");
+            goto error;
+        }
 
-    for(pos = start; pos < end; pos ++)
-    {
-        if(*pos == '\n')
-        {
-            line_end = pos - 1;
-            len = line_end - line_start;
-            
-            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+        if(master->slots == NULL || listLength(master->slots) == 0){
+            continue;
+        }
 
-            if(part == NULL || count_part < 8)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                    "split cluster nodes error");
+        vector[count] = master;
+        
+        lit = listGetIterator(master->slots, AL_START_HEAD);
+        if(lit == NULL){
+            __redisClusterSetError(cc, REDIS_ERR_OOM,
+                "List get iterator failed: out of memory");
+            goto error;
+        }
+        
+        while((lnode = listNext(lit))){
+            slot = listNodeValue(lnode);
+            if(slot->start > slot->end || 
+                slot->end >= REDIS_CLUSTER_SLOTS){
+                __redisClusterSetError(cc, REDIS_ERR_OTHER,
+                    "Slot region for node is error");
                 goto error;
             }
+            
+            for(k = slot->start; k <= slot->end; k ++){
+                if(index[k] != REDIS_CLUSTER_NODE_NONE){
+                    __redisClusterSetError(cc, REDIS_ERR_OTHER,
+                        "Diffent node hold a same slot");
+                    goto error;
+                }
 
-            //the address string is ":0", skip this node.
-            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0)
-            {
-                sdsfreesplitres(part, count_part);
-                count_part = 0;
-                part = NULL;
-                
-                start = pos + 1;
-                line_start = start;
-                pos = start;
-                
-                continue;
+                index[k] = (uint16_t)count;
             }
+            
+            slot_elem = hiarray_push(slots);
+            *slot_elem = slot;
+        }
 
-            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0)
-            {
-                role_len = sdslen(part[2]) - 7;
-                role = part[2] + 7;
-                myself = 1;
-            }
-            else
-            {
-                role_len = sdslen(part[2]);
-                role = part[2];
-            }
+        listReleaseIterator(lit);
+        lit = NULL;
 
-            //add master node
-            if(role_len >= 6 && memcmp(role, "master", 6) == 0)
+        count ++;
+    }
+
+    dictReleaseIterator(dit);
+    dit = NULL;
+
+    hiarray_sort(slots, cluster_slot_start_cmp);
+
+    /* A key read from the old owner of its slot is invalidated by that
+     * node only, which no longer sees it change. */
+    if(cc->cache != NULL && cluster_route_moves_slots(cc, vector, index)){
+        redisCacheFlush(cc->cache);
+    }
+    
+    cluster_nodes_swap_ctx(cc->nodes, nodes);
+    if(cc->nodes != NULL){
+        dictRelease(cc->nodes);
+        cc->nodes = NULL;
+    }
+    cc->nodes = nodes;
+
+    if(cc->slots != NULL)
+    {
+        cc->slots->nelem = 0;
+        hiarray_destroy(cc->slots);
+        cc->slots = NULL;
+    }
+    cc->slots = slots;
+
+    cluster_table_install(cc, vector, count, index);
+    cc->route_version ++;
+    
+    return REDIS_OK;
+
+error:
+
+    if(dit != NULL){
+        dictReleaseIterator(dit);
+    }
+
+    if(vector != NULL){
+        hi_free(vector);
+    }
+
+    if(lit != NULL){
+        listReleaseIterator(lit);    
+    }
+
+    if(slots != NULL)
+    {
+        if(slots == cc->slots)
+        {
+            cc->slots = NULL;
+        }
+        
+        slots->nelem = 0;
+        hiarray_destroy(slots);
+    }
+
+    if(nodes != NULL){
+        if(nodes == cc->nodes){
+            cc->nodes = NULL;
+        }
+
+        dictRelease(nodes);
+    }
+    
+    return REDIS_ERR;
+}
+
+/**
+  * Install the route described by a topology reply. The reply is left
+  * untouched.
+  */
+static int
+cluster_route_apply(redisClusterContext *cc, redisReply *reply)
+{
+    dict *nodes;
+
+    if(cluster_reply_is_shards(reply)){
+        nodes = parse_cluster_shards(cc, reply, cc->flags);
+    }else if(reply->type == REDIS_REPLY_ARRAY){
+        nodes = parse_cluster_slots(cc, reply, cc->flags);
+    }else{
+        nodes = parse_cluster_nodes(cc, reply->str, reply->len, cc->flags);
+    }
+
+    if(nodes == NULL){
+        return REDIS_ERR;
+    }
+
+    return cluster_route_install(cc, nodes);
+}
+
+/**
+  * Update route with the topology fetched over c. On success the reply is
+  * handed to *keep when keep is not NULL.
+  */
+static int 
+cluster_update_route_with(redisClusterContext *cc, 
+    redisContext *c, redisReply **keep)
+{
+    redisReply *reply;
+    int ret;
+
+    reply = cluster_route_query(cc, c);
+    if(reply == NULL){
+        return REDIS_ERR;
+    }
+
+    ret = cluster_route_apply(cc, reply);
+    if(ret == REDIS_OK && keep != NULL){
+        *keep = reply;
+    }else{
+        freeReplyObject(reply);
+    }
+
+    return ret;
+}
+
+/**
+  * Update route with the "cluster nodes" command reply.
+  */
+static int 
+cluster_update_route_with_nodes_old(redisClusterContext *cc, 
+    const char *ip, int port)
+{
+    int ret;
+    redisContext *c = NULL;
+    redisReply *reply = NULL;
+    struct hiarray *slots = NULL;
+    dict *nodes = NULL;
+    dict *nodes_name = NULL;
+    cluster_node *master, *slave;
+    cluster_slot **slot;
+    char *pos, *start, *end, *line_start, *line_end;
+    char *role;
+    int role_len;
+    uint8_t myself = 0;
+    int slot_start, slot_end;
+    sds *part = NULL, *slot_start_end = NULL;
+    int count_part = 0, count_slot_start_end = 0;
+    int j, k;
+    int len;
+    cluster_node *table[REDIS_CLUSTER_SLOTS] = {NULL};
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(ip == NULL || port <= 0)
+    {
+        __redisClusterSetError(cc,
+            REDIS_ERR_OTHER,"ip or port error!");
+        goto error;
+    }
+
+    if(cc->connect_timeout)
+    {
+        c = redisConnectWithTimeout(ip, port, *cc->connect_timeout);
+    }
+    else
+    {
+        c = redisConnect(ip, port);
+    }
+
+    cluster_ssl_initiate(cc, c);
+        
+    if (c == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "init redis context error(return NULL)");
+        goto error;
+    }
+    else if(c->err)
+    {
+        __redisClusterSetError(cc,c->err,c->errstr);
+        goto error;
+    }
+
+    if (REDIS_OK != redisClusterAuth(cc, c)) {
+        goto error;
+    }
+
+    reply = redisCommand(c, REDIS_COMMAND_CLUSTER_NODES);
+
+    if(reply == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "command(cluster nodes) reply error(NULL)");
+        goto error;
+    }
+    else if(reply->type != REDIS_REPLY_STRING)
+    {
+        if(reply->type == REDIS_REPLY_ERROR)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                reply->str);
+        }
+        else
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "command(cluster nodes) reply error(type is not string)");
+        }
+        
+        goto error;
+    }
+
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    
+    slots = hiarray_create(10, sizeof(cluster_slot*));
+    if(slots == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "array create error");
+        goto error;
+    }
+
+    start = reply->str;
+    end = start + reply->len;
+    
+    line_start = start;
+
+    for(pos = start; pos < end; pos ++)
+    {
+        if(*pos == '\n')
+        {
+            line_end = pos - 1;
+            len = line_end - line_start;
+            
+            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+
+            if(part == NULL || count_part < 8)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                    "split cluster nodes error");
+                goto error;
+            }
+
+            //the address string is ":0", skip this node.
+            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0)
+            {
+                sdsfreesplitres(part, count_part);
+                count_part = 0;
+                part = NULL;
+                
+                start = pos + 1;
+                line_start = start;
+                pos = start;
+                
+                continue;
+            }
+
+            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0)
+            {
+                role_len = sdslen(part[2]) - 7;
+                role = part[2] + 7;
+                myself = 1;
+            }
+            else
+            {
+                role_len = sdslen(part[2]);
+                role = part[2];
+            }
+
+            //add master node
+            if(role_len >= 6 && memcmp(role, "master", 6) == 0)
+            {
+                if(count_part < 8)
+                {
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                        "master node part number error");
+                    goto error;
+                }
+                
+                master = node_get_with_nodes(cc, 
+                    part, count_part, REDIS_ROLE_MASTER);
+                if(master == NULL)
+                {
+                    goto error;
+                }
+
+                ret = dictAdd(nodes, 
+                    sdsnewlen(master->addr, sdslen(master->addr)), master);
+                if(ret != DICT_OK)
+                {
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                        "the address already exists in the nodes");
+                    cluster_node_deinit(master);
+                    hi_free(master);
+                    goto error;
+                }
+
+                if(cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE)
+                {
+                    ret = cluster_master_slave_mapping_with_name(cc, 
+                        &nodes_name, master, master->name);
+                    if(ret != REDIS_OK)
+                    {
+                        cluster_node_deinit(master);
+                        hi_free(master);
+                        goto error;
+                    }
+                }
+                
+                if(myself == 1)
+                {
+                    master->con = c;
+                    c = NULL;
+                }
+                
+                for(k = 8; k < count_part; k ++)
+                {
+                    slot_start_end = sdssplitlen(part[k], 
+                        sdslen(part[k]), "-", 1, &count_slot_start_end);
+                    
+                    if(slot_start_end == NULL)
+                    {
+                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                            "split slot start end error(NULL)");
+                        goto error;
+                    }
+                    else if(count_slot_start_end == 1)
+                    {
+                        slot_start = 
+                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
+                        slot_end = slot_start;
+                    }
+                    else if(count_slot_start_end == 2)
+                    {
+                        slot_start = 
+                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
+                        slot_end = 
+                            hi_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
+                    }
+                    else
+                    {
+                        slot_start = -1;
+                        slot_end = -1;
+                    }
+                    
+                    sdsfreesplitres(slot_start_end, count_slot_start_end);
+                    count_slot_start_end = 0;
+                    slot_start_end = NULL;
+
+                    if(slot_start < 0 || slot_end < 0 || 
+                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS)
+                    {
+                        continue;
+                    }
+
+                    for(j = slot_start; j <= slot_end; j ++)
+                    {
+                        if(table[j] != NULL)
+                        {
+                            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                "diffent node hold a same slot");
+                            goto error;
+                        }
+                        table[j] = master;
+                    }
+                    
+                    slot = hiarray_push(slots);
+                    if(slot == NULL)
+                    {
+                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                            "slot push in array error");
+                        goto error;
+                    }
+
+                    *slot = cluster_slot_create(master);
+                    if(*slot == NULL)
+                    {
+                        __redisClusterSetError(cc,REDIS_ERR_OOM,
+                            "Out of memory");
+                        goto error;
+                    }
+
+                    (*slot)->start = (uint32_t)slot_start;
+                    (*slot)->end = (uint32_t)slot_end;                    
+                }
+
+            }
+            //add slave node
+            else if((cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE) && 
+                (role_len >= 5 && memcmp(role, "slave", 5) == 0))
+            {
+                slave = node_get_with_nodes(cc, part, 
+                    count_part, REDIS_ROLE_SLAVE);
+                if(slave == NULL)
+                {
+                    goto error;
+                }
+
+                ret = cluster_master_slave_mapping_with_name(cc, 
+                    &nodes_name, slave, part[3]);
+                if(ret != REDIS_OK)
+                {
+                    cluster_node_deinit(slave);
+                    hi_free(slave);
+                    goto error;
+                }
+                
+                if(myself == 1)
+                {
+                    slave->con = c;
+                    c = NULL;
+                }
+            }
+
+            if(myself == 1)
+            {
+                myself = 0;
+            }
+
+            sdsfreesplitres(part, count_part);
+            count_part = 0;
+            part = NULL;
+            
+            start = pos + 1;
+            line_start = start;
+            pos = start;
+        }
+    }
+
+    if(cc->slots != NULL)
+    {
+        cc->slots->nelem = 0;
+        hiarray_destroy(cc->slots);
+        cc->slots = NULL;
+    }
+    cc->slots = slots;
+
+    cluster_nodes_swap_ctx(cc->nodes, nodes);
+
+    if(cc->nodes != NULL)
+    {
+        dictRelease(cc->nodes);
+        cc->nodes = NULL;
+    }
+    cc->nodes = nodes;
+
+    hiarray_sort(cc->slots, cluster_slot_start_cmp);
+
+    if(cluster_table_install_view(cc, table) != REDIS_OK)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
+    }
+    cc->route_version ++;
+    
+    freeReplyObject(reply);
+
+    if(c != NULL)
+    {
+        redisFree(c);
+    }
+
+    if(nodes_name != NULL)
+    {
+        dictRelease(nodes_name);
+    }
+    
+    return REDIS_OK;
+
+error:
+        
+    if(part != NULL)
+    {
+        sdsfreesplitres(part, count_part);
+        count_part = 0;
+        part = NULL;
+    }
+
+    if(slot_start_end != NULL)
+    {
+        sdsfreesplitres(slot_start_end, count_slot_start_end);
+        count_slot_start_end = 0;
+        slot_start_end = NULL;
+    }
+
+    if(slots != NULL)
+    {
+        if(slots == cc->slots)
+        {
+            cc->slots = NULL;
+        }
+
+        slots->nelem = 0;
+        hiarray_destroy(slots);
+    }
+
+    if(nodes != NULL)
+    {
+        if(nodes == cc->nodes)
+        {
+            cc->nodes = NULL;
+        }
+
+        dictRelease(nodes);
+    }
+
+    if(nodes_name != NULL)
+    {
+        dictRelease(nodes_name);
+    }
+
+    if(reply != NULL)
+    {
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+
+    if(c != NULL)
+    {
+        redisFree(c);
+    }
+    
+    return REDIS_ERR;
+}
+
+/* A connection opened without blocking, in parallel with others. */
+typedef struct cluster_connect
+{
+    redisContext *c;
+    cluster_node *node;     /* the node it is for, if any */
+    int state;
+    int err;                /* errno of a failed connection */
+}cluster_connect;
+
+#define CLUSTER_CONNECT_PENDING 0
+#define CLUSTER_CONNECT_DONE    1   /* connected, socket made blocking */
+#define CLUSTER_CONNECT_USED    2
+#define CLUSTER_CONNECT_FAILED  3
+
+static void
+cluster_connect_start(cluster_connect *conn, const char *host, int port,
+    cluster_node *node)
+{
+    conn->node = node;
+    conn->state = CLUSTER_CONNECT_FAILED;
+    conn->err = ECONNREFUSED;
+
+    conn->c = redisConnectNonBlock(host, port);
+    if(conn->c == NULL)
+    {
+        conn->err = ENOMEM;
+        return;
+    }
+
+    if(conn->c->err)
+    {
+        redisFree(conn->c);
+        conn->c = NULL;
+        return;
+    }
+
+    conn->state = CLUSTER_CONNECT_PENDING;
+}
+
+/* The connect completed: check its outcome and turn the connection into
+ * the blocking one redisConnect() would have returned. */
+static int
+cluster_connect_done(redisClusterContext *cc, cluster_connect *conn)
+{
+    redisContext *c = conn->c;
+    socklen_t len = sizeof(conn->err);
+    int flags;
+
+    conn->err = 0;
+    if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &conn->err, &len) < 0)
+    {
+        conn->err = errno;
+    }
+
+    if(conn->err == 0)
+    {
+        flags = fcntl(c->fd, F_GETFL);
+        if(flags < 0 || fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+        {
+            conn->err = errno;
+        }
+    }
+
+    if(conn->err != 0)
+    {
+        conn->state = CLUSTER_CONNECT_FAILED;
+        return REDIS_ERR;
+    }
+
+    c->flags |= REDIS_BLOCK;
+    redisSetTcpNoDelay(c);
+
+    if(cc->timeout)
+    {
+        redisSetTimeout(c, *cc->timeout);
+    }
+
+    /* The handshakes are not done in parallel, the session cache of the
+     * SSL context makes them cheap. */
+    if(cluster_ssl_initiate(cc, c) != REDIS_OK)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        conn->err = ECONNABORTED;
+        conn->state = CLUSTER_CONNECT_FAILED;
+        return REDIS_ERR;
+    }
+
+    conn->state = CLUSTER_CONNECT_DONE;
+
+    return REDIS_OK;
+}
+
+/**
+  * Wait for the pending connections of conns until one of them is made, or
+  * all of them when all is set. Returns how many were made, 0 when none is
+  * pending any more or once the deadline (hi_msec_now() time, < 0 for none)
+  * is passed; the connections still pending then fail with ETIMEDOUT.
+  */
+static int
+cluster_connect_wait(redisClusterContext *cc, cluster_connect *conns,
+    int n, int all, int64_t deadline)
+{
+    struct pollfd *pfd;
+    int *index;
+    int i, k, made = 0, ret, timeout;
+    int64_t now;
+
+    pfd = hi_alloc(n*(sizeof(*pfd) + sizeof(*index)));
+    if(pfd == NULL)
+    {
+        return 0;
+    }
+
+    index = (int *)(pfd + n);
+
+    for(;;)
+    {
+        for(i = 0, k = 0; i < n; i ++)
+        {
+            if(conns[i].state == CLUSTER_CONNECT_PENDING)
+            {
+                pfd[k].fd = conns[i].c->fd;
+                pfd[k].events = POLLOUT;
+                pfd[k].revents = 0;
+                index[k ++] = i;
+            }
+        }
+
+        if(k == 0 || (made > 0 && !all))
+        {
+            break;
+        }
+
+        timeout = -1;
+        if(deadline >= 0)
+        {
+            now = hi_msec_now();
+            timeout = deadline > now ? (int)(deadline - now) : 0;
+        }
+
+        ret = poll(pfd, k, timeout);
+        if(ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(ret <= 0)
+        {
+            for(i = 0; i < k; i ++)
+            {
+                conns[index[i]].state = CLUSTER_CONNECT_FAILED;
+                conns[index[i]].err = ret == 0 ? ETIMEDOUT : errno;
+            }
+            break;
+        }
+
+        for(i = 0; i < k; i ++)
+        {
+            if(pfd[i].revents != 0 &&
+                cluster_connect_done(cc, &conns[index[i]]) == REDIS_OK)
+            {
+                made ++;
+            }
+        }
+    }
+
+    hi_free(pfd);
+
+    return made;
+}
+
+static int64_t
+cluster_connect_deadline(redisClusterContext *cc)
+{
+    if(cc->connect_timeout == NULL)
+    {
+        return -1;
+    }
+
+    return hi_msec_now() + cc->connect_timeout->tv_sec*1000LL +
+        cc->connect_timeout->tv_usec/1000;
+}
+
+static void
+cluster_connect_release(cluster_connect *conns, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i ++)
+    {
+        if(conns[i].c != NULL)
+        {
+            redisFree(conns[i].c);
+        }
+    }
+
+    hi_free(conns);
+}
+
+/* Connections opened at once to fetch the route. */
+#define CLUSTER_ROUTE_FANOUT    3
+
+/* Fetch and install the route from the first address that answers. The
+ * last known address and random masters are connected to at once, up to
+ * CLUSTER_ROUTE_FANOUT of them, so a dead one does not cost a connect
+ * timeout; another master is only connected to when one of them fails,
+ * so that large clusters do not see a connection to every node on every
+ * refresh. The route is asked to the first connection made, then to the
+ * next ones if that fails. The reply is handed to *keep when keep is not
+ * NULL. */
+static int
+cluster_update_route_fetch(redisClusterContext *cc, redisReply **keep)
+{
+    int ret = REDIS_ERR;
+    int i, j, n = 0, total = 0, next = 0, pending, started, err = 0;
+    cluster_connect *conns;
+    cluster_node **order, *node;
+    dictIterator *it;
+    dictEntry *de;
+    int64_t deadline = -1;
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    total = cc->nodes ? (int)dictSize(cc->nodes) : 0;
+
+    conns = hi_alloc((1 + total)*(sizeof(*conns) + sizeof(*order)));
+    if(conns == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
+
+    order = (cluster_node **)(conns + 1 + total);
+    total = 0;
+
+    if(cc->nodes != NULL)
+    {
+        it = dictGetIterator(cc->nodes);
+        while ((de = dictNext(it)) != NULL)
+        {
+            node = dictGetEntryVal(de);
+            if(node == NULL || node->host == NULL || node->port <= 0)
+            {
+                continue;
+            }
+
+            order[total ++] = node;
+        }
+        dictReleaseIterator(it);
+    }
+
+    for(i = total - 1; i > 0; i --)
+    {
+        j = (int)(random()%(i + 1));
+        node = order[i];
+        order[i] = order[j];
+        order[j] = node;
+    }
+
+    if(cc->ip != NULL && cc->port > 0)
+    {
+        cluster_connect_start(&conns[n ++], cc->ip, cc->port, NULL);
+    }
+    else if(total == 0)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, cc->nodes == NULL ?
+            "no server address" : "no valid server address");
+        cluster_connect_release(conns, n);
+        return REDIS_ERR;
+    }
+
+    for(;;)
+    {
+        pending = 0;
+        for(i = 0; i < n; i ++)
+        {
+            if(conns[i].state == CLUSTER_CONNECT_PENDING)
+            {
+                pending ++;
+            }
+        }
+
+        started = n == 1 && next == 0;
+        while(pending < CLUSTER_ROUTE_FANOUT && next < total)
+        {
+            node = order[next ++];
+            cluster_connect_start(&conns[n], node->host, node->port, node);
+            if(conns[n ++].state == CLUSTER_CONNECT_PENDING)
+            {
+                pending ++;
+                started = 1;
+            }
+        }
+
+        if(pending == 0)
+        {
+            break;
+        }
+
+        if(started)
+        {
+            deadline = cluster_connect_deadline(cc);
+        }
+
+        /* None made: the pending ones failed, open the next ones. */
+        if(cluster_connect_wait(cc, conns, n, 0, deadline) == 0)
+        {
+            continue;
+        }
+
+        for(i = 0; i < n && ret != REDIS_OK; i ++)
+        {
+            if(conns[i].state != CLUSTER_CONNECT_DONE)
+            {
+                continue;
+            }
+
+            conns[i].state = CLUSTER_CONNECT_USED;
+            ret = cluster_update_route_with(cc, conns[i].c, keep);
+
+            redisFree(conns[i].c);
+            conns[i].c = NULL;
+        }
+
+        if(ret == REDIS_OK)
+        {
+            break;
+        }
+    }
+
+    if(ret == REDIS_OK)
+    {
+        if(cc->err)
+        {
+            cc->err = 0;
+            memset(cc->errstr, '\0', strlen(cc->errstr));
+        }
+    }
+    else if(cc->err == 0)
+    {
+        for(i = 0; i < n; i ++)
+        {
+            if(conns[i].state == CLUSTER_CONNECT_FAILED)
+            {
+                err = conns[i].err;
+            }
+        }
+
+        __redisClusterSetError(cc, err == ETIMEDOUT ? REDIS_ERR_TIMEOUT :
+            REDIS_ERR_IO, strerror(err ? err : ECONNREFUSED));
+    }
+
+    cluster_connect_release(conns, n);
+
+    return ret;
+}
+
+/* HELLO 3, with AUTH when there is a password: at most 5 arguments. */
+static int cluster_hello_argv(redisClusterContext *cc, 
+    const char **argv, size_t *argvlen)
+{
+    int argc = 0;
+
+    argv[argc] = REDIS_COMMAND_HELLO;
+    argvlen[argc++] = strlen(REDIS_COMMAND_HELLO);
+    argv[argc] = "3";
+    argvlen[argc++] = 1;
+
+    if(cc->password != NULL)
+    {
+        argv[argc] = REDIS_COMMAND_AUTH;
+        argvlen[argc++] = strlen(REDIS_COMMAND_AUTH);
+        argv[argc] = REDIS_DEFAULT_USER;
+        argvlen[argc++] = strlen(REDIS_DEFAULT_USER);
+        argv[argc] = cc->password;
+        argvlen[argc++] = cc->password_len;
+    }
+
+    return argc;
+}
+
+/* Servers before 6 have no HELLO, and 6 and later may refuse RESP3. */
+static int cluster_hello_unsupported(redisReply *reply)
+{
+    return reply->type == REDIS_REPLY_ERROR &&
+        (strncmp(reply->str, "NOPROTO", 7) == 0 ||
+        strncasecmp(reply->str, "ERR unknown command", 19) == 0);
+}
+
+/* Check the reply to HELLO 3 sent over c, falling back to RESP2 and a
+ * plain AUTH when the server does not speak RESP3. */
+static int cluster_hello_reply_check(redisClusterContext *cc, 
+    redisContext *c, redisReply *reply)
+{
+    if(reply->type == REDIS_REPLY_MAP || reply->type == REDIS_REPLY_ARRAY)
+    {
+        return REDIS_OK;
+    }
+
+    if(cluster_hello_unsupported(reply))
+    {
+        return redisClusterAuth(cc, c);
+    }
+
+    if(reply->type == REDIS_REPLY_ERROR)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, reply->str);
+    }
+    else
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "Command(Hello) reply error: type is not map.");
+    }
+
+    return REDIS_ERR;
+}
+
+/* Route the blocking I/O of a new node connection through the ring of cc.
+ * A connection the ring can not take (out of memory) is left on the
+ * default funcs, working on its socket, rather than with the error of the
+ * failed setup. */
+static void cluster_node_uring(redisClusterContext *cc, redisContext *c)
+{
+    if(cc->uring == NULL || cc->ssl != NULL)
+    {
+        return;
+    }
+
+    if(redisInitiateUring(c, cc->uring) != REDIS_OK)
+    {
+        c->err = 0;
+        c->errstr[0] = '\0';
+    }
+}
+
+/* Set up the protocol of a node connection and authenticate it. The route
+ * is always fetched over RESP2 connections, see cluster_route_query. */
+static int cluster_node_handshake(redisClusterContext *cc, redisContext *c)
+{
+    const char *argv[5];
+    size_t argvlen[5];
+    redisReply *reply;
+    int argc, ret;
+
+    if(!(cc->flags & HIRCLUSTER_FLAG_RESP3))
+    {
+        return redisClusterAuth(cc, c);
+    }
+
+    argc = cluster_hello_argv(cc, argv, argvlen);
+
+    reply = redisCommandArgv(c, argc, argv, argvlen);
+    if(reply == NULL)
+    {
+        if(c->err)
+        {
+            __redisClusterSetError(cc, c->err, c->errstr);
+        }
+        else
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "Command(Hello) reply error(NULL).");
+        }
+        return REDIS_ERR;
+    }
+
+    ret = cluster_hello_reply_check(cc, c, reply);
+    freeReplyObject(reply);
+
+    return ret;
+}
+
+/* Open the connections of the masters, and of the slaves when they are
+ * parsed, all at once, then authenticate them with a single round trip.
+ * Nodes already connected are left alone. Errors are not reported: nodes
+ * that could not be reached are connected again on their first command. */
+static void
+cluster_warm_up(redisClusterContext *cc)
+{
+    cluster_connect *conns;
+    cluster_node *master, *slave;
+    redisContext *c;
+    redisReply *reply;
+    dictIterator *it;
+    dictEntry *de;
+    listIter *li;
+    listNode *ln;
+    const char *argv[5];
+    size_t argvlen[5];
+    int i, n = 0, max = 0, done, argc, ret;
+
+    if(cc->nodes == NULL)
+    {
+        return;
+    }
+
+    it = dictGetIterator(cc->nodes);
+    while((de = dictNext(it)) != NULL)
+    {
+        master = dictGetEntryVal(de);
+        max += 1 + (master->slaves ? listLength(master->slaves) : 0);
+    }
+    dictReleaseIterator(it);
+
+    if(max == 0)
+    {
+        return;
+    }
+
+    conns = hi_alloc(max*sizeof(*conns));
+    if(conns == NULL)
+    {
+        return;
+    }
+
+    it = dictGetIterator(cc->nodes);
+    while((de = dictNext(it)) != NULL)
+    {
+        master = dictGetEntryVal(de);
+        if((master->con == NULL || master->con->err) &&
+            cluster_node_breaker_allow(master))
+        {
+            cluster_connect_start(&conns[n ++], master->host,
+                master->port, master);
+        }
+
+        if(master->slaves == NULL || !(cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE))
+        {
+            continue;
+        }
+
+        li = listGetIterator(master->slaves, AL_START_HEAD);
+        while((ln = listNext(li)) != NULL)
+        {
+            slave = listNodeValue(ln);
+            if((slave->con == NULL || slave->con->err) &&
+                cluster_node_breaker_allow(slave))
+            {
+                cluster_connect_start(&conns[n ++], slave->host,
+                    slave->port, slave);
+            }
+        }
+        listReleaseIterator(li);
+    }
+    dictReleaseIterator(it);
+
+    cluster_connect_wait(cc, conns, n, 1, cluster_connect_deadline(cc));
+
+    if(cc->password != NULL || (cc->flags & HIRCLUSTER_FLAG_RESP3))
+    {
+        argc = cluster_hello_argv(cc, argv, argvlen);
+
+        for(i = 0; i < n; i ++)
+        {
+            c = conns[i].c;
+            if(conns[i].state != CLUSTER_CONNECT_DONE)
+            {
+                continue;
+            }
+
+            if(cc->flags & HIRCLUSTER_FLAG_RESP3)
+            {
+                ret = redisAppendCommandArgv(c, argc, argv, argvlen);
+            }
+            else
+            {
+                ret = redisAppendCommand(c, "%s %b", REDIS_COMMAND_AUTH,
+                    cc->password, cc->password_len);
+            }
+
+            if(ret != REDIS_OK)
+            {
+                conns[i].state = CLUSTER_CONNECT_FAILED;
+                continue;
+            }
+
+            do
+            {
+                if(redisBufferWrite(c, &done) != REDIS_OK)
+                {
+                    conns[i].state = CLUSTER_CONNECT_FAILED;
+                    break;
+                }
+            } while(!done);
+        }
+
+        for(i = 0; i < n; i ++)
+        {
+            if(conns[i].state != CLUSTER_CONNECT_DONE)
+            {
+                continue;
+            }
+
+            reply = NULL;
+            if(redisGetReply(conns[i].c, (void **)&reply) != REDIS_OK ||
+                reply == NULL)
+            {
+                conns[i].state = CLUSTER_CONNECT_FAILED;
+            }
+            else if(cc->flags & HIRCLUSTER_FLAG_RESP3)
+            {
+                if(cluster_hello_reply_check(cc, conns[i].c, reply) != REDIS_OK)
+                {
+                    conns[i].state = CLUSTER_CONNECT_FAILED;
+                }
+            }
+            else if(reply->type != REDIS_REPLY_STATUS ||
+                strcmp(reply->str, REDIS_COMMAND_AUTH_OK) != 0)
+            {
+                conns[i].state = CLUSTER_CONNECT_FAILED;
+            }
+
+            if(reply != NULL)
+            {
+                freeReplyObject(reply);
+            }
+        }
+    }
+
+    for(i = 0; i < n; i ++)
+    {
+        if(conns[i].state != CLUSTER_CONNECT_DONE)
+        {
+            cluster_node_breaker_failure(cc, conns[i].node);
+            continue;
+        }
+
+        cluster_node_breaker_success(conns[i].node);
+
+        cluster_node_uring(cc, conns[i].c);
+
+        if(conns[i].node->con != NULL)
+        {
+            redisFree(conns[i].node->con);
+        }
+
+        conns[i].node->con = conns[i].c;
+        cluster_node_con_replaced(cc, conns[i].node);
+        conns[i].c = NULL;
+    }
+
+    cluster_connect_release(conns, n);
+}
+
+/* A published topology: the route reply of one fetch, shared read-only by
+ * the contexts of a redisClusterTopology. A context holds a reference only
+ * while it installs the route. */
+typedef struct cluster_route_snapshot
+{
+    int refcount;
+    uint64_t version;
+    redisReply *reply;
+}cluster_route_snapshot;
+
+struct redisClusterTopology
+{
+    int refcount;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cluster_route_snapshot *current;    /* under lock */
+    uint64_t version;       /* of current, read without the lock */
+    int refreshing;         /* a context is fetching a new route */
+};
+
+static void cluster_route_snapshot_release(cluster_route_snapshot *snap)
+{
+    if(snap == NULL)
+    {
+        return;
+    }
+
+    if(__atomic_sub_fetch(&snap->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        freeReplyObject(snap->reply);
+        free(snap);
+    }
+}
+
+redisClusterTopology *redisClusterTopologyCreate(void)
+{
+    redisClusterTopology *t;
+
+    t = calloc(1, sizeof(*t));
+    if(t == NULL)
+    {
+        return NULL;
+    }
+
+    if(pthread_mutex_init(&t->lock, NULL) != 0)
+    {
+        free(t);
+        return NULL;
+    }
+
+    if(pthread_cond_init(&t->cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&t->lock);
+        free(t);
+        return NULL;
+    }
+
+    t->refcount = 1;
+
+    return t;
+}
+
+void redisClusterTopologyRelease(redisClusterTopology *t)
+{
+    if(t == NULL)
+    {
+        return;
+    }
+
+    if(__atomic_sub_fetch(&t->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    cluster_route_snapshot_release(t->current);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+uint64_t redisClusterTopologyVersion(redisClusterTopology *t)
+{
+    return t == NULL ? 0 : __atomic_load_n(&t->version, __ATOMIC_ACQUIRE);
+}
+
+/* Install the last published route if cc is not on it yet. */
+static int cluster_topology_sync(redisClusterContext *cc)
+{
+    redisClusterTopology *t = cc->topology;
+    cluster_route_snapshot *snap;
+    int ret;
+
+    if(__atomic_load_n(&t->version, __ATOMIC_ACQUIRE) == cc->topology_version)
+    {
+        return REDIS_OK;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    snap = t->current;
+    if(snap != NULL)
+    {
+        __atomic_add_fetch(&snap->refcount, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if(snap == NULL)
+    {
+        return REDIS_OK;
+    }
+
+    ret = cluster_route_apply(cc, snap->reply);
+    if(ret == REDIS_OK)
+    {
+        cc->topology_version = snap->version;
+    }
+
+    cluster_route_snapshot_release(snap);
+
+    return ret;
+}
+
+/* Called before a command: pick up a route published by another context.
+ * Skipped in the middle of a pipeline, whose replies are read from the
+ * connections of the current nodes. */
+static void cluster_topology_check(redisClusterContext *cc)
+{
+    if(cc->topology == NULL ||
+        __atomic_load_n(&cc->topology->version, __ATOMIC_ACQUIRE) == cc->topology_version)
+    {
+        return;
+    }
+
+    if(cc->requests != NULL && listLength(cc->requests) > 0)
+    {
+        return;
+    }
+
+    cluster_topology_sync(cc);
+}
+
+/* Refresh the route of a context sharing a topology. Only one context
+ * fetches at a time: the others wait for it and install its result, and a
+ * context that is behind the published route installs it without asking
+ * the cluster at all. An async context never waits, it runs in the event
+ * loop: it keeps its route while another context fetches, and picks up
+ * the result before its next command. */
+static int cluster_update_route_shared(redisClusterContext *cc)
+{
+    redisClusterTopology *t = cc->topology;
+    cluster_route_snapshot *snap = NULL, *old = NULL;
+    redisReply *reply = NULL;
+    uint64_t seen = cc->topology_version;
+    int ret;
+
+    pthread_mutex_lock(&t->lock);
+    while(t->refreshing && t->version == seen)
+    {
+        if(!(cc->flags & REDIS_BLOCK))
+        {
+            pthread_mutex_unlock(&t->lock);
+            return REDIS_OK;
+        }
+
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+
+    if(t->version != seen)
+    {
+        pthread_mutex_unlock(&t->lock);
+        return cluster_topology_sync(cc);
+    }
+
+    t->refreshing = 1;
+    pthread_mutex_unlock(&t->lock);
+
+    ret = cluster_update_route_fetch(cc, &reply);
+    if(ret == REDIS_OK)
+    {
+        snap = malloc(sizeof(*snap));
+        if(snap == NULL)
+        {
+            freeReplyObject(reply);
+        }
+        else
+        {
+            snap->refcount = 1;
+            snap->reply = reply;
+        }
+    }
+
+    pthread_mutex_lock(&t->lock);
+    if(snap != NULL)
+    {
+        old = t->current;
+        snap->version = t->version + 1;
+        t->current = snap;
+        __atomic_store_n(&t->version, snap->version, __ATOMIC_RELEASE);
+        cc->topology_version = snap->version;
+    }
+    t->refreshing = 0;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    cluster_route_snapshot_release(old);
+
+    return ret;
+}
+
+#define CLUSTER_ROUTE_FILE_MAGIC     "HIRT"
+#define CLUSTER_ROUTE_FILE_VERSION   1
+#define CLUSTER_ROUTE_FILE_BOM       0x0102
+
+/* A topology file is a header, the node records, the slot range records
+ * and the NUL terminated strings they refer to by offset. Everything is in
+ * host byte order with fixed sizes, so a mapped file is read in place;
+ * files written by another architecture are rejected through the bom. */
+typedef struct cluster_route_file_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t bom;
+    uint32_t nnodes;
+    uint32_t nranges;
+    uint32_t strings_len;
+    uint32_t checksum;      /* crc16 of everything after the header */
+    int64_t saved_at;       /* unix time */
+}cluster_route_file_header;
+
+typedef struct cluster_route_file_node
+{
+    uint64_t config_epoch;
+    uint32_t name;          /* offsets in the strings */
+    uint32_t host;
+    int32_t master;         /* index of the master, -1 for a master */
+    uint16_t port;
+    uint8_t role;
+    uint8_t reserved;
+}cluster_route_file_node;
+
+typedef struct cluster_route_file_range
+{
+    uint16_t start;
+    uint16_t end;
+    uint32_t node;          /* index of the master */
+}cluster_route_file_range;
+
+static uint32_t
+cluster_route_file_string(sds *strings, const char *str)
+{
+    uint32_t off = (uint32_t)sdslen(*strings);
+
+    if(str == NULL)
+    {
+        str = "";
+    }
+
+    *strings = sdscatlen(*strings, str, strlen(str) + 1);
+
+    return off;
+}
+
+static int
+cluster_route_file_add_node(struct hiarray *nodes, sds *strings,
+    cluster_node *node, int32_t master)
+{
+    cluster_route_file_node *rec;
+
+    rec = hiarray_push(nodes);
+    if(rec == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    memset(rec, 0, sizeof(*rec));
+    rec->config_epoch = node->config_epoch;
+    rec->name = cluster_route_file_string(strings, node->name);
+    rec->host = cluster_route_file_string(strings, node->host);
+    rec->master = master;
+    rec->port = (uint16_t)node->port;
+    rec->role = node->role;
+
+    return REDIS_OK;
+}
+
+static int
+cluster_route_file_write(const char *path, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    while(len > 0)
+    {
+        n = write(fd, p, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            close(fd);
+            return REDIS_ERR;
+        }
+
+        p += n;
+        len -= (size_t)n;
+    }
+
+    if(close(fd) < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/**
+  * Write the current route to path. The file is written aside then renamed,
+  * so concurrent readers see either the old or the new route.
+  */
+static int
+cluster_route_save(redisClusterContext *cc, const char *path)
+{
+    cluster_route_file_header header;
+    cluster_route_file_range *range;
+    struct hiarray *nodes = NULL, *ranges = NULL;
+    sds strings = NULL, buf = NULL, tmp = NULL;
+    cluster_node *master, *slave;
+    cluster_slot *slot;
+    dictIterator *dit = NULL;
+    dictEntry *den;
+    listIter *lit;
+    listNode *lnode;
+    int32_t index;
+    int ret = REDIS_ERR;
+
+    if(cc->nodes == NULL || dictSize(cc->nodes) == 0)
+    {
+        return REDIS_ERR;
+    }
+
+    nodes = hiarray_create(dictSize(cc->nodes), sizeof(cluster_route_file_node));
+    ranges = hiarray_create(dictSize(cc->nodes), sizeof(cluster_route_file_range));
+    strings = sdsempty();
+    dit = dictGetIterator(cc->nodes);
+    if(nodes == NULL || ranges == NULL || strings == NULL || dit == NULL)
+    {
+        goto done;
+    }
+
+    while((den = dictNext(dit)) != NULL)
+    {
+        master = dictGetEntryVal(den);
+        index = (int32_t)hiarray_n(nodes);
+
+        if(cluster_route_file_add_node(nodes, &strings, master, -1) != REDIS_OK)
+        {
+            goto done;
+        }
+
+        if(master->slots != NULL)
+        {
+            lit = listGetIterator(master->slots, AL_START_HEAD);
+            if(lit == NULL)
+            {
+                goto done;
+            }
+
+            while((lnode = listNext(lit)) != NULL)
+            {
+                slot = listNodeValue(lnode);
+
+                range = hiarray_push(ranges);
+                if(range == NULL)
+                {
+                    listReleaseIterator(lit);
+                    goto done;
+                }
+
+                range->start = (uint16_t)slot->start;
+                range->end = (uint16_t)slot->end;
+                range->node = (uint32_t)index;
+            }
+
+            listReleaseIterator(lit);
+        }
+
+        if(master->slaves != NULL)
+        {
+            lit = listGetIterator(master->slaves, AL_START_HEAD);
+            if(lit == NULL)
+            {
+                goto done;
+            }
+
+            while((lnode = listNext(lit)) != NULL)
+            {
+                slave = listNodeValue(lnode);
+                if(cluster_route_file_add_node(nodes, &strings,
+                    slave, index) != REDIS_OK)
+                {
+                    listReleaseIterator(lit);
+                    goto done;
+                }
+            }
+
+            listReleaseIterator(lit);
+        }
+    }
+
+    buf = sdsnewlen(NULL, sizeof(header));
+    buf = sdscatlen(buf, nodes->elem, hiarray_n(nodes)*nodes->size);
+    buf = sdscatlen(buf, ranges->elem, hiarray_n(ranges)*ranges->size);
+    buf = sdscatlen(buf, strings, sdslen(strings));
+    if(buf == NULL)
+    {
+        goto done;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CLUSTER_ROUTE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CLUSTER_ROUTE_FILE_VERSION;
+    header.bom = CLUSTER_ROUTE_FILE_BOM;
+    header.nnodes = hiarray_n(nodes);
+    header.nranges = hiarray_n(ranges);
+    header.strings_len = (uint32_t)sdslen(strings);
+    header.checksum = crc16(buf + sizeof(header),
+        (int)(sdslen(buf) - sizeof(header)));
+    header.saved_at = (int64_t)time(NULL);
+    memcpy(buf, &header, sizeof(header));
+
+    tmp = sdscatprintf(sdsempty(), "%s.tmp.%ld", path, (long)getpid());
+    if(tmp == NULL)
+    {
+        goto done;
+    }
+
+    if(cluster_route_file_write(tmp, buf, sdslen(buf)) != REDIS_OK ||
+        rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        goto done;
+    }
+
+    ret = REDIS_OK;
+
+done:
+
+    if(dit != NULL)
+    {
+        dictReleaseIterator(dit);
+    }
+
+    if(nodes != NULL)
+    {
+        nodes->nelem = 0;
+        hiarray_destroy(nodes);
+    }
+
+    if(ranges != NULL)
+    {
+        ranges->nelem = 0;
+        hiarray_destroy(ranges);
+    }
+
+    sdsfree(strings);
+    sdsfree(buf);
+    sdsfree(tmp);
+
+    return ret;
+}
+
+static cluster_node *
+cluster_route_file_node_create(const cluster_route_file_node *rec,
+    const char *strings)
+{
+    cluster_node *node;
+
+    node = hi_alloc(sizeof(cluster_node));
+    if(node == NULL)
+    {
+        return NULL;
+    }
+
+    cluster_node_init(node);
+
+    node->port = rec->port;
+    node->role = rec->role;
+    node->config_epoch = rec->config_epoch;
+
+    /* Routes from cluster slots have no node names. */
+    if(strings[rec->name] != '\0')
+    {
+        node->name = sdsnew(strings + rec->name);
+        if(node->name == NULL)
+        {
+            goto error;
+        }
+    }
+
+    node->host = sdsnew(strings + rec->host);
+    if(node->host == NULL)
+    {
+        goto error;
+    }
+
+    node->addr = sdscatfmt(sdsempty(), "%s:%i", node->host, node->port);
+    if(node->addr == NULL)
+    {
+        goto error;
+    }
+
+    return node;
+
+error:
+
+    listClusterNodeDestructor(node);
+    return NULL;
+}
+
+/**
+  * Install the route saved in path, if it is sound and not older than
+  * max_age seconds (0: any age).
+  */
+static int
+cluster_route_load(redisClusterContext *cc, const char *path, int max_age)
+{
+    const cluster_route_file_header *header;
+    const cluster_route_file_node *recs;
+    const cluster_route_file_range *ranges;
+    const char *strings;
+    cluster_node **index = NULL, *node, *master;
+    cluster_slot *slot;
+    dict *nodes = NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    size_t size;
+    sds key;
+    uint32_t i;
+    int fd;
+    int ret = REDIS_ERR;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header))
+    {
+        close(fd);
+        return REDIS_ERR;
+    }
+
+    size = (size_t)st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        return REDIS_ERR;
+    }
+
+    header = map;
+    if(memcmp(header->magic, CLUSTER_ROUTE_FILE_MAGIC, sizeof(header->magic)) ||
+        header->version != CLUSTER_ROUTE_FILE_VERSION ||
+        header->bom != CLUSTER_ROUTE_FILE_BOM ||
+        header->nnodes == 0 || header->strings_len == 0 ||
+        header->nnodes > size || header->nranges > size ||
+        size != sizeof(*header) +
+            (size_t)header->nnodes*sizeof(cluster_route_file_node) +
+            (size_t)header->nranges*sizeof(cluster_route_file_range) +
+            header->strings_len)
+    {
+        goto done;
+    }
+
+    if(max_age > 0 && (int64_t)time(NULL) - header->saved_at > max_age)
+    {
+        goto done;
+    }
+
+    if(header->checksum != crc16((const char *)map + sizeof(*header),
+        (int)(size - sizeof(*header))))
+    {
+        goto done;
+    }
+
+    recs = (const cluster_route_file_node *)(header + 1);
+    ranges = (const cluster_route_file_range *)(recs + header->nnodes);
+    strings = (const char *)(ranges + header->nranges);
+    if(strings[header->strings_len - 1] != '\0')
+    {
+        goto done;
+    }
+
+    index = hi_alloc(header->nnodes*sizeof(*index));
+    nodes = dictCreate(&clusterNodesDictType, NULL);
+    if(index == NULL || nodes == NULL)
+    {
+        goto done;
+    }
+
+    memset(index, 0, header->nnodes*sizeof(*index));
+
+    /* Masters are written before their slaves. */
+    for(i = 0; i < header->nnodes; i ++)
+    {
+        if(recs[i].name >= header->strings_len ||
+            recs[i].host >= header->strings_len ||
+            recs[i].port == 0)
+        {
+            goto done;
+        }
+
+        if(recs[i].role == REDIS_ROLE_MASTER)
+        {
+            if(recs[i].master != -1)
+            {
+                goto done;
+            }
+        }
+        else if(recs[i].role == REDIS_ROLE_SLAVE)
+        {
+            if(recs[i].master < 0 || (uint32_t)recs[i].master >= i ||
+                index[recs[i].master] == NULL)
+            {
+                goto done;
+            }
+
+            if(!(cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE))
+            {
+                continue;
+            }
+        }
+        else
+        {
+            goto done;
+        }
+
+        node = cluster_route_file_node_create(&recs[i], strings);
+        if(node == NULL)
+        {
+            goto done;
+        }
+
+        if(node->role == REDIS_ROLE_SLAVE)
+        {
+            master = index[recs[i].master];
+            if(master->slaves == NULL)
+            {
+                master->slaves = listCreate();
+                if(master->slaves == NULL)
+                {
+                    listClusterNodeDestructor(node);
+                    goto done;
+                }
+
+                master->slaves->free = listClusterNodeDestructor;
+            }
+
+            if(listAddNodeTail(master->slaves, node) == NULL)
+            {
+                listClusterNodeDestructor(node);
+                goto done;
+            }
+
+            continue;
+        }
+
+        key = sdsnewlen(node->addr, sdslen(node->addr));
+        if(key == NULL || dictAdd(nodes, key, node) != DICT_OK)
+        {
+            sdsfree(key);
+            listClusterNodeDestructor(node);
+            goto done;
+        }
+
+        index[i] = node;
+    }
+
+    for(i = 0; i < header->nranges; i ++)
+    {
+        if(ranges[i].node >= header->nnodes ||
+            recs[ranges[i].node].role != REDIS_ROLE_MASTER)
+        {
+            goto done;
+        }
+
+        slot = cluster_slot_create(index[ranges[i].node]);
+        if(slot == NULL)
+        {
+            goto done;
+        }
+
+        slot->start = ranges[i].start;
+        slot->end = ranges[i].end;
+    }
+
+    ret = cluster_route_install(cc, nodes);
+    nodes = NULL;
+
+    /* A bad file is not the caller's error: the route is fetched. */
+    if(ret != REDIS_OK && cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }
+
+done:
+
+    if(nodes != NULL)
+    {
+        dictRelease(nodes);
+    }
+
+    if(index != NULL)
+    {
+        hi_free(index);
+    }
+
+    munmap(map, size);
+
+    return ret;
+}
+
+int
+cluster_update_route(redisClusterContext *cc)
+{
+    int ret;
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    /* The first route comes from the file when there is one. It is only
+     * checked against the cluster when it fails us: a MOVED or a node that
+     * cannot be reached triggers the usual refresh, which in turn rewrites
+     * the file. */
+    if(cc->route_version == 0 && cc->topology_file != NULL &&
+        cluster_route_load(cc, cc->topology_file,
+            cc->topology_file_max_age) == REDIS_OK)
+    {
+        if((cc->flags & HIRCLUSTER_FLAG_WARM_UP) && (cc->flags & REDIS_BLOCK))
+        {
+            cluster_warm_up(cc);
+        }
+
+        return REDIS_OK;
+    }
+
+    if(cc->topology != NULL)
+    {
+        ret = cluster_update_route_shared(cc);
+    }
+    else
+    {
+        ret = cluster_update_route_fetch(cc, NULL);
+    }
+
+    if(ret == REDIS_OK && cc->topology_file != NULL)
+    {
+        cluster_route_save(cc, cc->topology_file);
+    }
+
+    if(ret == REDIS_OK && (cc->flags & HIRCLUSTER_FLAG_WARM_UP) &&
+        (cc->flags & REDIS_BLOCK))
+    {
+        cluster_warm_up(cc);
+    }
+
+    return ret;
+}
+
+static void print_cluster_node_list(redisClusterContext *cc)
+{
+    dictIterator *di = NULL;
+    dictEntry *de;
+    listIter *it;
+    listNode *ln;
+    cluster_node *master, *slave;
+    hilist *slaves;
+
+    if(cc == NULL)
+    {
+        return;
+    }
+
+    di = dictGetIterator(cc->nodes);
+
+    printf("name\taddress\trole\tslaves\n");
+    
+    while((de = dictNext(di)) != NULL) {
+        master = dictGetEntryVal(de);
+
+        printf("%s\t%s\t%d\t%s\n",master->name, master->addr, 
+            master->role, master->slaves?"hava":"null");
+
+        slaves = master->slaves;
+        if(slaves == NULL)
+        {
+            continue;
+        }
+        
+        it = listGetIterator(slaves, AL_START_HEAD);
+        while((ln = listNext(it)) != NULL)
+        {
+            slave = listNodeValue(ln);
+            printf("%s\t%s\t%d\t%s\n",slave->name, slave->addr, 
+                slave->role, slave->slaves?"hava":"null");
+        }
+
+        listReleaseIterator(it);
+
+        printf("\n");
+    }
+}
+
+
+int test_cluster_update_route(redisClusterContext *cc)
+{
+    int ret;
+    
+    ret = cluster_update_route(cc);
+
+    //print_cluster_node_list(cc);
+    
+    return ret;
+}
+
+redisClusterContext *redisClusterContextInit(void) {
+    redisClusterContext *cc;
+
+    cc = calloc(1,sizeof(redisClusterContext));
+    if (cc == NULL)
+        return NULL;
+
+    cc->err = 0;
+    cc->errstr[0] = '\0';
+    cc->ip = NULL;
+    cc->port = 0;
+    cc->flags = 0;
+    cc->connect_timeout = NULL;
+    cc->timeout = NULL;
+    cc->nodes = NULL;
+    cc->slots = NULL;
+    cc->max_redirect_count = CLUSTER_DEFAULT_MAX_REDIRECT_COUNT;
+    cc->retry_count = 0;
+    cc->breaker_threshold = CLUSTER_DEFAULT_BREAKER_THRESHOLD;
+    cc->backoff_min = CLUSTER_DEFAULT_BACKOFF_MIN_USEC;
+    cc->backoff_max = CLUSTER_DEFAULT_BACKOFF_MAX_USEC;
+    cc->requests = NULL;
+    cc->need_update_route = 0;
+    cc->update_route_time = 0LL;
+    cc->route_no_shards = 0;
+
+    cc->route_version = 0LL;
+
+    memset(cc->table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
+    memset(cc->slot_index, 0xff, sizeof(cc->slot_index));
+    cc->node_vector = NULL;
+    cc->node_count = 0;
+
+    cc->flags |= REDIS_BLOCK;
+
+    cc->password_len = 0;
+    cc->password = NULL;
+
+    cc->uring = NULL;
+
+    cc->topology = NULL;
+    cc->topology_version = 0;
+
+    cc->topology_file = NULL;
+    cc->topology_file_max_age = 0;
+
+    cc->scripts = NULL;
+
+    cc->cache = NULL;
+
+    cc->ssl = NULL;
+    cc->ssl_init_fn = NULL;
+
+    cc->con_generation = 0;
+    
+    return cc;
+}
+
+void redisClusterFree(redisClusterContext *cc) {
+    
+    if (cc == NULL)
+        return;
+
+    if(cc->ip)
+    {
+        sdsfree(cc->ip);
+        cc->ip = NULL;
+    }
+
+    if (cc->connect_timeout)
+    {
+        free(cc->connect_timeout);
+    }
+
+    if (cc->timeout)
+    {
+        free(cc->timeout);
+    }
+
+    memset(cc->table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
+
+    if(cc->node_vector != NULL)
+    {
+        hi_free(cc->node_vector);
+        cc->node_vector = NULL;
+    }
+
+    if(cc->slots != NULL)
+    {
+        cc->slots->nelem = 0;
+        hiarray_destroy(cc->slots);
+        cc->slots = NULL;
+    }
+
+    if(cc->nodes != NULL)
+    {
+        dictRelease(cc->nodes);
+    }
+
+    if(cc->requests != NULL)
+    {
+        listRelease(cc->requests);
+    }
+
+    if(cc->password)
+    {
+        free(cc->password);
+    }
+
+    /* After the nodes, their connections still use the ring. */
+    if(cc->uring)
+    {
+        redisFreeUringContext(cc->uring);
+    }
+
+    redisClusterTopologyRelease(cc->topology);
+
+    if(cc->topology_file != NULL)
+    {
+        sdsfree(cc->topology_file);
+    }
+
+    if(cc->scripts != NULL)
+    {
+        dictRelease(cc->scripts);
+    }
+    
+    free(cc);
+}
+
+/* Connect to a Redis cluster. On error the field error in the returned
+ * context will be set to the return value of the error function.
+ * When no set of reply functions is given, the default set will be used. */
+static int _redisClusterConnect2(redisClusterContext *cc)
+{
+
+    if (cc->nodes == NULL || dictSize(cc->nodes) == 0)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address does not set up");
+        return REDIS_ERR;
+    }
+    
+    return cluster_update_route(cc);
+}
+
+/* Connect to a Redis cluster. On error the field error in the returned
+ * context will be set to the return value of the error function.
+ * When no set of reply functions is given, the default set will be used. */
+static redisClusterContext *_redisClusterConnect(redisClusterContext *cc, const char *addrs) {
+
+    int ret;
+    
+    ret = redisClusterSetOptionAddNodes(cc, addrs);
+    if (ret != REDIS_OK)
+    {
+        return cc;
+    }
+    
+    cluster_update_route(cc);
+
+    return cc;
+}
+
+redisClusterContext *redisClusterConnect(const char *addrs, int flags)
+{
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    cc->flags |= REDIS_BLOCK;
+    if(flags)
+    {
+        cc->flags |= flags;
+    }
+    
+    return _redisClusterConnect(cc, addrs);
+}
+
+redisClusterContext *redisClusterConnectWithTimeout(
+    const char *addrs, const struct timeval tv, int flags)
+{
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    cc->flags |= REDIS_BLOCK;
+    if(flags)
+    {
+        cc->flags |= flags;
+    }
+    
+    if (cc->connect_timeout == NULL)
+    {
+        cc->connect_timeout = malloc(sizeof(struct timeval));
+    }
+    
+    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
+    
+    return _redisClusterConnect(cc, addrs);
+}
+
+redisClusterContext *redisClusterConnectNonBlock(const char *addrs, int flags) {
+
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    cc->flags &= ~REDIS_BLOCK;
+    if(flags)
+    {
+        cc->flags |= flags;
+    }
+    
+    return _redisClusterConnect(cc, addrs);
+}
+
+int redisClusterSetOptionAddNode(redisClusterContext *cc, const char *addr)
+{
+    dictEntry *node_entry;
+    cluster_node *node;
+    sds *ip_port = NULL;
+    int ip_port_count = 0;
+    sds ip;
+    int port;
+    sds addr_sds = NULL;
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cc->nodes == NULL)
+    {
+        cc->nodes = dictCreate(&clusterNodesDictType, NULL);
+        if(cc->nodes == NULL)
+        {
+            return REDIS_ERR;
+        }
+    }
+
+    addr_sds = sdsnew(addr);
+    node_entry = dictFind(cc->nodes, addr_sds);
+    sdsfree(addr_sds);
+    if(node_entry == NULL)
+    {
+        ip_port = sdssplitlen(addr, strlen(addr), 
+            IP_PORT_SEPARATOR, strlen(IP_PORT_SEPARATOR), &ip_port_count);
+        if(ip_port == NULL || ip_port_count != 2 || 
+            sdslen(ip_port[0]) <= 0 || sdslen(ip_port[1]) <= 0)
+        {
+            if(ip_port != NULL)
+            {
+                sdsfreesplitres(ip_port, ip_port_count);
+            }
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server address is error(correct is like: 127.0.0.1:1234)");
+            return REDIS_ERR;
+        }
+
+        ip = ip_port[0];
+        port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
+
+        if(port <= 0)
+        {
+            sdsfreesplitres(ip_port, ip_port_count);
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server port is error");
+            return REDIS_ERR;
+        }
+
+        sdsfree(ip_port[1]);
+        free(ip_port);
+        ip_port = NULL;
+    
+        node = hi_alloc(sizeof(cluster_node));
+        if(node == NULL)
+        {
+            sdsfree(ip);
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"alloc cluster node error");
+            return REDIS_ERR;
+        }
+
+        cluster_node_init(node);
+
+        node->addr = sdsnew(addr);
+        if(node->addr == NULL)
+        {
+            sdsfree(ip);
+            hi_free(node);
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"new node address error");
+            return REDIS_ERR;
+        }
+
+        node->host = ip;
+        node->port = port;
+
+        dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), node);
+    }
+    
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionAddNodes(redisClusterContext *cc, const char *addrs)
+{
+    int ret;
+    sds *address = NULL;
+    int address_count = 0;
+    int i;
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    address = sdssplitlen(addrs, strlen(addrs), CLUSTER_ADDRESS_SEPARATOR, 
+        strlen(CLUSTER_ADDRESS_SEPARATOR), &address_count);
+    if(address == NULL || address_count <= 0)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address is error(correct is like: 127.0.0.1:1234,127.0.0.2:5678)");
+        return REDIS_ERR;
+    }
+
+    for(i = 0; i < address_count; i ++)
+    {
+        ret = redisClusterSetOptionAddNode(cc, address[i]);
+        if(ret != REDIS_OK)
+        {
+            sdsfreesplitres(address, address_count);
+            return REDIS_ERR;
+        }
+    }
+
+    sdsfreesplitres(address, address_count);
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionAuthPassword(redisClusterContext *cc, const char *password)
+{
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(password == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"password is NULL");
+        return REDIS_ERR;
+    }
+
+    cc->password_len = strlen(password);
+    cc->password = (sds) malloc (cc->password_len + 1);
+    memcpy(cc->password, password, cc->password_len);
+    cc->password[cc->password_len] = 0;
+
+    return REDIS_OK;
+}
+
+int redisClusterAuth(redisClusterContext *cc, redisContext *c)
+{
+    if(cc == NULL || c == NULL)
+    {
+        return REDIS_ERR;
+    }
+    if(cc->password == NULL)
+    {
+        return REDIS_OK;
+    }
+    // AUTH password, as an argument: it may hold '%' or spaces
+    redisReply *reply = redisCommand(c, REDIS_COMMAND_AUTH" %b",
+        cc->password, cc->password_len);
+    if(reply == NULL){
+        if (c->err == REDIS_ERR_TIMEOUT) {
+            __redisClusterSetError(cc,c->err,
+                                   "Command(Auth) reply error(socket timeout)");
+        } else {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                   "Command(Auth) reply error(NULL).");
+        }
+        goto error;
+    }else if(reply->type != REDIS_REPLY_STATUS){
+        if(reply->type == REDIS_REPLY_ERROR){
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                   reply->str);
+        }else{
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                                   "Command(Auth) reply error: type is not status.");
+        }
+
+        goto error;
+    }
+    if (0 != strcmp(reply->str, REDIS_COMMAND_AUTH_OK))
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                               "Command(Auth) reply error: reply->str is not OK.");
+        goto error;
+    }
+    freeReplyObject(reply);
+    return REDIS_OK;
+    error:
+    if(reply != NULL){
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+    return REDIS_ERR;
+}
+
+int redisClusterSetOptionConnectBlock(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= REDIS_BLOCK;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionConnectNonBlock(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags &= ~REDIS_BLOCK;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionParseSlaves(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_ADD_SLAVE;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionParseOpenSlots(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_ADD_OPENSLOT;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionRouteUseSlots(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_ROUTE_USE_SLOTS;
+
+    return REDIS_OK;
+}
+
+/* Connect to all the masters, and to their slaves with
+ * HIRCLUSTER_FLAG_ADD_SLAVE, in parallel as soon as the route is known,
+ * rather than on their first command. Blocking contexts only. */
+int redisClusterSetOptionWarmUp(redisClusterContext *cc)
+{
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_WARM_UP;
+
+    return REDIS_OK;
+}
+
+/* Speak RESP3 to the nodes: replies keep their native types (maps,
+ * sets, doubles, booleans) and push messages are possible. Servers that
+ * do not have it are spoken RESP2 to, as without this option. */
+int redisClusterSetOptionResp3(redisClusterContext *cc)
+{
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_RESP3;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionRouteUseNodes(redisClusterContext *cc)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->flags |= HIRCLUSTER_FLAG_ROUTE_USE_NODES;
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionConnectTimeout(redisClusterContext *cc, const struct timeval tv)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if (cc->connect_timeout == NULL)
+    {
+        cc->connect_timeout = malloc(sizeof(struct timeval));
+    }
+    
+    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
+
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionTimeout(redisClusterContext *cc, const struct timeval tv)
+{
+
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if (cc->timeout == NULL)
+    {
+        cc->timeout = malloc(sizeof(struct timeval));
+        memcpy(cc->timeout, &tv, sizeof(struct timeval));
+    }
+    else if (cc->timeout->tv_sec != tv.tv_sec || cc->timeout->tv_usec != tv.tv_usec)
+    {
+        memcpy(cc->timeout, &tv, sizeof(struct timeval));
+
+        if (cc->nodes && dictSize(cc->nodes) > 0)
+        {
+            dictEntry *de;
+            dictIterator *di;
+            cluster_node *node;
+
+            di = dictGetIterator(cc->nodes);
+
+            while ((de=dictNext(di)))
+            {
+                node = dictGetEntryVal(de);
+                if (node->con && node->con->flags&REDIS_CONNECTED && node->con->err == 0)
+                {
+                    redisSetTimeout(node->con, tv);
+                }
+
+                if (node->slaves && listLength(node->slaves) > 0)
+                {
+                    cluster_node *slave;
+                    listIter *li;
+                    listNode *ln;
+                    
+                    li = listGetIterator(node->slaves, AL_START_HEAD);
+                    while ((ln = listNext(li)))
+                    {
+                        slave = listNodeValue(ln);
+                        if (slave->con && slave->con->flags&REDIS_CONNECTED && slave->con->err == 0)
+                        {
+                            redisSetTimeout(slave->con, tv);
+                        }
+                    }
+
+                    listReleaseIterator(li);
+                }
+            }
+
+            dictReleaseIterator(di);
+        }
+    }
+
+    if (cc->uring)
+    {
+        redisUringSetTimeout(cc->uring, tv);
+    }
+    
+    return REDIS_OK;
+}
+
+int redisClusterSetOptionMaxRedirect(redisClusterContext *cc, int max_redirect_count)
+{
+    if(cc == NULL || max_redirect_count <= 0)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->max_redirect_count = max_redirect_count;
+
+    return REDIS_OK;
+}
+
+/* A node that failed `failures` times in a row (0: never) is not reconnected
+ * to for a backoff time, from min doubling up to max, during which its
+ * commands fail at once. */
+int redisClusterSetOptionReconnectBackoff(redisClusterContext *cc,
+    int failures, const struct timeval min, const struct timeval max)
+{
+    int64_t min_usec, max_usec;
+
+    if(cc == NULL || failures < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    min_usec = (int64_t)min.tv_sec * 1000000 + min.tv_usec;
+    max_usec = (int64_t)max.tv_sec * 1000000 + max.tv_usec;
+    if(min_usec <= 0 || max_usec < min_usec)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->breaker_threshold = failures;
+    cc->backoff_min = min_usec;
+    cc->backoff_max = max_usec;
+
+    return REDIS_OK;
+}
+
+/* Share the route with the other contexts using t. Must be called before
+ * connecting. */
+int redisClusterSetOptionTopology(redisClusterContext *cc, redisClusterTopology *t)
+{
+    if(cc == NULL || t == NULL || cc->topology != NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    __atomic_add_fetch(&t->refcount, 1, __ATOMIC_RELAXED);
+    cc->topology = t;
+    cc->topology_version = 0;
+
+    return REDIS_OK;
+}
+
+/* Keep the route in a file: a context connecting with a file younger than
+ * max_age seconds (0: no limit) starts from it without asking the cluster,
+ * and every route fetched later is written back. The file can be shared by
+ * the processes of a host. */
+int redisClusterSetOptionTopologyFile(redisClusterContext *cc, const char *path, int max_age)
+{
+    if(cc == NULL || path == NULL || max_age < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cc->topology_file != NULL)
+    {
+        sdsfree(cc->topology_file);
+    }
+
+    cc->topology_file = sdsnew(path);
+    if(cc->topology_file == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
+
+    cc->topology_file_max_age = max_age;
+
+    return REDIS_OK;
+}
+
+/* Serve the cacheable commands (see hicache.h) sent with redisClusterCommand
+ * from cache. Every node connection is tracked on its first command, with
+ * the invalidations going to a second connection to the node. The cache
+ * stays owned by the caller and must outlive cc. */
+int redisClusterSetOptionCache(redisClusterContext *cc, redisCache *cache)
+{
+    if(cc == NULL || cache == NULL || cc->cache != NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->cache = cache;
+
+    return REDIS_OK;
+}
+
+int redisClusterSaveTopology(redisClusterContext *cc, const char *path)
+{
+    if(cc == NULL || path == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cluster_route_save(cc, path) != REDIS_OK)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_IO, "Save topology failed");
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/* Do the blocking I/O of the node connections through a shared io_uring:
+ * the pipelined requests of all the nodes are written with one submission
+ * and their replies read ahead into registered buffers. Connections made
+ * before this call keep using plain sockets. Returns REDIS_ERR when
+ * io_uring is not available, the context then works as before, or when
+ * TLS is enabled: a TLS connection does its I/O through OpenSSL and cannot
+ * be handed to the ring. */
+int redisClusterSetOptionIoUring(redisClusterContext *cc)
+{
+    if(cc == NULL || cc->ssl != NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cc->uring != NULL)
+    {
+        return REDIS_OK;
+    }
+
+    cc->uring = redisCreateUringContext(0, 0, 0);
+    if(cc->uring == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cc->timeout)
+    {
+        redisUringSetTimeout(cc->uring, *cc->timeout);
+    }
+
+    return REDIS_OK;
+}
+
+int redisClusterConnect2(redisClusterContext *cc)
+{
+    
+    if(cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+    
+    return _redisClusterConnect2(cc);
+}
+
+/* node->con is about to be, or has just been, opened again or replaced:
+ * whatever was bound to the previous connection is gone, WATCH included.
+ * Neither is the new one tracked, what was read through the old one may
+ * have changed unnoticed; tracking is turned on again on its first cached
+ * command. */
+static void cluster_node_con_replaced(redisClusterContext *cc,
+    cluster_node *node)
+{
+    node->con_generation = ++ cc->con_generation;
+
+    if(node->tracking)
+    {
+        node->tracking = 0;
+        redisCacheFlush(cc->cache);
+    }
+}
+
+/* Set up a connection to node that has just been opened, or count the
+ * failure to open it. */
+static void cluster_node_connected(redisClusterContext *cc,
+    cluster_node *node, redisContext *c)
+{
+    cluster_node_con_replaced(cc, node);
+
+    if(c == NULL || c->err)
+    {
+        cluster_node_breaker_failure(cc, node);
+        return;
+    }
+
+    if (cc->timeout)
+    {
+        redisSetTimeout(c, *cc->timeout);
+    }
+    cluster_node_uring(cc, c);
+    cluster_node_handshake(cc, c);
+
+    cluster_node_breaker_success(node);
+}
+
+redisContext *ctx_get_by_node(redisClusterContext *cc, cluster_node *node)
+{
+    redisContext *c = NULL;
+    if(node == NULL)
+    {
+        return NULL;
+    }
+
+    c = node->con;
+    if(c != NULL)
+    {
+        /* An open breaker leaves the error of the last attempt in place. */
+        if(c->err && cluster_node_breaker_allow(node))
+        {
+            redisReconnect(c);
+            cluster_ssl_initiate(cc, c);
+            cluster_node_connected(cc, node, c);
+        }
+
+        return c;
+    }
+
+    if(node->host == NULL || node->port <= 0)
+    {
+        return NULL;
+    }
+
+    if(!cluster_node_breaker_allow(node))
+    {
+        return NULL;
+    }
+
+    if(cc->connect_timeout)
+    {
+        c = redisConnectWithTimeout(node->host, node->port, *cc->connect_timeout);
+    }
+    else
+    {
+        c = redisConnect(node->host, node->port);
+    }
+
+    cluster_ssl_initiate(cc, c);
+    cluster_node_connected(cc, node, c);
+
+    node->con = c;
+
+    return c;
+}
+
+static cluster_node *node_get_by_slot(redisClusterContext *cc, uint32_t slot_num)
+{
+    struct hiarray *slots;
+    uint32_t slot_count;
+    cluster_slot **slot;
+    uint32_t middle, start, end;
+    uint8_t stop = 0;
+    
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    if(slot_num >= REDIS_CLUSTER_SLOTS)
+    {
+        return NULL;
+    }
+
+    slots = cc->slots;
+    if(slots == NULL)
+    {
+        return NULL;
+    }
+    slot_count = hiarray_n(slots);
+
+    start = 0;
+    end = slot_count - 1;
+    middle = 0;
+
+    do{
+        if(start >= end)
+        {
+            stop = 1;
+            middle = end;
+        }
+        else
+        {
+            middle = start + (end - start)/2;
+        }
+
+        ASSERT(middle < slot_count);
+
+        slot = hiarray_get(slots, middle);
+        if((*slot)->start > slot_num)
+        {
+            end = middle - 1;
+        }
+        else if((*slot)->end < slot_num)
+        {
+            start = middle + 1;
+        }
+        else
+        {
+            return (*slot)->node;
+        }
+            
+        
+    }while(!stop);
+
+    printf("slot_num : %d\n", slot_num);
+    printf("slot_count : %d\n", slot_count);
+    printf("start : %d\n", start);
+    printf("end : %d\n", end);
+    printf("middle : %d\n", middle);
+
+    return NULL;
+}
+
+
+static cluster_node *node_get_by_table(redisClusterContext *cc, uint32_t slot_num)
+{   
+    uint16_t index;
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    if(slot_num >= REDIS_CLUSTER_SLOTS)
+    {
+        return NULL;
+    }
+
+    index = cc->slot_index[slot_num];
+    if(index == REDIS_CLUSTER_NODE_NONE)
+    {
+        return NULL;
+    }
+
+    return cc->node_vector[index];
+}
+
+static cluster_node *node_get_witch_connected(redisClusterContext *cc)
+{
+    dictIterator *di;
+    dictEntry *de;
+    struct cluster_node *node;
+    redisContext *c = NULL;
+    redisReply *reply = NULL;
+
+    if(cc == NULL || cc->nodes == NULL)
+    {
+        return NULL;
+    }
+
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        if(node == NULL)
+        {
+            continue;
+        }
+        
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL || c->err)
+        {
+            continue;
+        }
+
+        reply = redisCommand(c, REDIS_COMMAND_PING);
+        if(reply != NULL && reply->type == REDIS_REPLY_STATUS &&
+            reply->str != NULL && strcmp(reply->str, "PONG") == 0)
+        {
+            freeReplyObject(reply);
+            reply = NULL;
+            
+            dictReleaseIterator(di);            
+        
+            return node;
+        }
+        else if(reply != NULL)
+        {
+            freeReplyObject(reply);
+            reply = NULL;
+        }
+    }
+
+    dictReleaseIterator(di);
+
+    return NULL;
+}
+
+static int slot_get_by_command(redisClusterContext *cc, char *cmd, int len)
+{
+    struct cmd *command = NULL;
+    struct keypos *kp;
+    int key_count;
+    uint32_t i;
+    int slot_num = -1;
+
+    if(cc == NULL || cmd == NULL || len <= 0)
+    {
+        goto done;
+    }
+
+    command = command_get();
+    if(command == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
+    }
+    
+    command->cmd = cmd;
+    command->clen = len;
+    redis_parse_cmd(command);
+    if(command->result != CMD_PARSE_OK)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "parse command error");
+        goto done;
+    }
+
+    key_count = hiarray_n(command->keys);
+
+    if(key_count <= 0)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no keys in command(must have keys for redis cluster mode)");
+        goto done;
+    }
+    else if(key_count == 1)
+    {
+        kp = hiarray_get(command->keys, 0);
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+
+        goto done;
+    }
+    
+    for(i = 0; i < hiarray_n(command->keys); i ++)
+    {
+        kp = hiarray_get(command->keys, i);
+
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+    }
+
+done:
+    
+    if(command != NULL)
+    {
+        command->cmd = NULL;
+        command_destroy(command);
+    }
+    
+    return slot_num;
+}
+
+/* Get the cluster config from one node.
+  * Return value: config_value string must free by usr.
+  */
+static char * cluster_config_get(redisClusterContext *cc, 
+    const char *config_name, int *config_value_len)
+{
+    redisContext *c;
+    cluster_node *node;
+    redisReply *reply = NULL, *sub_reply;
+    char *config_value = NULL;
+
+    if(cc == NULL || config_name == NULL
+        || config_value_len == NULL)
+    {
+        return NULL;
+    }
+    
+    node = node_get_witch_connected(cc);
+    if(node == NULL)
+    {
+        __redisClusterSetError(cc, 
+            REDIS_ERR_OTHER, "no reachable node in cluster");
+        goto error;
+    }
+
+    c = ctx_get_by_node(cc, node);
+    
+    reply = redisCommand(c, "config get %s", config_name);
+    if(reply == NULL)
+    {
+        __redisClusterSetError(cc, 
+            REDIS_ERR_OTHER, "reply for config get is null");
+        goto error;
+    }
+
+    /* A map under RESP3, its key and value in a row all the same. */
+    if(reply->type != REDIS_REPLY_ARRAY && reply->type != REDIS_REPLY_MAP)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "reply for config get type is not array");
+        goto error;
+    }
+
+    if(reply->elements != 2)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "reply for config get elements number is not 2");
+        goto error;
+    }
+
+    sub_reply = reply->element[0];
+    if(sub_reply == NULL || sub_reply->type != REDIS_REPLY_STRING)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "reply for config get config name is not string");
+        goto error;
+    }
+
+    if(strcmp(sub_reply->str, config_name))
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "reply for config get config name is not we want");
+        goto error;
+    }
+
+    sub_reply = reply->element[1];
+    if(sub_reply == NULL || sub_reply->type != REDIS_REPLY_STRING)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "reply for config get config value type is not string");
+        goto error;
+    }
+
+    config_value = sub_reply->str;
+    *config_value_len = sub_reply->len;
+    sub_reply->str= NULL;
+
+    if(reply != NULL)
+    {
+        freeReplyObject(reply);    
+    }
+
+    return config_value;
+
+error:
+
+    if(reply != NULL)
+    {
+        freeReplyObject(reply);    
+    }
+
+    return NULL;
+}
+
+/* Helper function for the redisClusterAppendCommand* family of functions.
+ *
+ * Write a formatted command to the output buffer. When this family
+ * is used, you need to call redisGetReply yourself to retrieve
+ * the reply (or replies in pub/sub).
+ */
+static int __redisClusterAppendCommand(redisClusterContext *cc, 
+    struct cmd *command) {
+
+    cluster_node *node;
+    redisContext *c = NULL;
+
+    if(cc == NULL || command == NULL)
+    {
+        return REDIS_ERR;
+    }
+    
+    node = node_get_by_table(cc, (uint32_t)command->slot_num);
+    if(node == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by slot error");
+        return REDIS_ERR;
+    }
+
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
+        return REDIS_ERR;
+    }
+    else if(c->err)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
+
+    if (__redisAppendCommand(c, command->cmd, command->clen) != REDIS_OK) 
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
+    
+    return REDIS_OK;
+}
+
+/* Helper function for the redisClusterGetReply* family of functions.
+ */
+static int __redisClusterGetReply(redisClusterContext *cc, int slot_num, void **reply)
+{
+    cluster_node *node;
+    redisContext *c;
+
+    if(cc == NULL || slot_num < 0 || reply == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    node = node_get_by_table(cc, (uint32_t)slot_num);
+    if(node == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table is null");
+        return REDIS_ERR;
+    }
+
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    else if(c->err)
+    {
+        if(cc->need_update_route == 0)
+        {
+            cc->retry_count ++;
+            if(cc->retry_count > cc->max_redirect_count)
             {
-                if(count_part < 8)
-                {
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "master node part number error");
-                    goto error;
-                }
-                
-                master = node_get_with_nodes(cc, 
-                    part, count_part, REDIS_ROLE_MASTER);
-                if(master == NULL)
-                {
-                    goto error;
-                }
+                cc->need_update_route = 1;
+                cc->retry_count = 0;
+            }
+        }
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
 
-                ret = dictAdd(nodes, 
-                    sdsnewlen(master->addr, sdslen(master->addr)), master);
-                if(ret != DICT_OK)
-                {
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                        "the address already exists in the nodes");
-                    cluster_node_deinit(master);
-                    hi_free(master);
-                    goto error;
-                }
+    if(redisGetReply(c, reply) != REDIS_OK)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
+    
+    if(cluster_reply_error_type(*reply) == CLUSTER_ERR_MOVED)
+    {
+        cc->need_update_route = 1;
+    }
 
-                if(cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE)
-                {
-                    ret = cluster_master_slave_mapping_with_name(cc, 
-                        &nodes_name, master, master->name);
-                    if(ret != REDIS_OK)
-                    {
-                        cluster_node_deinit(master);
-                        hi_free(master);
-                        goto error;
-                    }
-                }
-                
-                if(myself == 1)
-                {
-                    master->con = c;
-                    c = NULL;
-                }
-                
-                for(k = 8; k < count_part; k ++)
-                {
-                    slot_start_end = sdssplitlen(part[k], 
-                        sdslen(part[k]), "-", 1, &count_slot_start_end);
-                    
-                    if(slot_start_end == NULL)
-                    {
-                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                            "split slot start end error(NULL)");
-                        goto error;
-                    }
-                    else if(count_slot_start_end == 1)
-                    {
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
-                        slot_end = slot_start;
-                    }
-                    else if(count_slot_start_end == 2)
-                    {
-                        slot_start = 
-                            hi_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
-                        slot_end = 
-                            hi_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
-                    }
-                    else
-                    {
-                        slot_start = -1;
-                        slot_end = -1;
-                    }
-                    
-                    sdsfreesplitres(slot_start_end, count_slot_start_end);
-                    count_slot_start_end = 0;
-                    slot_start_end = NULL;
+    return REDIS_OK;
+}
 
-                    if(slot_start < 0 || slot_end < 0 || 
-                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS)
-                    {
-                        continue;
-                    }
+static cluster_node *node_get_by_ask_error_reply(
+    redisClusterContext *cc, redisReply *reply)
+{
+    sds *part = NULL, *ip_port = NULL;
+    int part_len = 0, ip_port_len;
+    dictEntry *de;
+    cluster_node *node = NULL;
 
-                    for(j = slot_start; j <= slot_end; j ++)
-                    {
-                        if(table[j] != NULL)
-                        {
-                            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                "diffent node hold a same slot");
-                            goto error;
-                        }
-                        table[j] = master;
-                    }
-                    
-                    slot = hiarray_push(slots);
-                    if(slot == NULL)
-                    {
-                        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                            "slot push in array error");
-                        goto error;
-                    }
+    if(cc == NULL || reply == NULL)
+    {
+        return NULL;
+    }
 
-                    *slot = cluster_slot_create(master);
-                    if(*slot == NULL)
-                    {
-                        __redisClusterSetError(cc,REDIS_ERR_OOM,
-                            "Out of memory");
-                        goto error;
-                    }
+    if(cluster_reply_error_type(reply) != CLUSTER_ERR_ASK)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "reply is not ask error!");
+        return NULL;
+    }
+    
+    part = sdssplitlen(reply->str, reply->len, " ", 1, &part_len);
 
-                    (*slot)->start = (uint32_t)slot_start;
-                    (*slot)->end = (uint32_t)slot_end;                    
-                }
+    if(part != NULL && part_len == 3)
+    {
+        ip_port = sdssplitlen(part[2], sdslen(part[2]), 
+            ":", 1, &ip_port_len);
 
-            }
-            //add slave node
-            else if((cc->flags & HIRCLUSTER_FLAG_ADD_SLAVE) && 
-                (role_len >= 5 && memcmp(role, "slave", 5) == 0))
+        if(ip_port != NULL && ip_port_len == 2)
+        {
+            de = dictFind(cc->nodes, part[2]);
+            if(de == NULL)
             {
-                slave = node_get_with_nodes(cc, part, 
-                    count_part, REDIS_ROLE_SLAVE);
-                if(slave == NULL)
+                node = hi_alloc(sizeof(cluster_node));
+                if(node == NULL)
                 {
-                    goto error;
-                }
+                    __redisClusterSetError(cc, 
+                        REDIS_ERR_OOM, "Out of memory");
 
-                ret = cluster_master_slave_mapping_with_name(cc, 
-                    &nodes_name, slave, part[3]);
-                if(ret != REDIS_OK)
-                {
-                    cluster_node_deinit(slave);
-                    hi_free(slave);
-                    goto error;
+                    goto done;
                 }
+
+                cluster_node_init(node);
+                node->addr = part[1];
+                node->host = ip_port[0];
+                node->port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
+                node->role = REDIS_ROLE_MASTER;
+
+                dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), node);
                 
-                if(myself == 1)
-                {
-                    slave->con = c;
-                    c = NULL;
-                }
+                part = NULL;
+                ip_port = NULL;
             }
-
-            if(myself == 1)
+            else
             {
-                myself = 0;
+                node = de->val;
+
+                goto done;
             }
+        }
+        else
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "ask error reply address part parse error!");
 
-            sdsfreesplitres(part, count_part);
-            count_part = 0;
-            part = NULL;
-            
-            start = pos + 1;
-            line_start = start;
-            pos = start;
+            goto done;
         }
-    }
 
-    if(cc->slots != NULL)
-    {
-        cc->slots->nelem = 0;
-        hiarray_destroy(cc->slots);
-        cc->slots = NULL;
     }
-    cc->slots = slots;
-
-    cluster_nodes_swap_ctx(cc->nodes, nodes);
-
-    if(cc->nodes != NULL)
+    else
     {
-        dictRelease(cc->nodes);
-        cc->nodes = NULL;
-    }
-    cc->nodes = nodes;
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "ask error reply parse error!");
 
-    hiarray_sort(cc->slots, cluster_slot_start_cmp);
+        goto done;
+    }
 
-    memcpy(cc->table, table, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
-    cc->route_version ++;
-    
-    freeReplyObject(reply);
+done:
 
-    if(c != NULL)
+    if(part != NULL)
     {
-        redisFree(c);
+        sdsfreesplitres(part, part_len);
+        part = NULL;
     }
 
-    if(nodes_name != NULL)
+    if(ip_port != NULL)
     {
-        dictRelease(nodes_name);
+        sdsfreesplitres(ip_port, ip_port_len);
+        ip_port = NULL;
     }
     
-    return REDIS_OK;
+    return node;
+}
 
-error:
-        
-    if(part != NULL)
-    {
-        sdsfreesplitres(part, count_part);
-        count_part = 0;
-        part = NULL;
-    }
+/* Register a Lua script and write its SHA1 digest, as a NUL terminated
+ * hex string, to sha (at least 41 bytes). An EVALSHA of a registered script
+ * that gets NOSCRIPT, from a node that restarted or just took over its
+ * slot, loads the script there and is sent again, in the same round trip
+ * for the synchronous API. Pipelined commands (redisClusterAppend*) are not
+ * retried. */
+int redisClusterScriptRegister(redisClusterContext *cc, const char *script, 
+    size_t len, char *sha)
+{
+    char hex[HISHA1_HEX_LEN + 1];
+    sds key, body;
 
-    if(slot_start_end != NULL)
+    if(cc == NULL || script == NULL)
     {
-        sdsfreesplitres(slot_start_end, count_slot_start_end);
-        count_slot_start_end = 0;
-        slot_start_end = NULL;
+        return REDIS_ERR;
     }
 
-    if(slots != NULL)
+    hisha1_hex(script, len, hex);
+
+    if(cc->scripts == NULL)
     {
-        if(slots == cc->slots)
+        cc->scripts = dictCreate(&clusterScriptsDictType, NULL);
+        if(cc->scripts == NULL)
         {
-            cc->slots = NULL;
+            __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+            return REDIS_ERR;
         }
+    }
 
-        slots->nelem = 0;
-        hiarray_destroy(slots);
+    key = sdsnewlen(hex, HISHA1_HEX_LEN);
+    if(key == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
     }
 
-    if(nodes != NULL)
+    if(dictFind(cc->scripts, key) == NULL)
     {
-        if(nodes == cc->nodes)
+        body = sdsnewlen(script, len);
+        if(body == NULL || dictAdd(cc->scripts, key, body) != DICT_OK)
         {
-            cc->nodes = NULL;
+            sdsfree(body);
+            sdsfree(key);
+            __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+            return REDIS_ERR;
         }
-
-        dictRelease(nodes);
     }
-
-    if(nodes_name != NULL)
+    else
     {
-        dictRelease(nodes_name);
+        sdsfree(key);
     }
 
-    if(reply != NULL)
+    if(sha != NULL)
     {
-        freeReplyObject(reply);
-        reply = NULL;
+        memcpy(sha, hex, sizeof(hex));
     }
 
-    if(c != NULL)
-    {
-        redisFree(c);
-    }
-    
-    return REDIS_ERR;
+    return REDIS_OK;
 }
 
-int
-cluster_update_route(redisClusterContext *cc)
+static int cluster_reply_is_noscript(redisReply *reply)
 {
-    int ret;
-    int flag_err_not_set = 1;
-    cluster_node *node;
-    dictIterator *it;
+    return reply != NULL && reply->type == REDIS_REPLY_ERROR &&
+        reply->len >= (int)strlen(REDIS_ERROR_NOSCRIPT) &&
+        strncmp(reply->str, REDIS_ERROR_NOSCRIPT, 
+            strlen(REDIS_ERROR_NOSCRIPT)) == 0;
+}
+
+/* The body of the registered script an EVALSHA command calls, or NULL.
+ * The digest is the first argument of the formatted command. */
+static sds cluster_script_get(redisClusterContext *cc, struct cmd *command)
+{
+    char *p, *end;
     dictEntry *de;
-    
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
-    }
+    sds sha;
+    long len;
+    int i;
 
-    if(cc->ip != NULL && cc->port > 0)
+    if(cc->scripts == NULL || command->type != CMD_REQ_REDIS_EVALSHA)
     {
-        ret = cluster_update_route_by_addr(cc, cc->ip, cc->port);
-        if(ret == REDIS_OK)
-        {
-            return REDIS_OK;
-        }
-
-        flag_err_not_set = 0;
+        return NULL;
     }
 
-    if(cc->nodes == NULL)
+    p = command->cmd;
+    end = command->cmd + command->clen;
+
+    /* Skip *<argc>\r\n, then $<len>\r\nEVALSHA\r\n, to the digest. */
+    p = memchr(p, '\n', end - p);
+    for(i = 0; p != NULL && i < 2; i ++)
     {
-        if(flag_err_not_set)
+        p ++;
+        if(p >= end || *p != '$')
         {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, "no server address");
+            return NULL;
         }
-        
-        return REDIS_ERR;
-    }
 
-    it = dictGetIterator(cc->nodes);
-    while ((de = dictNext(it)) != NULL)
-    {
-        node = dictGetEntryVal(de);
-        if(node == NULL || node->host == NULL || node->port < 0)
+        len = strtol(p + 1, NULL, 10);
+        p = memchr(p, '\n', end - p);
+        if(p == NULL || len < 0 || end - (p + 1) < len)
         {
-            continue;
+            return NULL;
         }
 
-        ret = cluster_update_route_by_addr(cc, node->host, node->port);
-        if(ret == REDIS_OK)
+        if(i == 0)
         {
-            if(cc->err)
-            {
-                cc->err = 0;
-                memset(cc->errstr, '\0', strlen(cc->errstr));
-            }
-            
-            dictReleaseIterator(it);
-            return REDIS_OK;
+            p += len + 2;
         }
+    }
 
-        flag_err_not_set = 0;
+    if(p == NULL || len != HISHA1_HEX_LEN)
+    {
+        return NULL;
     }
-    
-    dictReleaseIterator(it);
 
-    if(flag_err_not_set)
+    sha = sdsnewlen(p + 1, len);
+    if(sha == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no valid server address");
+        return NULL;
     }
 
-    return REDIS_ERR;
+    sdstolower(sha);
+    de = dictFind(cc->scripts, sha);
+    sdsfree(sha);
+
+    return de == NULL ? NULL : dictGetEntryVal(de);
 }
 
-static void print_cluster_node_list(redisClusterContext *cc)
+/* Load script on c and send the command again, both in one write. The
+ * reply of the command is returned, or the error that SCRIPT LOAD got. */
+static redisReply *cluster_script_retry(redisClusterContext *cc, 
+    redisContext *c, struct cmd *command, sds script)
 {
-    dictIterator *di = NULL;
-    dictEntry *de;
-    listIter *it;
-    listNode *ln;
-    cluster_node *master, *slave;
-    hilist *slaves;
+    redisReply *load, *reply;
 
-    if(cc == NULL)
+    if(redisAppendCommand(c, REDIS_COMMAND_SCRIPT_LOAD" %b", 
+            script, sdslen(script)) != REDIS_OK ||
+        __redisAppendCommand(c, command->cmd, command->clen) != REDIS_OK)
     {
-        return;
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
     }
 
-    di = dictGetIterator(cc->nodes);
+    load = __redisBlockForReply(c);
+    if(load == NULL)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
+    }
 
-    printf("name\taddress\trole\tslaves\n");
-    
-    while((de = dictNext(di)) != NULL) {
-        master = dictGetEntryVal(de);
+    reply = __redisBlockForReply(c);
+    if(reply == NULL)
+    {
+        freeReplyObject(load);
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
+    }
 
-        printf("%s\t%s\t%d\t%s\n",master->name, master->addr, 
-            master->role, master->slaves?"hava":"null");
+    if(load->type == REDIS_REPLY_ERROR)
+    {
+        freeReplyObject(reply);
+        return load;
+    }
 
-        slaves = master->slaves;
-        if(slaves == NULL)
+    freeReplyObject(load);
+
+    return reply;
+}
+
+/* Turn tracking on for c, the connection to node, opening the node
+ * connection receiving its invalidations first. */
+static int cluster_cache_track(redisClusterContext *cc, 
+    cluster_node *node, redisContext *c)
+{
+    redisContext *inv;
+    long long id;
+
+    if(node->inv_con != NULL && node->inv_con->err)
+    {
+        redisFree(node->inv_con);
+        node->inv_con = NULL;
+        node->inv_id = -1;
+    }
+
+    if(node->inv_con == NULL)
+    {
+        if(cc->connect_timeout)
         {
-            continue;
+            inv = redisConnectWithTimeout(node->host, node->port, *cc->connect_timeout);
         }
-        
-        it = listGetIterator(slaves, AL_START_HEAD);
-        while((ln = listNext(it)) != NULL)
+        else
         {
-            slave = listNodeValue(ln);
-            printf("%s\t%s\t%d\t%s\n",slave->name, slave->addr, 
-                slave->role, slave->slaves?"hava":"null");
+            inv = redisConnect(node->host, node->port);
         }
 
-        listReleaseIterator(it);
+        cluster_ssl_initiate(cc, inv);
 
-        printf("\n");
-    }
-}
+        if(inv == NULL || inv->err)
+        {
+            redisFree(inv);
+            return REDIS_ERR;
+        }
 
+        if (cc->timeout)
+        {
+            redisSetTimeout(inv, *cc->timeout);
+        }
+        redisClusterAuth(cc, inv);
 
-int test_cluster_update_route(redisClusterContext *cc)
-{
-    int ret;
-    
-    ret = cluster_update_route(cc);
+        id = redisCacheListen(inv);
+        if(id < 0)
+        {
+            redisFree(inv);
+            return REDIS_ERR;
+        }
 
-    //print_cluster_node_list(cc);
-    
-    return ret;
-}
+        node->inv_con = inv;
+        node->inv_id = id;
+    }
 
-redisClusterContext *redisClusterContextInit(void) {
-    redisClusterContext *cc;
+    if(redisCacheTrack(cc->cache, c, node->inv_id) != REDIS_OK)
+    {
+        /* Not asked again on this connection (servers before 6). */
+        if(c->err == 0)
+        {
+            node->tracking = -1;
+        }
+        return REDIS_ERR;
+    }
 
-    cc = calloc(1,sizeof(redisClusterContext));
-    if (cc == NULL)
-        return NULL;
+    node->tracking = 1;
 
-    cc->err = 0;
-    cc->errstr[0] = '\0';
-    cc->ip = NULL;
-    cc->port = 0;
-    cc->flags = 0;
-    cc->connect_timeout = NULL;
-    cc->timeout = NULL;
-    cc->nodes = NULL;
-    cc->slots = NULL;
-    cc->max_redirect_count = CLUSTER_DEFAULT_MAX_REDIRECT_COUNT;
-    cc->retry_count = 0;
-    cc->requests = NULL;
-    cc->need_update_route = 0;
-    cc->update_route_time = 0LL;
+    return REDIS_OK;
+}
 
-    cc->route_version = 0LL;
+/* Look command up in the cache, before it is sent to node through c.
+ * Returns whether its reply may be cached. */
+static int cluster_cache_get(redisClusterContext *cc, cluster_node *node,
+    redisContext *c, struct cmd *command, void **reply)
+{
+    *reply = NULL;
 
-    memset(cc->table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
+    if(node->tracking < 0 || 
+        (node->tracking == 0 && cluster_cache_track(cc, node, c) != REDIS_OK))
+    {
+        return 0;
+    }
 
-    cc->flags |= REDIS_BLOCK;
+    /* The invalidations of the keys of node only come from node. */
+    if(redisCachePoll(cc->cache, node->inv_con) != REDIS_OK)
+    {
+        redisFree(node->inv_con);
+        node->inv_con = NULL;
+        node->inv_id = -1;
+        node->tracking = 0;
+        return 0;
+    }
 
-    cc->password_len = 0;
-    cc->password = NULL;
-    
-    return cc;
+    *reply = redisCacheGet(cc->cache, command);
+
+    return 1;
 }
 
-void redisClusterFree(redisClusterContext *cc) {
-    
-    if (cc == NULL)
-        return;
+static void *redis_cluster_command_execute(redisClusterContext *cc, 
+    struct cmd *command)
+{
+    int ret;
+    void *reply = NULL;
+    cluster_node *node;
+    redisContext *c = NULL;
+    int error_type;
+    sds script;
+    int cached;
 
-    if(cc->ip)
+retry:
+    
+    node = node_get_by_table(cc, (uint32_t)command->slot_num);
+    if(node == NULL)
     {
-        sdsfree(cc->ip);
-        cc->ip = NULL;
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table error");
+        return NULL;
     }
 
-    if (cc->connect_timeout)
+    c = ctx_get_by_node(cc, node);
+    if(c == NULL)
     {
-        free(cc->connect_timeout);
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
+        return NULL;
     }
-
-    if (cc->timeout)
+    else if(c->err)
     {
-        free(cc->timeout);
-    }
+        node = node_get_witch_connected(cc);
+        if(node == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, "no reachable node in cluster");
+            return NULL;
+        }
 
-    memset(cc->table, 0, REDIS_CLUSTER_SLOTS*sizeof(cluster_node *));
+        cc->retry_count ++;
+        if(cc->retry_count > cc->max_redirect_count)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
+                "too many cluster redirect");
+            return NULL;
+        }
 
-    if(cc->slots != NULL)
-    {
-        cc->slots->nelem = 0;
-        hiarray_destroy(cc->slots);
-        cc->slots = NULL;
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
+            return NULL;
+        }
+        else if(c->err)
+        {
+            __redisClusterSetError(cc, c->err, c->errstr);
+            return NULL;
+        }
     }
 
-    if(cc->nodes != NULL)
+    cached = 0;
+    if(cc->cache != NULL && c == node->con)
     {
-        dictRelease(cc->nodes);
+        cached = cluster_cache_get(cc, node, c, command, &reply);
+        if(reply != NULL)
+        {
+            return reply;
+        }
     }
 
-    if(cc->requests != NULL)
-    {
-        listRelease(cc->requests);
-    }
+ask_retry:
 
-    if(cc->password)
+    if (__redisAppendCommand(c,command->cmd, command->clen) != REDIS_OK) 
     {
-        free(cc->password);
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
     }
     
-    free(cc);
-}
-
-/* Connect to a Redis cluster. On error the field error in the returned
- * context will be set to the return value of the error function.
- * When no set of reply functions is given, the default set will be used. */
-static int _redisClusterConnect2(redisClusterContext *cc)
-{
-
-    if (cc->nodes == NULL || dictSize(cc->nodes) == 0)
+    reply = __redisBlockForReply(c);
+    if(reply == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address does not set up");
-        return REDIS_ERR;
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
     }
-    
-    return cluster_update_route(cc);
-}
-
-/* Connect to a Redis cluster. On error the field error in the returned
- * context will be set to the return value of the error function.
- * When no set of reply functions is given, the default set will be used. */
-static redisClusterContext *_redisClusterConnect(redisClusterContext *cc, const char *addrs) {
 
-    int ret;
-    
-    ret = redisClusterSetOptionAddNodes(cc, addrs);
-    if (ret != REDIS_OK)
+    if(cluster_reply_is_noscript(reply) && 
+        (script = cluster_script_get(cc, command)) != NULL)
     {
-        return cc;
+        freeReplyObject(reply);
+        reply = cluster_script_retry(cc, c, command, script);
+        if(reply == NULL)
+        {
+            return NULL;
+        }
     }
-    
-    cluster_update_route(cc);
 
-    return cc;
-}
+    error_type = cluster_reply_error_type(reply);
+    if(error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
+    {
+        cc->retry_count ++;
+        if(cc->retry_count > cc->max_redirect_count)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
+                "too many cluster redirect");
+            freeReplyObject(reply);
+            return NULL;
+        }
+        
+        switch(error_type)
+        {
+        case CLUSTER_ERR_MOVED:
+            freeReplyObject(reply);
+            reply = NULL;
+            ret = cluster_update_route(cc);
+            if(ret != REDIS_OK)
+            {
+                __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                    "route update error, please recreate redisClusterContext!");
+                return NULL;
+            }
+            
+            goto retry;
+            
+            break;
+        case CLUSTER_ERR_ASK:
+            node = node_get_by_ask_error_reply(cc, reply);
+            if(node == NULL)
+            {
+                freeReplyObject(reply);
+                return NULL;
+            }
 
-redisClusterContext *redisClusterConnect(const char *addrs, int flags)
-{
-    redisClusterContext *cc;
+            freeReplyObject(reply);
+            reply = NULL;
 
-    cc = redisClusterContextInit();
+            c = ctx_get_by_node(cc, node);
+            if(c == NULL)
+            {
+                __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
+                return NULL;
+            }
+            else if(c->err)
+            {
+                __redisClusterSetError(cc, c->err, c->errstr);
+                return NULL;
+            }
 
-    if(cc == NULL)
-    {
-        return NULL;
+            reply = redisCommand(c, REDIS_COMMAND_ASKING);
+            if(reply == NULL)
+            {
+                __redisClusterSetError(cc, c->err, c->errstr);
+                return NULL;
+            }
+
+            freeReplyObject(reply);
+            reply = NULL;
+
+            /* The key is not tracked there. */
+            cached = 0;
+            
+            goto ask_retry;
+
+            break;
+        case CLUSTER_ERR_TRYAGAIN:
+        case CLUSTER_ERR_CROSSSLOT:
+        case CLUSTER_ERR_CLUSTERDOWN:
+            freeReplyObject(reply);
+            reply = NULL;
+            goto retry;
+            
+            break;
+        default:
+
+            break;
+        }
     }
 
-    cc->flags |= REDIS_BLOCK;
-    if(flags)
+    if(cached && c == node->con && 
+        ((redisReply *)reply)->type != REDIS_REPLY_ERROR)
     {
-        cc->flags |= flags;
+        redisCacheSet(cc->cache, command, reply);
     }
     
-    return _redisClusterConnect(cc, addrs);
+    return reply;
 }
 
-redisClusterContext *redisClusterConnectWithTimeout(
-    const char *addrs, const struct timeval tv, int flags)
+static int command_pre_fragment(redisClusterContext *cc, 
+    struct cmd *command, hilist *commands)
 {
-    redisClusterContext *cc;
-
-    cc = redisClusterContextInit();
+    
+    struct keypos *kp, *sub_kp;
+    uint32_t key_count;
+    uint32_t i, j;
+    uint32_t idx;
+    uint32_t key_len;
+    int slot_num = -1;
+    struct cmd *sub_command;
+    struct cmd **sub_commands = NULL;
+    char num_str[12];
+    uint8_t num_str_len;
+    
 
-    if(cc == NULL)
+    if(command == NULL || commands == NULL)
     {
-        return NULL;
+        goto done;
     }
 
-    cc->flags |= REDIS_BLOCK;
-    if(flags)
+    key_count = hiarray_n(command->keys);
+
+    sub_commands = hi_zalloc(REDIS_CLUSTER_SLOTS * sizeof(*sub_commands));
+    if (sub_commands == NULL) 
     {
-        cc->flags |= flags;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
     }
-    
-    if (cc->connect_timeout == NULL)
+
+    command->frag_seq = hi_alloc(key_count * sizeof(*command->frag_seq));
+    if(command->frag_seq == NULL)
     {
-        cc->connect_timeout = malloc(sizeof(struct timeval));
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto done;
     }
     
-    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
     
-    return _redisClusterConnect(cc, addrs);
-}
+    for(i = 0; i < key_count; i ++)
+    {
+        kp = hiarray_get(command->keys, i);
 
-redisClusterContext *redisClusterConnectNonBlock(const char *addrs, int flags) {
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
 
-    redisClusterContext *cc;
+        if(slot_num < 0 || slot_num >= REDIS_CLUSTER_SLOTS)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"keyHashSlot return error");
+            goto done;
+        }
 
-    cc = redisClusterContextInit();
+        if (sub_commands[slot_num] == NULL) {
+            sub_commands[slot_num] = command_get();
+            if (sub_commands[slot_num] == NULL) {
+                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                slot_num = -1;
+                goto done;
+            }
+        }
 
-    if(cc == NULL)
-    {
-        return NULL;
-    }
+        command->frag_seq[i] = sub_command = sub_commands[slot_num];
 
-    cc->flags &= ~REDIS_BLOCK;
-    if(flags)
-    {
-        cc->flags |= flags;
-    }
-    
-    return _redisClusterConnect(cc, addrs);
-}
+        sub_command->narg++;
 
-int redisClusterSetOptionAddNode(redisClusterContext *cc, const char *addr)
-{
-    dictEntry *node_entry;
-    cluster_node *node;
-    sds *ip_port = NULL;
-    int ip_port_count = 0;
-    sds ip;
-    int port;
-    sds addr_sds = NULL;
-    
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
-    }
+        sub_kp = hiarray_push(sub_command->keys);
+        if (sub_kp == NULL) {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            slot_num = -1;
+            goto done;
+        }
+        
+        sub_kp->start = kp->start;
+        sub_kp->end = kp->end;
+
+        key_len = (uint32_t)(kp->end - kp->start);
+
+        sub_command->clen += key_len + uint_len(key_len);
+
+        sub_command->slot_num = slot_num;
+
+        if (command->type == CMD_REQ_REDIS_MSET) {
+            uint32_t len = 0;
+            char *p;
+
+            for (p = sub_kp->end + 1; !isdigit(*p); p++){}
+            
+            p = sub_kp->end + 1;
+            while(!isdigit(*p))
+            {
+                p ++;
+            }
 
-    if(cc->nodes == NULL)
-    {
-        cc->nodes = dictCreate(&clusterNodesDictType, NULL);
-        if(cc->nodes == NULL)
-        {
-            return REDIS_ERR;
+            for (; isdigit(*p); p++) {              
+                len = len * 10 + (uint32_t)(*p - '0');
+            }
+            
+            len += CRLF_LEN * 2;
+            len += (p - sub_kp->end);
+            sub_kp->remain_len = len;
+            sub_command->clen += len;
         }
     }
 
-    addr_sds = sdsnew(addr);
-    node_entry = dictFind(cc->nodes, addr_sds);
-    sdsfree(addr_sds);
-    if(node_entry == NULL)
-    {
-        ip_port = sdssplitlen(addr, strlen(addr), 
-            IP_PORT_SEPARATOR, strlen(IP_PORT_SEPARATOR), &ip_port_count);
-        if(ip_port == NULL || ip_port_count != 2 || 
-            sdslen(ip_port[0]) <= 0 || sdslen(ip_port[1]) <= 0)
-        {
-            if(ip_port != NULL)
-            {
-                sdsfreesplitres(ip_port, ip_port_count);
-            }
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server address is error(correct is like: 127.0.0.1:1234)");
-            return REDIS_ERR;
+    for (i = 0; i < REDIS_CLUSTER_SLOTS; i++) {     /* prepend command header */
+        sub_command = sub_commands[i];
+        if (sub_command == NULL) {
+            continue;
         }
 
-        ip = ip_port[0];
-        port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
+        idx = 0;            
+        if (command->type == CMD_REQ_REDIS_MGET) {
+            //"*%d\r\n$4\r\nmget\r\n"
+            
+            sub_command->clen += 5*sub_command->narg;
 
-        if(port <= 0)
-        {
-            sdsfreesplitres(ip_port, ip_port_count);
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"server port is error");
-            return REDIS_ERR;
-        }
+            sub_command->narg ++;
 
-        sdsfree(ip_port[1]);
-        free(ip_port);
-        ip_port = NULL;
-    
-        node = hi_alloc(sizeof(cluster_node));
-        if(node == NULL)
-        {
-            sdsfree(ip);
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"alloc cluster node error");
-            return REDIS_ERR;
-        }
+            hi_itoa(num_str, sub_command->narg);
+            num_str_len = (uint8_t)(strlen(num_str));
 
-        cluster_node_init(node);
+            sub_command->clen += 13 + num_str_len;
 
-        node->addr = sdsnew(addr);
-        if(node->addr == NULL)
-        {
-            sdsfree(ip);
-            hi_free(node);
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"new node address error");
-            return REDIS_ERR;
-        }
+            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
+            if(sub_command->cmd == NULL)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                slot_num = -1;
+                goto done;
+            }
 
-        node->host = ip;
-        node->port = port;
+            sub_command->cmd[idx++] = '*';
+            memcpy(sub_command->cmd + idx, num_str, num_str_len);
+            idx += num_str_len;
+            memcpy(sub_command->cmd + idx, "\r\n$4\r\nmget\r\n", 12);
+            idx += 12;
+            
+            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
+            {
+                kp = hiarray_get(sub_command->keys, j);
+                key_len = (uint32_t)(kp->end - kp->start);
+                hi_itoa(num_str, key_len);
+                num_str_len = strlen(num_str);
 
-        dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), node);
-    }
-    
-    return REDIS_OK;
-}
+                sub_command->cmd[idx++] = '$';
+                memcpy(sub_command->cmd + idx, num_str, num_str_len);
+                idx += num_str_len;
+                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+                idx += CRLF_LEN;
+                memcpy(sub_command->cmd + idx, kp->start, key_len);
+                idx += key_len;
+                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+                idx += CRLF_LEN;
+            }
+        } else if (command->type == CMD_REQ_REDIS_DEL) {
+            //"*%d\r\n$3\r\ndel\r\n"
+            
+            sub_command->clen += 5*sub_command->narg;
 
-int redisClusterSetOptionAddNodes(redisClusterContext *cc, const char *addrs)
-{
-    int ret;
-    sds *address = NULL;
-    int address_count = 0;
-    int i;
+            sub_command->narg ++;
 
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
-    }
+            hi_itoa(num_str, sub_command->narg);
+            num_str_len = (uint8_t)strlen(num_str);
+            
+            sub_command->clen += 12 + num_str_len;
 
-    address = sdssplitlen(addrs, strlen(addrs), CLUSTER_ADDRESS_SEPARATOR, 
-        strlen(CLUSTER_ADDRESS_SEPARATOR), &address_count);
-    if(address == NULL || address_count <= 0)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"servers address is error(correct is like: 127.0.0.1:1234,127.0.0.2:5678)");
-        return REDIS_ERR;
-    }
+            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
+            if(sub_command->cmd == NULL)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                slot_num = -1;
+                goto done;
+            }
 
-    for(i = 0; i < address_count; i ++)
-    {
-        ret = redisClusterSetOptionAddNode(cc, address[i]);
-        if(ret != REDIS_OK)
-        {
-            sdsfreesplitres(address, address_count);
-            return REDIS_ERR;
-        }
-    }
+            sub_command->cmd[idx++] = '*';
+            memcpy(sub_command->cmd + idx, num_str, num_str_len);
+            idx += num_str_len;
+            memcpy(sub_command->cmd + idx, "\r\n$3\r\ndel\r\n", 11);
+            idx += 11;
 
-    sdsfreesplitres(address, address_count);
+            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
+            {
+                kp = hiarray_get(sub_command->keys, j);
+                key_len = (uint32_t)(kp->end - kp->start);
+                hi_itoa(num_str, key_len);
+                num_str_len = strlen(num_str);
 
-    return REDIS_OK;
-}
+                sub_command->cmd[idx++] = '$';
+                memcpy(sub_command->cmd + idx, num_str, num_str_len);
+                idx += num_str_len;
+                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+                idx += CRLF_LEN;
+                memcpy(sub_command->cmd + idx, kp->start, key_len);
+                idx += key_len;
+                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+                idx += CRLF_LEN;
+            }
+        } else if (command->type == CMD_REQ_REDIS_MSET) {
+            //"*%d\r\n$4\r\nmset\r\n"
+            
+            sub_command->clen += 3*sub_command->narg;
 
-int redisClusterSetOptionAuthPassword(redisClusterContext *cc, const char *password)
-{
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
-    }
+            sub_command->narg *= 2;
 
-    if(password == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"password is NULL");
-        return REDIS_ERR;
-    }
+            sub_command->narg ++;
 
-    cc->password_len = strlen(password);
-    cc->password = (sds) malloc (cc->password_len + 1);
-    memcpy(cc->password, password, cc->password_len);
-    cc->password[cc->password_len] = 0;
+            hi_itoa(num_str, sub_command->narg);
+            num_str_len = (uint8_t)strlen(num_str);
+        
+            sub_command->clen += 13 + num_str_len;
 
-    return REDIS_OK;
-}
+            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
+            if(sub_command->cmd == NULL)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+                slot_num = -1;
+                goto done;
+            }
 
-int redisClusterAuth(redisClusterContext *cc, redisContext *c)
-{
-    if(cc == NULL || c == NULL)
-    {
-        return REDIS_ERR;
-    }
-    if(cc->password == NULL)
-    {
-        return REDIS_OK;
-    }
-    // AUTH password
-    size_t cmd_len = 4 + 1 + cc->password_len + 1;
-    sds cmd = (sds) malloc (cmd_len);
-    snprintf(cmd, cmd_len, "%s %s", REDIS_COMMAND_AUTH, cc->password);
+            sub_command->cmd[idx++] = '*';
+            memcpy(sub_command->cmd + idx, num_str, num_str_len);
+            idx += num_str_len;
+            memcpy(sub_command->cmd + idx, "\r\n$4\r\nmset\r\n", 12);
+            idx += 12;
+            
+            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
+            {
+                kp = hiarray_get(sub_command->keys, j);
+                key_len = (uint32_t)(kp->end - kp->start);
+                hi_itoa(num_str, key_len);
+                num_str_len = strlen(num_str);
 
-    redisReply *reply = redisCommand(c, cmd);
-    free(cmd);
-    if(reply == NULL){
-        if (c->err == REDIS_ERR_TIMEOUT) {
-            __redisClusterSetError(cc,c->err,
-                                   "Command(Auth) reply error(socket timeout)");
+                sub_command->cmd[idx++] = '$';
+                memcpy(sub_command->cmd + idx, num_str, num_str_len);
+                idx += num_str_len;
+                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
+                idx += CRLF_LEN;
+                memcpy(sub_command->cmd + idx, kp->start, key_len + kp->remain_len);
+                idx += key_len + kp->remain_len;
+                
+            }
         } else {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                   "Command(Auth) reply error(NULL).");
-        }
-        goto error;
-    }else if(reply->type != REDIS_REPLY_STATUS){
-        if(reply->type == REDIS_REPLY_ERROR){
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                   reply->str);
-        }else{
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                                   "Command(Auth) reply error: type is not status.");
+            NOT_REACHED();
         }
 
-        goto error;
-    }
-    if (0 != strcmp(reply->str, REDIS_COMMAND_AUTH_OK))
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                               "Command(Auth) reply error: reply->str is not OK.");
-        goto error;
-    }
-    return REDIS_OK;
-    error:
-    if(reply != NULL){
-        freeReplyObject(reply);
-        reply = NULL;
+        //printf("len : %d\n", sub_command->clen);
+        //print_string_with_length_fix_CRLF(sub_command->cmd, sub_command->clen);
+        
+        sub_command->type = command->type;
+
+        listAddNodeTail(commands, sub_command);
     }
-    return REDIS_ERR;
-}
 
-int redisClusterSetOptionConnectBlock(redisClusterContext *cc)
-{
+done:
 
-    if(cc == NULL)
+    if(sub_commands != NULL)
     {
-        return REDIS_ERR;
+        hi_free(sub_commands);
     }
 
-    cc->flags |= REDIS_BLOCK;
-
-    return REDIS_OK;
-}
-
-int redisClusterSetOptionConnectNonBlock(redisClusterContext *cc)
-{
-
-    if(cc == NULL)
+    if(slot_num >= 0 && commands != NULL 
+        && listLength(commands) == 1)
     {
-        return REDIS_ERR;
-    }
+        listNode *list_node = listFirst(commands);
+        listDelNode(commands, list_node);
+        if(command->frag_seq)
+        {
+            hi_free(command->frag_seq);
+            command->frag_seq = NULL;
+        }
 
-    cc->flags &= ~REDIS_BLOCK;
+        command->slot_num = slot_num;
+    }
 
-    return REDIS_OK;
+    return slot_num;
 }
 
-int redisClusterSetOptionParseSlaves(redisClusterContext *cc)
-{
+/* MGET replies an array, a set would be merged the same way. */
+#define cluster_reply_is_array(r)   \
+    ((r)->type == REDIS_REPLY_ARRAY || (r)->type == REDIS_REPLY_SET)
 
-    if(cc == NULL)
+/* Merge the replies of the fragments of command. Their elements are kept
+ * as the nodes sent them, whatever the protocol: with RESP3, a missing key
+ * of MGET is a RESP3 null, which reads as REDIS_REPLY_NIL just the same. */
+static void *command_post_fragment(redisClusterContext *cc, 
+    struct cmd *command, hilist *commands)
+{
+    struct cmd *sub_command;
+    listNode *list_node;
+    listIter *list_iter;
+    redisReply *reply, *sub_reply;
+    long long count = 0;
+    
+    list_iter = listGetIterator(commands, AL_START_HEAD);
+    while((list_node = listNext(list_iter)) != NULL)
     {
-        return REDIS_ERR;
-    }
-
-    cc->flags |= HIRCLUSTER_FLAG_ADD_SLAVE;
-
-    return REDIS_OK;
-}
+        sub_command = list_node->value;
+        reply = sub_command->reply;
+        if(reply == NULL)
+        {
+            listReleaseIterator(list_iter);
+            return NULL;
+        }
+        else if(reply->type == REDIS_REPLY_ERROR)
+        {
+            listReleaseIterator(list_iter);
+            return reply;
+        }
 
-int redisClusterSetOptionParseOpenSlots(redisClusterContext *cc)
-{
+        if (command->type == CMD_REQ_REDIS_MGET) {
+            if(!cluster_reply_is_array(reply))
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be array)");
+                listReleaseIterator(list_iter);
+                return NULL;
+            }
+        }else if(command->type == CMD_REQ_REDIS_DEL){
+            if(reply->type != REDIS_REPLY_INTEGER)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be integer)");
+                listReleaseIterator(list_iter);
+                return NULL;
+            }
 
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
+            count += reply->integer;
+        }else if(command->type == CMD_REQ_REDIS_MSET){
+            if(reply->type != REDIS_REPLY_STATUS ||
+                reply->len != 2 || strcmp(reply->str, REDIS_STATUS_OK) != 0)
+            {
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be status and ok)");
+                listReleaseIterator(list_iter);
+                return NULL;
+            }
+        }else {
+            NOT_REACHED();
+        }
     }
 
-    cc->flags |= HIRCLUSTER_FLAG_ADD_OPENSLOT;
-
-    return REDIS_OK;
-}
+    listReleaseIterator(list_iter);
 
-int redisClusterSetOptionRouteUseSlots(redisClusterContext *cc)
-{
+    reply = hi_calloc(1,sizeof(*reply));
 
-    if(cc == NULL)
+    if (reply == NULL)
     {
-        return REDIS_ERR;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
     }
 
-    cc->flags |= HIRCLUSTER_FLAG_ROUTE_USE_SLOTS;
+    if (command->type == CMD_REQ_REDIS_MGET) {
+        int i;
+        uint32_t key_count;
 
-    return REDIS_OK;
-}
+        reply->type = REDIS_REPLY_ARRAY;
 
-int redisClusterSetOptionConnectTimeout(redisClusterContext *cc, const struct timeval tv)
-{
+        key_count = hiarray_n(command->keys);
 
-    if(cc == NULL)
-    {
-        return REDIS_ERR;
-    }
+        reply->elements = key_count;
+        reply->element = hi_calloc(key_count, sizeof(*reply));
+        if (reply->element == NULL) {
+            freeReplyObject(reply);
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return NULL;
+        }
+            
+        for (i = key_count - 1; i >= 0; i--) {      /* for each key */
+            sub_reply = command->frag_seq[i]->reply;            /* get it's reply */
+            if (sub_reply == NULL) {
+                freeReplyObject(reply);
+                __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply is null");
+                return NULL;
+            }
 
-    if (cc->connect_timeout == NULL)
-    {
-        cc->connect_timeout = malloc(sizeof(struct timeval));
+            if(sub_reply->type == REDIS_REPLY_STRING)
+            {
+                reply->element[i] = sub_reply;
+            }
+            else if(cluster_reply_is_array(sub_reply))
+            {
+                if(sub_reply->elements == 0)
+                {
+                    freeReplyObject(reply);
+                    __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply elements error");
+                    return NULL;
+                }
+                
+                reply->element[i] = sub_reply->element[sub_reply->elements - 1];
+                sub_reply->elements --;
+            }
+        }
+    }else if(command->type == CMD_REQ_REDIS_DEL){
+        reply->type = REDIS_REPLY_INTEGER;
+        reply->integer = count;
+    }else if(command->type == CMD_REQ_REDIS_MSET){
+        reply->type = REDIS_REPLY_STATUS;
+        uint32_t str_len = strlen(REDIS_STATUS_OK);
+        reply->str = hi_alloc((str_len + 1) * sizeof(char*));
+        if(reply->str == NULL)
+        {
+            freeReplyObject(reply);
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return NULL;
+        }
+
+        reply->len = str_len;
+        memcpy(reply->str, REDIS_STATUS_OK, str_len);
+        reply->str[str_len] = '\0';
+    }else {
+        NOT_REACHED();
     }
-    
-    memcpy(cc->connect_timeout, &tv, sizeof(struct timeval));
 
-    return REDIS_OK;
+    return reply;
 }
 
-int redisClusterSetOptionTimeout(redisClusterContext *cc, const struct timeval tv)
+/* 
+ * Split the command into subcommands by slot
+ * 
+ * Returns slot_num
+ * If slot_num < 0 or slot_num >=  REDIS_CLUSTER_SLOTS means this function runs error;
+ * Otherwise if  the commands > 1 , slot_num is the last subcommand slot number. 
+ */
+static int command_format_by_slot(redisClusterContext *cc, 
+    struct cmd *command, hilist *commands)
 {
+    struct keypos *kp;
+    int key_count;
+    int slot_num = -1;
 
-    if(cc == NULL)
+    if(cc == NULL || commands == NULL ||
+        command == NULL || 
+        command->cmd == NULL || command->clen <= 0)
     {
-        return REDIS_ERR;
+        goto done;
     }
 
-    if (cc->timeout == NULL)
+    
+    redis_parse_cmd(command);
+    if(command->result == CMD_PARSE_ENOMEM)
     {
-        cc->timeout = malloc(sizeof(struct timeval));
-        memcpy(cc->timeout, &tv, sizeof(struct timeval));
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "Parse command error: out of memory");
+        goto done;
     }
-    else if (cc->timeout->tv_sec != tv.tv_sec || cc->timeout->tv_usec != tv.tv_usec)
+    else if(command->result != CMD_PARSE_OK)
     {
-        memcpy(cc->timeout, &tv, sizeof(struct timeval));
-
-        if (cc->nodes && dictSize(cc->nodes) > 0)
-        {
-            dictEntry *de;
-            dictIterator *di;
-            cluster_node *node;
-
-            di = dictGetIterator(cc->nodes);
-
-            while ((de=dictNext(di)))
-            {
-                node = dictGetEntryVal(de);
-                if (node->con && node->con->flags&REDIS_CONNECTED && node->con->err == 0)
-                {
-                    redisSetTimeout(node->con, tv);
-                }
-
-                if (node->slaves && listLength(node->slaves) > 0)
-                {
-                    cluster_node *slave;
-                    listIter *li;
-                    listNode *ln;
-                    
-                    li = listGetIterator(node->slaves, AL_START_HEAD);
-                    while ((ln = listNext(li)))
-                    {
-                        slave = listNodeValue(ln);
-                        if (slave->con && slave->con->flags&REDIS_CONNECTED && slave->con->err == 0)
-                        {
-                            redisSetTimeout(slave->con, tv);
-                        }
-                    }
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, command->errstr);
+        goto done;
+    }
 
-                    listReleaseIterator(li);
-                }
-            }
+    key_count = hiarray_n(command->keys);
 
-            dictReleaseIterator(di);
-        }
+    if(key_count <= 0)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "No keys in command(must have keys for redis cluster mode)");
+        goto done;
+    }
+    else if(key_count == 1)
+    {
+        kp = hiarray_get(command->keys, 0);
+        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+        command->slot_num = slot_num;
+
+        goto done;
     }
+
+    slot_num = command_pre_fragment(cc, command, commands);
+
+done:
     
-    return REDIS_OK;
+    return slot_num;
 }
 
-int redisClusterSetOptionMaxRedirect(redisClusterContext *cc, int max_redirect_count)
+
+void redisClusterSetMaxRedirect(redisClusterContext *cc, int max_redirect_count)
 {
     if(cc == NULL || max_redirect_count <= 0)
     {
-        return REDIS_ERR;
+        return;
     }
 
     cc->max_redirect_count = max_redirect_count;
-
-    return REDIS_OK;
 }
 
-int redisClusterConnect2(redisClusterContext *cc)
-{
-    
+void *redisClusterFormattedCommand(redisClusterContext *cc, char *cmd, int len) {
+    redisReply *reply = NULL;
+    int slot_num;
+    struct cmd *command = NULL, *sub_command;
+    hilist *commands = NULL;
+    listNode *list_node;
+    listIter *list_iter = NULL;
+
     if(cc == NULL)
     {
-        return REDIS_ERR;
+        return NULL;
     }
-    
-    return _redisClusterConnect2(cc);
-}
 
-redisContext *ctx_get_by_node(redisClusterContext *cc, cluster_node *node)
-{
-    redisContext *c = NULL;
-    if(node == NULL)
+    if(cc->err)
+    {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
+    }  
+
+    cluster_topology_check(cc);
+    
+    command = command_get();
+    if(command == NULL)
     {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
         return NULL;
     }
+    
+    command->cmd = cmd;
+    command->clen = len;
 
-    c = node->con;
-    if(c != NULL)
+    commands = listCreate();
+    if(commands == NULL)
     {
-        if(c->err)
-        {
-            redisReconnect(c);
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
+    }
 
-            if (c != NULL && c->err == 0) {
-                if (cc->timeout)
-                {
-                    redisSetTimeout(c, *cc->timeout);
-                }
-                redisClusterAuth(cc, c);
-            }
-        }
+    commands->free = listCommandFree;
 
-        return c;
-    }
+    slot_num = command_format_by_slot(cc, command, commands);
 
-    if(node->host == NULL || node->port <= 0)
+    if(slot_num < 0)
     {
-        return NULL;
+        goto error;
     }
-
-    if(cc->connect_timeout)
+    else if(slot_num >= REDIS_CLUSTER_SLOTS)
     {
-        c = redisConnectWithTimeout(node->host, node->port, *cc->connect_timeout);
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
+        goto error;
     }
-    else
+
+    //all keys belong to one slot
+    if(listLength(commands) == 0)
     {
-        c = redisConnect(node->host, node->port);
+        reply = redis_cluster_command_execute(cc, command);
+        goto done;
     }
 
-    if (c != NULL && c->err == 0)
+    ASSERT(listLength(commands) != 1);
+
+    list_iter = listGetIterator(commands, AL_START_HEAD);
+    while((list_node = listNext(list_iter)) != NULL)
     {
-        if (cc->timeout)
+        sub_command = list_node->value;
+        
+        reply = redis_cluster_command_execute(cc, sub_command);
+        if(reply == NULL)
+        {
+            goto error;
+        }
+        else if(reply->type == REDIS_REPLY_ERROR)
         {
-            redisSetTimeout(c, *cc->timeout);
+            goto done;
         }
-        redisClusterAuth(cc, c);
+
+        sub_command->reply = reply;
     }
 
-    node->con = c;
+    reply = command_post_fragment(cc, command, commands);
+    
+done:
 
-    return c;
-}
+    command->cmd = NULL;
+    command_destroy(command);
 
-static cluster_node *node_get_by_slot(redisClusterContext *cc, uint32_t slot_num)
-{
-    struct hiarray *slots;
-    uint32_t slot_count;
-    cluster_slot **slot;
-    uint32_t middle, start, end;
-    uint8_t stop = 0;
+    if(commands != NULL)
+    {
+        listRelease(commands);
+    }
+
+    if(list_iter != NULL)
+    {
+        listReleaseIterator(list_iter);
+    }
+
+    cc->retry_count = 0;
     
-    if(cc == NULL)
+    return reply;
+
+error:
+
+    if(command != NULL)
     {
-        return NULL;
+        command->cmd = NULL;
+        command_destroy(command);
     }
 
-    if(slot_num >= REDIS_CLUSTER_SLOTS)
+    if(commands != NULL)
     {
-        return NULL;
+        listRelease(commands);
     }
 
-    slots = cc->slots;
-    if(slots == NULL)
+    if(list_iter != NULL)
+    {
+        listReleaseIterator(list_iter);
+    }
+
+    cc->retry_count = 0;
+    
+    return NULL;
+}
+
+void *redisClustervCommand(redisClusterContext *cc, const char *format, va_list ap) {
+    redisReply *reply;
+    char *cmd;
+    int len;
+
+    if(cc == NULL)
     {
         return NULL;
     }
-    slot_count = hiarray_n(slots);
 
-    start = 0;
-    end = slot_count - 1;
-    middle = 0;
+    len = redisvFormatCommand(&cmd,format,ap);
 
-    do{
-        if(start >= end)
-        {
-            stop = 1;
-            middle = end;
-        }
-        else
-        {
-            middle = start + (end - start)/2;
-        }
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    } else if (len == -2) {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
+        return NULL;
+    }   
 
-        ASSERT(middle < slot_count);
+    reply = redisClusterFormattedCommand(cc, cmd, len);
 
-        slot = hiarray_get(slots, middle);
-        if((*slot)->start > slot_num)
-        {
-            end = middle - 1;
-        }
-        else if((*slot)->end < slot_num)
-        {
-            start = middle + 1;
-        }
-        else
-        {
-            return (*slot)->node;
-        }
-            
-        
-    }while(!stop);
+    free(cmd);
 
-    printf("slot_num : %d\n", slot_num);
-    printf("slot_count : %d\n", slot_count);
-    printf("start : %d\n", start);
-    printf("end : %d\n", end);
-    printf("middle : %d\n", middle);
+    return reply;
+}
+
+void *redisClusterCommand(redisClusterContext *cc, const char *format, ...) {
+    va_list ap;
+    redisReply *reply = NULL;
+    
+    va_start(ap,format);
+    reply = redisClustervCommand(cc, format, ap);
+    va_end(ap);
+
+    return reply;
+}
+
+void *redisClusterCommandArgv(redisClusterContext *cc, int argc, const char **argv, const size_t *argvlen) {
+    redisReply *reply = NULL;
+    char *cmd;
+    int len;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+	
+    reply = redisClusterFormattedCommand(cc, cmd, len);
+
+    free(cmd);
+
+    return reply;
+}
+
+int redisClusterAppendFormattedCommand(redisClusterContext *cc, 
+    char *cmd, int len) {
+    int slot_num;
+    struct cmd *command = NULL, *sub_command;
+    hilist *commands = NULL;
+    listNode *list_node;
+    listIter *list_iter = NULL;
 
-    return NULL;
-}
+    cluster_topology_check(cc);
 
+    if(cc->requests == NULL)
+    {
+        cc->requests = listCreate();
+        if(cc->requests == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            goto error;
+        }
 
-static cluster_node *node_get_by_table(redisClusterContext *cc, uint32_t slot_num)
-{   
-    if(cc == NULL)
+        cc->requests->free = listCommandFree;
+    }
+    
+    command = command_get();
+    if(command == NULL)
     {
-        return NULL;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
     }
+    
+    command->cmd = cmd;
+    command->clen = len;
 
-    if(slot_num >= REDIS_CLUSTER_SLOTS)
+    commands = listCreate();
+    if(commands == NULL)
     {
-        return NULL;
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        goto error;
     }
 
-    return cc->table[slot_num];
-    
-}
+    commands->free = listCommandFree;
 
-static cluster_node *node_get_witch_connected(redisClusterContext *cc)
-{
-    dictIterator *di;
-    dictEntry *de;
-    struct cluster_node *node;
-    redisContext *c = NULL;
-    redisReply *reply = NULL;
+    slot_num = command_format_by_slot(cc, command, commands);
 
-    if(cc == NULL || cc->nodes == NULL)
+    if(slot_num < 0)
     {
-        return NULL;
+        goto error;
+    }
+    else if(slot_num >= REDIS_CLUSTER_SLOTS)
+    {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
+        goto error;
     }
 
-    di = dictGetIterator(cc->nodes);
-    while((de = dictNext(di)) != NULL)
+    //all keys belong to one slot
+    if(listLength(commands) == 0)
     {
-        node = dictGetEntryVal(de);
-        if(node == NULL)
+        if(__redisClusterAppendCommand(cc, command) == REDIS_OK)
         {
-            continue;
+            goto done;
         }
-        
-        c = ctx_get_by_node(cc, node);
-        if(c == NULL || c->err)
+        else
         {
-            continue;
+            goto error;
         }
+    }
 
-        reply = redisCommand(c, REDIS_COMMAND_PING);
-        if(reply != NULL && reply->type == REDIS_REPLY_STATUS &&
-            reply->str != NULL && strcmp(reply->str, "PONG") == 0)
-        {
-            freeReplyObject(reply);
-            reply = NULL;
-            
-            dictReleaseIterator(di);            
+    ASSERT(listLength(commands) != 1);
+
+    list_iter = listGetIterator(commands, AL_START_HEAD);
+    while((list_node = listNext(list_iter)) != NULL)
+    {
+        sub_command = list_node->value;
         
-            return node;
+        if(__redisClusterAppendCommand(cc, sub_command) == REDIS_OK)
+        {
+            continue;
         }
-        else if(reply != NULL)
+        else
         {
-            freeReplyObject(reply);
-            reply = NULL;
+            goto error;
         }
     }
 
-    dictReleaseIterator(di);
-
-    return NULL;
-}
-
-static int slot_get_by_command(redisClusterContext *cc, char *cmd, int len)
-{
-    struct cmd *command = NULL;
-    struct keypos *kp;
-    int key_count;
-    uint32_t i;
-    int slot_num = -1;
+done:
 
-    if(cc == NULL || cmd == NULL || len <= 0)
+    if(command->cmd != NULL)
     {
-        goto done;
+        command->cmd = NULL;
+    }
+    else
+    {
+        goto error;
     }
 
-    command = command_get();
-    if(command == NULL)
+    if(commands != NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto done;
+        if(listLength(commands) > 0)
+        {
+            command->sub_commands = commands;
+        }
+        else
+        {
+            listRelease(commands);
+        }
     }
-    
-    command->cmd = cmd;
-    command->clen = len;
-    redis_parse_cmd(command);
-    if(command->result != CMD_PARSE_OK)
+
+    if(list_iter != NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "parse command error");
-        goto done;
+        listReleaseIterator(list_iter);
     }
 
-    key_count = hiarray_n(command->keys);
+    listAddNodeTail(cc->requests, command);
+    
+    return REDIS_OK;
 
-    if(key_count <= 0)
+error:
+
+    if(command != NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "no keys in command(must have keys for redis cluster mode)");
-        goto done;
+        command->cmd = NULL;
+        command_destroy(command);
     }
-    else if(key_count == 1)
+
+    if(commands != NULL)
     {
-        kp = hiarray_get(command->keys, 0);
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+        listRelease(commands);
+    }
 
-        goto done;
+    if(list_iter != NULL)
+    {
+        listReleaseIterator(list_iter);
     }
+
+    /* Attention: mybe here we must pop the 
+      sub_commands that had append to the nodes.  
+      But now we do not handle it. */
     
-    for(i = 0; i < hiarray_n(command->keys); i ++)
-    {
-        kp = hiarray_get(command->keys, i);
+    return REDIS_ERR;
+}
 
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
-    }
 
-done:
+int redisClustervAppendCommand(redisClusterContext *cc, 
+    const char *format, va_list ap) {
+    int ret;
+    char *cmd;
+    int len;
     
-    if(command != NULL)
+    len = redisvFormatCommand(&cmd,format,ap);  
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    } else if (len == -2) {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
+        return REDIS_ERR;
+    }   
+
+    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
+
+    free(cmd);
+
+    return ret;
+}
+
+int redisClusterAppendCommand(redisClusterContext *cc, 
+    const char *format, ...) {
+
+    int ret;
+    va_list ap;
+
+    if(cc == NULL || format == NULL)
     {
-        command->cmd = NULL;
-        command_destroy(command);
+        return REDIS_ERR;
     }
     
-    return slot_num;
+    va_start(ap,format);
+    ret = redisClustervAppendCommand(cc, format, ap);
+    va_end(ap);
+
+    return ret;
 }
 
-/* Get the cluster config from one node.
-  * Return value: config_value string must free by usr.
-  */
-static char * cluster_config_get(redisClusterContext *cc, 
-    const char *config_name, int *config_value_len)
-{
-    redisContext *c;
-    cluster_node *node;
-    redisReply *reply = NULL, *sub_reply;
-    char *config_value = NULL;
+int redisClusterAppendCommandArgv(redisClusterContext *cc, 
+    int argc, const char **argv, const size_t *argvlen) {
+    int ret;
+    char *cmd;
+    int len;
 
-    if(cc == NULL || config_name == NULL
-        || config_value_len == NULL)
-    {
-        return NULL;
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
     }
     
-    node = node_get_witch_connected(cc);
-    if(node == NULL)
+    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
+    
+    free(cmd);
+
+    return ret;
+}
+
+static int redisCLusterSendAll(redisClusterContext *cc)
+{
+    dictIterator *di;
+    dictEntry *de;
+    struct cluster_node *node;
+    redisContext *c = NULL;
+    redisContext **cs = NULL;
+    size_t n = 0;
+    int wdone = 0;
+    int ret;
+    
+    if(cc == NULL || cc->nodes == NULL)
     {
-        __redisClusterSetError(cc, 
-            REDIS_ERR_OTHER, "no reachable node in cluster");
-        goto error;
+        return REDIS_ERR;
     }
 
-    c = ctx_get_by_node(cc, node);
-    
-    reply = redisCommand(c, "config get %s", config_name);
-    if(reply == NULL)
+    /* Gather the connections and flush them all in one submission. */
+    if(cc->uring != NULL)
     {
-        __redisClusterSetError(cc, 
-            REDIS_ERR_OTHER, "reply for config get is null");
-        goto error;
+        cs = malloc(dictSize(cc->nodes)*sizeof(*cs));
+        if(cs == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
     }
 
-    if(reply->type != REDIS_REPLY_ARRAY)
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get type is not array");
-        goto error;
+        node = dictGetEntryVal(de);
+        if(node == NULL)
+        {
+            continue;
+        }
+        
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL)
+        {
+            continue;
+        }
+
+        if(cs != NULL)
+        {
+            cs[n++] = c;
+            continue;
+        }
+
+        if (c->flags & REDIS_BLOCK) {
+            /* Write until done */
+            do {
+                if (redisBufferWrite(c,&wdone) == REDIS_ERR)
+                {
+                    dictReleaseIterator(di);
+                    return REDIS_ERR;
+                }
+            } while (!wdone);
+        }
     }
+    
+    dictReleaseIterator(di);
 
-    if(reply->elements != 2)
+    if(cs != NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get elements number is not 2");
-        goto error;
+        ret = redisUringFlush(cc->uring, cs, n);
+        free(cs);
+        return ret;
     }
 
-    sub_reply = reply->element[0];
-    if(sub_reply == NULL || sub_reply->type != REDIS_REPLY_STRING)
-    {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get config name is not string");
-        goto error;
+    return REDIS_OK;
+}
+
+static int redisCLusterClearAll(redisClusterContext *cc)
+{
+    dictIterator *di;
+    dictEntry *de;
+    struct cluster_node *node;
+    redisContext *c = NULL;
+    
+    if (cc == NULL) {
+        return REDIS_ERR;
     }
 
-    if(strcmp(sub_reply->str, config_name))
-    {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get config name is not we want");
-        goto error;
+    if (cc->err) {
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
     }
 
-    sub_reply = reply->element[1];
-    if(sub_reply == NULL || sub_reply->type != REDIS_REPLY_STRING)
-    {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply for config get config value type is not string");
-        goto error;
+    if (cc->nodes == NULL) {
+        return REDIS_ERR;
     }
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        if(node == NULL)
+        {
+            continue;
+        }
 
-    config_value = sub_reply->str;
-    *config_value_len = sub_reply->len;
-    sub_reply->str= NULL;
+        c = node->con;
+        if(c == NULL)
+        {
+            continue;
+        }
 
-    if(reply != NULL)
-    {
-        freeReplyObject(reply);    
+        redisFree(c);
+        node->con = NULL;
     }
+    
+    dictReleaseIterator(di);
+    
+    return REDIS_OK;
+}
 
-    return config_value;
+int redisClusterGetReply(redisClusterContext *cc, void **reply) {
 
-error:
+    struct cmd *command, *sub_command;
+    hilist *commands = NULL;
+    listNode *list_command, *list_sub_command;
+    listIter *list_iter = NULL;
+    int slot_num;
+    void *sub_reply;
 
-    if(reply != NULL)
-    {
-        freeReplyObject(reply);    
-    }
+    if(cc == NULL || reply == NULL)
+        return REDIS_ERR;
 
-    return NULL;
-}
+    cc->err = 0;
+    cc->errstr[0] = '\0';
 
-/* Helper function for the redisClusterAppendCommand* family of functions.
- *
- * Write a formatted command to the output buffer. When this family
- * is used, you need to call redisGetReply yourself to retrieve
- * the reply (or replies in pub/sub).
- */
-static int __redisClusterAppendCommand(redisClusterContext *cc, 
-    struct cmd *command) {
+    *reply = NULL;
 
-    cluster_node *node;
-    redisContext *c = NULL;
+    if (cc->requests == NULL)
+        return REDIS_ERR;
 
-    if(cc == NULL || command == NULL)
+    list_command = listFirst(cc->requests);
+
+    //no more reply
+    if(list_command == NULL)
     {
-        return REDIS_ERR;
+        *reply = NULL;
+        return REDIS_OK;
     }
     
-    node = node_get_by_table(cc, (uint32_t)command->slot_num);
-    if(node == NULL)
+    command = list_command->value;
+    if(command == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by slot error");
-        return REDIS_ERR;
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "command in the requests list is null");
+        goto error;
+    }
+    
+    slot_num = command->slot_num;
+    if(slot_num >= 0)
+    {
+        listDelNode(cc->requests, list_command);
+        return __redisClusterGetReply(cc, slot_num, reply);
     }
 
-    c = ctx_get_by_node(cc, node);
-    if(c == NULL)
+    commands = command->sub_commands;
+    if(commands == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
-        return REDIS_ERR;
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,
+            "sub_commands in command is null");
+        goto error;
     }
-    else if(c->err)
+
+    ASSERT(listLength(commands) != 1);
+
+    list_iter = listGetIterator(commands, AL_START_HEAD);
+    while((list_sub_command = listNext(list_iter)) != NULL)
     {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
+        sub_command = list_sub_command->value;
+        if(sub_command == NULL)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "sub_command is null");
+            goto error;
+        }
+        
+        slot_num = sub_command->slot_num;
+        if(slot_num < 0)
+        {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,
+                "sub_command slot_num is less then zero");
+            goto error;
+        }
+        
+        if(__redisClusterGetReply(cc, slot_num, &sub_reply) != REDIS_OK)
+        {
+            goto error;
+        }
+
+        sub_command->reply = sub_reply;
     }
 
-    if (__redisAppendCommand(c, command->cmd, command->clen) != REDIS_OK) 
+    listReleaseIterator(list_iter);
+    list_iter = NULL;
+
+    *reply = command_post_fragment(cc, command, commands);
+    if(*reply == NULL)
     {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
+        goto error;
     }
-    
+
+    listDelNode(cc->requests, list_command);
     return REDIS_OK;
-}
 
-/* Helper function for the redisClusterGetReply* family of functions.
- */
-static int __redisClusterGetReply(redisClusterContext *cc, int slot_num, void **reply)
-{
-    cluster_node *node;
-    redisContext *c;
+error:
 
-    if(cc == NULL || slot_num < 0 || reply == NULL)
+    if(list_iter != NULL)
     {
-        return REDIS_ERR;
+        listReleaseIterator(list_iter);
     }
 
-    node = node_get_by_table(cc, (uint32_t)slot_num);
-    if(node == NULL)
+    listDelNode(cc->requests, list_command);
+    return REDIS_ERR;
+}
+
+void redisClusterReset(redisClusterContext *cc)
+{
+    int status;
+    void *reply;
+    
+    if(cc == NULL || cc->nodes == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table is null");
-        return REDIS_ERR;
+        return;
     }
 
-    c = ctx_get_by_node(cc, node);
-    if(c == NULL)
+    if (cc->err) {
+        redisCLusterClearAll(cc);
+    } else {
+        redisCLusterSendAll(cc);
+        
+        do {
+            status = redisClusterGetReply(cc, &reply);
+            if (status == REDIS_OK) {
+                freeReplyObject(reply);
+            } else {
+                redisCLusterClearAll(cc);
+                break;
+            }
+        } while(reply != NULL);
+    }
+    
+    if(cc->requests)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return REDIS_ERR;
+        listRelease(cc->requests);
+        cc->requests = NULL;
     }
-    else if(c->err)
+
+    if(cc->need_update_route)
     {
-        if(cc->need_update_route == 0)
+        status = cluster_update_route(cc);
+        if(status != REDIS_OK)
         {
-            cc->retry_count ++;
-            if(cc->retry_count > cc->max_redirect_count)
-            {
-                cc->need_update_route = 1;
-                cc->retry_count = 0;
-            }
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "route update error, please recreate redisClusterContext!");
+            return;
         }
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
+        cc->need_update_route = 0;
     }
+}
 
-    if(redisGetReply(c, reply) != REDIS_OK)
-    {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return REDIS_ERR;
-    }
-    
-    if(cluster_reply_error_type(*reply) == CLUSTER_ERR_MOVED)
-    {
-        cc->need_update_route = 1;
-    }
+/*############redis cluster transactions############*/
 
-    return REDIS_OK;
+#define REDIS_PROTOCOL_MULTI "*1\r\n$5\r\nMULTI\r\n"
+#define REDIS_PROTOCOL_EXEC "*1\r\n$4\r\nEXEC\r\n"
+#define REDIS_PROTOCOL_UNWATCH "*1\r\n$7\r\nUNWATCH\r\n"
+
+struct redisClusterTransaction
+{
+    redisClusterContext *cc;
+    int slot_num;               /* -1 until the first key */
+    sds cmds;                   /* the queued commands, formatted */
+    int count;
+
+    /* WATCH pins the transaction to the connection it was sent on: the
+     * con of the node at watch_addr, while it keeps its generation. */
+    sds watch_addr;
+    uint64_t watch_generation;
+};
+
+static void cluster_transaction_reset(redisClusterTransaction *tx)
+{
+    sdsclear(tx->cmds);
+    tx->count = 0;
+    tx->slot_num = -1;
+    sdsfree(tx->watch_addr);
+    tx->watch_addr = NULL;
 }
 
-static cluster_node *node_get_by_ask_error_reply(
-    redisClusterContext *cc, redisReply *reply)
+/* The connection the keys are watched on, NULL once it has been closed,
+ * opened again or dropped with its node by a route update: the keys are
+ * no longer watched then. */
+static redisContext *cluster_transaction_watch_con(redisClusterTransaction *tx)
 {
-    sds *part = NULL, *ip_port = NULL;
-    int part_len = 0, ip_port_len;
+    redisClusterContext *cc = tx->cc;
+    cluster_node *node;
     dictEntry *de;
-    cluster_node *node = NULL;
 
-    if(cc == NULL || reply == NULL)
+    if(tx->watch_addr == NULL || cc->nodes == NULL)
     {
         return NULL;
     }
 
-    if(cluster_reply_error_type(reply) != CLUSTER_ERR_ASK)
+    de = dictFind(cc->nodes, tx->watch_addr);
+    if(de == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "reply is not ask error!");
         return NULL;
     }
-    
-    part = sdssplitlen(reply->str, reply->len, " ", 1, &part_len);
 
-    if(part != NULL && part_len == 3)
+    node = dictGetEntryVal(de);
+    if(node->con == NULL || node->con->err || 
+        node->con_generation != tx->watch_generation)
     {
-        ip_port = sdssplitlen(part[2], sdslen(part[2]), 
-            ":", 1, &ip_port_len);
-
-        if(ip_port != NULL && ip_port_len == 2)
-        {
-            de = dictFind(cc->nodes, part[2]);
-            if(de == NULL)
-            {
-                node = hi_alloc(sizeof(cluster_node));
-                if(node == NULL)
-                {
-                    __redisClusterSetError(cc, 
-                        REDIS_ERR_OOM, "Out of memory");
-
-                    goto done;
-                }
+        return NULL;
+    }
 
-                cluster_node_init(node);
-                node->addr = part[1];
-                node->host = ip_port[0];
-                node->port = hi_atoi(ip_port[1], sdslen(ip_port[1]));
-                node->role = REDIS_ROLE_MASTER;
+    return node->con;
+}
 
-                dictAdd(cc->nodes, sdsnewlen(node->addr, sdslen(node->addr)), node);
-                
-                part = NULL;
-                ip_port = NULL;
-            }
-            else
-            {
-                node = de->val;
+/* The slot of all the keys of a formatted command, -1 with cc->err set
+ * when it has none or more than one. */
+static int cluster_transaction_slot(redisClusterContext *cc, char *cmd, 
+    int len)
+{
+    struct cmd *command;
+    struct keypos *kp;
+    uint32_t i;
+    int slot_num = -1, slot;
 
-                goto done;
-            }
-        }
-        else
-        {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                "ask error reply address part parse error!");
+    command = command_get();
+    if(command == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+        return -1;
+    }
 
-            goto done;
-        }
+    command->cmd = cmd;
+    command->clen = len;
 
+    redis_parse_cmd(command);
+    if(command->result == CMD_PARSE_ENOMEM)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "Parse command error: out of memory");
+        goto done;
     }
-    else
+    else if(command->result != CMD_PARSE_OK)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-            "ask error reply parse error!");
-
+        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, command->errstr);
         goto done;
     }
 
-done:
-
-    if(part != NULL)
+    if(hiarray_n(command->keys) == 0)
     {
-        sdsfreesplitres(part, part_len);
-        part = NULL;
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "No keys in command(must have keys for redis cluster mode)");
+        goto done;
     }
 
-    if(ip_port != NULL)
+    for(i = 0; i < hiarray_n(command->keys); i ++)
     {
-        sdsfreesplitres(ip_port, ip_port_len);
-        ip_port = NULL;
+        kp = hiarray_get(command->keys, i);
+        slot = keyHashSlot(kp->start, kp->end - kp->start);
+        if(slot_num >= 0 && slot != slot_num)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "keys in a transaction must hash to the same slot");
+            slot_num = -1;
+            goto done;
+        }
+
+        slot_num = slot;
     }
-    
-    return node;
+
+done:
+
+    command->cmd = NULL;
+    command_destroy(command);
+
+    return slot_num;
 }
 
-static void *redis_cluster_command_execute(redisClusterContext *cc, 
-    struct cmd *command)
+redisClusterTransaction *redisClusterTransactionCreate(redisClusterContext *cc)
 {
-    int ret;
-    void *reply = NULL;
-    cluster_node *node;
-    redisContext *c = NULL;
-    int error_type;
+    redisClusterTransaction *tx;
 
-retry:
-    
-    node = node_get_by_table(cc, (uint32_t)command->slot_num);
-    if(node == NULL)
+    if(cc == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table error");
         return NULL;
     }
 
-    c = ctx_get_by_node(cc, node);
-    if(c == NULL)
+    tx = hi_alloc(sizeof(*tx));
+    if(tx == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
         return NULL;
     }
-    else if(c->err)
-    {
-        node = node_get_witch_connected(cc);
-        if(node == NULL)
-        {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, "no reachable node in cluster");
-            return NULL;
-        }
-
-        cc->retry_count ++;
-        if(cc->retry_count > cc->max_redirect_count)
-        {
-            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
-                "too many cluster redirect");
-            return NULL;
-        }
-
-        c = ctx_get_by_node(cc, node);
-        if(c == NULL)
-        {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
-            return NULL;
-        }
-        else if(c->err)
-        {
-            __redisClusterSetError(cc, c->err, c->errstr);
-            return NULL;
-        }
-    }
-
-ask_retry:
 
-    if (__redisAppendCommand(c,command->cmd, command->clen) != REDIS_OK) 
-    {
-        __redisClusterSetError(cc, c->err, c->errstr);
-        return NULL;
-    }
-    
-    reply = __redisBlockForReply(c);
-    if(reply == NULL)
+    tx->cc = cc;
+    tx->watch_addr = NULL;
+    tx->cmds = sdsempty();
+    if(tx->cmds == NULL)
     {
-        __redisClusterSetError(cc, c->err, c->errstr);
+        hi_free(tx);
         return NULL;
     }
 
-    error_type = cluster_reply_error_type(reply);
-    if(error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
-    {
-        cc->retry_count ++;
-        if(cc->retry_count > cc->max_redirect_count)
-        {
-            __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
-                "too many cluster redirect");
-            freeReplyObject(reply);
-            return NULL;
-        }
-        
-        switch(error_type)
-        {
-        case CLUSTER_ERR_MOVED:
-            freeReplyObject(reply);
-            reply = NULL;
-            ret = cluster_update_route(cc);
-            if(ret != REDIS_OK)
-            {
-                __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                    "route update error, please recreate redisClusterContext!");
-                return NULL;
-            }
-            
-            goto retry;
-            
-            break;
-        case CLUSTER_ERR_ASK:
-            node = node_get_by_ask_error_reply(cc, reply);
-            if(node == NULL)
-            {
-                freeReplyObject(reply);
-                return NULL;
-            }
+    cluster_transaction_reset(tx);
 
-            freeReplyObject(reply);
-            reply = NULL;
+    return tx;
+}
 
-            c = ctx_get_by_node(cc, node);
-            if(c == NULL)
-            {
-                __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node error");
-                return NULL;
-            }
-            else if(c->err)
-            {
-                __redisClusterSetError(cc, c->err, c->errstr);
-                return NULL;
-            }
+/* Drop the queued commands and the watched keys, if any. */
+void redisClusterTransactionDiscard(redisClusterTransaction *tx)
+{
+    redisContext *c;
+    redisReply *reply;
+
+    if(tx == NULL)
+    {
+        return;
+    }
 
-            reply = redisCommand(c, REDIS_COMMAND_ASKING);
-            if(reply == NULL)
+    c = cluster_transaction_watch_con(tx);
+    if(c != NULL)
+    {
+        if(__redisAppendCommand(c, REDIS_PROTOCOL_UNWATCH, 
+            strlen(REDIS_PROTOCOL_UNWATCH)) == REDIS_OK)
+        {
+            reply = __redisBlockForReply(c);
+            if(reply != NULL)
             {
-                __redisClusterSetError(cc, c->err, c->errstr);
-                return NULL;
+                freeReplyObject(reply);
             }
+        }
+    }
 
-            freeReplyObject(reply);
-            reply = NULL;
-            
-            goto ask_retry;
-
-            break;
-        case CLUSTER_ERR_TRYAGAIN:
-        case CLUSTER_ERR_CROSSSLOT:
-        case CLUSTER_ERR_CLUSTERDOWN:
-            freeReplyObject(reply);
-            reply = NULL;
-            goto retry;
-            
-            break;
-        default:
+    cluster_transaction_reset(tx);
+}
 
-            break;
-        }
+void redisClusterTransactionFree(redisClusterTransaction *tx)
+{
+    if(tx == NULL)
+    {
+        return;
     }
-    
-    return reply;
+
+    redisClusterTransactionDiscard(tx);
+
+    sdsfree(tx->cmds);
+    hi_free(tx);
 }
 
-static int command_pre_fragment(redisClusterContext *cc, 
-    struct cmd *command, hilist *commands)
+/* WATCH key at once, on the node serving its slot, which pins the
+ * transaction there: reads done with redisClusterCommand in between go
+ * over the same connection. Must come before the first queued command. A
+ * transaction with watched keys is not redirected: if its slot moves, or
+ * the connection is lost, Exec fails. */
+int redisClusterTransactionWatch(redisClusterTransaction *tx, 
+    const char *key, size_t len)
 {
-    
-    struct keypos *kp, *sub_kp;
-    uint32_t key_count;
-    uint32_t i, j;
-    uint32_t idx;
-    uint32_t key_len;
-    int slot_num = -1;
-    struct cmd *sub_command;
-    struct cmd **sub_commands = NULL;
-    char num_str[12];
-    uint8_t num_str_len;
-    
+    redisClusterContext *cc;
+    cluster_node *node = NULL;
+    redisContext *c;
+    redisReply *reply;
+    int slot_num, retry = 0;
 
-    if(command == NULL || commands == NULL)
+    if(tx == NULL || key == NULL)
     {
-        goto done;
+        return REDIS_ERR;
     }
 
-    key_count = hiarray_n(command->keys);
+    cc = tx->cc;
+    cc->err = 0;
+    cc->errstr[0] = '\0';
 
-    sub_commands = hi_zalloc(REDIS_CLUSTER_SLOTS * sizeof(*sub_commands));
-    if (sub_commands == NULL) 
+    if(tx->count > 0)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto done;
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "WATCH must come before the commands of the transaction");
+        return REDIS_ERR;
     }
 
-    command->frag_seq = hi_alloc(key_count * sizeof(*command->frag_seq));
-    if(command->frag_seq == NULL)
+    slot_num = keyHashSlot((char *)key, (int)len);
+    if(tx->slot_num >= 0 && slot_num != tx->slot_num)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto done;
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "keys in a transaction must hash to the same slot");
+        return REDIS_ERR;
     }
-    
-    
-    for(i = 0; i < key_count; i ++)
+
+    if(tx->watch_addr == NULL)
     {
-        kp = hiarray_get(command->keys, i);
+        cluster_topology_check(cc);
+    }
 
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
+again:
 
-        if(slot_num < 0 || slot_num >= REDIS_CLUSTER_SLOTS)
+    if(tx->watch_addr != NULL)
+    {
+        c = cluster_transaction_watch_con(tx);
+        if(c == NULL)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,"keyHashSlot return error");
-            goto done;
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "connection of the watched keys was lost");
+            return REDIS_ERR;
+        }
+    }
+    else
+    {
+        node = node_get_by_table(cc, (uint32_t)slot_num);
+        if(node == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table error");
+            return REDIS_ERR;
         }
 
-        if (sub_commands[slot_num] == NULL) {
-            sub_commands[slot_num] = command_get();
-            if (sub_commands[slot_num] == NULL) {
-                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
-            }
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
+            return REDIS_ERR;
         }
+    }
 
-        command->frag_seq[i] = sub_command = sub_commands[slot_num];
+    if(c->err)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
 
-        sub_command->narg++;
+    reply = redisCommand(c, "WATCH %b", key, len);
+    if(reply == NULL)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return REDIS_ERR;
+    }
 
-        sub_kp = hiarray_push(sub_command->keys);
-        if (sub_kp == NULL) {
-            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-            slot_num = -1;
-            goto done;
+    /* Only the first key may follow its slot to another node. */
+    if(cluster_reply_error_type(reply) == CLUSTER_ERR_MOVED && 
+        tx->watch_addr == NULL && retry ++ < cc->max_redirect_count)
+    {
+        freeReplyObject(reply);
+        if(cluster_update_route(cc) != REDIS_OK)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "route update error, please recreate redisClusterContext!");
+            return REDIS_ERR;
         }
-        
-        sub_kp->start = kp->start;
-        sub_kp->end = kp->end;
 
-        key_len = (uint32_t)(kp->end - kp->start);
+        goto again;
+    }
 
-        sub_command->clen += key_len + uint_len(key_len);
+    if(reply->type == REDIS_REPLY_ERROR)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, reply->str);
+        freeReplyObject(reply);
+        return REDIS_ERR;
+    }
 
-        sub_command->slot_num = slot_num;
+    freeReplyObject(reply);
 
-        if (command->type == CMD_REQ_REDIS_MSET) {
-            uint32_t len = 0;
-            char *p;
+    if(tx->watch_addr == NULL)
+    {
+        tx->watch_addr = sdsnewlen(node->addr, sdslen(node->addr));
+        if(tx->watch_addr == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+            return REDIS_ERR;
+        }
 
-            for (p = sub_kp->end + 1; !isdigit(*p); p++){}
-            
-            p = sub_kp->end + 1;
-            while(!isdigit(*p))
-            {
-                p ++;
-            }
+        tx->watch_generation = node->con_generation;
+    }
+    tx->slot_num = slot_num;
 
-            for (; isdigit(*p); p++) {              
-                len = len * 10 + (uint32_t)(*p - '0');
-            }
-            
-            len += CRLF_LEN * 2;
-            len += (p - sub_kp->end);
-            sub_kp->remain_len = len;
-            sub_command->clen += len;
-        }
+    return REDIS_OK;
+}
+
+/* Queue a command, checking that its keys hash to the slot of the
+ * transaction. Nothing is sent before Exec. */
+int redisClusterTransactionAppendFormattedCommand(redisClusterTransaction *tx, 
+    char *cmd, int len)
+{
+    redisClusterContext *cc;
+    int slot_num;
+
+    if(tx == NULL || cmd == NULL || len <= 0)
+    {
+        return REDIS_ERR;
     }
 
-    for (i = 0; i < REDIS_CLUSTER_SLOTS; i++) {     /* prepend command header */
-        sub_command = sub_commands[i];
-        if (sub_command == NULL) {
-            continue;
-        }
+    cc = tx->cc;
+    cc->err = 0;
+    cc->errstr[0] = '\0';
 
-        idx = 0;            
-        if (command->type == CMD_REQ_REDIS_MGET) {
-            //"*%d\r\n$4\r\nmget\r\n"
-            
-            sub_command->clen += 5*sub_command->narg;
+    slot_num = cluster_transaction_slot(cc, cmd, len);
+    if(slot_num < 0)
+    {
+        return REDIS_ERR;
+    }
 
-            sub_command->narg ++;
+    if(tx->slot_num >= 0 && slot_num != tx->slot_num)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+            "keys in a transaction must hash to the same slot");
+        return REDIS_ERR;
+    }
 
-            hi_itoa(num_str, sub_command->narg);
-            num_str_len = (uint8_t)(strlen(num_str));
+    tx->cmds = sdscatlen(tx->cmds, cmd, len);
+    if(tx->cmds == NULL)
+    {
+        __redisClusterSetError(cc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
 
-            sub_command->clen += 13 + num_str_len;
+    tx->slot_num = slot_num;
+    tx->count ++;
 
-            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
-            if(sub_command->cmd == NULL)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
-            }
+    return REDIS_OK;
+}
 
-            sub_command->cmd[idx++] = '*';
-            memcpy(sub_command->cmd + idx, num_str, num_str_len);
-            idx += num_str_len;
-            memcpy(sub_command->cmd + idx, "\r\n$4\r\nmget\r\n", 12);
-            idx += 12;
-            
-            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
-            {
-                kp = hiarray_get(sub_command->keys, j);
-                key_len = (uint32_t)(kp->end - kp->start);
-                hi_itoa(num_str, key_len);
-                num_str_len = strlen(num_str);
+int redisClusterTransactionvAppendCommand(redisClusterTransaction *tx, 
+    const char *format, va_list ap)
+{
+    char *cmd = NULL;
+    int len;
+    int status;
 
-                sub_command->cmd[idx++] = '$';
-                memcpy(sub_command->cmd + idx, num_str, num_str_len);
-                idx += num_str_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-                memcpy(sub_command->cmd + idx, kp->start, key_len);
-                idx += key_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-            }
-        } else if (command->type == CMD_REQ_REDIS_DEL) {
-            //"*%d\r\n$3\r\ndel\r\n"
-            
-            sub_command->clen += 5*sub_command->narg;
+    len = redisvFormatCommand(&cmd, format, ap);
+    if(len == -1)
+    {
+        if(tx != NULL)
+        {
+            __redisClusterSetError(tx->cc, REDIS_ERR_OOM, "Out of memory");
+        }
+        return REDIS_ERR;
+    }
+    else if(len == -2)
+    {
+        if(tx != NULL)
+        {
+            __redisClusterSetError(tx->cc, REDIS_ERR_OTHER, "Invalid format string");
+        }
+        return REDIS_ERR;
+    }
+
+    status = redisClusterTransactionAppendFormattedCommand(tx, cmd, len);
+
+    free(cmd);
+
+    return status;
+}
+
+int redisClusterTransactionAppendCommand(redisClusterTransaction *tx, 
+    const char *format, ...)
+{
+    va_list ap;
+    int status;
 
-            sub_command->narg ++;
+    va_start(ap, format);
+    status = redisClusterTransactionvAppendCommand(tx, format, ap);
+    va_end(ap);
 
-            hi_itoa(num_str, sub_command->narg);
-            num_str_len = (uint8_t)strlen(num_str);
-            
-            sub_command->clen += 12 + num_str_len;
+    return status;
+}
 
-            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
-            if(sub_command->cmd == NULL)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
-            }
+int redisClusterTransactionAppendCommandArgv(redisClusterTransaction *tx, 
+    int argc, const char **argv, const size_t *argvlen)
+{
+    char *cmd = NULL;
+    int len;
+    int status;
 
-            sub_command->cmd[idx++] = '*';
-            memcpy(sub_command->cmd + idx, num_str, num_str_len);
-            idx += num_str_len;
-            memcpy(sub_command->cmd + idx, "\r\n$3\r\ndel\r\n", 11);
-            idx += 11;
+    len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+    if(len == -1)
+    {
+        if(tx != NULL)
+        {
+            __redisClusterSetError(tx->cc, REDIS_ERR_OOM, "Out of memory");
+        }
+        return REDIS_ERR;
+    }
 
-            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
-            {
-                kp = hiarray_get(sub_command->keys, j);
-                key_len = (uint32_t)(kp->end - kp->start);
-                hi_itoa(num_str, key_len);
-                num_str_len = strlen(num_str);
+    status = redisClusterTransactionAppendFormattedCommand(tx, cmd, len);
 
-                sub_command->cmd[idx++] = '$';
-                memcpy(sub_command->cmd + idx, num_str, num_str_len);
-                idx += num_str_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-                memcpy(sub_command->cmd + idx, kp->start, key_len);
-                idx += key_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-            }
-        } else if (command->type == CMD_REQ_REDIS_MSET) {
-            //"*%d\r\n$4\r\nmset\r\n"
-            
-            sub_command->clen += 3*sub_command->narg;
+    free(cmd);
 
-            sub_command->narg *= 2;
+    return status;
+}
 
-            sub_command->narg ++;
+/* Send [ASKING] MULTI, the queued commands and EXEC in one write, then
+ * read all their replies. *redirect is set to the first redirection a
+ * queued command got, which makes the server abort the transaction. */
+static redisReply *cluster_transaction_send(redisClusterTransaction *tx, 
+    redisContext *c, int asking, redisReply **redirect)
+{
+    redisClusterContext *cc = tx->cc;
+    redisReply *reply = NULL;
+    int i, n, error_type;
 
-            hi_itoa(num_str, sub_command->narg);
-            num_str_len = (uint8_t)strlen(num_str);
-        
-            sub_command->clen += 13 + num_str_len;
+    *redirect = NULL;
 
-            sub_command->cmd = hi_zalloc(sub_command->clen * sizeof(*sub_command->cmd));
-            if(sub_command->cmd == NULL)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-                slot_num = -1;
-                goto done;
-            }
+    if((asking && __redisAppendCommand(c, REDIS_PROTOCOL_ASKING, 
+            strlen(REDIS_PROTOCOL_ASKING)) != REDIS_OK) ||
+        __redisAppendCommand(c, REDIS_PROTOCOL_MULTI, 
+            strlen(REDIS_PROTOCOL_MULTI)) != REDIS_OK ||
+        __redisAppendCommand(c, tx->cmds, sdslen(tx->cmds)) != REDIS_OK ||
+        __redisAppendCommand(c, REDIS_PROTOCOL_EXEC, 
+            strlen(REDIS_PROTOCOL_EXEC)) != REDIS_OK)
+    {
+        __redisClusterSetError(cc, c->err, c->errstr);
+        return NULL;
+    }
 
-            sub_command->cmd[idx++] = '*';
-            memcpy(sub_command->cmd + idx, num_str, num_str_len);
-            idx += num_str_len;
-            memcpy(sub_command->cmd + idx, "\r\n$4\r\nmset\r\n", 12);
-            idx += 12;
-            
-            for(j = 0; j < hiarray_n(sub_command->keys); j ++)
-            {
-                kp = hiarray_get(sub_command->keys, j);
-                key_len = (uint32_t)(kp->end - kp->start);
-                hi_itoa(num_str, key_len);
-                num_str_len = strlen(num_str);
+    /* ASKING, MULTI and the queued commands, then EXEC. */
+    n = (asking ? 1 : 0) + 1 + tx->count;
+    for(i = 0; i <= n; i ++)
+    {
+        reply = __redisBlockForReply(c);
+        if(reply == NULL)
+        {
+            __redisClusterSetError(cc, c->err, c->errstr);
+            break;
+        }
 
-                sub_command->cmd[idx++] = '$';
-                memcpy(sub_command->cmd + idx, num_str, num_str_len);
-                idx += num_str_len;
-                memcpy(sub_command->cmd + idx, CRLF, CRLF_LEN);
-                idx += CRLF_LEN;
-                memcpy(sub_command->cmd + idx, kp->start, key_len + kp->remain_len);
-                idx += key_len + kp->remain_len;
-                
-            }
-        } else {
-            NOT_REACHED();
+        if(i == n)
+        {
+            break;
         }
 
-        //printf("len : %d\n", sub_command->clen);
-        //print_string_with_length_fix_CRLF(sub_command->cmd, sub_command->clen);
-        
-        sub_command->type = command->type;
+        error_type = cluster_reply_error_type(reply);
+        if(*redirect == NULL && 
+            error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
+        {
+            *redirect = reply;
+            continue;
+        }
 
-        listAddNodeTail(commands, sub_command);
+        freeReplyObject(reply);
+        reply = NULL;
     }
 
-done:
+    if(reply == NULL && *redirect != NULL)
+    {
+        freeReplyObject(*redirect);
+        *redirect = NULL;
+    }
 
-    if(sub_commands != NULL)
+    return reply;
+}
+
+/* Run the queued commands as one MULTI/EXEC on the node serving their slot,
+ * in a single round trip. Returns the reply of EXEC: an array with the
+ * reply of every command, a nil reply when a watched key changed, or the
+ * error that aborted the transaction. A redirection of the whole
+ * transaction (MOVED, ASK, TRYAGAIN...) sends it again, unless keys are
+ * watched. The transaction is empty afterwards, ready to be reused. */
+redisReply *redisClusterTransactionExec(redisClusterTransaction *tx)
+{
+    redisClusterContext *cc;
+    redisReply *reply = NULL, *redirect;
+    cluster_node *node = NULL;
+    redisContext *c;
+    int error_type, asking = 0, retry = 0;
+
+    if(tx == NULL)
     {
-        hi_free(sub_commands);
+        return NULL;
     }
 
-    if(slot_num >= 0 && commands != NULL 
-        && listLength(commands) == 1)
+    cc = tx->cc;
+    cc->err = 0;
+    cc->errstr[0] = '\0';
+
+    if(tx->slot_num < 0)
     {
-        listNode *list_node = listFirst(commands);
-        listDelNode(commands, list_node);
-        if(command->frag_seq)
+        __redisClusterSetError(cc, REDIS_ERR_OTHER, "transaction has no keys");
+        goto done;
+    }
+
+    if(tx->watch_addr == NULL)
+    {
+        cluster_topology_check(cc);
+    }
+
+again:
+
+    if(tx->watch_addr != NULL)
+    {
+        c = cluster_transaction_watch_con(tx);
+        if(c == NULL)
         {
-            hi_free(command->frag_seq);
-            command->frag_seq = NULL;
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "connection of the watched keys was lost");
+            goto done;
+        }
+    }
+    else
+    {
+        if(!asking)
+        {
+            node = node_get_by_table(cc, (uint32_t)tx->slot_num);
+            if(node == NULL)
+            {
+                __redisClusterSetError(cc, REDIS_ERR_OTHER, "node get by table error");
+                goto done;
+            }
         }
 
-        command->slot_num = slot_num;
+        c = ctx_get_by_node(cc, node);
+        if(c == NULL)
+        {
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, "ctx get by node is null");
+            goto done;
+        }
+        else if(c->err)
+        {
+            __redisClusterSetError(cc, c->err, c->errstr);
+            goto done;
+        }
     }
 
-    return slot_num;
-}
+    reply = cluster_transaction_send(tx, c, asking, &redirect);
+    if(reply == NULL || redirect == NULL)
+    {
+        goto done;
+    }
 
-static void *command_post_fragment(redisClusterContext *cc, 
-    struct cmd *command, hilist *commands)
-{
-    struct cmd *sub_command;
-    listNode *list_node;
-    listIter *list_iter;
-    redisReply *reply, *sub_reply;
-    long long count = 0;
-    
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_node = listNext(list_iter)) != NULL)
+    if(tx->watch_addr != NULL)
     {
-        sub_command = list_node->value;
-        reply = sub_command->reply;
-        if(reply == NULL)
+        freeReplyObject(redirect);
+        goto done;
+    }
+
+    if(++ retry > cc->max_redirect_count)
+    {
+        freeReplyObject(redirect);
+        freeReplyObject(reply);
+        reply = NULL;
+        __redisClusterSetError(cc, REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
+            "too many cluster redirect");
+        goto done;
+    }
+
+    freeReplyObject(reply);
+    reply = NULL;
+
+    asking = 0;
+    error_type = cluster_reply_error_type(redirect);
+    if(error_type == CLUSTER_ERR_MOVED)
+    {
+        if(cluster_update_route(cc) != REDIS_OK)
         {
-            return NULL;
+            freeReplyObject(redirect);
+            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
+                "route update error, please recreate redisClusterContext!");
+            goto done;
         }
-        else if(reply->type == REDIS_REPLY_ERROR)
+    }
+    else if(error_type == CLUSTER_ERR_ASK)
+    {
+        node = node_get_by_ask_error_reply(cc, redirect);
+        if(node == NULL)
         {
-            return reply;
+            freeReplyObject(redirect);
+            goto done;
         }
 
-        if (command->type == CMD_REQ_REDIS_MGET) {
-            if(reply->type != REDIS_REPLY_ARRAY)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be array)");
-                return NULL;
-            }
-        }else if(command->type == CMD_REQ_REDIS_DEL){
-            if(reply->type != REDIS_REPLY_INTEGER)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be integer)");
-                return NULL;
-            }
+        asking = 1;
+    }
 
-            count += reply->integer;
-        }else if(command->type == CMD_REQ_REDIS_MSET){
-            if(reply->type != REDIS_REPLY_STATUS ||
-                reply->len != 2 || strcmp(reply->str, REDIS_STATUS_OK) != 0)
-            {
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"reply type is error(here only can be status and ok)");
-                return NULL;
-            }
-        }else {
-            NOT_REACHED();
-        }
+    freeReplyObject(redirect);
+
+    goto again;
+
+done:
+
+    /* EXEC and DISCARD unwatch, and so does the lost connection. */
+    cluster_transaction_reset(tx);
+
+    return reply;
+}
+
+/*############redis cluster async############*/
+
+/* We want the error field to be accessible directly instead of requiring
+ * an indirection to the redisContext struct. */
+static void __redisClusterAsyncCopyError(redisClusterAsyncContext *acc) {
+    if (!acc)
+        return;
+
+    redisClusterContext *cc = acc->cc;
+    acc->err = cc->err;
+    memcpy(acc->errstr, cc->errstr, 128);
+}
+
+static void __redisClusterAsyncSetError(redisClusterAsyncContext *acc, 
+    int type, const char *str) {
+    
+    size_t len;
+
+    acc->err = type;
+    if (str != NULL) {
+        len = strlen(str);
+        len = len < (sizeof(acc->errstr)-1) ? len : (sizeof(acc->errstr)-1);
+        memcpy(acc->errstr,str,len);
+        acc->errstr[len] = '\0';
+    } else {
+        /* Only REDIS_ERR_IO may lack a description! */
+        assert(type == REDIS_ERR_IO);
+        strerror_r(errno, acc->errstr, sizeof(acc->errstr));
     }
+}
 
-    reply = hi_calloc(1,sizeof(*reply));
+static redisClusterAsyncContext *redisClusterAsyncInitialize(redisClusterContext *cc) {
+    redisClusterAsyncContext *acc;
 
-    if (reply == NULL)
+    if(cc == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
         return NULL;
     }
 
-    if (command->type == CMD_REQ_REDIS_MGET) {
-        int i;
-        uint32_t key_count;
+    acc = hi_alloc(sizeof(redisClusterAsyncContext));
+    if (acc == NULL)
+        return NULL;
 
-        reply->type = REDIS_REPLY_ARRAY;
+    acc->cc = cc;
 
-        key_count = hiarray_n(command->keys);
+    acc->err = 0;
+    acc->data = NULL;
+    acc->adapter = NULL;
+    acc->attach_fn = NULL;
 
-        reply->elements = key_count;
-        reply->element = hi_calloc(key_count, sizeof(*reply));
-        if (reply->element == NULL) {
-            freeReplyObject(reply);
-            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-            return NULL;
-        }
-            
-        for (i = key_count - 1; i >= 0; i--) {      /* for each key */
-            sub_reply = command->frag_seq[i]->reply;            /* get it's reply */
-            if (sub_reply == NULL) {
-                freeReplyObject(reply);
-                __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply is null");
-                return NULL;
-            }
+    acc->onConnect = NULL;
+    acc->onDisconnect = NULL;
 
-            if(sub_reply->type == REDIS_REPLY_STRING)
-            {
-                reply->element[i] = sub_reply;
-            }
-            else if(sub_reply->type == REDIS_REPLY_ARRAY)
-            {
-                if(sub_reply->elements == 0)
-                {
-                    freeReplyObject(reply);
-                    __redisClusterSetError(cc,REDIS_ERR_OTHER,"sub reply elements error");
-                    return NULL;
-                }
-                
-                reply->element[i] = sub_reply->element[sub_reply->elements - 1];
-                sub_reply->elements --;
-            }
-        }
-    }else if(command->type == CMD_REQ_REDIS_DEL){
-        reply->type = REDIS_REPLY_INTEGER;
-        reply->integer = count;
-    }else if(command->type == CMD_REQ_REDIS_MSET){
-        reply->type = REDIS_REPLY_STATUS;
-        uint32_t str_len = strlen(REDIS_STATUS_OK);
-        reply->str = hi_alloc((str_len + 1) * sizeof(char*));
-        if(reply->str == NULL)
-        {
-            freeReplyObject(reply);
-            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-            return NULL;
-        }
+    acc->corked = 0;
+    acc->batch_max_bytes = 0;
+    acc->batch_max_latency.tv_sec = 0;
+    acc->batch_max_latency.tv_usec = 0;
+
+    acc->pending = 0;
+    acc->low_pending = 0;
+    acc->high_pending = 0;
+    acc->paused = 0;
+    acc->onFlow = NULL;
+    memset(&acc->node_flow_limits, 0, sizeof(acc->node_flow_limits));
+
+    acc->command_timeout = 0;
+    acc->deadlines = NULL;
+    acc->timer_expire = 0;
+    acc->timer.data = NULL;
+    acc->timer.schedule = NULL;
+    acc->timer.cleanup = NULL;
+
+    acc->health_interval = 0;
+    acc->health_timeout = 0;
+    acc->health_refresh_time = 0;
+    acc->health_timer = NULL;
+    acc->route_updating = 0;
+
+    acc->subscriptions = NULL;
+    acc->sub_refresh = 0;
+    acc->sub_timer = NULL;
 
-        reply->len = str_len;
-        memcpy(reply->str, REDIS_STATUS_OK, str_len);
-        reply->str[str_len] = '\0';
-    }else {
-        NOT_REACHED();
+    return acc;
+}
+
+static cluster_async_data *cluster_async_data_get(void)
+{
+    cluster_async_data *cad;
+
+    cad = hi_alloc(sizeof(cluster_async_data));
+    if(cad == NULL)
+    {
+        return NULL;
     }
 
-    return reply;
+    cad->acc = NULL;
+    cad->command = NULL;
+    cad->callback = NULL;
+    cad->privdata = NULL;
+    cad->retry_count = 0;
+    cad->timed_out = 0;
+    cad->script_loaded = 0;
+    hiwheel_timer_init(&cad->deadline, NULL, cad);
+
+    return cad;
 }
 
-/* 
- * Split the command into subcommands by slot
- * 
- * Returns slot_num
- * If slot_num < 0 or slot_num >=  REDIS_CLUSTER_SLOTS means this function runs error;
- * Otherwise if  the commands > 1 , slot_num is the last subcommand slot number. 
- */
-static int command_format_by_slot(redisClusterContext *cc, 
-    struct cmd *command, hilist *commands)
+/* Update the paused state of the cluster context after its number of
+ * pending commands changed. */
+static void cluster_async_flow_check(redisClusterAsyncContext *acc)
 {
-    struct keypos *kp;
-    int key_count;
-    int slot_num = -1;
-
-    if(cc == NULL || commands == NULL ||
-        command == NULL || 
-        command->cmd == NULL || command->clen <= 0)
+    if(acc->high_pending == 0)
     {
-        goto done;
+        acc->paused = 0;
+        return;
     }
 
-    
-    redis_parse_cmd(command);
-    if(command->result == CMD_PARSE_ENOMEM)
+    if(!acc->paused && acc->pending >= acc->high_pending)
     {
-        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, "Parse command error: out of memory");
-        goto done;
+        acc->paused = 1;
+        if(acc->onFlow)
+        {
+            acc->onFlow(acc, 1);
+        }
     }
-    else if(command->result != CMD_PARSE_OK)
+    else if(acc->paused && acc->pending <= acc->low_pending)
     {
-        __redisClusterSetError(cc, REDIS_ERR_PROTOCOL, command->errstr);
-        goto done;
+        acc->paused = 0;
+        if(acc->onFlow)
+        {
+            acc->onFlow(acc, 0);
+        }
     }
+}
 
-    key_count = hiarray_n(command->keys);
-
-    if(key_count <= 0)
+static void cluster_async_data_free(cluster_async_data *cad)
+{
+    if(cad == NULL)
     {
-        __redisClusterSetError(cc, REDIS_ERR_OTHER, "No keys in command(must have keys for redis cluster mode)");
-        goto done;
+        return;
     }
-    else if(key_count == 1)
+
+    /* cad->acc is only set once the command was queued. */
+    if(cad->acc != NULL)
     {
-        kp = hiarray_get(command->keys, 0);
-        slot_num = keyHashSlot(kp->start, kp->end - kp->start);
-        command->slot_num = slot_num;
+        if(hiwheel_timer_pending(&cad->deadline))
+        {
+            hiwheel_del(cad->acc->deadlines, &cad->deadline);
+        }
 
-        goto done;
+        if(!cad->timed_out)
+        {
+            cad->acc->pending --;
+            cluster_async_flow_check(cad->acc);
+        }
     }
 
-    slot_num = command_pre_fragment(cc, command, commands);
-
-done:
+    if(cad->command != NULL)
+    {
+        command_destroy(cad->command);
+    }
     
-    return slot_num;
+    hi_free(cad);
+    cad = NULL;
 }
 
-
-void redisClusterSetMaxRedirect(redisClusterContext *cc, int max_redirect_count)
+/* Authenticate a new node connection and set its protocol, ahead of its
+ * first command. AUTH goes on its own, before HELLO 3, so that it holds
+ * whether the server speaks RESP3 or not: falling back to it once HELLO is
+ * refused would come too late for the commands sent behind. A server
+ * without RESP3 is spoken RESP2 to. The replies are not waited for, a
+ * failure shows in the replies of the commands (NOAUTH...), and acc->err
+ * is left to them. */
+static void cluster_async_handshake(redisClusterAsyncContext *acc, 
+    redisAsyncContext *ac)
 {
-    if(cc == NULL || max_redirect_count <= 0)
+    redisClusterContext *cc = acc->cc;
+
+    if(cc->password != NULL)
     {
-        return;
+        redisAsyncCommand(ac, NULL, NULL, "%s %b", REDIS_COMMAND_AUTH, 
+            cc->password, cc->password_len);
     }
 
-    cc->max_redirect_count = max_redirect_count;
+    if(cc->flags & HIRCLUSTER_FLAG_RESP3)
+    {
+        redisAsyncCommand(ac, NULL, NULL, "%s 3", REDIS_COMMAND_HELLO);
+    }
 }
 
-void *redisClusterFormattedCommand(redisClusterContext *cc, char *cmd, int len) {
-    redisReply *reply = NULL;
-    int slot_num;
-    struct cmd *command = NULL, *sub_command;
-    hilist *commands = NULL;
-    listNode *list_node;
-    listIter *list_iter = NULL;
+static void unlinkAsyncContextAndNode(redisAsyncContext* ac)
+{
+    cluster_node *node;
 
-    if(cc == NULL)
-    {
-        return NULL;
+    if (ac->data) {
+        node = (cluster_node *)(ac->data);
+        node->acon = NULL;
     }
+}
 
-    if(cc->err)
-    {
-        cc->err = 0;
-        memset(cc->errstr, '\0', strlen(cc->errstr));
-    }  
+redisAsyncContext * actx_get_by_node(redisClusterAsyncContext *acc, 
+    cluster_node *node)
+{
+    redisAsyncContext *ac;
     
-    command = command_get();
-    if(command == NULL)
+    if(node == NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node is null");
         return NULL;
     }
-    
-    command->cmd = cmd;
-    command->clen = len;
 
-    commands = listCreate();
-    if(commands == NULL)
+    ac = node->acon;
+    if(ac != NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto error;
+        if (ac->c.err == 0) {
+            return ac;
+        } else {
+            NOT_REACHED();
+        }
     }
 
-    commands->free = listCommandFree;
-
-    slot_num = command_format_by_slot(cc, command, commands);
-
-    if(slot_num < 0)
+    if(node->host == NULL || node->port <= 0)
     {
-        goto error;
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node host or port is error");
+        return NULL;
     }
-    else if(slot_num >= REDIS_CLUSTER_SLOTS)
+
+    if(!cluster_node_breaker_allow(node))
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
-        goto error;
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node is unreachable, waiting to reconnect");
+        return NULL;
     }
 
-    //all keys belong to one slot
-    if(listLength(commands) == 0)
+    ac = redisAsyncConnect(node->host, node->port);
+    if(ac == NULL)
     {
-        reply = redis_cluster_command_execute(cc, command);
-        goto done;
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node host or port is error");
+        return NULL;
     }
 
-    ASSERT(listLength(commands) != 1);
+    if(cluster_ssl_initiate(acc->cc, &ac->c) != REDIS_OK)
+    {
+        __redisClusterAsyncSetError(acc, ac->c.err, ac->c.errstr);
+        cluster_node_breaker_failure(acc->cc, node);
+        redisAsyncFree(ac);
+        return NULL;
+    }
 
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_node = listNext(list_iter)) != NULL)
+    if(acc->adapter)
     {
-        sub_command = list_node->value;
-        
-        reply = redis_cluster_command_execute(cc, sub_command);
-        if(reply == NULL)
-        {
-            goto error;
-        }
-        else if(reply->type == REDIS_REPLY_ERROR)
-        {
-            goto done;
-        }
+        acc->attach_fn(ac, acc->adapter);
+    }
+
+    if(acc->onConnect)
+    {
+        redisAsyncSetConnectCallback(ac, acc->onConnect);
+    }
 
-        sub_command->reply = reply;
+    if(acc->onDisconnect)
+    {
+        redisAsyncSetDisconnectCallback(ac, acc->onDisconnect);
     }
 
-    reply = command_post_fragment(cc, command, commands);
+    redisAsyncSetBatchLimits(ac, acc->batch_max_bytes, acc->batch_max_latency);
+    redisAsyncSetFlowLimits(ac, &acc->node_flow_limits);
+    if(acc->corked)
+    {
+        redisAsyncCork(ac);
+    }
+
+    ac->data = node;
+    ac->dataHandler = unlinkAsyncContextAndNode;
+    node->acon = ac;
+    node->lost_acon = NULL;
+
+    cluster_async_handshake(acc, ac);
     
-done:
+    return ac;
+}
 
-    command->cmd = NULL;
-    command_destroy(command);
+static redisAsyncContext *actx_get_after_update_route_by_slot(
+    redisClusterAsyncContext *acc, int slot_num)
+{
+    int ret;
+    redisClusterContext *cc;
+    redisAsyncContext *ac;
+    cluster_node *node;
 
-    if(commands != NULL)
+    if(acc == NULL || slot_num < 0)
     {
-        listRelease(commands);
+        return NULL;
     }
 
-    if(list_iter != NULL)
+    cc = acc->cc;
+    if(cc == NULL)
     {
-        listReleaseIterator(list_iter);
+        return NULL;
     }
-
-    cc->retry_count = 0;
     
-    return reply;
-
-error:
+    ret = cluster_update_route(cc);
+    if(ret != REDIS_OK)
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
+            "route update error, please recreate redisClusterContext!");
+        return NULL;
+    }
 
-    if(command != NULL)
+    node = node_get_by_table(cc, (uint32_t)slot_num);
+    if(node == NULL)
     {
-        command->cmd = NULL;
-        command_destroy(command);
+        __redisClusterAsyncSetError(acc, 
+            REDIS_ERR_OTHER, "node get by table error");
+        return NULL;
     }
 
-    if(commands != NULL)
+    ac = actx_get_by_node(acc, node);
+    if(ac == NULL)
     {
-        listRelease(commands);
+        return NULL;
+    }
+    else if(ac->err)
+    {
+        __redisClusterAsyncSetError(acc, ac->err, ac->errstr);
+        return NULL;
     }
 
-    if(list_iter != NULL)
+    return ac;
+}
+
+redisClusterAsyncContext *redisClusterAsyncConnect(const char *addrs, int flags) {
+
+    redisClusterContext *cc;
+    redisClusterAsyncContext *acc;
+
+    cc = redisClusterConnectNonBlock(addrs, flags);
+    if(cc == NULL)
     {
-        listReleaseIterator(list_iter);
+        return NULL;
     }
 
-    cc->retry_count = 0;
+    acc = redisClusterAsyncInitialize(cc);
+    if (acc == NULL) {
+        redisClusterFree(cc);
+        return NULL;
+    }
     
-    return NULL;
+    __redisClusterAsyncCopyError(acc);
+    
+    return acc;
 }
 
-void *redisClustervCommand(redisClusterContext *cc, const char *format, va_list ap) {
-    redisReply *reply;
-    char *cmd;
-    int len;
+
+/* Like redisClusterAsyncConnect, for a context set up with the
+ * redisClusterSetOption* functions (nodes, SSL...). The returned context
+ * owns cc; on NULL, cc is left to the caller. */
+redisClusterAsyncContext *redisClusterAsyncConnect2(redisClusterContext *cc) {
+
+    redisClusterAsyncContext *acc;
 
     if(cc == NULL)
     {
         return NULL;
     }
 
-    len = redisvFormatCommand(&cmd,format,ap);
+    cc->flags &= ~REDIS_BLOCK;
+    _redisClusterConnect2(cc);
 
-    if (len == -1) {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return NULL;
-    } else if (len == -2) {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
+    acc = redisClusterAsyncInitialize(cc);
+    if (acc == NULL) {
         return NULL;
-    }   
-
-    reply = redisClusterFormattedCommand(cc, cmd, len);
+    }
 
-    free(cmd);
+    __redisClusterAsyncCopyError(acc);
 
-    return reply;
+    return acc;
 }
 
-void *redisClusterCommand(redisClusterContext *cc, const char *format, ...) {
-    va_list ap;
-    redisReply *reply = NULL;
-    
-    va_start(ap,format);
-    reply = redisClustervCommand(cc, format, ap);
-    va_end(ap);
+int redisClusterAsyncSetConnectCallback(
+    redisClusterAsyncContext *acc, redisConnectCallback *fn) 
+{    
+    if (acc->onConnect == NULL) {
+        acc->onConnect = fn;
+        return REDIS_OK;
+    }
+    return REDIS_ERR;
+}
 
-    return reply;
+int redisClusterAsyncSetDisconnectCallback(
+    redisClusterAsyncContext *acc, redisDisconnectCallback *fn)
+{
+    if (acc->onDisconnect == NULL) {
+        acc->onDisconnect = fn;
+        return REDIS_OK;
+    }
+    return REDIS_ERR;
 }
 
-void *redisClusterCommandArgv(redisClusterContext *cc, int argc, const char **argv, const size_t *argvlen) {
-    redisReply *reply = NULL;
-    char *cmd;
-    int len;
+static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    int ret;
+    redisReply *reply = r;
+    cluster_async_data *cad = privdata;
+    redisClusterAsyncContext *acc;
+    redisClusterContext *cc;
+    redisAsyncContext *ac_retry = NULL;
+    int error_type;
+    cluster_node *node;
+    struct cmd *command;
+    int64_t now, next;
+    sds script;
 
-    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    if (len == -1) {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return NULL;
+    if(cad == NULL)
+    {
+        goto error;
     }
-	
-    reply = redisClusterFormattedCommand(cc, cmd, len);
 
-    free(cmd);
+    /* The user already got a timeout for this command. */
+    if(cad->timed_out)
+    {
+        goto error;
+    }
 
-    return reply;
-}
+    acc = cad->acc;
+    if(acc == NULL)
+    {
+        goto error;
+    }
 
-int redisClusterAppendFormattedCommand(redisClusterContext *cc, 
-    char *cmd, int len) {
-    int slot_num;
-    struct cmd *command = NULL, *sub_command;
-    hilist *commands = NULL;
-    listNode *list_node;
-    listIter *list_iter = NULL;
+    cc = acc->cc;
+    if(cc == NULL)
+    {
+        goto error;
+    }
 
-    if(cc->requests == NULL)
+    command = cad->command;
+    if(command == NULL)
     {
-        cc->requests = listCreate();
-        if(cc->requests == NULL)
+        goto error;
+    }
+    
+    if(reply == NULL)
+    {
+        //Note: 
+        //I can't decide witch is the best way to deal with connect 
+        //problem for hiredis cluster async api.
+        //But now the way is : when enough null reply for a node,
+        //we will update the route after the cluster node timeout.
+        //If you have a better idea, please contact with me. Thank you.
+        //My email: diguo58@gmail.com
+        
+        node = (cluster_node *)(ac->data);
+        ASSERT(node != NULL);
+
+        /* A connection freed or closed by the user is not lost: the
+         * context may even be going away with it. */
+        if(ac->err == 0 || (ac->c.flags & REDIS_FREEING))
         {
-            __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-            goto error;
+            goto done;
+        }
+
+        node->failure_count ++;
+
+        /* The breaker counts a lost connection once, not once per command
+         * it held. Counted even while a route update is due. */
+        if(node->lost_acon != ac)
+        {
+            node->lost_acon = ac;
+            cluster_node_breaker_failure(cc, node);
+        }
+
+        if(acc->health_interval != 0 && node->role == REDIS_ROLE_MASTER)
+        {
+            node->down = 1;
+            cluster_async_health_soon(acc);
+        }
+        
+        __redisClusterAsyncSetError(acc, 
+            ac->err, ac->errstr);
+        
+        if(cc->update_route_time != 0)
+        {
+            now = hi_usec_now();
+            if(now >= cc->update_route_time)
+            {
+                ret = cluster_update_route(cc);
+                if(ret != REDIS_OK)
+                {
+                    __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
+                        "route update error, please recreate redisClusterContext!");
+                }
+                
+                cc->update_route_time = 0LL;
+            }
+            
+            goto done;
         }
+        
+        if(node->failure_count > cc->max_redirect_count)
+        {
+            char *cluster_timeout_str;
+            int cluster_timeout_str_len;
+            int cluster_timeout;
+
+            node->failure_count = 0;
+            if(cc->update_route_time != 0)
+            {
+                goto done;
+            }
+            
+            cluster_timeout_str = cluster_config_get(cc, 
+                "cluster-node-timeout", &cluster_timeout_str_len);
+            if(cluster_timeout_str == NULL)
+            {
+                __redisClusterAsyncSetError(acc, 
+                    cc->err, cc->errstr);
+                goto done;
+            }
 
-        cc->requests->free = listCommandFree;
-    }
-    
-    command = command_get();
-    if(command == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto error;
-    }
-    
-    command->cmd = cmd;
-    command->clen = len;
+            cluster_timeout = hi_atoi(cluster_timeout_str, 
+                cluster_timeout_str_len);
+            free(cluster_timeout_str);
+            if(cluster_timeout <= 0)
+            {
+                __redisClusterAsyncSetError(acc, 
+                    REDIS_ERR_OTHER, 
+                    "cluster_timeout_str convert to integer error");
+                goto done;
+            }
 
-    commands = listCreate();
-    if(commands == NULL)
-    {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        goto error;
-    }
+            now = hi_usec_now();
+            if (now < 0) {
+                __redisClusterAsyncSetError(acc, 
+                    REDIS_ERR_OTHER, 
+                    "get now usec time error");
+                goto done;
+            }
 
-    commands->free = listCommandFree;
+            next = now + (cluster_timeout * 1000LL);
 
-    slot_num = command_format_by_slot(cc, command, commands);
+            cc->update_route_time = next;
+            
+        }
 
-    if(slot_num < 0)
-    {
-        goto error;
+        goto done;
     }
-    else if(slot_num >= REDIS_CLUSTER_SLOTS)
+
+    /* Any reply proves the connection, failure_count counts in a row. */
+    if(ac->data != NULL)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"slot_num is out of range");
-        goto error;
+        cluster_node_breaker_success((cluster_node *)(ac->data));
     }
 
-    //all keys belong to one slot
-    if(listLength(commands) == 0)
+    /* The script is loaded ahead of the command on the same connection. */
+    if(!cad->script_loaded && cluster_reply_is_noscript(reply))
     {
-        if(__redisClusterAppendCommand(cc, command) == REDIS_OK)
-        {
-            goto done;
-        }
-        else
+        script = cluster_script_get(cc, command);
+        if(script != NULL && redisAsyncCommand(ac, NULL, NULL, 
+            REDIS_COMMAND_SCRIPT_LOAD" %b", script, sdslen(script)) == REDIS_OK)
         {
-            goto error;
+            cad->script_loaded = 1;
+            ac_retry = ac;
+            goto retry;
         }
     }
 
-    ASSERT(listLength(commands) != 1);
+    error_type = cluster_reply_error_type(reply);
 
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_node = listNext(list_iter)) != NULL)
+    if(error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
     {
-        sub_command = list_node->value;
-        
-        if(__redisClusterAppendCommand(cc, sub_command) == REDIS_OK)
+        cad->retry_count ++;
+        if(cad->retry_count > cc->max_redirect_count)
         {
-            continue;
+            cad->retry_count = 0;
+            __redisClusterAsyncSetError(acc, 
+                REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
+                "too many cluster redirect");
+            goto done;
         }
-        else
+        
+        switch(error_type)
         {
-            goto error;
+        case CLUSTER_ERR_MOVED:
+            ac_retry = actx_get_after_update_route_by_slot(acc, command->slot_num);
+            if(ac_retry == NULL)
+            {
+                goto done;
+            }
+            
+            break;
+        case CLUSTER_ERR_ASK:
+            node = node_get_by_ask_error_reply(cc, reply);
+            if(node == NULL)
+            {
+                __redisClusterAsyncSetError(acc, 
+                    cc->err, cc->errstr);
+                goto done;
+            }
+
+            ac_retry = actx_get_by_node(acc, node);
+            if(ac_retry == NULL)
+            {
+                goto done;
+            }
+            else if(ac_retry->err)
+            {
+                __redisClusterAsyncSetError(acc,
+                    ac_retry->err, ac_retry->errstr);
+                goto done;
+            }
+
+            ret = redisAsyncCommand(ac_retry,
+                NULL,NULL,REDIS_COMMAND_ASKING);
+            if(ret != REDIS_OK)
+            {
+                if(redisAsyncIsPaused(ac_retry))
+                {
+                    __redisClusterAsyncSetError(acc, REDIS_ERR_BACKPRESSURE,
+                        "Too many pending commands for the node");
+                }
+                else
+                {
+                    __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER,
+                        "asking command send error");
+                }
+                goto done;
+            }
+            
+            break;
+        case CLUSTER_ERR_TRYAGAIN:
+        case CLUSTER_ERR_CROSSSLOT:
+        case CLUSTER_ERR_CLUSTERDOWN:
+            ac_retry = ac;
+            
+            break;
+        default:
+
+            goto done;
+            break;
         }
+
+        goto retry;
     }
 
 done:
 
-    if(command->cmd != NULL)
+    if(acc->err)
     {
-        command->cmd = NULL;
+        cad->callback(acc, NULL, cad->privdata);
     }
     else
     {
-        goto error;
+        cad->callback(acc, r, cad->privdata);
     }
 
-    if(commands != NULL)
+    if(cc->err)
     {
-        if(listLength(commands) > 0)
-        {
-            command->sub_commands = commands;
-        }
-        else
-        {
-            listRelease(commands);
-        }
+        cc->err = 0;
+        memset(cc->errstr, '\0', strlen(cc->errstr));
     }
 
-    if(list_iter != NULL)
+    if(acc->err)
     {
-        listReleaseIterator(list_iter);
+        acc->err = 0;
+        memset(acc->errstr, '\0', strlen(acc->errstr));
     }
-
-    listAddNodeTail(cc->requests, command);
     
-    return REDIS_OK;
-
-error:
-
-    if(command != NULL)
+    if(cad != NULL)
     {
-        command->cmd = NULL;
-        command_destroy(command);
+        cluster_async_data_free(cad);
     }
 
-    if(commands != NULL)
+    return;
+
+retry:
+
+    ret = redisAsyncFormattedCommand(ac_retry,
+        redisClusterAsyncCallback,cad,command->cmd,command->clen);
+    if(ret != REDIS_OK)
     {
-        listRelease(commands);
+        if(redisAsyncIsPaused(ac_retry))
+        {
+            __redisClusterAsyncSetError(acc, REDIS_ERR_BACKPRESSURE, 
+                "Too many pending commands for the node");
+        }
+        else
+        {
+            __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
+                "redirect command send error");
+        }
+        goto done;
     }
+    
+    return;
 
-    if(list_iter != NULL)
+error:
+
+    if(cad != NULL)
     {
-        listReleaseIterator(list_iter);
+        cluster_async_data_free(cad);
     }
-
-    /* Attention: mybe here we must pop the 
-      sub_commands that had append to the nodes.  
-      But now we do not handle it. */
-    
-    return REDIS_ERR;
 }
 
+/* Fail a command whose deadline passed. Its reply is still expected on the
+ * connection: the cad stays queued there and is freed when it arrives. */
+static void cluster_async_data_timeout(struct hiwheel_timer *t, void *data)
+{
+    cluster_async_data *cad = data;
+    redisClusterAsyncContext *acc = cad->acc;
 
-int redisClustervAppendCommand(redisClusterContext *cc, 
-    const char *format, va_list ap) {
-    int ret;
-    char *cmd;
-    int len;
-    
-    len = redisvFormatCommand(&cmd,format,ap);  
-    if (len == -1) {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return REDIS_ERR;
-    } else if (len == -2) {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid format string");
-        return REDIS_ERR;
-    }   
+    (void)t;
 
-    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
+    cad->timed_out = 1;
 
-    free(cmd);
+    __redisClusterAsyncSetError(acc, REDIS_ERR_TIMEOUT, "Command timed out");
 
-    return ret;
+    if(cad->callback)
+    {
+        cad->callback(acc, NULL, cad->privdata);
+    }
+
+    acc->err = 0;
+    acc->errstr[0] = '\0';
+
+    acc->pending --;
+    cluster_async_flow_check(acc);
 }
 
-int redisClusterAppendCommand(redisClusterContext *cc, 
-    const char *format, ...) {
+/* Make sure the adapter timer fires no later than the next deadline. */
+static void cluster_async_timer_schedule(redisClusterAsyncContext *acc)
+{
+    int64_t next, now;
+    struct timeval tv;
 
-    int ret;
-    va_list ap;
+    if(acc->deadlines == NULL || acc->timer.schedule == NULL)
+    {
+        return;
+    }
 
-    if(cc == NULL || format == NULL)
+    next = hiwheel_next_timeout(acc->deadlines);
+    if(next < 0)
     {
-        return REDIS_ERR;
+        return;
     }
-    
-    va_start(ap,format);
-    ret = redisClustervAppendCommand(cc, format, ap);
-    va_end(ap);
 
-    return ret;
+    now = hi_usec_now();
+    if(acc->timer_expire != 0 && acc->timer_expire <= now + next)
+    {
+        return;
+    }
+
+    acc->timer_expire = now + next;
+
+    tv.tv_sec = next / 1000000;
+    tv.tv_usec = next % 1000000;
+    acc->timer.schedule(acc->timer.data, tv);
 }
 
-int redisClusterAppendCommandArgv(redisClusterContext *cc, 
-    int argc, const char **argv, const size_t *argvlen) {
-    int ret;
-    char *cmd;
-    int len;
+static struct hiwheel *cluster_async_wheel(redisClusterAsyncContext *acc)
+{
+    if(acc->deadlines == NULL)
+    {
+        acc->deadlines = hi_alloc(sizeof(*acc->deadlines));
+        if(acc->deadlines == NULL)
+        {
+            return NULL;
+        }
 
-    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    if (len == -1) {
-        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
-        return REDIS_ERR;
+        hiwheel_init(acc->deadlines, hi_usec_now(), CLUSTER_DEADLINE_TICK_USEC);
     }
-    
-    ret = redisClusterAppendFormattedCommand(cc, cmd, len);
-    
-    free(cmd);
 
-    return ret;
+    return acc->deadlines;
 }
 
-static int redisCLusterSendAll(redisClusterContext *cc)
+static int cluster_async_deadline_add(redisClusterAsyncContext *acc, 
+    cluster_async_data *cad, int64_t timeout)
 {
-    dictIterator *di;
-    dictEntry *de;
-    struct cluster_node *node;
-    redisContext *c = NULL;
-    int wdone = 0;
-    
-    if(cc == NULL || cc->nodes == NULL)
+    int64_t now;
+
+    if(cluster_async_wheel(acc) == NULL)
     {
         return REDIS_ERR;
     }
 
-    di = dictGetIterator(cc->nodes);
-    while((de = dictNext(di)) != NULL)
-    {
-        node = dictGetEntryVal(de);
-        if(node == NULL)
-        {
-            continue;
-        }
-        
-        c = ctx_get_by_node(cc, node);
-        if(c == NULL)
-        {
-            continue;
-        }
+    now = hi_usec_now();
 
-        if (c->flags & REDIS_BLOCK) {
-            /* Write until done */
-            do {
-                if (redisBufferWrite(c,&wdone) == REDIS_ERR)
-                {
-                    dictReleaseIterator(di);
-                    return REDIS_ERR;
-                }
-            } while (!wdone);
-        }
+    /* An empty wheel is not advanced by the timer, catch up first
+     * (nothing can expire). */
+    if(acc->deadlines->count == 0)
+    {
+        hiwheel_advance(acc->deadlines, now);
     }
-    
-    dictReleaseIterator(di);
+
+    cad->deadline.fn = cluster_async_data_timeout;
+    hiwheel_add(acc->deadlines, &cad->deadline, now + timeout);
+
+    cluster_async_timer_schedule(acc);
 
     return REDIS_OK;
 }
 
-static int redisCLusterClearAll(redisClusterContext *cc)
+/* To be called by the adapter when the timer armed through
+ * acc->timer.schedule fires. */
+void redisClusterAsyncHandleTimer(redisClusterAsyncContext *acc)
 {
-    dictIterator *di;
-    dictEntry *de;
-    struct cluster_node *node;
-    redisContext *c = NULL;
-    
-    if (cc == NULL) {
-        return REDIS_ERR;
+    if(acc == NULL)
+    {
+        return;
     }
 
-    if (cc->err) {
-        cc->err = 0;
-        memset(cc->errstr, '\0', strlen(cc->errstr));
+    acc->timer_expire = 0;
+
+    if(acc->deadlines != NULL)
+    {
+        hiwheel_advance(acc->deadlines, hi_usec_now());
     }
 
-    if (cc->nodes == NULL) {
+    cluster_async_timer_schedule(acc);
+}
+
+/* Default deadline of every command, a zero tv disables it. Deadlines are
+ * only enforced when the adapter installed the acc->timer hooks. */
+int redisClusterAsyncSetCommandTimeout(redisClusterAsyncContext *acc, 
+    const struct timeval tv)
+{
+    if(acc == NULL || tv.tv_sec < 0 || tv.tv_usec < 0)
+    {
         return REDIS_ERR;
     }
-    di = dictGetIterator(cc->nodes);
-    while((de = dictNext(di)) != NULL)
-    {
-        node = dictGetEntryVal(de);
-        if(node == NULL)
-        {
-            continue;
-        }
 
-        c = node->con;
-        if(c == NULL)
-        {
-            continue;
-        }
+    acc->command_timeout = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 
-        redisFree(c);
-        node->con = NULL;
-    }
-    
-    dictReleaseIterator(di);
-    
     return REDIS_OK;
 }
 
-int redisClusterGetReply(redisClusterContext *cc, void **reply) {
-
-    struct cmd *command, *sub_command;
-    hilist *commands = NULL;
-    listNode *list_command, *list_sub_command;
-    listIter *list_iter;
-    int slot_num;
-    void *sub_reply;
+static int cluster_async_update_route(redisClusterAsyncContext *acc);
 
-    if(cc == NULL || reply == NULL)
-        return REDIS_ERR;
+static void cluster_async_route_reply(redisAsyncContext *ac, void *r, 
+    void *privdata)
+{
+    redisReply *reply = r;
+    redisClusterAsyncContext *acc = privdata;
+    redisClusterContext *cc = acc->cc;
 
-    cc->err = 0;
-    cc->errstr[0] = '\0';
+    acc->route_updating = 0;
 
-    *reply = NULL;
+    if(reply == NULL || (ac->c.flags & REDIS_FREEING))
+    {
+        return;
+    }
 
-    if (cc->requests == NULL)
-        return REDIS_ERR;
+    /* Asked again with cluster nodes, on the same connection. */
+    if(reply->type == REDIS_REPLY_ERROR && 
+        cluster_reply_unknown_subcommand(reply) && !cc->route_no_shards &&
+        !(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS))
+    {
+        cc->route_no_shards = 1;
+        if(redisAsyncCommand(ac, cluster_async_route_reply, acc, 
+            REDIS_COMMAND_CLUSTER_NODES) == REDIS_OK)
+        {
+            acc->route_updating = 1;
+        }
 
-    list_command = listFirst(cc->requests);
+        return;
+    }
 
-    //no more reply
-    if(list_command == NULL)
+    if(reply->type != REDIS_REPLY_ARRAY && reply->type != REDIS_REPLY_STRING &&
+        reply->type != REDIS_REPLY_VERB)
     {
-        *reply = NULL;
-        return REDIS_OK;
+        return;
     }
-    
-    command = list_command->value;
-    if(command == NULL)
+
+    /* With a shared topology only this context moves to the new route, the
+     * others refresh on their own failures. */
+    if(cluster_route_apply(cc, reply) != REDIS_OK)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "command in the requests list is null");
-        goto error;
+        cc->err = 0;
+        cc->errstr[0] = '\0';
+        return;
     }
-    
-    slot_num = command->slot_num;
-    if(slot_num >= 0)
+
+    if(cc->topology_file != NULL)
     {
-        listDelNode(cc->requests, list_command);
-        return __redisClusterGetReply(cc, slot_num, reply);
+        cluster_route_save(cc, cc->topology_file);
     }
+}
 
-    commands = command->sub_commands;
-    if(commands == NULL)
+/* Ask for the route over the connection of a master that is up, without
+ * blocking: the reply installs it. Does nothing while a request is in
+ * flight. */
+static int cluster_async_update_route(redisClusterAsyncContext *acc)
+{
+    redisClusterContext *cc = acc->cc;
+    redisAsyncContext *ac = NULL;
+    cluster_node *master, *spare = NULL;
+    dictIterator *di;
+    dictEntry *de;
+    const char *command;
+
+    if(acc->route_updating)
     {
-        __redisClusterSetError(cc,REDIS_ERR_OTHER,
-            "sub_commands in command is null");
-        goto error;
+        return REDIS_OK;
     }
 
-    ASSERT(listLength(commands) != 1);
+    if(cc->nodes == NULL)
+    {
+        return REDIS_ERR;
+    }
 
-    list_iter = listGetIterator(commands, AL_START_HEAD);
-    while((list_sub_command = listNext(list_iter)) != NULL)
+    di = dictGetIterator(cc->nodes);
+    while((de = dictNext(di)) != NULL)
     {
-        sub_command = list_sub_command->value;
-        if(sub_command == NULL)
+        master = dictGetEntryVal(de);
+        if(master->down)
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "sub_command is null");
-            goto error;
+            continue;
         }
-        
-        slot_num = sub_command->slot_num;
-        if(slot_num < 0)
+
+        if(master->acon != NULL && master->acon->c.err == 0 &&
+            !(master->acon->c.flags & REDIS_DISCONNECTING))
         {
-            __redisClusterSetError(cc,REDIS_ERR_OTHER,
-                "sub_command slot_num is less then zero");
-            goto error;
+            ac = master->acon;
+            break;
         }
-        
-        if(__redisClusterGetReply(cc, slot_num, &sub_reply) != REDIS_OK)
+
+        if(spare == NULL)
         {
-            goto error;
+            spare = master;
         }
-
-        sub_command->reply = sub_reply;
     }
+    dictReleaseIterator(di);
 
-    *reply = command_post_fragment(cc, command, commands);
-    if(*reply == NULL)
+    if(ac == NULL && spare != NULL)
     {
-        goto error;
+        ac = actx_get_by_node(acc, spare);
+        if(ac == NULL)
+        {
+            acc->err = 0;
+            acc->errstr[0] = '\0';
+        }
     }
 
-    listDelNode(cc->requests, list_command);
-    return REDIS_OK;
-
-error:
-
-    listDelNode(cc->requests, list_command);
-    return REDIS_ERR;
-}
-
-void redisClusterReset(redisClusterContext *cc)
-{
-    int status;
-    void *reply;
-    
-    if(cc == NULL || cc->nodes == NULL)
+    if(ac == NULL)
     {
-        return;
+        return REDIS_ERR;
     }
 
-    if (cc->err) {
-        redisCLusterClearAll(cc);
-    } else {
-        redisCLusterSendAll(cc);
-        
-        do {
-            status = redisClusterGetReply(cc, &reply);
-            if (status == REDIS_OK) {
-                freeReplyObject(reply);
-            } else {
-                redisCLusterClearAll(cc);
-                break;
-            }
-        } while(reply != NULL);
+    if(cc->flags & HIRCLUSTER_FLAG_ROUTE_USE_SLOTS)
+    {
+        command = REDIS_COMMAND_CLUSTER_SLOTS;
     }
-    
-    if(cc->requests)
+    else if(!(cc->flags & (HIRCLUSTER_FLAG_ADD_OPENSLOT|HIRCLUSTER_FLAG_ROUTE_USE_NODES)) &&
+        !cc->route_no_shards)
     {
-        listRelease(cc->requests);
-        cc->requests = NULL;
+        command = REDIS_COMMAND_CLUSTER_SHARDS;
     }
-
-    if(cc->need_update_route)
+    else
     {
-        status = cluster_update_route(cc);
-        if(status != REDIS_OK)
-        {
-            __redisClusterSetError(cc, REDIS_ERR_OTHER, 
-                "route update error, please recreate redisClusterContext!");
-            return;
-        }
-        cc->need_update_route = 0;
+        command = REDIS_COMMAND_CLUSTER_NODES;
     }
-}
 
-/*############redis cluster async############*/
+    if(redisAsyncCommand(ac, cluster_async_route_reply, acc, command) != REDIS_OK)
+    {
+        return REDIS_ERR;
+    }
 
-/* We want the error field to be accessible directly instead of requiring
- * an indirection to the redisContext struct. */
-static void __redisClusterAsyncCopyError(redisClusterAsyncContext *acc) {
-    if (!acc)
-        return;
+    acc->route_updating = 1;
 
-    redisClusterContext *cc = acc->cc;
-    acc->err = cc->err;
-    memcpy(acc->errstr, cc->errstr, 128);
+    return REDIS_OK;
 }
 
-static void __redisClusterAsyncSetError(redisClusterAsyncContext *acc, 
-    int type, const char *str) {
-    
-    size_t len;
+/* The node is found through ac->data, which follows the connection across
+ * route updates. */
+static void cluster_async_health_reply(redisAsyncContext *ac, void *r, 
+    void *privdata)
+{
+    redisReply *reply = r;
+    redisClusterAsyncContext *acc = privdata;
+    cluster_node *node = ac->data;
 
-    acc->err = type;
-    if (str != NULL) {
-        len = strlen(str);
-        len = len < (sizeof(acc->errstr)-1) ? len : (sizeof(acc->errstr)-1);
-        memcpy(acc->errstr,str,len);
-        acc->errstr[len] = '\0';
-    } else {
-        /* Only REDIS_ERR_IO may lack a description! */
-        assert(type == REDIS_ERR_IO);
-        strerror_r(errno, acc->errstr, sizeof(acc->errstr));
+    if(node == NULL || node->ping_sent == 0)
+    {
+        return;
+    }
+
+    if(reply == NULL || reply->type == REDIS_REPLY_ERROR)
+    {
+        node->ping_sent = 0;
+        node->down = 1;
+
+        /* Not while the context is being freed. */
+        if(acc->health_interval != 0 && node->role == REDIS_ROLE_MASTER)
+        {
+            cluster_async_health_soon(acc);
+        }
+
+        return;
     }
+
+    node->latency = hi_usec_now() - node->ping_sent;
+    node->ping_sent = 0;
+    node->down = 0;
+
+    cluster_node_breaker_success(node);
 }
 
-static redisClusterAsyncContext *redisClusterAsyncInitialize(redisClusterContext *cc) {
-    redisClusterAsyncContext *acc;
+/* PING node unless the last PING is still in flight, and tell whether it
+ * should be considered down. */
+static int cluster_async_health_ping(redisClusterAsyncContext *acc, 
+    cluster_node *node, int64_t now)
+{
+    redisAsyncContext *ac;
 
-    if(cc == NULL)
+    if(node->ping_sent != 0)
     {
-        return NULL;
+        if(now - node->ping_sent >= acc->health_timeout)
+        {
+            node->down = 1;
+        }
+
+        return node->down;
     }
 
-    acc = hi_alloc(sizeof(redisClusterAsyncContext));
-    if (acc == NULL)
-        return NULL;
+    ac = actx_get_by_node(acc, node);
+    if(ac == NULL)
+    {
+        acc->err = 0;
+        acc->errstr[0] = '\0';
 
-    acc->cc = cc;
+        node->down = 1;
+        return 1;
+    }
 
-    acc->err = 0;
-    acc->data = NULL;
-    acc->adapter = NULL;
-    acc->attach_fn = NULL;
+    /* Behind the replies still due, or in a corked buffer, the PING would
+     * time them rather than the node: the commands in flight tell whether
+     * it is lost. */
+    if(ac->replies.head != NULL || sdslen(ac->c.obuf) > 0)
+    {
+        return node->down;
+    }
 
-    acc->onConnect = NULL;
-    acc->onDisconnect = NULL;
+    /* A node that is only busy (backpressure) is left alone. */
+    if(redisAsyncCommand(ac, cluster_async_health_reply, acc, 
+        REDIS_COMMAND_PING) == REDIS_OK)
+    {
+        node->ping_sent = now;
+    }
 
-    return acc;
+    return node->down;
 }
 
-static cluster_async_data *cluster_async_data_get(void)
+static void cluster_async_health_check(struct hiwheel_timer *t, void *data)
 {
-    cluster_async_data *cad;
+    redisClusterAsyncContext *acc = data;
+    redisClusterContext *cc = acc->cc;
+    dictIterator *di;
+    dictEntry *de;
+    listIter *li;
+    listNode *ln;
+    cluster_node *master;
+    int64_t now;
+    int refresh = 0;
 
-    cad = hi_alloc(sizeof(cluster_async_data));
-    if(cad == NULL)
+    now = hi_usec_now();
+
+    if(cc->nodes != NULL)
     {
-        return NULL;
+        di = dictGetIterator(cc->nodes);
+        while((de = dictNext(di)) != NULL)
+        {
+            master = dictGetEntryVal(de);
+            if(cluster_async_health_ping(acc, master, now))
+            {
+                refresh = 1;
+            }
+
+            if(master->slaves == NULL)
+            {
+                continue;
+            }
+
+            li = listGetIterator(master->slaves, AL_START_HEAD);
+            while((ln = listNext(li)) != NULL)
+            {
+                cluster_async_health_ping(acc, listNodeValue(ln), now);
+            }
+            listReleaseIterator(li);
+        }
+        dictReleaseIterator(di);
     }
 
-    cad->acc = NULL;
-    cad->command = NULL;
-    cad->callback = NULL;
-    cad->privdata = NULL;
-    cad->retry_count = 0;
+    /* The route names the new master once the failover is done, there is
+     * no point in asking more than once per round. */
+    if(refresh && now - acc->health_refresh_time >= acc->health_interval)
+    {
+        acc->health_refresh_time = now;
+        cluster_async_update_route(acc);
+    }
 
-    return cad;
+    hiwheel_add(acc->deadlines, t, hi_usec_now() + acc->health_interval);
 }
 
-static void cluster_async_data_free(cluster_async_data *cad)
+/* Run the checks at the next timer tick rather than at the end of the
+ * round. */
+static void cluster_async_health_soon(redisClusterAsyncContext *acc)
 {
-    if(cad == NULL)
+    if(acc->health_timer == NULL || acc->deadlines == NULL)
     {
         return;
     }
 
-    if(cad->command != NULL)
+    hiwheel_add(acc->deadlines, acc->health_timer, hi_usec_now());
+    cluster_async_timer_schedule(acc);
+}
+
+/* PING every node each interval, off the request path, keeping its
+ * latency in node->latency and its liveness in node->down. A node with
+ * replies due is not PINGed, its commands stand for the probe. A master
+ * that fails to answer within timeout, or whose connection is lost,
+ * refreshes the route at once, and then once per interval until it is
+ * back or replaced; the route is asked for without blocking. A zero interval stops the checks. The adapter must be attached
+ * first, the checks run from its timer. */
+int redisClusterAsyncSetHealthCheck(redisClusterAsyncContext *acc, 
+    const struct timeval interval, const struct timeval timeout)
+{
+    int64_t interval_usec, timeout_usec;
+
+    if(acc == NULL || interval.tv_sec < 0 || interval.tv_usec < 0 ||
+        timeout.tv_sec < 0 || timeout.tv_usec < 0)
     {
-        command_destroy(cad->command);
+        return REDIS_ERR;
     }
-    
-    hi_free(cad);
-    cad = NULL;
+
+    interval_usec = (int64_t)interval.tv_sec * 1000000 + interval.tv_usec;
+    timeout_usec = (int64_t)timeout.tv_sec * 1000000 + timeout.tv_usec;
+
+    if(interval_usec == 0)
+    {
+        if(acc->health_timer != NULL)
+        {
+            hiwheel_del(acc->deadlines, acc->health_timer);
+        }
+
+        acc->health_interval = 0;
+        return REDIS_OK;
+    }
+
+    if(timeout_usec == 0 || acc->timer.schedule == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(cluster_async_wheel(acc) == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(acc->health_timer == NULL)
+    {
+        acc->health_timer = hi_alloc(sizeof(*acc->health_timer));
+        if(acc->health_timer == NULL)
+        {
+            return REDIS_ERR;
+        }
+
+        hiwheel_timer_init(acc->health_timer, cluster_async_health_check, acc);
+    }
+
+    /* An empty wheel is not advanced by the timer. */
+    if(acc->deadlines->count == 0)
+    {
+        hiwheel_advance(acc->deadlines, hi_usec_now());
+    }
+
+    acc->health_interval = interval_usec;
+    acc->health_timeout = timeout_usec;
+
+    hiwheel_add(acc->deadlines, acc->health_timer, 
+        hi_usec_now() + interval_usec);
+    cluster_async_timer_schedule(acc);
+
+    return REDIS_OK;
 }
 
-static void unlinkAsyncContextAndNode(redisAsyncContext* ac)
+typedef struct cluster_subscription
 {
-    cluster_node *node;
+    redisClusterAsyncContext *acc;
+    sds channel;
+    int slot_num;
+    redisClusterCallbackFn *fn;
+    void *privdata;
+    redisAsyncContext *ac;  /* connection subscribed on, NULL: to resubscribe */
+    int unsubscribed;       /* SUNSUBSCRIBE sent, ends on its reply */
+}cluster_subscription;
 
-    if (ac->data) {
-        node = (cluster_node *)(ac->data);
-        node->acon = NULL;
+static void unlinkSubContextAndNode(redisAsyncContext *ac)
+{
+    cluster_node *node = ac->data;
+
+    /* It may have been replaced already. */
+    if(node != NULL && node->sub_acon == ac)
+    {
+        node->sub_acon = NULL;
     }
 }
 
-redisAsyncContext * actx_get_by_node(redisClusterAsyncContext *acc, 
+/* The connection of node dedicated to sharded pub/sub: a subscribed 
+ * connection only takes (un)subscribe commands. */
+static redisAsyncContext *actx_sub_get_by_node(redisClusterAsyncContext *acc, 
     cluster_node *node)
 {
     redisAsyncContext *ac;
-    
-    if(node == NULL)
-    {
-        return NULL;
-    }
 
-    ac = node->acon;
+    ac = node->sub_acon;
     if(ac != NULL)
     {
-        if (ac->c.err == 0) {
-            return ac;
-        } else {
-            NOT_REACHED();
+        if(ac->c.flags & (REDIS_DISCONNECTING|REDIS_FREEING))
+        {
+            __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
+                "node pub/sub connection is closing");
+            return NULL;
         }
+
+        return ac;
     }
 
     if(node->host == NULL || node->port <= 0)
@@ -4454,6 +8908,12 @@ redisAsyncContext * actx_get_by_node(redisClusterAsyncContext *acc,
         return NULL;
     }
 
+    if(!cluster_node_breaker_allow(node))
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "node is unreachable, waiting to reconnect");
+        return NULL;
+    }
+
     ac = redisAsyncConnect(node->host, node->port);
     if(ac == NULL)
     {
@@ -4461,6 +8921,14 @@ redisAsyncContext * actx_get_by_node(redisClusterAsyncContext *acc,
         return NULL;
     }
 
+    if(ac->err || cluster_ssl_initiate(acc->cc, &ac->c) != REDIS_OK)
+    {
+        __redisClusterAsyncSetError(acc, ac->c.err, ac->c.errstr);
+        cluster_node_breaker_failure(acc->cc, node);
+        redisAsyncFree(ac);
+        return NULL;
+    }
+
     if(acc->adapter)
     {
         acc->attach_fn(ac, acc->adapter);
@@ -4477,346 +8945,439 @@ redisAsyncContext * actx_get_by_node(redisClusterAsyncContext *acc,
     }
 
     ac->data = node;
-    ac->dataHandler = unlinkAsyncContextAndNode;
-    node->acon = ac;
-    
+    ac->dataHandler = unlinkSubContextAndNode;
+    node->sub_acon = ac;
+    node->lost_acon = NULL;
+
+    /* Ahead of SSUBSCRIBE, as on the command connections. */
+    cluster_async_handshake(acc, ac);
+
     return ac;
 }
 
-static redisAsyncContext *actx_get_after_update_route_by_slot(
-    redisClusterAsyncContext *acc, int slot_num)
+static void cluster_subscription_free(cluster_subscription *sub)
 {
-    int ret;
-    redisClusterContext *cc;
-    redisAsyncContext *ac;
-    cluster_node *node;
+    if(sub->acc->subscriptions != NULL)
+    {
+        dictDelete(sub->acc->subscriptions, sub->channel);
+    }
 
-    if(acc == NULL || slot_num < 0)
+    sdsfree(sub->channel);
+    hi_free(sub);
+}
+
+/* Call the callback a last time and forget the subscription. */
+static void cluster_subscription_end(cluster_subscription *sub, redisReply *reply)
+{
+    if(sub->fn)
     {
-        return NULL;
+        sub->fn(sub->acc, reply, sub->privdata);
     }
 
-    cc = acc->cc;
-    if(cc == NULL)
+    cluster_subscription_free(sub);
+}
+
+/* Resubscribing is left to the timer: the callbacks of the connection
+ * that lost the subscriptions run while it is being freed. */
+static int cluster_async_resubscribe_later(redisClusterAsyncContext *acc, 
+    int64_t delay)
+{
+    int64_t now;
+
+    if(acc->sub_timer == NULL || acc->deadlines == NULL)
     {
-        return NULL;
+        return REDIS_ERR;
     }
-    
-    ret = cluster_update_route(cc);
-    if(ret != REDIS_OK)
+
+    if(hiwheel_timer_pending(acc->sub_timer))
     {
-        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
-            "route update error, please recreate redisClusterContext!");
-        return NULL;
+        return REDIS_OK;
     }
 
-    node = node_get_by_table(cc, (uint32_t)slot_num);
+    now = hi_usec_now();
+
+    /* An empty wheel is not advanced by the timer. */
+    if(acc->deadlines->count == 0)
+    {
+        hiwheel_advance(acc->deadlines, now);
+    }
+
+    hiwheel_add(acc->deadlines, acc->sub_timer, now + delay);
+    cluster_async_timer_schedule(acc);
+
+    return REDIS_OK;
+}
+
+static void cluster_async_sub_reply(redisAsyncContext *ac, void *r, 
+    void *privdata)
+{
+    redisReply *reply = r;
+    cluster_subscription *sub = privdata;
+    redisClusterAsyncContext *acc = sub->acc;
+    cluster_node *node = ac->data;
+
+    if(reply == NULL)
+    {
+        /* Not to be picked up again by a resubscription. */
+        if(node != NULL && node->sub_acon == ac)
+        {
+            node->sub_acon = NULL;
+        }
+
+        sub->ac = NULL;
+
+        if(sub->unsubscribed)
+        {
+            cluster_subscription_end(sub, NULL);
+            return;
+        }
+
+        /* An error reply to SSUBSCRIBE, such as MOVED, closes a 
+         * subscribed connection (REDIS_ERR_OTHER): it shows up here,
+         * with a node that is fine. */
+        if(ac->c.err)
+        {
+            acc->sub_refresh = 1;
+
+            if(node != NULL && ac->c.err != REDIS_ERR_OTHER && 
+                !(ac->c.flags & REDIS_FREEING) && node->lost_acon != ac)
+            {
+                node->lost_acon = ac;
+                cluster_node_breaker_failure(acc->cc, node);
+            }
+        }
+
+        if(cluster_async_resubscribe_later(acc, 0) != REDIS_OK)
+        {
+            cluster_subscription_end(sub, NULL);
+        }
+
+        return;
+    }
+
+    if(node != NULL)
+    {
+        cluster_node_breaker_success(node);
+    }
+
+    if((reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_PUSH) && 
+        reply->elements > 0 && reply->element[0]->type == REDIS_REPLY_STRING &&
+        strcasecmp(reply->element[0]->str, "sunsubscribe") == 0)
+    {
+        sub->ac = NULL;
+
+        if(sub->unsubscribed)
+        {
+            cluster_subscription_end(sub, reply);
+            return;
+        }
+
+        /* Not asked for: the server drops the subscribers of a slot
+         * that moved away. */
+        acc->sub_refresh = 1;
+
+        if(cluster_async_resubscribe_later(acc, 0) != REDIS_OK)
+        {
+            cluster_subscription_end(sub, reply);
+        }
+
+        return;
+    }
+
+    if(sub->fn)
+    {
+        sub->fn(acc, reply, sub->privdata);
+    }
+}
+
+static int cluster_async_subscribe(redisClusterAsyncContext *acc, 
+    cluster_subscription *sub)
+{
+    cluster_node *node;
+    redisAsyncContext *ac;
+
+    node = node_get_by_table(acc->cc, (uint32_t)sub->slot_num);
     if(node == NULL)
     {
         __redisClusterAsyncSetError(acc, 
             REDIS_ERR_OTHER, "node get by table error");
-        return NULL;
+        return REDIS_ERR;
     }
 
-    ac = actx_get_by_node(acc, node);
+    ac = actx_sub_get_by_node(acc, node);
     if(ac == NULL)
     {
-        __redisClusterAsyncSetError(acc, 
-            REDIS_ERR_OTHER, "actx get by node error");
-        return NULL;
+        return REDIS_ERR;
     }
-    else if(ac->err)
+
+    if(redisAsyncCommand(ac, cluster_async_sub_reply, sub, "SSUBSCRIBE %b", 
+        sub->channel, sdslen(sub->channel)) != REDIS_OK)
     {
-        __redisClusterAsyncSetError(acc, ac->err, ac->errstr);
-        return NULL;
+        __redisClusterAsyncSetError(acc, 
+            REDIS_ERR_OTHER, "ssubscribe error");
+        return REDIS_ERR;
     }
 
-    return ac;
-}
+    sub->ac = ac;
 
-redisClusterAsyncContext *redisClusterAsyncConnect(const char *addrs, int flags) {
+    return REDIS_OK;
+}
 
-    redisClusterContext *cc;
-    redisClusterAsyncContext *acc;
+/* Subscribe again the subscriptions that lost their connection, 
+ * on the master the (refreshed) route names for their slot. */
+static void cluster_async_resubscribe(struct hiwheel_timer *t, void *data)
+{
+    redisClusterAsyncContext *acc = data;
+    redisClusterContext *cc = acc->cc;
+    cluster_subscription *sub;
+    dictIterator *di;
+    dictEntry *de;
+    int retry = 0;
 
-    cc = redisClusterConnectNonBlock(addrs, flags);
-    if(cc == NULL)
+    if(acc->subscriptions == NULL)
     {
-        return NULL;
+        return;
     }
 
-    acc = redisClusterAsyncInitialize(cc);
-    if (acc == NULL) {
-        redisClusterFree(cc);
-        return NULL;
+    if(acc->sub_refresh)
+    {
+        acc->sub_refresh = 0;
+        if(cluster_update_route(cc) != REDIS_OK)
+        {
+            cc->err = 0;
+            cc->errstr[0] = '\0';
+            acc->sub_refresh = 1;
+        }
     }
-    
-    __redisClusterAsyncCopyError(acc);
-    
-    return acc;
-}
 
+    di = dictGetIterator(acc->subscriptions);
+    while((de = dictNext(di)) != NULL)
+    {
+        sub = dictGetEntryVal(de);
+        if(sub->ac != NULL || sub->unsubscribed)
+        {
+            continue;
+        }
 
-int redisClusterAsyncSetConnectCallback(
-    redisClusterAsyncContext *acc, redisConnectCallback *fn) 
-{    
-    if (acc->onConnect == NULL) {
-        acc->onConnect = fn;
-        return REDIS_OK;
+        if(cluster_async_subscribe(acc, sub) != REDIS_OK)
+        {
+            acc->err = 0;
+            acc->errstr[0] = '\0';
+            retry = 1;
+        }
     }
-    return REDIS_ERR;
-}
+    dictReleaseIterator(di);
 
-int redisClusterAsyncSetDisconnectCallback(
-    redisClusterAsyncContext *acc, redisDisconnectCallback *fn)
-{
-    if (acc->onDisconnect == NULL) {
-        acc->onDisconnect = fn;
-        return REDIS_OK;
+    /* The node is down or the route is stale: try again once the
+     * shortest reconnect backoff is over. */
+    if(retry)
+    {
+        acc->sub_refresh = 1;
+        hiwheel_add(acc->deadlines, t, hi_usec_now() + cc->backoff_min);
     }
-    return REDIS_ERR;
 }
 
-static void redisClusterAsyncCallback(redisAsyncContext *ac, void *r, void *privdata) {
-    int ret;
-    redisReply *reply = r;
-    cluster_async_data *cad = privdata;
-    redisClusterAsyncContext *acc;
-    redisClusterContext *cc;
-    redisAsyncContext *ac_retry = NULL;
-    int error_type;
-    cluster_node *node;
-    struct cmd *command;
-    int64_t now, next;
+/* Subscribe to the sharded channel: SSUBSCRIBE is sent to the master of
+ * its slot, on a connection of its own. fn gets the ssubscribe and
+ * smessage replies, and is called a last time with the sunsubscribe reply,
+ * or with NULL when the subscription ends with the context. Subscribing
+ * again to a channel only replaces fn and privdata.
+ *
+ * When the adapter installed the timer hooks, a subscription whose slot 
+ * moves (MOVED, or the server unsubscribing it) or whose connection is 
+ * lost is subscribed again on the new master, fn then gets another 
+ * ssubscribe reply. Without them the subscription ends there. */
+int redisClusterAsyncSSubscribe(redisClusterAsyncContext *acc, 
+    redisClusterCallbackFn *fn, void *privdata, const char *channel, size_t len)
+{
+    cluster_subscription *sub;
+    dictEntry *de;
+    sds name;
 
-    if(cad == NULL)
+    if(acc == NULL || acc->cc == NULL)
     {
-        goto error;
+        return REDIS_ERR;
     }
 
-    acc = cad->acc;
-    if(acc == NULL)
+    if(channel == NULL || len == 0)
     {
-        goto error;
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "channel is empty");
+        return REDIS_ERR;
     }
 
-    cc = acc->cc;
-    if(cc == NULL)
+    if(acc->subscriptions == NULL)
     {
-        goto error;
+        acc->subscriptions = dictCreate(&clusterSubscriptionsDictType, NULL);
+        if(acc->subscriptions == NULL)
+        {
+            __redisClusterAsyncSetError(acc, REDIS_ERR_OOM, "Out of memory");
+            return REDIS_ERR;
+        }
     }
 
-    command = cad->command;
-    if(command == NULL)
-    {
-        goto error;
-    }
-    
-    if(reply == NULL)
+    if(acc->sub_timer == NULL && acc->timer.schedule != NULL && 
+        cluster_async_wheel(acc) != NULL)
     {
-        //Note: 
-        //I can't decide witch is the best way to deal with connect 
-        //problem for hiredis cluster async api.
-        //But now the way is : when enough null reply for a node,
-        //we will update the route after the cluster node timeout.
-        //If you have a better idea, please contact with me. Thank you.
-        //My email: diguo58@gmail.com
-        
-        node = (cluster_node *)(ac->data);
-        ASSERT(node != NULL);
-        
-        __redisClusterAsyncSetError(acc, 
-            ac->err, ac->errstr);
-        
-        if(cc->update_route_time != 0)
+        acc->sub_timer = hi_alloc(sizeof(*acc->sub_timer));
+        if(acc->sub_timer != NULL)
         {
-            now = hi_usec_now();
-            if(now >= cc->update_route_time)
-            {
-                ret = cluster_update_route(cc);
-                if(ret != REDIS_OK)
-                {
-                    __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
-                        "route update error, please recreate redisClusterContext!");
-                }
-                
-                cc->update_route_time = 0LL;
-            }
-            
-            goto done;
+            hiwheel_timer_init(acc->sub_timer, cluster_async_resubscribe, acc);
         }
-        
-        node->failure_count ++;
-        if(node->failure_count > cc->max_redirect_count)
-        {
-            char *cluster_timeout_str;
-            int cluster_timeout_str_len;
-            int cluster_timeout;
-
-            node->failure_count = 0;
-            if(cc->update_route_time != 0)
-            {
-                goto done;
-            }
-            
-            cluster_timeout_str = cluster_config_get(cc, 
-                "cluster-node-timeout", &cluster_timeout_str_len);
-            if(cluster_timeout_str == NULL)
-            {
-                __redisClusterAsyncSetError(acc, 
-                    cc->err, cc->errstr);
-                goto done;
-            }
-
-            cluster_timeout = hi_atoi(cluster_timeout_str, 
-                cluster_timeout_str_len);
-            free(cluster_timeout_str);
-            if(cluster_timeout <= 0)
-            {
-                __redisClusterAsyncSetError(acc, 
-                    REDIS_ERR_OTHER, 
-                    "cluster_timeout_str convert to integer error");
-                goto done;
-            }
+    }
 
-            now = hi_usec_now();
-            if (now < 0) {
-                __redisClusterAsyncSetError(acc, 
-                    REDIS_ERR_OTHER, 
-                    "get now usec time error");
-                goto done;
-            }
+    name = sdsnewlen(channel, len);
+    if(name == NULL)
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
 
-            next = now + (cluster_timeout * 1000LL);
+    /* Still subscribed, or until its sunsubscribe reply comes back: 
+     * that reply will resubscribe it. */
+    de = dictFind(acc->subscriptions, name);
+    if(de != NULL)
+    {
+        sdsfree(name);
 
-            cc->update_route_time = next;
-            
-        }
+        sub = dictGetEntryVal(de);
+        sub->fn = fn;
+        sub->privdata = privdata;
+        sub->unsubscribed = 0;
 
-        goto done;
+        return REDIS_OK;
     }
 
-    error_type = cluster_reply_error_type(reply);
-
-    if(error_type > CLUSTER_NOT_ERR && error_type < CLUSTER_ERR_SENTINEL)
+    sub = hi_alloc(sizeof(*sub));
+    if(sub == NULL)
     {
-        cad->retry_count ++;
-        if(cad->retry_count > cc->max_redirect_count)
-        {
-            cad->retry_count = 0;
-            __redisClusterAsyncSetError(acc, 
-                REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT, 
-                "too many cluster redirect");
-            goto done;
-        }
-        
-        switch(error_type)
-        {
-        case CLUSTER_ERR_MOVED:
-            ac_retry = actx_get_after_update_route_by_slot(acc, command->slot_num);
-            if(ac_retry == NULL)
-            {
-                goto done;
-            }
-            
-            break;
-        case CLUSTER_ERR_ASK:
-            node = node_get_by_ask_error_reply(cc, reply);
-            if(node == NULL)
-            {
-                __redisClusterAsyncSetError(acc, 
-                    cc->err, cc->errstr);
-                goto done;
-            }
+        sdsfree(name);
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
 
-            ac_retry = actx_get_by_node(acc, node);
-            if(ac_retry == NULL)
-            {
-                __redisClusterAsyncSetError(acc, 
-                    REDIS_ERR_OTHER, "actx get by node error");
-                goto done;
-            }
-            else if(ac_retry->err)
-            {
-                __redisClusterAsyncSetError(acc, 
-                    ac_retry->err, ac_retry->errstr);
-                goto done;
-            }
+    sub->acc = acc;
+    sub->channel = name;
+    sub->slot_num = keyHashSlot(name, (int)len);
+    sub->fn = fn;
+    sub->privdata = privdata;
+    sub->ac = NULL;
+    sub->unsubscribed = 0;
 
-            ret = redisAsyncCommand(ac_retry,
-                NULL,NULL,REDIS_COMMAND_ASKING);
-            if(ret != REDIS_OK)
-            {
-                goto error;
-            }
-            
-            break;
-        case CLUSTER_ERR_TRYAGAIN:
-        case CLUSTER_ERR_CROSSSLOT:
-        case CLUSTER_ERR_CLUSTERDOWN:
-            ac_retry = ac;
-            
-            break;
-        default:
+    if(dictAdd(acc->subscriptions, sub->channel, sub) != DICT_OK)
+    {
+        sdsfree(name);
+        hi_free(sub);
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
 
-            goto done;
-            break;
+    if(cluster_async_subscribe(acc, sub) != REDIS_OK)
+    {
+        acc->sub_refresh = 1;
+        if(cluster_async_resubscribe_later(acc, acc->cc->backoff_min) == REDIS_OK)
+        {
+            acc->err = 0;
+            acc->errstr[0] = '\0';
+            return REDIS_OK;
         }
 
-        goto retry;
+        acc->sub_refresh = 0;
+        cluster_subscription_free(sub);
+        return REDIS_ERR;
     }
 
-done:
+    return REDIS_OK;
+}
 
-    if(acc->err)
+/* fn of the subscription is called a last time with the sunsubscribe 
+ * reply, or with NULL when it was waiting to be subscribed again. */
+int redisClusterAsyncSUnsubscribe(redisClusterAsyncContext *acc, 
+    const char *channel, size_t len)
+{
+    cluster_subscription *sub;
+    dictEntry *de;
+    sds name;
+
+    if(acc == NULL || channel == NULL)
     {
-        cad->callback(acc, NULL, cad->privdata);
+        return REDIS_ERR;
     }
-    else
+
+    name = sdsnewlen(channel, len);
+    if(name == NULL)
     {
-        cad->callback(acc, r, cad->privdata);
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
     }
 
-    if(cc->err)
+    de = acc->subscriptions == NULL ? NULL : 
+        dictFind(acc->subscriptions, name);
+    sdsfree(name);
+
+    if(de == NULL || ((cluster_subscription *)dictGetEntryVal(de))->unsubscribed)
     {
-        cc->err = 0;
-        memset(cc->errstr, '\0', strlen(cc->errstr));
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "channel is not subscribed");
+        return REDIS_ERR;
     }
 
-    if(acc->err)
+    sub = dictGetEntryVal(de);
+
+    if(sub->ac == NULL)
     {
-        acc->err = 0;
-        memset(acc->errstr, '\0', strlen(acc->errstr));
+        cluster_subscription_end(sub, NULL);
+        return REDIS_OK;
     }
-    
-    if(cad != NULL)
+
+    if(redisAsyncCommand(sub->ac, NULL, NULL, "SUNSUBSCRIBE %b", 
+        sub->channel, sdslen(sub->channel)) != REDIS_OK)
     {
-        cluster_async_data_free(cad);
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, "sunsubscribe error");
+        return REDIS_ERR;
     }
 
-    return;
+    sub->unsubscribed = 1;
 
-retry:
+    return REDIS_OK;
+}
 
-    ret = redisAsyncFormattedCommand(ac_retry,
-        redisClusterAsyncCallback,cad,command->cmd,command->clen);
-    if(ret != REDIS_OK)
+/* The subscriptions end with their connections, those waiting to be 
+ * subscribed again end now. */
+static void cluster_async_subscriptions_end(redisClusterAsyncContext *acc)
+{
+    cluster_subscription *sub;
+    dictIterator *di;
+    dictEntry *de;
+
+    if(acc->subscriptions == NULL)
     {
-        goto error;
+        return;
     }
-    
-    return;
 
-error:
+    if(acc->sub_timer != NULL)
+    {
+        hiwheel_del(acc->deadlines, acc->sub_timer);
+    }
 
-    if(cad != NULL)
+    di = dictGetIterator(acc->subscriptions);
+    while((de = dictNext(di)) != NULL)
     {
-        cluster_async_data_free(cad);
+        sub = dictGetEntryVal(de);
+        if(sub->ac == NULL)
+        {
+            cluster_subscription_end(sub, NULL);
+        }
+        else
+        {
+            sub->unsubscribed = 1;
+        }
     }
+    dictReleaseIterator(di);
 }
 
-int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc, 
-    redisClusterCallbackFn *fn, void *privdata, char *cmd, int len) {
+/* timeout is in usec: 0 for none, -1 for the context default. */
+static int __redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc, 
+    redisClusterCallbackFn *fn, void *privdata, char *cmd, int len, 
+    int64_t timeout) {
     
     redisClusterContext *cc;
     int status = REDIS_OK;
@@ -4846,6 +9407,15 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
         memset(acc->errstr, '\0', strlen(acc->errstr));
     }
 
+    if(acc->paused)
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_BACKPRESSURE, 
+            "Too many pending commands");
+        return REDIS_ERR;
+    }
+
+    cluster_topology_check(cc);
+
     command = command_get();
     if(command == NULL)
     {
@@ -4904,11 +9474,10 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
         goto error;
     }
     
+    /* Its error is kept, "node is unreachable" with an open breaker. */
     ac = actx_get_by_node(acc, node);
     if(ac == NULL)
     {
-        __redisClusterAsyncSetError(acc, 
-            REDIS_ERR_OTHER, "actx get by node error");
         goto error;
     }
     else if(ac->err)
@@ -4916,6 +9485,12 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
         __redisClusterAsyncSetError(acc, ac->err, ac->errstr);
         goto error;
     }
+    else if(redisAsyncIsPaused(ac))
+    {
+        __redisClusterAsyncSetError(acc, REDIS_ERR_BACKPRESSURE, 
+            "Too many pending commands for the node");
+        goto error;
+    }
 
     cad = cluster_async_data_get();
     if(cad == NULL)
@@ -4924,7 +9499,6 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
         goto error;
     }
 
-    cad->acc = acc;
     cad->command = command;
     cad->callback = fn;
     cad->privdata = privdata;
@@ -4933,9 +9507,29 @@ int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc,
         redisClusterAsyncCallback,cad,cmd,len);
     if(status != REDIS_OK)
     {
+        cad->command = NULL;
+        cluster_async_data_free(cad);
+        __redisClusterAsyncSetError(acc, REDIS_ERR_OTHER, 
+            "command send error");
         goto error;
     }
 
+    cad->acc = acc;
+    acc->pending ++;
+    cluster_async_flow_check(acc);
+
+    if(timeout < 0)
+    {
+        timeout = acc->command_timeout;
+    }
+
+    if(timeout > 0 && 
+        cluster_async_deadline_add(acc, cad, timeout) != REDIS_OK)
+    {
+        /* Already queued: only the deadline is lost. */
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+    }
+
     if(commands != NULL)
     {
         listRelease(commands);
@@ -4959,6 +9553,26 @@ error:
 }
 
 
+int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc, 
+    redisClusterCallbackFn *fn, void *privdata, char *cmd, int len) {
+    return __redisClusterAsyncFormattedCommand(acc, fn, privdata, 
+        cmd, len, -1);
+}
+
+/* Like redisClusterAsyncFormattedCommand, with a deadline overriding the
+ * context default, a zero tv meaning none. */
+int redisClusterAsyncFormattedCommandWithTimeout(redisClusterAsyncContext *acc, 
+    redisClusterCallbackFn *fn, void *privdata, const struct timeval tv, 
+    char *cmd, int len) {
+    if(tv.tv_sec < 0 || tv.tv_usec < 0)
+    {
+        return REDIS_ERR;
+    }
+
+    return __redisClusterAsyncFormattedCommand(acc, fn, privdata, 
+        cmd, len, (int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
 int redisClustervAsyncCommand(redisClusterAsyncContext *acc, 
     redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap) {
     int ret;
@@ -5017,6 +9631,60 @@ int redisClusterAsyncCommandArgv(redisClusterAsyncContext *acc,
     return ret;
 }
 
+int redisClusterAsyncCommandWithTimeout(redisClusterAsyncContext *acc, 
+    redisClusterCallbackFn *fn, void *privdata, const struct timeval tv, 
+    const char *format, ...) {
+    int ret;
+    char *cmd;
+    int len;
+    va_list ap;
+
+    if(acc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    va_start(ap,format);
+    len = redisvFormatCommand(&cmd,format,ap);
+    va_end(ap);
+
+    if (len == -1) {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    } else if (len == -2) {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OTHER,"Invalid format string");
+        return REDIS_ERR;
+    }
+
+    ret = redisClusterAsyncFormattedCommandWithTimeout(acc, fn, privdata, 
+        tv, cmd, len);
+
+    free(cmd);
+
+    return ret;
+}
+
+int redisClusterAsyncCommandArgvWithTimeout(redisClusterAsyncContext *acc, 
+    redisClusterCallbackFn *fn, void *privdata, const struct timeval tv, 
+    int argc, const char **argv, const size_t *argvlen) {
+    int ret;
+    char *cmd;
+    int len;
+    
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisClusterAsyncSetError(acc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    ret = redisClusterAsyncFormattedCommandWithTimeout(acc, fn, privdata, 
+        tv, cmd, len);
+
+    free(cmd);
+
+    return ret;
+}
+
 void redisClusterAsyncDisconnect(redisClusterAsyncContext *acc) {
 
     redisClusterContext *cc;
@@ -5039,6 +9707,8 @@ void redisClusterAsyncDisconnect(redisClusterAsyncContext *acc) {
     {
         return;
     }
+
+    cluster_async_subscriptions_end(acc);
     
     di = dictGetIterator(nodes);
 
@@ -5046,6 +9716,12 @@ void redisClusterAsyncDisconnect(redisClusterAsyncContext *acc) {
     {
         node = dictGetEntryVal(de);
 
+        ac = node->sub_acon;
+        if(ac != NULL && ac->err == 0)
+        {
+            redisAsyncDisconnect(ac);
+        }
+
         ac = node->acon;
 
         if(ac == NULL || ac->err)
@@ -5070,8 +9746,220 @@ void redisClusterAsyncFree(redisClusterAsyncContext *acc)
 
     cc = acc->cc;
 
+    /* The callbacks run while freeing the connections must not
+     * look like the cluster draining. */
+    acc->onFlow = NULL;
+    acc->health_interval = 0;
+
+    cluster_async_subscriptions_end(acc);
+
     redisClusterFree(cc);
 
+    if(acc->subscriptions != NULL)
+    {
+        dictRelease(acc->subscriptions);
+    }
+
+    if(acc->timer.cleanup)
+    {
+        acc->timer.cleanup(acc->timer.data);
+    }
+
+    if(acc->deadlines != NULL)
+    {
+        hi_free(acc->deadlines);
+    }
+
+    if(acc->health_timer != NULL)
+    {
+        hi_free(acc->health_timer);
+    }
+
+    if(acc->sub_timer != NULL)
+    {
+        hi_free(acc->sub_timer);
+    }
+
     hi_free(acc);
 }
 
+/* Apply fn to the connection of every node that has one. */
+static int actx_for_each(redisClusterAsyncContext *acc,
+    int (*fn)(redisAsyncContext *ac))
+{
+    dictIterator *di;
+    dictEntry *de;
+    cluster_node *node;
+    int ret = REDIS_OK;
+
+    if(acc == NULL || acc->cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if(acc->cc->nodes == NULL)
+    {
+        return REDIS_OK;
+    }
+
+    di = dictGetIterator(acc->cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        if(node->acon == NULL || node->acon->err)
+        {
+            continue;
+        }
+
+        if(fn(node->acon) != REDIS_OK)
+        {
+            ret = REDIS_ERR;
+        }
+    }
+
+    dictReleaseIterator(di);
+
+    return ret;
+}
+
+/* Coalesce the writes of every node connection, see redisAsyncCork().
+ * Connections opened while corked start corked as well. */
+int redisClusterAsyncCork(redisClusterAsyncContext *acc)
+{
+    if(acc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    acc->corked = 1;
+
+    return actx_for_each(acc, redisAsyncCork);
+}
+
+int redisClusterAsyncUncork(redisClusterAsyncContext *acc)
+{
+    if(acc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    acc->corked = 0;
+
+    return actx_for_each(acc, redisAsyncUncork);
+}
+
+int redisClusterAsyncFlush(redisClusterAsyncContext *acc)
+{
+    return actx_for_each(acc, redisAsyncFlush);
+}
+
+int redisClusterAsyncSetBatchLimits(redisClusterAsyncContext *acc,
+    size_t max_bytes, struct timeval max_latency)
+{
+    dictIterator *di;
+    dictEntry *de;
+    cluster_node *node;
+
+    if(acc == NULL || acc->cc == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    acc->batch_max_bytes = max_bytes;
+    acc->batch_max_latency = max_latency;
+
+    if(acc->cc->nodes == NULL)
+    {
+        return REDIS_OK;
+    }
+
+    di = dictGetIterator(acc->cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        if(node->acon != NULL)
+        {
+            redisAsyncSetBatchLimits(node->acon, max_bytes, max_latency);
+        }
+    }
+
+    dictReleaseIterator(di);
+
+    return REDIS_OK;
+}
+
+/* Cap the number of commands waiting for their callback across all nodes.
+ * high_pending 0 disables the limit. */
+int redisClusterAsyncSetFlowLimits(redisClusterAsyncContext *acc, 
+    size_t low_pending, size_t high_pending)
+{
+    if(acc == NULL || (high_pending && low_pending > high_pending))
+    {
+        return REDIS_ERR;
+    }
+
+    acc->low_pending = low_pending;
+    acc->high_pending = high_pending;
+
+    cluster_async_flow_check(acc);
+
+    return REDIS_OK;
+}
+
+/* Watermarks for every node connection, see redisAsyncSetFlowLimits().
+ * A paused node only refuses the commands routed to it. */
+int redisClusterAsyncSetNodeFlowLimits(redisClusterAsyncContext *acc, 
+    const redisFlowLimits *limits)
+{
+    dictIterator *di;
+    dictEntry *de;
+    cluster_node *node;
+
+    if(acc == NULL || acc->cc == NULL || limits == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    if((limits->high_pending && limits->low_pending > limits->high_pending) ||
+        (limits->high_bytes && limits->low_bytes > limits->high_bytes))
+    {
+        return REDIS_ERR;
+    }
+
+    acc->node_flow_limits = *limits;
+
+    if(acc->cc->nodes == NULL)
+    {
+        return REDIS_OK;
+    }
+
+    di = dictGetIterator(acc->cc->nodes);
+    while((de = dictNext(di)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        if(node->acon != NULL)
+        {
+            redisAsyncSetFlowLimits(node->acon, limits);
+        }
+    }
+
+    dictReleaseIterator(di);
+
+    return REDIS_OK;
+}
+
+redisClusterFlowCallback *redisClusterAsyncSetFlowCallback(
+    redisClusterAsyncContext *acc, redisClusterFlowCallback *fn)
+{
+    redisClusterFlowCallback *old;
+
+    if(acc == NULL)
+    {
+        return NULL;
+    }
+
+    old = acc->onFlow;
+    acc->onFlow = fn;
+
+    return old;
+}
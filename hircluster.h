@@ -10,11 +10,17 @@
 #define HIREDIS_VIP_PATCH 0
 
 #define REDIS_CLUSTER_SLOTS 16384
+#define REDIS_CLUSTER_NODE_NONE 0xffff  /* slot_index of an unserved slot */
 
 #define REDIS_ROLE_NULL     0
 #define REDIS_ROLE_MASTER   1
 #define REDIS_ROLE_SLAVE    2
 
+/* Circuit breaker of a node, guarding the reconnects to it. */
+#define REDIS_BREAKER_CLOSED    0   /* reconnect whenever needed */
+#define REDIS_BREAKER_OPEN      1   /* fail fast until retry_time */
+#define REDIS_BREAKER_HALF_OPEN 2   /* one reconnect is being tried */
+
 
 #define HIRCLUSTER_FLAG_NULL                0x0
 /* The flag to decide whether add slave node in 
@@ -29,9 +35,29 @@
   * table by 'cluster slots' command. Default   
   * is 'cluster nodes' command.*/
 #define HIRCLUSTER_FLAG_ROUTE_USE_SLOTS     0x4000
+/* The flag to always get the route table by 
+  * 'cluster nodes' command, even from servers 
+  * that have 'cluster shards' (Redis 7). */
+#define HIRCLUSTER_FLAG_ROUTE_USE_NODES     0x8000
+/* The flag to connect to all the nodes as soon 
+  * as the route is known, in parallel, rather 
+  * than on their first command. */
+#define HIRCLUSTER_FLAG_WARM_UP             0x10000
+/* The flag to speak RESP3 to the nodes, negotiated 
+  * by 'hello 3' when connecting. The route is still 
+  * fetched over RESP2. */
+#define HIRCLUSTER_FLAG_RESP3               0x20000
 
 struct dict;
 struct hilist;
+struct redisUringContext;
+struct redisClusterTopology;
+struct redisCache;
+struct redisSSLContext;
+
+/* Route shared by several cluster contexts, possibly used from different
+ * threads: one refresh serves them all. */
+typedef struct redisClusterTopology redisClusterTopology;
 
 typedef struct cluster_node
 {
@@ -42,10 +68,24 @@ typedef struct cluster_node
     uint8_t role;
     uint8_t myself;   /* myself ? */
     redisContext *con;
+    uint64_t con_generation;    /* changes whenever con is opened again */
     redisAsyncContext *acon;
+    redisAsyncContext *sub_acon;  /* sharded pub/sub, takes no other command */
     struct hilist *slots;
     struct hilist *slaves;
-    int failure_count;
+    int failure_count;      /* consecutive failures */
+    int breaker_failures;   /* connections lost in a row */
+    redisAsyncContext *lost_acon;   /* the last connection counted lost */
+    uint8_t breaker;        /* REDIS_BREAKER_* */
+    int64_t retry_time;     /* usec, no reconnect before while open */
+    int64_t backoff;        /* usec, last reconnect backoff */
+    int64_t ping_sent;      /* usec, health check PING in flight, 0: none */
+    int64_t latency;        /* usec, round trip of the last one answered */
+    int down;               /* the last health check failed */
+    uint64_t config_epoch;  /* 0 when unknown (cluster slots) */
+    redisContext *inv_con;  /* client side cache invalidations */
+    long long inv_id;       /* its client id */
+    int tracking;           /* CLIENT TRACKING on con: 1 on, -1 refused */
     void *data;     /* Not used by hiredis */
     struct hiarray *migrating;  /* copen_slot[] */
     struct hiarray *importing;  /* copen_slot[] */
@@ -87,6 +127,15 @@ typedef struct redisClusterContext {
     struct hiarray *slots;
 
     struct dict *nodes;
+
+    /* The route: the masters serving slots, and for every slot the index
+     * of its master in node_vector. */
+    cluster_node **node_vector;
+    uint32_t node_count;
+    uint16_t slot_index[REDIS_CLUSTER_SLOTS];
+
+    /* Same route as node pointers, kept for compatibility: read only,
+     * rewritten with slot_index on every route install. */
     cluster_node *table[REDIS_CLUSTER_SLOTS];
 
     uint64_t route_version;
@@ -94,13 +143,37 @@ typedef struct redisClusterContext {
     int max_redirect_count;
     int retry_count;
 
+    int breaker_threshold;  /* failures opening a node breaker, 0: never */
+    int64_t backoff_min;    /* usec, reconnect backoff bounds */
+    int64_t backoff_max;
+
     struct hilist *requests;
 
     int need_update_route;
     int64_t update_route_time;
+    int route_no_shards;    /* servers have no cluster shards */
 
     size_t password_len;
     sds password;
+
+    struct redisUringContext *uring;    /* shared by the node connections */
+
+    struct redisClusterTopology *topology;
+    uint64_t topology_version;          /* snapshot the route comes from */
+
+    sds topology_file;                  /* route cache, see SetOptionTopologyFile */
+    int topology_file_max_age;
+
+    struct dict *scripts;               /* see redisClusterScriptRegister */
+
+    struct redisCache *cache;           /* see SetOptionCache, not owned */
+
+    /* TLS of the node connections, see redisClusterSetOptionEnableSSL
+     * (hircluster_ssl.h). Not owned. */
+    struct redisSSLContext *ssl;
+    int (*ssl_init_fn)(redisContext *c, struct redisSSLContext *ssl);
+
+    uint64_t con_generation;            /* last one given to a node->con */
 } redisClusterContext;
 
 redisClusterContext *redisClusterConnect(const char *addrs, int flags);
@@ -119,9 +192,25 @@ int redisClusterSetOptionConnectNonBlock(redisClusterContext *cc);
 int redisClusterSetOptionParseSlaves(redisClusterContext *cc);
 int redisClusterSetOptionParseOpenSlots(redisClusterContext *cc);
 int redisClusterSetOptionRouteUseSlots(redisClusterContext *cc);
+int redisClusterSetOptionRouteUseNodes(redisClusterContext *cc);
+int redisClusterSetOptionWarmUp(redisClusterContext *cc);
+int redisClusterSetOptionResp3(redisClusterContext *cc);
 int redisClusterSetOptionConnectTimeout(redisClusterContext *cc, const struct timeval tv);
 int redisClusterSetOptionTimeout(redisClusterContext *cc, const struct timeval tv);
 int redisClusterSetOptionMaxRedirect(redisClusterContext *cc,  int max_redirect_count);
+int redisClusterSetOptionReconnectBackoff(redisClusterContext *cc, int failures, const struct timeval min, const struct timeval max);
+int redisClusterSetOptionIoUring(redisClusterContext *cc);
+int redisClusterSetOptionTopology(redisClusterContext *cc, redisClusterTopology *t);
+int redisClusterSetOptionTopologyFile(redisClusterContext *cc, const char *path, int max_age);
+int redisClusterSetOptionCache(redisClusterContext *cc, struct redisCache *cache);
+
+int redisClusterSaveTopology(redisClusterContext *cc, const char *path);
+
+int redisClusterScriptRegister(redisClusterContext *cc, const char *script, size_t len, char *sha);
+
+redisClusterTopology *redisClusterTopologyCreate(void);
+void redisClusterTopologyRelease(redisClusterTopology *t);
+uint64_t redisClusterTopologyVersion(redisClusterTopology *t);
 
 int redisClusterConnect2(redisClusterContext *cc);
 
@@ -141,6 +230,20 @@ int redisClusterAppendCommandArgv(redisClusterContext *cc, int argc, const char
 int redisClusterGetReply(redisClusterContext *cc, void **reply);
 void redisClusterReset(redisClusterContext *cc);
 
+/* MULTI/EXEC on the node serving the slot of all the keys of the
+ * transaction, see redisClusterTransactionExec. */
+typedef struct redisClusterTransaction redisClusterTransaction;
+
+redisClusterTransaction *redisClusterTransactionCreate(redisClusterContext *cc);
+void redisClusterTransactionFree(redisClusterTransaction *tx);
+int redisClusterTransactionWatch(redisClusterTransaction *tx, const char *key, size_t len);
+int redisClusterTransactionAppendFormattedCommand(redisClusterTransaction *tx, char *cmd, int len);
+int redisClusterTransactionvAppendCommand(redisClusterTransaction *tx, const char *format, va_list ap);
+int redisClusterTransactionAppendCommand(redisClusterTransaction *tx, const char *format, ...);
+int redisClusterTransactionAppendCommandArgv(redisClusterTransaction *tx, int argc, const char **argv, const size_t *argvlen);
+redisReply *redisClusterTransactionExec(redisClusterTransaction *tx);
+void redisClusterTransactionDiscard(redisClusterTransaction *tx);
+
 int cluster_update_route(redisClusterContext *cc);
 int test_cluster_update_route(redisClusterContext *cc);
 struct dict *parse_cluster_nodes(redisClusterContext *cc, char *str, int str_len, int flags);
@@ -150,10 +253,13 @@ struct dict *parse_cluster_slots(redisClusterContext *cc, redisReply *reply, int
 /*############redis cluster async############*/
 
 struct redisClusterAsyncContext;
+struct hiwheel;
+struct hiwheel_timer;
 
 typedef int (adapterAttachFn)(redisAsyncContext*, void*);
 
 typedef void (redisClusterCallbackFn)(struct redisClusterAsyncContext*, void*, void*);
+typedef void (redisClusterFlowCallback)(struct redisClusterAsyncContext*, int paused);
 
 /* Context for an async connection to Redis */
 typedef struct redisClusterAsyncContext {
@@ -177,18 +283,86 @@ typedef struct redisClusterAsyncContext {
     /* Called when the first write event was received. */
     redisConnectCallback *onConnect;
 
+    /* Write coalescing settings, applied to every node connection. */
+    int corked;
+    size_t batch_max_bytes;
+    struct timeval batch_max_latency;
+
+    /* Flow control: commands are refused with REDIS_ERR_BACKPRESSURE while
+     * paused, i.e. from the moment high_pending commands are waiting for their
+     * callback until no more than low_pending are left. */
+    size_t pending;
+    size_t low_pending;
+    size_t high_pending;
+    int paused;
+    redisClusterFlowCallback *onFlow;
+
+    /* Watermarks applied to every node connection. */
+    redisFlowLimits node_flow_limits;
+
+    /* Per command deadlines, tracked in a timing wheel that is advanced by
+     * the adapter timer below. 0 means no default deadline. */
+    int64_t command_timeout;
+    struct hiwheel *deadlines;
+    int64_t timer_expire; /* When the adapter timer fires next, 0 when not armed */
+
+    /* Timer hooks, installed by adapters that support command deadlines.
+     * schedule() (re)arms a one shot timer that must call
+     * redisClusterAsyncHandleTimer() when it fires. */
+    struct {
+        void *data;
+        void (*schedule)(void *data, struct timeval tv);
+        void (*cleanup)(void *data);
+    } timer;
+
+    /* Health checks, run from the timer above: every node is PINGed each
+     * health_interval usec (0: disabled), and a master that does not answer
+     * within health_timeout refreshes the route. */
+    int64_t health_interval;
+    int64_t health_timeout;
+    int64_t health_refresh_time;  /* last refresh the checks triggered */
+    struct hiwheel_timer *health_timer;
+    int route_updating;           /* a route request is in flight */
+
+    /* Sharded pub/sub subscriptions by channel. They are sent on a connection
+     * of their own to the master of their slot, and subscribed again from the
+     * timer above when that slot moves or that connection is lost. */
+    struct dict *subscriptions;
+    int sub_refresh;              /* refresh the route before resubscribing */
+    struct hiwheel_timer *sub_timer;
+
 } redisClusterAsyncContext;
 
 redisClusterAsyncContext *redisClusterAsyncConnect(const char *addrs, int flags);
+redisClusterAsyncContext *redisClusterAsyncConnect2(redisClusterContext *cc);
 int redisClusterAsyncSetConnectCallback(redisClusterAsyncContext *acc, redisConnectCallback *fn);
 int redisClusterAsyncSetDisconnectCallback(redisClusterAsyncContext *acc, redisDisconnectCallback *fn);
 int redisClusterAsyncFormattedCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, char *cmd, int len);
 int redisClustervAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap);
 int redisClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, ...);
 int redisClusterAsyncCommandArgv(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+int redisClusterAsyncFormattedCommandWithTimeout(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const struct timeval tv, char *cmd, int len);
+int redisClusterAsyncCommandWithTimeout(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const struct timeval tv, const char *format, ...);
+int redisClusterAsyncCommandArgvWithTimeout(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const struct timeval tv, int argc, const char **argv, const size_t *argvlen);
 void redisClusterAsyncDisconnect(redisClusterAsyncContext *acc);
 void redisClusterAsyncFree(redisClusterAsyncContext *acc);
 
+int redisClusterAsyncCork(redisClusterAsyncContext *acc);
+int redisClusterAsyncUncork(redisClusterAsyncContext *acc);
+int redisClusterAsyncFlush(redisClusterAsyncContext *acc);
+int redisClusterAsyncSetBatchLimits(redisClusterAsyncContext *acc, size_t max_bytes, struct timeval max_latency);
+
+int redisClusterAsyncSetCommandTimeout(redisClusterAsyncContext *acc, const struct timeval tv);
+void redisClusterAsyncHandleTimer(redisClusterAsyncContext *acc);
+int redisClusterAsyncSetHealthCheck(redisClusterAsyncContext *acc, const struct timeval interval, const struct timeval timeout);
+
+int redisClusterAsyncSSubscribe(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *channel, size_t len);
+int redisClusterAsyncSUnsubscribe(redisClusterAsyncContext *acc, const char *channel, size_t len);
+
+int redisClusterAsyncSetFlowLimits(redisClusterAsyncContext *acc, size_t low_pending, size_t high_pending);
+int redisClusterAsyncSetNodeFlowLimits(redisClusterAsyncContext *acc, const redisFlowLimits *limits);
+redisClusterFlowCallback *redisClusterAsyncSetFlowCallback(redisClusterAsyncContext *acc, redisClusterFlowCallback *fn);
+
 redisAsyncContext *actx_get_by_node(redisClusterAsyncContext *acc, cluster_node *node);
 
 #ifdef __cplusplus
@@ -0,0 +1,20 @@
+#include "hircluster_ssl.h"
+
+int redisClusterSetOptionEnableSSL(redisClusterContext *cc, redisSSLContext *ssl)
+{
+    if(cc == NULL || ssl == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    /* A connection is either TLS or io_uring, see SetOptionIoUring. */
+    if(cc->uring != NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    cc->ssl = ssl;
+    cc->ssl_init_fn = &redisInitiateSSLWithContext;
+
+    return REDIS_OK;
+}
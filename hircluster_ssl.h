@@ -0,0 +1,23 @@
+#ifndef __HIRCLUSTER_SSL_H
+#define __HIRCLUSTER_SSL_H
+
+#include "hircluster.h"
+#include "hiredis_ssl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Open every node connection of cc with TLS, the connections used to fetch
+ * the route included, synchronous and asynchronous alike. To be called
+ * before connecting; ssl is not owned and must outlive cc. Enable the
+ * session cache of ssl (redisSSLContextSetSessionCache) so that reconnects
+ * resume their sessions. Kept out of hircluster.c so that only the
+ * programs using it link with OpenSSL. */
+int redisClusterSetOptionEnableSSL(redisClusterContext *cc, redisSSLContext *ssl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
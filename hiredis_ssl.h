@@ -32,6 +32,8 @@
 #ifndef __HIREDIS_SSL_H
 #define __HIREDIS_SSL_H
 
+#include <stddef.h>  /* for size_t */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -104,6 +106,35 @@ redisSSLContext *redisCreateSSLContext(const char *cacert_filename, const char *
  */
 void redisFreeSSLContext(redisSSLContext *redis_ssl_ctx);
 
+/**
+ * Keep the TLS session of the last connection to every server (host and
+ * port), up to max_sessions servers, so that the next connections to it
+ * resume the session instead of doing a full handshake. The cache is shared
+ * by all the connections using redis_ssl_ctx, from any thread. It is
+ * disabled by default, and by a max_sessions of 0.
+ */
+int redisSSLContextSetSessionCache(redisSSLContext *redis_ssl_ctx, size_t max_sessions);
+
+/**
+ * Have the connections using redis_ssl_ctx hand the encryption over to the
+ * kernel (kTLS) once their handshake is done, so that their data is read
+ * and written with plain socket calls, and no longer copied and ciphered by
+ * OpenSSL in user space. Only the directions and ciphers the kernel takes
+ * are offloaded, the others staying on OpenSSL, see redisSSLGetKTLS().
+ * Returns REDIS_ERR when OpenSSL is built without kTLS (before 3.0, or
+ * OPENSSL_NO_KTLS). Disabled by default.
+ */
+int redisSSLContextEnableKTLS(redisSSLContext *redis_ssl_ctx);
+
+#define REDIS_SSL_KTLS_SEND 0x1
+#define REDIS_SSL_KTLS_RECV 0x2
+
+/**
+ * The directions of the SSL connection c offloaded to the kernel, a mask of
+ * REDIS_SSL_KTLS_SEND and REDIS_SSL_KTLS_RECV; 0 until its handshake is done.
+ */
+int redisSSLGetKTLS(redisContext *c);
+
 /**
  * Initiate SSL on an existing redisContext.
  *
@@ -0,0 +1,59 @@
+#ifndef __HIREDIS_URING_H
+#define __HIREDIS_URING_H
+
+#include <stddef.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct redisContext;
+
+/* An io_uring instance shared by any number of redisContext, together with
+ * an arena of read buffers registered with the kernel.
+ */
+typedef struct redisUringContext redisUringContext;
+
+/**
+ * Create an io_uring context with room for `entries` queued requests and
+ * `nbufs` registered read buffers of `bufsize` bytes each. Passing 0 picks
+ * the defaults. Returns NULL when io_uring is not available, callers are
+ * expected to keep using plain sockets in that case.
+ */
+redisUringContext *redisCreateUringContext(unsigned entries, unsigned nbufs,
+        size_t bufsize);
+
+/**
+ * Free a context created by redisCreateUringContext(). All the redisContext
+ * attached to it must have been freed before.
+ */
+void redisFreeUringContext(redisUringContext *u);
+
+/**
+ * Maximum time a blocking read or write waits for its completion. The
+ * default is to wait forever, like a blocking socket without SO_RCVTIMEO.
+ */
+void redisUringSetTimeout(redisUringContext *u, const struct timeval tv);
+
+/**
+ * Route the reads and writes of a connected redisContext through the ring.
+ * Must be called before anything is sent on the connection, and again
+ * after redisReconnect().
+ */
+int redisInitiateUring(struct redisContext *c, redisUringContext *u);
+
+/**
+ * Write the output buffers of `n` blocking contexts with a single submission
+ * and wait until all of them are flushed. A read is queued alongside every
+ * write, so the replies land in the registered buffers without further
+ * system calls. Contexts not attached to `u` are written with
+ * redisBufferWrite().
+ */
+int redisUringFlush(redisUringContext *u, struct redisContext **cs, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __HIREDIS_URING_H */
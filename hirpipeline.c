@@ -0,0 +1,422 @@
+#include "fmacros.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "hirpipeline.h"
+#include "hiutil.h"
+
+#define PIPELINE_REQUEST_PENDING    0
+#define PIPELINE_REQUEST_DONE       1
+#define PIPELINE_REQUEST_REDIRECTED 2
+
+typedef struct pipeline_request
+{
+    char *cmd;
+    int len;
+    void *reply;
+    int result;                 /* set by the thread running the batch */
+    int state;                  /* published from result, under the lock */
+    pthread_cond_t cond;
+    struct pipeline_request *next;
+}pipeline_request;
+
+struct redisClusterPipeline
+{
+    redisClusterContext *cc;
+
+    pthread_mutex_t lock;
+    pipeline_request *head;     /* requests waiting for the next batch */
+    pipeline_request *tail;
+    int busy;                   /* a caller is running a batch */
+    int max_batch;
+
+    int err;
+    char errstr[128];
+};
+
+static void pipeline_set_error(redisClusterPipeline *p, int type, const char *str)
+{
+    size_t len;
+
+    p->err = type;
+    len = strlen(str);
+    len = len < (sizeof(p->errstr) - 1) ? len : (sizeof(p->errstr) - 1);
+    memcpy(p->errstr, str, len);
+    p->errstr[len] = '\0';
+}
+
+static int pipeline_reply_is_redirect(redisReply *reply)
+{
+    if(reply == NULL || reply->type != REDIS_REPLY_ERROR || reply->str == NULL)
+    {
+        return 0;
+    }
+
+    return strncmp(reply->str, "MOVED ", 6) == 0 ||
+        strncmp(reply->str, "ASK ", 4) == 0 ||
+        strncmp(reply->str, "TRYAGAIN", 8) == 0;
+}
+
+redisClusterPipeline *redisClusterPipelineCreate(redisClusterContext *cc)
+{
+    redisClusterPipeline *p;
+
+    if(cc == NULL)
+    {
+        return NULL;
+    }
+
+    p = hi_alloc(sizeof(*p));
+    if(p == NULL)
+    {
+        return NULL;
+    }
+
+    memset(p, 0, sizeof(*p));
+
+    if(pthread_mutex_init(&p->lock, NULL) != 0)
+    {
+        hi_free(p);
+        return NULL;
+    }
+
+    p->cc = cc;
+    p->max_batch = REDIS_CLUSTER_PIPELINE_MAX_BATCH;
+
+    return p;
+}
+
+void redisClusterPipelineFree(redisClusterPipeline *p)
+{
+    if(p == NULL)
+    {
+        return;
+    }
+
+    ASSERT(p->head == NULL && p->busy == 0);
+
+    redisClusterFree(p->cc);
+    pthread_mutex_destroy(&p->lock);
+    hi_free(p);
+}
+
+int redisClusterPipelineSetMaxBatch(redisClusterPipeline *p, int max_batch)
+{
+    if(p == NULL || max_batch <= 0)
+    {
+        return REDIS_ERR;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->max_batch = max_batch;
+    pthread_mutex_unlock(&p->lock);
+
+    return REDIS_OK;
+}
+
+int redisClusterPipelineGetError(redisClusterPipeline *p, char *errstr, size_t len)
+{
+    int err;
+
+    if(p == NULL)
+    {
+        return REDIS_ERR_OTHER;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    err = p->err;
+    if(errstr != NULL && len > 0)
+    {
+        snprintf(errstr, len, "%s", p->errstr);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return err;
+}
+
+/* Send the batch as one pipeline and collect its replies. Called without
+ * the lock held; the batch is private to the calling thread, which only
+ * sets the result of the requests: their state is what their callers wait
+ * on, published under the lock once the batch is over. Requests that could
+ * not be appended are left PENDING so the caller can requeue them,
+ * redirected ones are marked REDIRECTED and executed one by one once the
+ * pipeline has been drained and the route refreshed. */
+static void pipeline_execute(redisClusterPipeline *p, pipeline_request *batch)
+{
+    redisClusterContext *cc = p->cc;
+    pipeline_request *r, *appended_end;
+    int err = 0;
+    char errstr[128];
+
+    errstr[0] = '\0';
+
+    /* Stop at the first failure: a multi-key command may have been
+     * partially appended, so the commands after it cannot be matched
+     * with their replies anymore. */
+    for(r = batch; r != NULL; r = r->next)
+    {
+        if(redisClusterAppendFormattedCommand(cc, r->cmd, r->len) != REDIS_OK)
+        {
+            err = cc->err ? cc->err : REDIS_ERR_OTHER;
+            snprintf(errstr, sizeof(errstr), "%s", cc->errstr);
+            r->reply = NULL;
+            r->result = PIPELINE_REQUEST_DONE;
+            r = r->next;
+            break;
+        }
+    }
+
+    appended_end = r;
+
+    for(r = batch; r != appended_end; r = r->next)
+    {
+        if(r->result == PIPELINE_REQUEST_DONE)
+        {
+            break;
+        }
+
+        if(redisClusterGetReply(cc, &r->reply) != REDIS_OK || r->reply == NULL)
+        {
+            err = cc->err ? cc->err : REDIS_ERR_OTHER;
+            snprintf(errstr, sizeof(errstr), "%s", cc->errstr);
+            r->reply = NULL;
+            r->result = PIPELINE_REQUEST_DONE;
+            continue;
+        }
+
+        if(pipeline_reply_is_redirect(r->reply))
+        {
+            freeReplyObject(r->reply);
+            r->reply = NULL;
+            r->result = PIPELINE_REQUEST_REDIRECTED;
+            continue;
+        }
+
+        r->result = PIPELINE_REQUEST_DONE;
+    }
+
+    /* An error may leave unread replies on some connections:
+     * let redisClusterReset drop them together with the connections. */
+    if(err)
+    {
+        cc->err = err;
+        snprintf(cc->errstr, sizeof(cc->errstr), "%s", errstr);
+    }
+
+    redisClusterReset(cc);
+
+    for(r = batch; r != appended_end; r = r->next)
+    {
+        if(r->result != PIPELINE_REQUEST_REDIRECTED)
+        {
+            continue;
+        }
+
+        r->reply = redisClusterFormattedCommand(cc, r->cmd, r->len);
+        if(r->reply == NULL)
+        {
+            err = cc->err ? cc->err : REDIS_ERR_OTHER;
+            snprintf(errstr, sizeof(errstr), "%s", cc->errstr);
+        }
+        r->result = PIPELINE_REQUEST_DONE;
+    }
+
+    if(err)
+    {
+        pthread_mutex_lock(&p->lock);
+        pipeline_set_error(p, err, errstr);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+void *redisClusterPipelineFormattedCommand(redisClusterPipeline *p, char *cmd, int len)
+{
+    pipeline_request req, *batch, *first, *last, *r, *next;
+    int n;
+
+    if(p == NULL || cmd == NULL || len <= 0)
+    {
+        return NULL;
+    }
+
+    req.cmd = cmd;
+    req.len = len;
+    req.reply = NULL;
+    req.result = PIPELINE_REQUEST_PENDING;
+    req.state = PIPELINE_REQUEST_PENDING;
+    req.next = NULL;
+    if(pthread_cond_init(&req.cond, NULL) != 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    if(p->tail == NULL)
+    {
+        p->head = p->tail = &req;
+    }
+    else
+    {
+        p->tail->next = &req;
+        p->tail = &req;
+    }
+
+    /* Only the state, set under the lock, tells that req is out of every
+     * batch and queue: a wake up alone does not. */
+    while(req.state == PIPELINE_REQUEST_PENDING)
+    {
+        if(p->busy)
+        {
+            pthread_cond_wait(&req.cond, &p->lock);
+            continue;
+        }
+
+        /* Nobody is talking to the cluster: take up to max_batch queued
+         * requests and run them on behalf of their callers. */
+        p->busy = 1;
+
+        batch = last = p->head;
+        for(n = 1; n < p->max_batch && last->next != NULL; n ++)
+        {
+            last = last->next;
+        }
+        p->head = last->next;
+        if(p->head == NULL)
+        {
+            p->tail = NULL;
+        }
+        last->next = NULL;
+
+        pthread_mutex_unlock(&p->lock);
+        pipeline_execute(p, batch);
+        pthread_mutex_lock(&p->lock);
+
+        p->busy = 0;
+
+        /* Everyone done gets woken up with its reply. Requests that were
+         * never sent go back to the front of the queue, in their order. */
+        first = last = NULL;
+        for(r = batch; r != NULL; r = next)
+        {
+            next = r->next;
+            r->next = NULL;
+
+            if(r->result == PIPELINE_REQUEST_DONE)
+            {
+                r->state = PIPELINE_REQUEST_DONE;
+                if(r != &req)
+                {
+                    pthread_cond_signal(&r->cond);
+                }
+                continue;
+            }
+
+            if(first == NULL)
+            {
+                first = r;
+            }
+            else
+            {
+                last->next = r;
+            }
+            last = r;
+        }
+
+        if(first != NULL)
+        {
+            last->next = p->head;
+            p->head = first;
+            if(p->tail == NULL)
+            {
+                p->tail = last;
+            }
+        }
+
+        /* Hand the connection over to the oldest waiter. */
+        if(p->head != NULL && p->head != &req)
+        {
+            pthread_cond_signal(&p->head->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    pthread_cond_destroy(&req.cond);
+
+    return req.reply;
+}
+
+void *redisClusterPipelinevCommand(redisClusterPipeline *p, const char *format, va_list ap)
+{
+    redisReply *reply;
+    char *cmd;
+    int len;
+
+    if(p == NULL)
+    {
+        return NULL;
+    }
+
+    len = redisvFormatCommand(&cmd, format, ap);
+    if(len == -1)
+    {
+        pthread_mutex_lock(&p->lock);
+        pipeline_set_error(p, REDIS_ERR_OOM, "Out of memory");
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+    else if(len == -2)
+    {
+        pthread_mutex_lock(&p->lock);
+        pipeline_set_error(p, REDIS_ERR_OTHER, "Invalid format string");
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+
+    reply = redisClusterPipelineFormattedCommand(p, cmd, len);
+
+    free(cmd);
+
+    return reply;
+}
+
+void *redisClusterPipelineCommand(redisClusterPipeline *p, const char *format, ...)
+{
+    va_list ap;
+    redisReply *reply = NULL;
+
+    va_start(ap, format);
+    reply = redisClusterPipelinevCommand(p, format, ap);
+    va_end(ap);
+
+    return reply;
+}
+
+void *redisClusterPipelineCommandArgv(redisClusterPipeline *p, int argc, const char **argv, const size_t *argvlen)
+{
+    redisReply *reply;
+    char *cmd;
+    int len;
+
+    if(p == NULL)
+    {
+        return NULL;
+    }
+
+    len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+    if(len == -1)
+    {
+        pthread_mutex_lock(&p->lock);
+        pipeline_set_error(p, REDIS_ERR_OOM, "Out of memory");
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+
+    reply = redisClusterPipelineFormattedCommand(p, cmd, len);
+
+    free(cmd);
+
+    return reply;
+}
@@ -0,0 +1,54 @@
+
+#ifndef __HIRPIPELINE_H
+#define __HIRPIPELINE_H
+
+#include "hircluster.h"
+
+#define REDIS_CLUSTER_PIPELINE_MAX_BATCH 1024
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct redisClusterPipeline;
+
+/* Thread-safe front end for a blocking redisClusterContext.
+ *
+ * Any number of threads may issue commands concurrently. Commands that
+ * arrive while a batch is on the wire are queued; the next caller to find
+ * the connection idle sends the whole queue as one pipeline (one write per
+ * node) and hands every waiting thread its own reply. Under low concurrency
+ * a call costs the same as redisClusterCommand, under high concurrency one
+ * round trip is shared by the whole batch.
+ *
+ * Replies that are MOVED/ASK/TRYAGAIN redirections are resolved by
+ * re-executing the command with redisClusterFormattedCommand after the
+ * batch, so callers never see them.
+ *
+ * Blocking commands (BLPOP, WAIT, ...) stall every command batched with
+ * them and should use a dedicated redisClusterContext. */
+typedef struct redisClusterPipeline redisClusterPipeline;
+
+/* The pipeline takes ownership of cc, which must not be used directly
+ * afterwards; it is freed by redisClusterPipelineFree. */
+redisClusterPipeline *redisClusterPipelineCreate(redisClusterContext *cc);
+void redisClusterPipelineFree(redisClusterPipeline *p);
+
+int redisClusterPipelineSetMaxBatch(redisClusterPipeline *p, int max_batch);
+
+/* Like their redisClusterCommand counterparts: return a reply to be freed
+ * with freeReplyObject, or NULL on error. */
+void *redisClusterPipelineFormattedCommand(redisClusterPipeline *p, char *cmd, int len);
+void *redisClusterPipelinevCommand(redisClusterPipeline *p, const char *format, va_list ap);
+void *redisClusterPipelineCommand(redisClusterPipeline *p, const char *format, ...);
+void *redisClusterPipelineCommandArgv(redisClusterPipeline *p, int argc, const char **argv, const size_t *argvlen);
+
+/* Copy the last error seen by the pipeline into errstr. Returns the error
+ * code, 0 when no command failed yet. */
+int redisClusterPipelineGetError(redisClusterPipeline *p, char *errstr, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,431 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np(), CPU_SET() */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "hirpool.h"
+#include "hiutil.h"
+#include "adapters/epoll.h"
+
+typedef struct pool_request
+{
+    struct pool_request *next;
+    redisClusterCallbackFn *fn;
+    void *privdata;
+    int len;
+    char cmd[];                 /* formatted command */
+}pool_request;
+
+typedef struct pool_loop
+{
+    struct redisClusterAsyncPool *pool;
+    int index;
+
+    pthread_t thread;
+    int started;
+
+    redisEpollLoop *loop;
+    redisClusterAsyncContext *acc;
+
+    int efd;                    /* eventfd waking the loop up */
+    redisEpollEvents *wakeup;
+
+    pool_request *head;         /* pushed by any thread, LIFO */
+    int stop;
+}pool_loop;
+
+struct redisClusterAsyncPool
+{
+    int nloops;
+    pool_loop *loops;
+    unsigned next;              /* round-robin for foreign threads */
+};
+
+/* The loop, if any, running the calling thread. */
+static __thread pool_loop *pool_current;
+
+/* Multi-producer, single consumer queue: producers push with a CAS on the
+ * head, the loop takes the whole list at once. Only the push that finds the
+ * queue empty has to wake the loop up, later ones are picked up by the same
+ * drain. */
+static void pool_push(pool_loop *l, pool_request *req)
+{
+    pool_request *head;
+    uint64_t one = 1;
+
+    head = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+    do
+    {
+        req->next = head;
+    } while(!__atomic_compare_exchange_n(&l->head, &head, req, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(head == NULL)
+    {
+        while(write(l->efd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+}
+
+/* Take the queued requests, oldest first. */
+static pool_request *pool_take(pool_loop *l)
+{
+    pool_request *req, *next, *list = NULL;
+
+    req = __atomic_exchange_n(&l->head, NULL, __ATOMIC_ACQUIRE);
+    while(req != NULL)
+    {
+        next = req->next;
+        req->next = list;
+        list = req;
+        req = next;
+    }
+
+    return list;
+}
+
+static void pool_wakeup(void *privdata)
+{
+    pool_loop *l = privdata;
+    pool_request *req, *next;
+    uint64_t n;
+
+    while(read(l->efd, &n, sizeof(n)) < 0 && errno == EINTR);
+
+    /* The queue is drained by redisClusterAsyncPoolFree once joined. */
+    if(__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+    {
+        redisEpollLoopStop(l->loop);
+        return;
+    }
+
+    for(req = pool_take(l); req != NULL; req = next)
+    {
+        next = req->next;
+
+        if(redisClusterAsyncFormattedCommand(l->acc, req->fn,
+            req->privdata, req->cmd, req->len) != REDIS_OK && req->fn)
+        {
+            req->fn(l->acc, NULL, req->privdata);
+        }
+
+        hi_free(req);
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    pool_loop *l = arg;
+
+    pool_current = l;
+
+    /* The eventfd stays registered, so this only returns once stopped. */
+    redisEpollLoopRun(l->loop);
+
+    pool_current = NULL;
+
+    return NULL;
+}
+
+static void pool_pin(pthread_t thread, int index)
+{
+    cpu_set_t set;
+    long ncpu;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu <= 0)
+    {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+redisClusterAsyncPool *redisClusterAsyncPoolCreate(const char *addrs, int nloops, int flags)
+{
+    redisClusterAsyncPool *pool;
+    pool_loop *l;
+    int i;
+
+    if(addrs == NULL)
+    {
+        return NULL;
+    }
+
+    if(nloops <= 0)
+    {
+        nloops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if(nloops <= 0)
+        {
+            nloops = 1;
+        }
+    }
+
+    pool = hi_alloc(sizeof(*pool));
+    if(pool == NULL)
+    {
+        return NULL;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+
+    pool->loops = hi_alloc(nloops*sizeof(*pool->loops));
+    if(pool->loops == NULL)
+    {
+        hi_free(pool);
+        return NULL;
+    }
+
+    memset(pool->loops, 0, nloops*sizeof(*pool->loops));
+    pool->nloops = nloops;
+
+    for(i = 0; i < nloops; i++)
+    {
+        l = &pool->loops[i];
+        l->pool = pool;
+        l->index = i;
+        l->efd = -1;
+    }
+
+    for(i = 0; i < nloops; i++)
+    {
+        l = &pool->loops[i];
+
+        l->loop = redisEpollLoopCreate(REDIS_EPOLL_BACKEND_AUTO);
+        if(l->loop == NULL)
+        {
+            goto error;
+        }
+
+        l->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if(l->efd < 0)
+        {
+            goto error;
+        }
+
+        l->wakeup = redisEpollWatchFd(l->loop, l->efd, pool_wakeup, l);
+        if(l->wakeup == NULL)
+        {
+            goto error;
+        }
+
+        l->acc = redisClusterAsyncConnect(addrs, flags);
+        if(l->acc == NULL || l->acc->err)
+        {
+            goto error;
+        }
+
+        if(redisClusterEpollAttach(l->acc, l->loop) != REDIS_OK)
+        {
+            goto error;
+        }
+    }
+
+    /* The contexts are only touched by their thread from now on. */
+    for(i = 0; i < nloops; i++)
+    {
+        l = &pool->loops[i];
+
+        if(pthread_create(&l->thread, NULL, pool_thread, l) != 0)
+        {
+            goto error;
+        }
+
+        l->started = 1;
+        pool_pin(l->thread, i);
+    }
+
+    return pool;
+
+error:
+
+    redisClusterAsyncPoolFree(pool);
+    return NULL;
+}
+
+void redisClusterAsyncPoolFree(redisClusterAsyncPool *pool)
+{
+    pool_request *req, *next;
+    pool_loop *l;
+    uint64_t one = 1;
+    int i;
+
+    if(pool == NULL)
+    {
+        return;
+    }
+
+    ASSERT(pool_current == NULL || pool_current->pool != pool);
+
+    for(i = 0; i < pool->nloops; i++)
+    {
+        l = &pool->loops[i];
+        if(!l->started)
+        {
+            continue;
+        }
+
+        __atomic_store_n(&l->stop, 1, __ATOMIC_RELEASE);
+        while(write(l->efd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+
+    for(i = 0; i < pool->nloops; i++)
+    {
+        l = &pool->loops[i];
+
+        if(l->started)
+        {
+            pthread_join(l->thread, NULL);
+        }
+
+        for(req = pool_take(l); req != NULL; req = next)
+        {
+            next = req->next;
+            if(req->fn)
+            {
+                req->fn(l->acc, NULL, req->privdata);
+            }
+            hi_free(req);
+        }
+
+        /* Calls the callbacks of the commands in flight. */
+        if(l->acc != NULL)
+        {
+            redisClusterAsyncFree(l->acc);
+        }
+
+        if(l->wakeup != NULL)
+        {
+            redisEpollUnwatchFd(l->wakeup);
+        }
+
+        if(l->efd >= 0)
+        {
+            close(l->efd);
+        }
+
+        redisEpollLoopFree(l->loop);
+    }
+
+    hi_free(pool->loops);
+    hi_free(pool);
+}
+
+int redisClusterAsyncPoolSize(redisClusterAsyncPool *pool)
+{
+    return pool == NULL ? 0 : pool->nloops;
+}
+
+int redisClusterAsyncPoolCurrent(redisClusterAsyncPool *pool)
+{
+    if(pool == NULL || pool_current == NULL || pool_current->pool != pool)
+    {
+        return -1;
+    }
+
+    return pool_current->index;
+}
+
+int redisClusterAsyncPoolFormattedCommand(redisClusterAsyncPool *pool,
+    redisClusterCallbackFn *fn, void *privdata, char *cmd, int len)
+{
+    pool_request *req;
+    pool_loop *l;
+    unsigned i;
+
+    if(pool == NULL || cmd == NULL || len <= 0)
+    {
+        return REDIS_ERR;
+    }
+
+    /* Already on one of the loops: stay there. */
+    if(pool_current != NULL && pool_current->pool == pool)
+    {
+        return redisClusterAsyncFormattedCommand(pool_current->acc,
+            fn, privdata, cmd, len);
+    }
+
+    i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    l = &pool->loops[i % pool->nloops];
+
+    if(__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+    {
+        return REDIS_ERR;
+    }
+
+    req = hi_alloc(sizeof(*req) + len);
+    if(req == NULL)
+    {
+        return REDIS_ERR;
+    }
+
+    req->fn = fn;
+    req->privdata = privdata;
+    req->len = len;
+    memcpy(req->cmd, cmd, len);
+
+    pool_push(l, req);
+
+    return REDIS_OK;
+}
+
+int redisClusterAsyncPoolvCommand(redisClusterAsyncPool *pool,
+    redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap)
+{
+    char *cmd = NULL;
+    int len;
+    int status;
+
+    /* Out of memory (-1) or an invalid format string (-2): no command */
+    len = redisvFormatCommand(&cmd, format, ap);
+    if(len == -1 || len == -2)
+    {
+        return REDIS_ERR;
+    }
+
+    status = redisClusterAsyncPoolFormattedCommand(pool, fn, privdata, cmd, len);
+
+    free(cmd);
+
+    return status;
+}
+
+int redisClusterAsyncPoolCommand(redisClusterAsyncPool *pool,
+    redisClusterCallbackFn *fn, void *privdata, const char *format, ...)
+{
+    va_list ap;
+    int status;
+
+    va_start(ap, format);
+    status = redisClusterAsyncPoolvCommand(pool, fn, privdata, format, ap);
+    va_end(ap);
+
+    return status;
+}
+
+int redisClusterAsyncPoolCommandArgv(redisClusterAsyncPool *pool,
+    redisClusterCallbackFn *fn, void *privdata, int argc, const char **argv,
+    const size_t *argvlen)
+{
+    char *cmd = NULL;
+    int len;
+    int status;
+
+    len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+    if(len == -1)
+    {
+        return REDIS_ERR;
+    }
+
+    status = redisClusterAsyncPoolFormattedCommand(pool, fn, privdata, cmd, len);
+
+    free(cmd);
+
+    return status;
+}
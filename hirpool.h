@@ -0,0 +1,57 @@
+#ifndef __HIRPOOL_H
+#define __HIRPOOL_H
+
+#include "hircluster.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct redisClusterAsyncPool;
+
+/* Multi-threaded front end for the cluster async API.
+ *
+ * The pool runs N threads, each with its own built-in event loop
+ * (adapters/epoll.h) and its own redisClusterAsyncContext, i.e. its own
+ * connection to every master. Commands may be issued from any thread:
+ * they are pushed on a lock-free queue of one of the loops, which is woken
+ * up through an eventfd only when its queue was empty. A command issued from
+ * a loop thread (e.g. from a reply callback) runs on that same loop without
+ * going through the queue; commands from other threads are spread over the
+ * loops round-robin.
+ *
+ * Callbacks run on the loop thread that sent the command, with that loop's
+ * redisClusterAsyncContext as first argument. A queued command that cannot
+ * be sent (backpressure, bad key...) gets its callback called with a NULL
+ * reply and acc->err set; on a loop thread the error is returned directly,
+ * as by redisClusterAsyncFormattedCommand. */
+typedef struct redisClusterAsyncPool redisClusterAsyncPool;
+
+/* Connect nloops contexts to the cluster (nloops <= 0: one per online CPU)
+ * and start their threads, pinned to one CPU each. flags are those of
+ * redisClusterAsyncConnect. Returns NULL on error. */
+redisClusterAsyncPool *redisClusterAsyncPoolCreate(const char *addrs, int nloops, int flags);
+
+/* Stop and join the loops, then free the contexts. Callbacks of the commands
+ * still queued or in flight are called with a NULL reply from the calling
+ * thread. Must not be called from a loop thread. */
+void redisClusterAsyncPoolFree(redisClusterAsyncPool *pool);
+
+int redisClusterAsyncPoolSize(redisClusterAsyncPool *pool);
+
+/* Index of the loop running the calling thread, -1 when the caller is not
+ * one of the loops of pool. */
+int redisClusterAsyncPoolCurrent(redisClusterAsyncPool *pool);
+
+/* From a foreign thread, return REDIS_ERR only when the command could not
+ * be queued (out of memory, pool stopping, bad format). */
+int redisClusterAsyncPoolFormattedCommand(redisClusterAsyncPool *pool, redisClusterCallbackFn *fn, void *privdata, char *cmd, int len);
+int redisClusterAsyncPoolvCommand(redisClusterAsyncPool *pool, redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisClusterAsyncPoolCommand(redisClusterAsyncPool *pool, redisClusterCallbackFn *fn, void *privdata, const char *format, ...);
+int redisClusterAsyncPoolCommandArgv(redisClusterAsyncPool *pool, redisClusterCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+#include <string.h>
+
+#include "hisha1.h"
+
+#define ROL(v, n)   (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void
+hisha1_transform(uint32_t state[5], const unsigned char block[64])
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    }
+
+    for (i = 16; i < 80; i++) {
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        t = ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void
+hisha1_init(struct hisha1 *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->count = 0;
+}
+
+void
+hisha1_update(struct hisha1 *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t used, n;
+
+    used = (size_t)(ctx->count % 64);
+    ctx->count += len;
+
+    while (len > 0) {
+        n = 64 - used;
+        if (n > len) {
+            n = len;
+        }
+
+        /* Whole blocks are hashed in place. */
+        if (used == 0 && n == 64) {
+            hisha1_transform(ctx->state, p);
+        } else {
+            memcpy(ctx->block + used, p, n);
+            if (used + n == 64) {
+                hisha1_transform(ctx->state, ctx->block);
+            }
+        }
+
+        used = (used + n) % 64;
+        p += n;
+        len -= n;
+    }
+}
+
+void
+hisha1_final(struct hisha1 *ctx, unsigned char digest[HISHA1_DIGEST_LEN])
+{
+    unsigned char pad[72];
+    uint64_t bits;
+    size_t used, n;
+    int i;
+
+    bits = ctx->count * 8;
+    used = (size_t)(ctx->count % 64);
+
+    /* 0x80, zeros up to 56 mod 64, then the length in bits, big endian. */
+    n = used < 56 ? 56 - used : 120 - used;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        pad[n + i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+
+    hisha1_update(ctx, pad, n + 8);
+
+    for (i = 0; i < HISHA1_DIGEST_LEN; i++) {
+        digest[i] = (unsigned char)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+void
+hisha1_hex(const void *data, size_t len, char hex[HISHA1_HEX_LEN + 1])
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[HISHA1_DIGEST_LEN];
+    struct hisha1 ctx;
+    int i;
+
+    hisha1_init(&ctx);
+    hisha1_update(&ctx, data, len);
+    hisha1_final(&ctx, digest);
+
+    for (i = 0; i < HISHA1_DIGEST_LEN; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[HISHA1_HEX_LEN] = '\0';
+}
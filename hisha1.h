@@ -0,0 +1,28 @@
+#ifndef __HISHA1_H_
+#define __HISHA1_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * SHA-1, only used to name Lua scripts the way the server does (EVALSHA),
+ * so that a script can be called by digest without loading it first.
+ */
+
+#define HISHA1_DIGEST_LEN   20
+#define HISHA1_HEX_LEN      (HISHA1_DIGEST_LEN * 2)
+
+struct hisha1 {
+    uint32_t state[5];
+    uint64_t count;               /* # bytes hashed */
+    unsigned char block[64];
+};
+
+void hisha1_init(struct hisha1 *ctx);
+void hisha1_update(struct hisha1 *ctx, const void *data, size_t len);
+void hisha1_final(struct hisha1 *ctx, unsigned char digest[HISHA1_DIGEST_LEN]);
+
+/* Lower case hex digest of data, NUL terminated, as SCRIPT LOAD returns it. */
+void hisha1_hex(const void *data, size_t len, char hex[HISHA1_HEX_LEN + 1]);
+
+#endif
@@ -0,0 +1,496 @@
+#define _GNU_SOURCE /* syscall(), MAP_POPULATE */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "hiutil.h"
+#include "hiuring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HI_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HI_HAVE_IO_URING
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+/* Internal tag for the timeout request of hiuring_submit_and_wait(). */
+#define HIURING_TIMEOUT_TAG UINT64_MAX
+
+struct hiuring {
+    int                  fd;
+    unsigned             features;
+
+    unsigned             *sq_head;
+    unsigned             *sq_tail;
+    unsigned             *sq_mask;
+    unsigned             *sq_entries;
+    unsigned             *sq_array;
+    struct io_uring_sqe  *sqes;
+    unsigned             sqe_tail;   /* local tail, published on submit */
+
+    unsigned             *cq_head;
+    unsigned             *cq_tail;
+    unsigned             *cq_mask;
+    struct io_uring_cqe  *cqes;
+
+    void                 *sq_ring;
+    size_t               sq_ring_sz;
+    void                 *cq_ring;
+    size_t               cq_ring_sz;
+    size_t               sqes_sz;
+
+    struct __kernel_timespec ts;
+};
+
+struct hiuring *
+hiuring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    struct hiuring *ring;
+    char *sq, *cq;
+
+    ring = hi_alloc(sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        hi_free(ring);
+        return NULL;
+    }
+
+    ring->features = p.features;
+
+    ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_sz > ring->sq_ring_sz) {
+            ring->sq_ring_sz = ring->cq_ring_sz;
+        }
+        ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto error;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto error;
+        }
+    }
+
+    ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return ring;
+
+error:
+    hiuring_destroy(ring);
+    return NULL;
+}
+
+void
+hiuring_destroy(struct hiuring *ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_sz);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+    }
+
+    close(ring->fd);
+    hi_free(ring);
+}
+
+int
+hiuring_fd(struct hiuring *ring)
+{
+    return ring->fd;
+}
+
+unsigned
+hiuring_pending(struct hiuring *ring)
+{
+    return ring->sqe_tail - *ring->sq_tail;
+}
+
+static struct io_uring_sqe *
+hiuring_get_sqe(struct hiuring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - head >= *ring->sq_entries) {
+        return NULL;
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+int
+hiuring_prep_poll_add(struct hiuring *ring, int fd, unsigned mask, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = hiuring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -EBUSY;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+int
+hiuring_prep_poll_remove(struct hiuring *ring, uint64_t target, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = hiuring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -EBUSY;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+static int
+hiuring_prep_rw(struct hiuring *ring, int op, int fd, const void *buf,
+                size_t len, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = hiuring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -EBUSY;
+    }
+
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+int
+hiuring_prep_recv(struct hiuring *ring, int fd, void *buf, size_t len, uint64_t user_data)
+{
+    return hiuring_prep_rw(ring, IORING_OP_RECV, fd, buf, len, user_data);
+}
+
+int
+hiuring_prep_send(struct hiuring *ring, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    return hiuring_prep_rw(ring, IORING_OP_SEND, fd, buf, len, user_data);
+}
+
+int
+hiuring_prep_read_fixed(struct hiuring *ring, int fd, void *buf, size_t len,
+                        int buf_index, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    ret = hiuring_prep_rw(ring, IORING_OP_READ_FIXED, fd, buf, len, user_data);
+    if (ret != 0) {
+        return ret;
+    }
+
+    sqe = &ring->sqes[(ring->sqe_tail - 1) & *ring->sq_mask];
+    sqe->buf_index = (uint16_t)buf_index;
+
+    return 0;
+}
+
+int
+hiuring_prep_cancel(struct hiuring *ring, uint64_t target, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = hiuring_get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -EBUSY;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+int
+hiuring_register_buffers(struct hiuring *ring, const struct iovec *iov, unsigned nr)
+{
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, nr) < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int
+hiuring_enter(struct hiuring *ring, unsigned wait_nr, int64_t timeout_usec)
+{
+#ifdef IORING_ENTER_EXT_ARG
+    struct io_uring_getevents_arg arg;
+#endif
+    unsigned submit, flags = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+    int ret;
+
+    submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+
+        if (timeout_usec >= 0) {
+            ring->ts.tv_sec = timeout_usec / 1000000;
+            ring->ts.tv_nsec = (timeout_usec % 1000000) * 1000;
+
+#ifdef IORING_ENTER_EXT_ARG
+            if (ring->features & IORING_FEAT_EXT_ARG) {
+                memset(&arg, 0, sizeof(arg));
+                arg.ts = (uint64_t)(uintptr_t)&ring->ts;
+                flags |= IORING_ENTER_EXT_ARG;
+                argp = &arg;
+                argsz = sizeof(arg);
+            } else
+#endif
+            {
+                struct io_uring_sqe *sqe = hiuring_get_sqe(ring);
+
+                /* No room for the timeout: don't block. */
+                if (sqe == NULL) {
+                    wait_nr = 0;
+                    flags &= ~IORING_ENTER_GETEVENTS;
+                } else {
+                    sqe->opcode = IORING_OP_TIMEOUT;
+                    sqe->fd = -1;
+                    sqe->addr = (uint64_t)(uintptr_t)&ring->ts;
+                    sqe->len = 1;
+                    sqe->off = wait_nr;
+                    sqe->user_data = HIURING_TIMEOUT_TAG;
+                    submit++;
+                    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+                }
+            }
+        }
+    }
+
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr,
+                           flags, argp, argsz);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return errno == ETIME ? 0 : -errno;
+    }
+
+    return ret;
+}
+
+int
+hiuring_submit(struct hiuring *ring)
+{
+    return hiuring_enter(ring, 0, -1);
+}
+
+int
+hiuring_submit_and_wait(struct hiuring *ring, unsigned wait_nr, int64_t timeout_usec)
+{
+    return hiuring_enter(ring, wait_nr, timeout_usec);
+}
+
+unsigned
+hiuring_reap(struct hiuring *ring, struct hiuring_cqe *cqes, unsigned max)
+{
+    unsigned head, tail, n = 0;
+    struct io_uring_cqe *cqe;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && n < max) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        head++;
+
+        if (cqe->user_data == HIURING_TIMEOUT_TAG) {
+            continue;
+        }
+
+        cqes[n].user_data = cqe->user_data;
+        cqes[n].res = cqe->res;
+        n++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+#else /* !HI_HAVE_IO_URING */
+
+struct hiuring *
+hiuring_create(unsigned entries)
+{
+    (void)entries;
+    return NULL;
+}
+
+void
+hiuring_destroy(struct hiuring *ring)
+{
+    (void)ring;
+}
+
+int
+hiuring_fd(struct hiuring *ring)
+{
+    (void)ring;
+    return -1;
+}
+
+unsigned
+hiuring_pending(struct hiuring *ring)
+{
+    (void)ring;
+    return 0;
+}
+
+int
+hiuring_prep_poll_add(struct hiuring *ring, int fd, unsigned mask, uint64_t user_data)
+{
+    (void)ring; (void)fd; (void)mask; (void)user_data;
+    return -ENOSYS;
+}
+
+int
+hiuring_prep_poll_remove(struct hiuring *ring, uint64_t target, uint64_t user_data)
+{
+    (void)ring; (void)target; (void)user_data;
+    return -ENOSYS;
+}
+
+int
+hiuring_prep_recv(struct hiuring *ring, int fd, void *buf, size_t len, uint64_t user_data)
+{
+    (void)ring; (void)fd; (void)buf; (void)len; (void)user_data;
+    return -ENOSYS;
+}
+
+int
+hiuring_prep_send(struct hiuring *ring, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    (void)ring; (void)fd; (void)buf; (void)len; (void)user_data;
+    return -ENOSYS;
+}
+
+int
+hiuring_prep_read_fixed(struct hiuring *ring, int fd, void *buf, size_t len,
+                        int buf_index, uint64_t user_data)
+{
+    (void)ring; (void)fd; (void)buf; (void)len; (void)buf_index; (void)user_data;
+    return -ENOSYS;
+}
+
+int
+hiuring_prep_cancel(struct hiuring *ring, uint64_t target, uint64_t user_data)
+{
+    (void)ring; (void)target; (void)user_data;
+    return -ENOSYS;
+}
+
+int
+hiuring_register_buffers(struct hiuring *ring, const struct iovec *iov, unsigned nr)
+{
+    (void)ring; (void)iov; (void)nr;
+    return -ENOSYS;
+}
+
+int
+hiuring_submit(struct hiuring *ring)
+{
+    (void)ring;
+    return -ENOSYS;
+}
+
+int
+hiuring_submit_and_wait(struct hiuring *ring, unsigned wait_nr, int64_t timeout_usec)
+{
+    (void)ring; (void)wait_nr; (void)timeout_usec;
+    return -ENOSYS;
+}
+
+unsigned
+hiuring_reap(struct hiuring *ring, struct hiuring_cqe *cqes, unsigned max)
+{
+    (void)ring; (void)cqes; (void)max;
+    return 0;
+}
+
+#endif /* HI_HAVE_IO_URING */
@@ -0,0 +1,55 @@
+#ifndef __HIURING_H_
+#define __HIURING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls, so that no
+ * external library is needed. Only the operations used by hiredis-vip are
+ * exposed. On systems without io_uring hiuring_create() returns NULL and the
+ * callers fall back to plain system calls.
+ */
+
+#define HIURING_POLL_IN     0x001
+#define HIURING_POLL_OUT    0x004
+#define HIURING_POLL_ERR    0x008
+#define HIURING_POLL_HUP    0x010
+
+struct hiuring;
+
+struct hiuring_cqe {
+    uint64_t user_data;
+    int32_t  res;
+};
+
+struct hiuring *hiuring_create(unsigned entries);
+void hiuring_destroy(struct hiuring *ring);
+int hiuring_fd(struct hiuring *ring);
+
+/* Queue a request. Fail with -EBUSY when the submission queue is full,
+ * call hiuring_submit() and retry. */
+int hiuring_prep_poll_add(struct hiuring *ring, int fd, unsigned mask, uint64_t user_data);
+int hiuring_prep_poll_remove(struct hiuring *ring, uint64_t target, uint64_t user_data);
+int hiuring_prep_recv(struct hiuring *ring, int fd, void *buf, size_t len, uint64_t user_data);
+int hiuring_prep_send(struct hiuring *ring, int fd, const void *buf, size_t len, uint64_t user_data);
+int hiuring_prep_read_fixed(struct hiuring *ring, int fd, void *buf, size_t len, int buf_index, uint64_t user_data);
+int hiuring_prep_cancel(struct hiuring *ring, uint64_t target, uint64_t user_data);
+
+/* Register buffers for hiuring_prep_read_fixed(). */
+int hiuring_register_buffers(struct hiuring *ring, const struct iovec *iov, unsigned nr);
+
+/* Submit the queued requests and wait until at least wait_nr completions
+ * are available or timeout_usec elapsed (-1 waits forever). Return the
+ * number of submitted requests or -errno. -ETIME is not an error. */
+int hiuring_submit(struct hiuring *ring);
+int hiuring_submit_and_wait(struct hiuring *ring, unsigned wait_nr, int64_t timeout_usec);
+
+/* Pop up to max completions, return their number. */
+unsigned hiuring_reap(struct hiuring *ring, struct hiuring_cqe *cqes, unsigned max);
+
+/* Number of queued, not yet submitted requests. */
+unsigned hiuring_pending(struct hiuring *ring);
+
+#endif
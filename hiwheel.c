@@ -0,0 +1,190 @@
+#include <stdlib.h>
+
+#include "hiutil.h"
+#include "hiwheel.h"
+
+static void
+hiwheel_link(struct hiwheel_timer *head, struct hiwheel_timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void
+hiwheel_unlink(struct hiwheel_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* Put t in the slot matching its remaining time. */
+static void
+hiwheel_place(struct hiwheel *w, struct hiwheel_timer *t)
+{
+    int64_t delta;
+    int level;
+
+    if (t->expire <= w->now) {
+        t->expire = w->now + 1;
+    }
+
+    delta = t->expire - w->now;
+
+    for (level = 0; level < HIWHEEL_LEVELS - 1; level++) {
+        if (delta < (1LL << ((level + 1) * HIWHEEL_SLOT_BITS))) {
+            break;
+        }
+    }
+
+    if (level == HIWHEEL_LEVELS - 1 &&
+        delta >= (1LL << (HIWHEEL_LEVELS * HIWHEEL_SLOT_BITS))) {
+        t->expire = w->now + (1LL << (HIWHEEL_LEVELS * HIWHEEL_SLOT_BITS)) - 1;
+    }
+
+    hiwheel_link(&w->slots[level][(t->expire >> (level * HIWHEEL_SLOT_BITS)) &
+                                  HIWHEEL_SLOT_MASK], t);
+}
+
+/*
+ * Move the timers of a higher level slot down to where they belong now. The
+ * ones expiring at the current tick go to its level 0 slot, which is run
+ * right after the cascade: placing them would push them a tick later.
+ */
+static void
+hiwheel_cascade(struct hiwheel *w, int level, int idx)
+{
+    struct hiwheel_timer *head, *t;
+
+    head = &w->slots[level][idx];
+
+    while (head->next != head) {
+        t = head->next;
+        hiwheel_unlink(t);
+
+        if (t->expire <= w->now) {
+            hiwheel_link(&w->slots[0][w->now & HIWHEEL_SLOT_MASK], t);
+        } else {
+            hiwheel_place(w, t);
+        }
+    }
+}
+
+void
+hiwheel_init(struct hiwheel *w, int64_t now_usec, int64_t tick_usec)
+{
+    int level, idx;
+
+    ASSERT(tick_usec > 0);
+
+    w->tick_usec = tick_usec;
+    w->now = now_usec / tick_usec;
+    w->count = 0;
+
+    for (level = 0; level < HIWHEEL_LEVELS; level++) {
+        for (idx = 0; idx < HIWHEEL_SLOTS; idx++) {
+            w->slots[level][idx].next = &w->slots[level][idx];
+            w->slots[level][idx].prev = &w->slots[level][idx];
+        }
+    }
+}
+
+/* (Re)arm t to fire at expire_usec, rounded up to the next tick. */
+void
+hiwheel_add(struct hiwheel *w, struct hiwheel_timer *t, int64_t expire_usec)
+{
+    if (hiwheel_timer_pending(t)) {
+        hiwheel_del(w, t);
+    }
+
+    t->expire = (expire_usec + w->tick_usec - 1) / w->tick_usec;
+    hiwheel_place(w, t);
+    w->count++;
+}
+
+void
+hiwheel_del(struct hiwheel *w, struct hiwheel_timer *t)
+{
+    if (!hiwheel_timer_pending(t)) {
+        return;
+    }
+
+    hiwheel_unlink(t);
+    w->count--;
+}
+
+/*
+ * Advance the wheel up to now_usec, calling every timer that expired on the
+ * way. A timer is unlinked before its callback runs, so the callback may add
+ * it again or add and remove other timers. Returns the number of timers
+ * that fired.
+ */
+size_t
+hiwheel_advance(struct hiwheel *w, int64_t now_usec)
+{
+    struct hiwheel_timer *head, *t;
+    int64_t target;
+    size_t fired = 0;
+    int level, idx;
+
+    target = now_usec / w->tick_usec;
+
+    while (w->now < target) {
+        if (w->count == 0) {
+            w->now = target;
+            break;
+        }
+
+        w->now++;
+
+        idx = (int)(w->now & HIWHEEL_SLOT_MASK);
+        for (level = 1; level < HIWHEEL_LEVELS && idx == 0; level++) {
+            idx = (int)((w->now >> (level * HIWHEEL_SLOT_BITS)) & HIWHEEL_SLOT_MASK);
+            hiwheel_cascade(w, level, idx);
+        }
+
+        head = &w->slots[0][w->now & HIWHEEL_SLOT_MASK];
+        while (head->next != head) {
+            t = head->next;
+            hiwheel_unlink(t);
+            w->count--;
+            fired++;
+            t->fn(t, t->data);
+        }
+    }
+
+    return fired;
+}
+
+/*
+ * Time in usec until the wheel needs to be advanced again, or -1 when no
+ * timer is pending. This is either the next level 0 slot holding a timer or
+ * the next cascade, whichever comes first.
+ */
+int64_t
+hiwheel_next_timeout(struct hiwheel *w)
+{
+    int64_t tick;
+    int i;
+
+    if (w->count == 0) {
+        return -1;
+    }
+
+    for (i = 1; i <= HIWHEEL_SLOTS; i++) {
+        tick = w->now + i;
+        if ((tick & HIWHEEL_SLOT_MASK) == 0) {
+            break;
+        }
+
+        if (w->slots[0][tick & HIWHEEL_SLOT_MASK].next !=
+            &w->slots[0][tick & HIWHEEL_SLOT_MASK]) {
+            break;
+        }
+    }
+
+    return i * w->tick_usec;
+}
@@ -0,0 +1,64 @@
+#ifndef __HIWHEEL_H_
+#define __HIWHEEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hierarchical timing wheel.
+ *
+ * Level 0 has one slot per tick, every following level has slots that are
+ * HIWHEEL_SLOTS times wider. Timers are placed at the level their remaining
+ * time fits in and cascade down one level each time the level below wraps
+ * around, so adding, removing and expiring a timer is O(1) whatever the
+ * number of pending timers. With 1ms ticks the wheel covers about 4.6 hours;
+ * later deadlines are clamped to the last slot.
+ */
+
+#define HIWHEEL_LEVELS      4
+#define HIWHEEL_SLOT_BITS   6
+#define HIWHEEL_SLOTS       (1 << HIWHEEL_SLOT_BITS)
+#define HIWHEEL_SLOT_MASK   (HIWHEEL_SLOTS - 1)
+
+struct hiwheel_timer;
+
+typedef void (*hiwheel_timer_fn)(struct hiwheel_timer *, void *);
+
+struct hiwheel_timer {
+    struct hiwheel_timer *next;
+    struct hiwheel_timer *prev;
+    int64_t              expire;  /* absolute tick */
+    hiwheel_timer_fn     fn;
+    void                 *data;
+};
+
+struct hiwheel {
+    int64_t              tick_usec;
+    int64_t              now;     /* current tick */
+    size_t               count;   /* # pending timers */
+    struct hiwheel_timer slots[HIWHEEL_LEVELS][HIWHEEL_SLOTS]; /* list heads */
+};
+
+static inline void
+hiwheel_timer_init(struct hiwheel_timer *t, hiwheel_timer_fn fn, void *data)
+{
+    t->next = NULL;
+    t->prev = NULL;
+    t->expire = 0;
+    t->fn = fn;
+    t->data = data;
+}
+
+static inline int
+hiwheel_timer_pending(const struct hiwheel_timer *t)
+{
+    return t->next != NULL;
+}
+
+void hiwheel_init(struct hiwheel *w, int64_t now_usec, int64_t tick_usec);
+void hiwheel_add(struct hiwheel *w, struct hiwheel_timer *t, int64_t expire_usec);
+void hiwheel_del(struct hiwheel *w, struct hiwheel_timer *t);
+size_t hiwheel_advance(struct hiwheel *w, int64_t now_usec);
+int64_t hiwheel_next_timeout(struct hiwheel *w);
+
+#endif
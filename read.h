@@ -50,6 +50,7 @@
 
 #if 1 //shenzheng 2015-8-10 redis cluster
 #define REDIS_ERR_CLUSTER_TOO_MANY_REDIRECT 7
+#define REDIS_ERR_BACKPRESSURE 8 /* Command refused, too many commands in flight */
 #endif //shenzheng 2015-8-10 redis cluster
 
 #define REDIS_REPLY_STRING 1
@@ -40,6 +40,7 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <sys/socket.h>
 #endif
 
 #include <openssl/ssl.h>
@@ -48,15 +49,66 @@
 #include "win32.h"
 #include "async_private.h"
 #include "hiredis_ssl.h"
+#include "net.h"
+
+/* Kernel TLS: OpenSSL 3.0 or later, built with it (Linux, FreeBSD). */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HIREDIS_USE_KTLS
+#endif
 
 void __redisSetError(redisContext *c, int type, const char *str);
 
+#ifdef _WIN32
+typedef CRITICAL_SECTION sslLockType;
+static void sslLockInit(sslLockType* l) {
+    InitializeCriticalSection(l);
+}
+static void sslLockAcquire(sslLockType* l) {
+    EnterCriticalSection(l);
+}
+static void sslLockRelease(sslLockType* l) {
+    LeaveCriticalSection(l);
+}
+static void sslLockDestroy(sslLockType* l) {
+    DeleteCriticalSection(l);
+}
+#else
+typedef pthread_mutex_t sslLockType;
+static void sslLockInit(sslLockType *l) {
+    pthread_mutex_init(l, NULL);
+}
+static void sslLockAcquire(sslLockType *l) {
+    pthread_mutex_lock(l);
+}
+static void sslLockRelease(sslLockType *l) {
+    pthread_mutex_unlock(l);
+}
+static void sslLockDestroy(sslLockType *l) {
+    pthread_mutex_destroy(l);
+}
+#endif
+
+/* A session kept for the next connection to the same server, see
+ * redisSSLContextSetSessionCache(). */
+typedef struct redisSSLSession {
+    char *peer;                     /* host:port */
+    SSL_SESSION *session;
+    struct redisSSLSession *next;   /* most recently stored first */
+} redisSSLSession;
+
 struct redisSSLContext {
     /* Associated OpenSSL SSL_CTX as created by redisCreateSSLContext() */
     SSL_CTX *ssl_ctx;
 
     /* Requested SNI, or NULL */
     char *server_name;
+
+    /* Client side session cache, shared by the connections (and threads)
+     * using the context. Disabled when max_sessions is 0. */
+    sslLockType sessions_lock;
+    redisSSLSession *sessions;
+    size_t nsessions;
+    size_t max_sessions;
 };
 
 /* The SSL connection context is attached to SSL/TLS connections as a privdata. */
@@ -80,10 +132,24 @@ typedef struct redisSSL {
      * should resume whenever a read takes place, if possible
      */
     int pendingWrite;
+
+    /**
+     * host:port of the server when its sessions are cached, or NULL
+     */
+    char *peer;
+
+    /** Whether the directions offloaded to the kernel are yet to be known */
+    int ktlsCheck;
+
+    /** REDIS_SSL_KTLS_SEND and REDIS_SSL_KTLS_RECV, the directions offloaded */
+    int ktls;
 } redisSSL;
 
 /* Forward declaration */
 redisContextFuncs redisContextSSLFuncs;
+#ifdef HIREDIS_USE_KTLS
+redisContextFuncs redisContextKTLSFuncs;
+#endif
 
 /**
  * OpenSSL global initialization and locking handling callbacks.
@@ -95,30 +161,6 @@ redisContextFuncs redisContextSSLFuncs;
 #endif
 
 #ifdef HIREDIS_USE_CRYPTO_LOCKS
-#ifdef _WIN32
-typedef CRITICAL_SECTION sslLockType;
-static void sslLockInit(sslLockType* l) {
-    InitializeCriticalSection(l);
-}
-static void sslLockAcquire(sslLockType* l) {
-    EnterCriticalSection(l);
-}
-static void sslLockRelease(sslLockType* l) {
-    LeaveCriticalSection(l);
-}
-#else
-typedef pthread_mutex_t sslLockType;
-static void sslLockInit(sslLockType *l) {
-    pthread_mutex_init(l, NULL);
-}
-static void sslLockAcquire(sslLockType *l) {
-    pthread_mutex_lock(l);
-}
-static void sslLockRelease(sslLockType *l) {
-    pthread_mutex_unlock(l);
-}
-#endif
-
 static sslLockType* ossl_locks;
 
 static void opensslDoLock(int mode, int lkid, const char *f, int line) {
@@ -163,6 +205,152 @@ int redisInitOpenSSL(void)
     return REDIS_OK;
 }
 
+/**
+ * Client side session cache.
+ */
+
+static redisSSLSession **sslSessionFind(redisSSLContext *ctx, const char *peer) {
+    redisSSLSession **p;
+
+    for (p = &ctx->sessions; *p != NULL; p = &(*p)->next) {
+        if (strcmp((*p)->peer, peer) == 0)
+            break;
+    }
+    return p;
+}
+
+static void sslSessionFree(redisSSLSession *s) {
+    SSL_SESSION_free(s->session);
+    hi_free(s->peer);
+    hi_free(s);
+}
+
+/* Drop the least recently stored sessions past max_sessions. */
+static void sslSessionTrim(redisSSLContext *ctx) {
+    redisSSLSession **p, *s;
+    size_t n = 0;
+
+    for (p = &ctx->sessions; *p != NULL && n < ctx->max_sessions; p = &(*p)->next)
+        n++;
+
+    while ((s = *p) != NULL) {
+        *p = s->next;
+        sslSessionFree(s);
+        ctx->nsessions--;
+    }
+}
+
+/* Called by OpenSSL with every new session of a connection whose sessions
+ * are cached: at the end of a TLS 1.2 handshake, and with each ticket the
+ * server sends afterwards with TLS 1.3. Takes the reference on success. */
+static int sslSessionNew(SSL *ssl, SSL_SESSION *session) {
+    redisSSL *rssl = SSL_get_app_data(ssl);
+    redisSSLContext *ctx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    redisSSLSession **p, *s;
+
+    if (rssl == NULL || rssl->peer == NULL || ctx == NULL)
+        return 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (!SSL_SESSION_is_resumable(session))
+        return 0;
+#endif
+
+    sslLockAcquire(&ctx->sessions_lock);
+
+    if (ctx->max_sessions == 0) {
+        sslLockRelease(&ctx->sessions_lock);
+        return 0;
+    }
+
+    p = sslSessionFind(ctx, rssl->peer);
+    if ((s = *p) != NULL) {
+        *p = s->next;
+        SSL_SESSION_free(s->session);
+    } else {
+        s = hi_calloc(1, sizeof(*s));
+        if (s == NULL || (s->peer = hi_strdup(rssl->peer)) == NULL) {
+            sslLockRelease(&ctx->sessions_lock);
+            hi_free(s);
+            return 0;
+        }
+        ctx->nsessions++;
+    }
+
+    s->session = session;
+    s->next = ctx->sessions;
+    ctx->sessions = s;
+
+    sslSessionTrim(ctx);
+
+    sslLockRelease(&ctx->sessions_lock);
+    return 1;
+}
+
+/* Offer the session last stored for the server of c, if any, and have the
+ * new ones of the connection stored. */
+static int sslSessionResume(redisContext *c, redisSSLContext *ctx, redisSSL *rssl) {
+    redisSSLSession *s;
+    size_t len;
+
+    len = strlen(c->tcp.host) + 8;
+    rssl->peer = hi_malloc(len);
+    if (rssl->peer == NULL)
+        return REDIS_ERR;
+    snprintf(rssl->peer, len, "%s:%d", c->tcp.host, c->tcp.port);
+
+    SSL_set_app_data(rssl->ssl, rssl);
+
+    sslLockAcquire(&ctx->sessions_lock);
+    s = *sslSessionFind(ctx, rssl->peer);
+    if (s != NULL)
+        SSL_set_session(rssl->ssl, s->session);
+    sslLockRelease(&ctx->sessions_lock);
+
+    return REDIS_OK;
+}
+
+int redisSSLContextSetSessionCache(redisSSLContext *ctx, size_t max_sessions)
+{
+    if (!ctx)
+        return REDIS_ERR;
+
+    sslLockAcquire(&ctx->sessions_lock);
+    ctx->max_sessions = max_sessions;
+    sslSessionTrim(ctx);
+    sslLockRelease(&ctx->sessions_lock);
+
+    return REDIS_OK;
+}
+
+int redisSSLContextEnableKTLS(redisSSLContext *ctx)
+{
+    if (!ctx)
+        return REDIS_ERR;
+
+#ifdef HIREDIS_USE_KTLS
+    SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_ENABLE_KTLS);
+    return REDIS_OK;
+#else
+    return REDIS_ERR;
+#endif
+}
+
+int redisSSLGetKTLS(redisContext *c)
+{
+    redisSSL *rssl;
+
+    if (!c || (c->funcs != &redisContextSSLFuncs
+#ifdef HIREDIS_USE_KTLS
+        && c->funcs != &redisContextKTLSFuncs
+#endif
+        ))
+        return 0;
+
+    rssl = c->privctx;
+    return rssl ? rssl->ktls : 0;
+}
+
 /**
  * redisSSLContext helper context destruction.
  */
@@ -202,6 +390,10 @@ void redisFreeSSLContext(redisSSLContext *ctx)
         ctx->ssl_ctx = NULL;
     }
 
+    ctx->max_sessions = 0;
+    sslSessionTrim(ctx);
+    sslLockDestroy(&ctx->sessions_lock);
+
     hi_free(ctx);
 }
 
@@ -218,12 +410,20 @@ redisSSLContext *redisCreateSSLContext(const char *cacert_filename, const char *
     if (ctx == NULL)
         goto error;
 
+    sslLockInit(&ctx->sessions_lock);
+
     ctx->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
     if (!ctx->ssl_ctx) {
         if (error) *error = REDIS_SSL_CTX_CREATE_FAILED;
         goto error;
     }
 
+    /* Sessions are only stored by sslSessionNew(), when enabled. */
+    SSL_CTX_set_app_data(ctx->ssl_ctx, ctx);
+    SSL_CTX_set_session_cache_mode(ctx->ssl_ctx,
+            SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx->ssl_ctx, sslSessionNew);
+
     SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
     SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_PEER, NULL);
 
@@ -261,12 +461,35 @@ error:
     return NULL;
 }
 
+/**
+ * Once the handshake is done, what the kernel encrypts and decrypts is
+ * written and read with plain socket calls, see redisContextKTLSFuncs.
+ * OpenSSL only offloads the ciphers the kernel has, and nothing when the
+ * tls module is not loaded: the connection then stays on SSL_read() and
+ * SSL_write().
+ */
+static void sslKTLSCheck(redisContext *c, redisSSL *rssl) {
+    rssl->ktlsCheck = 0;
+
+#ifdef HIREDIS_USE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(rssl->ssl)))
+        rssl->ktls |= REDIS_SSL_KTLS_SEND;
+    if (BIO_get_ktls_recv(SSL_get_rbio(rssl->ssl)))
+        rssl->ktls |= REDIS_SSL_KTLS_RECV;
+
+    if (rssl->ktls)
+        c->funcs = &redisContextKTLSFuncs;
+#else
+    (void)c;
+#endif
+}
+
 /**
  * SSL Connection initialization.
  */
 
 
-static int redisSSLConnect(redisContext *c, SSL *ssl) {
+static int redisSSLConnect(redisContext *c, SSL *ssl, redisSSLContext *ctx) {
     if (c->privctx) {
         __redisSetError(c, REDIS_ERR_OTHER, "redisContext was already associated");
         return REDIS_ERR;
@@ -281,6 +504,17 @@ static int redisSSLConnect(redisContext *c, SSL *ssl) {
     c->funcs = &redisContextSSLFuncs;
     rssl->ssl = ssl;
 
+    if (ctx && ctx->max_sessions && c->connection_type == REDIS_CONN_TCP &&
+        sslSessionResume(c, ctx, rssl) != REDIS_OK) {
+        __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+        hi_free(rssl);
+        return REDIS_ERR;
+    }
+
+#ifdef HIREDIS_USE_KTLS
+    rssl->ktlsCheck = (SSL_get_options(rssl->ssl) & SSL_OP_ENABLE_KTLS) != 0;
+#endif
+
     SSL_set_mode(rssl->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     SSL_set_fd(rssl->ssl, c->fd);
     SSL_set_connect_state(rssl->ssl);
@@ -289,6 +523,8 @@ static int redisSSLConnect(redisContext *c, SSL *ssl) {
     int rv = SSL_connect(rssl->ssl);
     if (rv == 1) {
         c->privctx = rssl;
+        if (rssl->ktlsCheck)
+            sslKTLSCheck(c, rssl);
         return REDIS_OK;
     }
 
@@ -311,6 +547,8 @@ static int redisSSLConnect(redisContext *c, SSL *ssl) {
         __redisSetError(c, REDIS_ERR_IO, err);
     }
 
+    SSL_set_app_data(rssl->ssl, NULL);
+    hi_free(rssl->peer);
     hi_free(rssl);
     return REDIS_ERR;
 }
@@ -321,7 +559,7 @@ static int redisSSLConnect(redisContext *c, SSL *ssl) {
  */
 
 int redisInitiateSSL(redisContext *c, SSL *ssl) {
-    return redisSSLConnect(c, ssl);
+    return redisSSLConnect(c, ssl, NULL);
 }
 
 /**
@@ -353,7 +591,12 @@ int redisInitiateSSLWithContext(redisContext *c, redisSSLContext *redis_ssl_ctx)
         }
     }
 
-    return redisSSLConnect(c, ssl);
+    /* A failed handshake does not own ssl either: free it here, clusters
+     * retry connections over and over. */
+    if (redisSSLConnect(c, ssl, redis_ssl_ctx) != REDIS_OK)
+        goto error;
+
+    return REDIS_OK;
 
 error:
     if (ssl)
@@ -386,9 +629,16 @@ static void redisSSLFree(void *privctx){
 
     if (!rsc) return;
     if (rsc->ssl) {
+        /* Without a shutdown, OpenSSL would take the session as bad and
+         * no longer resume it. A quiet one sends nothing. */
+        if (rsc->peer) {
+            SSL_set_quiet_shutdown(rsc->ssl, 1);
+            SSL_shutdown(rsc->ssl);
+        }
         SSL_free(rsc->ssl);
         rsc->ssl = NULL;
     }
+    hi_free(rsc->peer);
     hi_free(rsc);
 }
 
@@ -397,6 +647,8 @@ static ssize_t redisSSLRead(redisContext *c, char *buf, size_t bufcap) {
 
     int nread = SSL_read(rssl->ssl, buf, bufcap);
     if (nread > 0) {
+        if (rssl->ktlsCheck && SSL_is_init_finished(rssl->ssl))
+            sslKTLSCheck(c, rssl);
         return nread;
     } else if (nread == 0) {
         __redisSetError(c, REDIS_ERR_EOF, "Server closed the connection");
@@ -442,6 +694,8 @@ static ssize_t redisSSLWrite(redisContext *c) {
 
     if (rv > 0) {
         rssl->lastLen = 0;
+        if (rssl->ktlsCheck && SSL_is_init_finished(rssl->ssl))
+            sslKTLSCheck(c, rssl);
     } else if (rv < 0) {
         rssl->lastLen = len;
 
@@ -524,3 +778,58 @@ redisContextFuncs redisContextSSLFuncs = {
     .write = redisSSLWrite
 };
 
+#ifdef HIREDIS_USE_KTLS
+
+/**
+ * Implementation of redisContextFuncs for SSL connections offloaded to the
+ * kernel: the directions it took over skip OpenSSL.
+ */
+
+static ssize_t redisKTLSRead(redisContext *c, char *buf, size_t bufcap) {
+    redisSSL *rssl = c->privctx;
+
+    /* What OpenSSL has already decrypted goes first. */
+    if (!(rssl->ktls & REDIS_SSL_KTLS_RECV) || SSL_pending(rssl->ssl) > 0)
+        return redisSSLRead(c, buf, bufcap);
+
+    ssize_t nread = recv(c->fd, buf, bufcap, 0);
+    if (nread > 0) {
+        return nread;
+    } else if (nread == 0) {
+        __redisSetError(c, REDIS_ERR_EOF, "Server closed the connection");
+        return -1;
+    } else if (errno == EIO) {
+        /* The next record is not application data (TLS 1.3 session ticket
+         * or key update, alert): the kernel leaves it to OpenSSL. */
+        return redisSSLRead(c, buf, bufcap);
+    } else if ((errno == EWOULDBLOCK && !(c->flags & REDIS_BLOCK)) || errno == EINTR) {
+        return 0;
+    } else {
+        __redisSetError(c, REDIS_ERR_IO, NULL);
+        return -1;
+    }
+}
+
+static ssize_t redisKTLSWrite(redisContext *c) {
+    redisSSL *rssl = c->privctx;
+
+    /* A write SSL_write() left unfinished is finished by SSL_write(). */
+    if (!(rssl->ktls & REDIS_SSL_KTLS_SEND) || rssl->lastLen)
+        return redisSSLWrite(c);
+
+    ssize_t nwritten = redisNetWrite(c);
+    if (nwritten < 0 && c->err == 0)
+        return 0;   /* Try again later */
+    return nwritten;
+}
+
+redisContextFuncs redisContextKTLSFuncs = {
+    .free_privctx = redisSSLFree,
+    .async_read = redisSSLAsyncRead,
+    .async_write = redisSSLAsyncWrite,
+    .read = redisKTLSRead,
+    .write = redisKTLSWrite
+};
+
+#endif
+
@@ -0,0 +1,1028 @@
+/*
+ * Tests of the asynchronous cluster context, on the epoll adapter, against
+ * the cluster of mock-cluster.h. The sources are included to reach their
+ * internals, the static functions among them.
+ */
+#include "hircluster.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "adapters/epoll.h"
+#include "hirpool.h"
+#include "mock-cluster.h"
+
+/* The following lines make up our testing "framework" :) */
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+/* What the callbacks of a group of commands got. */
+struct result {
+    int calls;
+    int nulls;
+    int err;                /* of the last NULL reply */
+    int64_t at;             /* usec of the last call */
+    char str[64];           /* the last string reply */
+};
+
+static void result_callback(redisClusterAsyncContext *acc, void *r,
+    void *privdata)
+{
+    struct result *res = privdata;
+    redisReply *reply = r;
+
+    res->calls ++;
+    res->at = redisEpollNow();
+
+    if(reply == NULL)
+    {
+        res->nulls ++;
+        res->err = acc->err;
+        return;
+    }
+
+    if(reply->type == REDIS_REPLY_STRING || reply->type == REDIS_REPLY_STATUS)
+    {
+        snprintf(res->str, sizeof(res->str), "%s", reply->str);
+    }
+}
+
+/* Run loop for ms milliseconds, or until *calls reaches count. */
+static void loop_run(redisEpollLoop *loop, int ms, int *calls, int count)
+{
+    int64_t end = redisEpollNow() + ms*1000LL;
+
+    while(redisEpollNow() < end && (calls == NULL || *calls < count))
+    {
+        redisEpollLoopRunOnce(loop, 5000);
+    }
+}
+
+/* A key whose slot node of mc serves, "<prefix><n>". */
+static void key_on_node(struct mock_cluster *mc, int node, const char *prefix,
+    char *key, size_t size)
+{
+    int n;
+
+    for(n = 0; ; n ++)
+    {
+        snprintf(key, size, "%s%d", prefix, n);
+        if(mock_cluster_slot_node(mc, keyHashSlot(key, (int)strlen(key))) == node)
+        {
+            return;
+        }
+    }
+}
+
+static int key_slot(const char *key)
+{
+    return keyHashSlot((char *)key, (int)strlen(key));
+}
+
+/* The node of cc serving node of mc. */
+static cluster_node *context_node(redisClusterContext *cc,
+    struct mock_cluster *mc, int node)
+{
+    dictEntry *de;
+    sds addr;
+
+    addr = sdsnew(mock_cluster_node_addr(mc, node));
+    de = dictFind(cc->nodes, addr);
+    sdsfree(addr);
+
+    return de == NULL ? NULL : dictGetEntryVal(de);
+}
+
+static redisClusterContext *context_init(struct mock_cluster *mc)
+{
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+    redisClusterSetOptionAddNodes(cc, mock_cluster_addrs(mc));
+
+    return cc;
+}
+
+/* Connect cc, set up by the caller, and attach its async context. */
+static redisClusterAsyncContext *context_async(redisClusterContext *cc,
+    redisEpollLoop *loop)
+{
+    redisClusterAsyncContext *acc;
+
+    if(redisClusterConnect2(cc) != REDIS_OK)
+    {
+        printf("connect: %s\n", cc->errstr);
+        exit(1);
+    }
+
+    acc = redisClusterAsyncConnect2(cc);
+    redisClusterEpollAttach(acc, loop);
+
+    return acc;
+}
+
+/* The replies of a node connection, counted in calls. */
+static void reply_callback(redisAsyncContext *ac, void *r, void *privdata)
+{
+    int *calls = privdata;
+
+    (void)ac;
+    (void)r;
+    (*calls) ++;
+}
+
+/* The replies of a node connection, in a struct result. */
+static void node_callback(redisAsyncContext *ac, void *r, void *privdata)
+{
+    struct result *res = privdata;
+
+    res->calls ++;
+    res->at = redisEpollNow();
+    if(r == NULL)
+    {
+        res->nulls ++;
+        res->err = ac->c.err;
+    }
+}
+
+static void flow_callback(redisAsyncContext *ac, int paused)
+{
+    int *transitions = ac->data;
+
+    transitions[paused] ++;
+}
+
+/* A connection to node of mc, attached to loop and connected. */
+static redisAsyncContext *node_async(struct mock_cluster *mc, int node,
+    redisEpollLoop *loop)
+{
+    redisAsyncContext *ac;
+    int calls = 0;
+
+    ac = redisAsyncConnect("127.0.0.1", mock_cluster_node_port(mc, node));
+    redisEpollAttach(ac, loop);
+    redisAsyncCommand(ac, reply_callback, &calls, "PING");
+    loop_run(loop, 1000, &calls, 1);
+
+    return ac;
+}
+
+static uint64_t node_commands(struct mock_cluster *mc, int node)
+{
+    struct mock_node_stats stats;
+
+    mock_cluster_stats(mc, node, &stats);
+
+    return stats.commands;
+}
+
+static void test_batch(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisAsyncContext *ac;
+    struct timeval none = {0, 0}, latency = {0, 20000}, timeout = {0, 150000};
+    struct result res;
+    uint64_t commands;
+    int64_t start;
+    int i;
+
+    mc = mock_cluster_start(1, 0);
+    loop = redisEpollLoopCreate(0);
+    ac = node_async(mc, 0, loop);
+
+    test("Batch: a corked context keeps its commands: ");
+    memset(&res, 0, sizeof(res));
+    commands = node_commands(mc, 0);
+    redisAsyncCork(ac);
+    for(i = 0; i < 10; i ++)
+    {
+        redisAsyncCommand(ac, node_callback, &res, "SET key%d value", i);
+    }
+    loop_run(loop, 50, NULL, 0);
+    test_cond(res.calls == 0 && node_commands(mc, 0) == commands &&
+        sdslen(ac->c.obuf) > 0);
+
+    test("Batch: uncorked, they go out together: ");
+    redisAsyncUncork(ac);
+    loop_run(loop, 1000, &res.calls, 10);
+    test_cond(res.calls == 10 && res.nulls == 0 &&
+        node_commands(mc, 0) == commands + 10);
+
+    test("Batch: written once the buffer reaches max_bytes: ");
+    memset(&res, 0, sizeof(res));
+    redisAsyncSetBatchLimits(ac, 200, none);
+    redisAsyncCork(ac);
+    for(i = 0; i < 3; i ++)
+    {
+        redisAsyncCommand(ac, node_callback, &res, "SET key%d value", i);
+    }
+    loop_run(loop, 50, NULL, 0);
+    commands = res.calls;
+    while(sdslen(ac->c.obuf) < 200)
+    {
+        redisAsyncCommand(ac, node_callback, &res, "SET key%d value", i ++);
+    }
+    loop_run(loop, 1000, &res.calls, i);
+    test_cond(commands == 0 && res.calls == i && res.nulls == 0);
+    redisAsyncUncork(ac);
+
+    test("Batch: written once the oldest command waited max_latency: ");
+    memset(&res, 0, sizeof(res));
+    redisAsyncSetBatchLimits(ac, 0, latency);
+    redisAsyncCork(ac);
+    start = redisEpollNow();
+    redisAsyncCommand(ac, node_callback, &res, "GET key");
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(res.calls == 1 && res.nulls == 0 &&
+        res.at - start >= 15000 && res.at - start < 500000);
+
+    test("Batch: the command timeout still fires after the latency limit: ");
+    memset(&res, 0, sizeof(res));
+    redisAsyncSetTimeout(ac, timeout);
+    mock_cluster_latency(mc, 0, 1000000);
+    start = redisEpollNow();
+    redisAsyncCommand(ac, node_callback, &res, "GET key");
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(res.calls == 1 && res.nulls == 1 &&
+        res.err == REDIS_ERR_TIMEOUT && res.at - start < 600000);
+    mock_cluster_latency(mc, 0, 0);
+
+    /* The timeout disconnected and freed the context. */
+    redisEpollLoopFree(loop);
+    mock_cluster_stop(mc);
+}
+
+static void test_flow(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisAsyncContext *ac;
+    redisFlowLimits limits = {1, 4, 0, 0};
+    int transitions[2] = {0, 0}, calls = 0, quit = 0, i, ret;
+
+    mc = mock_cluster_start(1, 0);
+    loop = redisEpollLoopCreate(0);
+    ac = node_async(mc, 0, loop);
+    ac->data = transitions;
+    redisAsyncSetFlowCallback(ac, flow_callback);
+    redisAsyncSetFlowLimits(ac, &limits);
+    mock_cluster_latency(mc, 0, 100000);
+
+    test("Flow: paused at the high watermark of pending replies: ");
+    for(i = 0; i < 4; i ++)
+    {
+        redisAsyncCommand(ac, reply_callback, &calls, "GET k");
+    }
+    test_cond(redisAsyncIsPaused(ac) && transitions[1] == 1);
+
+    test("Flow: a paused context refuses commands with an error of its own: ");
+    ret = redisAsyncCommand(ac, reply_callback, &calls, "GET k");
+    test_cond(ret == REDIS_ERR && ac->err == REDIS_ERR_BACKPRESSURE &&
+        ac->c.err == 0 && calls == 0);
+
+    test("Flow: QUIT goes through while paused: ");
+    test_cond(redisAsyncCommand(ac, reply_callback, &quit, "QUIT") ==
+        REDIS_OK);
+
+    test("Flow: resumed at the low watermark, the error cleared: ");
+    loop_run(loop, 1000, &calls, 4);
+    test_cond(calls == 4 && !redisAsyncIsPaused(ac) && transitions[0] == 1 &&
+        ac->err == 0);
+    loop_run(loop, 1000, &quit, 1);
+    redisAsyncFree(ac);
+
+    test("Flow: paused at the high watermark of the output buffer: ");
+    ac = node_async(mc, 0, loop);
+    redisAsyncCommand(ac, reply_callback, &quit, "SSUBSCRIBE ch");
+    loop_run(loop, 1000, &quit, 2);
+    limits.high_pending = 0;
+    limits.low_bytes = 64;
+    limits.high_bytes = 256;
+    transitions[0] = transitions[1] = 0;
+    ac->data = transitions;
+    redisAsyncSetFlowCallback(ac, flow_callback);
+    redisAsyncSetFlowLimits(ac, &limits);
+    redisAsyncCork(ac);
+    calls = 0;
+    for(i = 0; i < 100 && !redisAsyncIsPaused(ac); i ++)
+    {
+        redisAsyncCommand(ac, reply_callback, &calls, "SET key%d value", i);
+    }
+    test_cond(redisAsyncIsPaused(ac) && sdslen(ac->c.obuf) >= 256 &&
+        redisAsyncCommand(ac, reply_callback, &calls, "GET k") == REDIS_ERR &&
+        ac->err == REDIS_ERR_BACKPRESSURE);
+
+    test("Flow: SUNSUBSCRIBE goes through while paused: ");
+    test_cond(redisAsyncCommand(ac, NULL, NULL, "SUNSUBSCRIBE ch") == REDIS_OK);
+
+    test("Flow: the buffer written out resumes it: ");
+    redisAsyncUncork(ac);
+    loop_run(loop, 1000, &calls, i);
+    test_cond(calls == i && !redisAsyncIsPaused(ac) && ac->err == 0);
+
+    redisAsyncFree(ac);
+    redisEpollLoopFree(loop);
+    mock_cluster_stop(mc);
+}
+
+static void test_deadlines(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisClusterAsyncContext *acc;
+    struct result res;
+    struct timeval tv = {0, 50000};
+    char key[32];
+    int64_t start;
+
+    mc = mock_cluster_start(2, 0);
+    loop = redisEpollLoopCreate(0);
+    acc = context_async(context_init(mc), loop);
+    key_on_node(mc, 1, "deadline", key, sizeof(key));
+
+    /* Connected first, for the latency to hold the command only. */
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "SET %s v", key);
+    loop_run(loop, 1000, &res.calls, 1);
+
+    test("Deadline: a command past its timeout fails in time: ");
+    mock_cluster_latency(mc, 1, 300000);
+    memset(&res, 0, sizeof(res));
+    start = redisEpollNow();
+    redisClusterAsyncCommandWithTimeout(acc, result_callback, &res, tv,
+        "GET %s", key);
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(res.calls == 1 && res.nulls == 1 &&
+        res.err == REDIS_ERR_TIMEOUT && res.at - start < 250000);
+
+    test("Deadline: the late reply does not call back again: ");
+    loop_run(loop, 400, NULL, 0);
+    test_cond(res.calls == 1);
+
+    test("Deadline: the default timeout of the context: ");
+    redisClusterAsyncSetCommandTimeout(acc, tv);
+    memset(&res, 0, sizeof(res));
+    start = redisEpollNow();
+    redisClusterAsyncCommand(acc, result_callback, &res, "GET %s", key);
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(res.calls == 1 && res.err == REDIS_ERR_TIMEOUT &&
+        res.at - start < 250000);
+    loop_run(loop, 400, NULL, 0);
+
+    test("Deadline: a reply in time is delivered: ");
+    mock_cluster_latency(mc, 1, 0);
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "GET %s", key);
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(res.calls == 1 && res.nulls == 0 && strcmp(res.str, "v") == 0);
+
+    redisClusterAsyncFree(acc);
+    redisEpollLoopFree(loop);
+    mock_cluster_stop(mc);
+}
+
+/* Send count GETs to the single node of mc, which drops the connection on
+ * the first one, and wait for their NULL replies. */
+static void breaker_lose(redisClusterAsyncContext *acc, redisEpollLoop *loop,
+    struct mock_cluster *mc, int count)
+{
+    struct result res;
+    int i;
+
+    memset(&res, 0, sizeof(res));
+    mock_cluster_fault(mc, 0, MOCK_FAULT_DISCONNECT, 1);
+    for(i = 0; i < count; i ++)
+    {
+        redisClusterAsyncCommand(acc, result_callback, &res, "GET k%d", i);
+    }
+    loop_run(loop, 1000, &res.calls, count);
+}
+
+static void test_breaker(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisClusterContext *cc;
+    redisClusterAsyncContext *acc;
+    struct timeval min = {0, 100000}, max = {1, 0};
+    struct result res;
+    cluster_node *node;
+    int ret;
+
+    mc = mock_cluster_start(1, 0);
+    loop = redisEpollLoopCreate(0);
+
+    test("Breaker: off by default, lost connections are opened again: ");
+    cc = context_init(mc);
+    acc = context_async(cc, loop);
+    node = context_node(cc, mc, 0);
+    breaker_lose(acc, loop, mc, 5);
+    breaker_lose(acc, loop, mc, 5);
+    breaker_lose(acc, loop, mc, 5);
+    memset(&res, 0, sizeof(res));
+    ret = redisClusterAsyncCommand(acc, result_callback, &res, "SET k v");
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(ret == REDIS_OK && node->breaker == REDIS_BREAKER_CLOSED &&
+        res.nulls == 0 && strcmp(res.str, "OK") == 0);
+    redisClusterAsyncFree(acc);
+
+    /* Past max_redirect NULL replies the client looks up the node timeout
+     * over a new connection, whose success closes the breaker. */
+    cc = context_init(mc);
+    redisClusterSetOptionReconnectBackoff(cc, 2, min, max);
+    redisClusterSetOptionMaxRedirect(cc, 100);
+    acc = context_async(cc, loop);
+    node = context_node(cc, mc, 0);
+
+    test("Breaker: a lost connection counts once, whatever was pending: ");
+    breaker_lose(acc, loop, mc, 20);
+    test_cond(node->breaker_failures == 1 &&
+        node->breaker == REDIS_BREAKER_CLOSED);
+
+    test("Breaker: a reply closes it again: ");
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "GET k");
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(res.nulls == 0 && node->breaker_failures == 0);
+
+    test("Breaker: a connection freed by the client is not counted: ");
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "GET k");
+    redisClusterAsyncCommand(acc, result_callback, &res, "GET k");
+    redisAsyncFree(node->acon);
+    test_cond(res.calls == 2 && res.nulls == 2 && node->acon == NULL &&
+        node->breaker_failures == 0);
+
+    test("Breaker: opens on threshold connections lost in a row: ");
+    breaker_lose(acc, loop, mc, 5);
+    breaker_lose(acc, loop, mc, 5);
+    ret = redisClusterAsyncCommand(acc, result_callback, &res, "GET k");
+    test_cond(ret != REDIS_OK && node->breaker == REDIS_BREAKER_OPEN &&
+        strstr(acc->errstr, "unreachable") != NULL);
+
+    test("Breaker: tries again once the backoff is over: ");
+    loop_run(loop, 150, NULL, 0);
+    memset(&res, 0, sizeof(res));
+    ret = redisClusterAsyncCommand(acc, result_callback, &res, "GET k");
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(ret == REDIS_OK && res.nulls == 0 &&
+        node->breaker == REDIS_BREAKER_CLOSED);
+
+    test("Breaker: freeing the context with commands pending: ");
+    redisClusterSetOptionMaxRedirect(cc, 0);
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "GET k");
+    redisClusterAsyncCommand(acc, result_callback, &res, "GET k");
+    redisClusterAsyncFree(acc);
+    test_cond(res.calls == 2 && res.nulls == 2);
+
+    redisEpollLoopFree(loop);
+    mock_cluster_stop(mc);
+}
+
+static void test_health_check(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisClusterContext *cc;
+    redisClusterAsyncContext *acc;
+    struct timeval interval = {0, 50000}, timeout = {0, 30000};
+    struct result res;
+    cluster_node *node;
+    char key[32];
+    int64_t start, step, longest = 0;
+    int i, slot, moved = 0;
+
+    mc = mock_cluster_start(3, 0);
+    loop = redisEpollLoopCreate(0);
+    cc = context_init(mc);
+    acc = context_async(cc, loop);
+    redisClusterAsyncSetHealthCheck(acc, interval, timeout);
+    node = context_node(cc, mc, 0);
+    key_on_node(mc, 0, "health", key, sizeof(key));
+    slot = key_slot(key);
+
+    test("Health check: a node holding corked commands is not down: ");
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCork(acc);
+    for(i = 0; i < 100; i ++)
+    {
+        redisClusterAsyncCommand(acc, result_callback, &res, "GET %s", key);
+    }
+    loop_run(loop, 300, NULL, 0);
+    test_cond(node->down == 0);
+    redisClusterAsyncUncork(acc);
+    loop_run(loop, 1000, &res.calls, 100);
+
+    test("Health check: the route follows a failover without blocking: ");
+    mock_cluster_move_slots(mc, slot, slot, 1);
+    mock_cluster_latency(mc, 0, 400000);
+    start = redisEpollNow();
+    while(!moved && redisEpollNow() - start < 1000000)
+    {
+        step = redisEpollNow();
+        redisEpollLoopRunOnce(loop, 5000);
+        step = redisEpollNow() - step;
+        longest = step > longest ? step : longest;
+
+        moved = strcmp(node_get_by_table(cc, (uint32_t)slot)->addr,
+            mock_cluster_node_addr(mc, 1)) == 0;
+    }
+    /* The route update replaced the node, what it knew carried over. */
+    node = context_node(cc, mc, 0);
+    test_cond(moved && node != NULL && node->down && longest < 200000);
+    mock_cluster_latency(mc, 0, 0);
+
+    redisClusterAsyncFree(acc);
+    redisEpollLoopFree(loop);
+    mock_cluster_stop(mc);
+}
+
+static void test_handshake(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisClusterContext *cc;
+    redisClusterAsyncContext *acc;
+    struct result res;
+    int flags;
+
+    for(flags = 0; flags <= MOCK_CLUSTER_RESP2; flags += MOCK_CLUSTER_RESP2)
+    {
+        mc = mock_cluster_start(2, flags);
+        mock_cluster_password(mc, "secret");
+        loop = redisEpollLoopCreate(0);
+        cc = context_init(mc);
+        redisClusterSetOptionResp3(cc);
+        redisClusterSetOptionAuthPassword(cc, "secret");
+        acc = context_async(cc, loop);
+
+        if(flags)
+        {
+            test("Async RESP3 refused: AUTH then RESP2: ");
+        }
+        else
+        {
+            test("Async RESP3: AUTH then HELLO 3: ");
+        }
+        memset(&res, 0, sizeof(res));
+        redisClusterAsyncCommand(acc, result_callback, &res, "SET k0 v");
+        redisClusterAsyncCommand(acc, result_callback, &res, "SET k1 v");
+        redisClusterAsyncCommand(acc, result_callback, &res, "GET k1");
+        loop_run(loop, 1000, &res.calls, 3);
+        test_cond(res.calls == 3 && res.nulls == 0 && strcmp(res.str, "v") == 0 &&
+            acc->err == 0);
+
+        redisClusterAsyncFree(acc);
+        redisEpollLoopFree(loop);
+        mock_cluster_stop(mc);
+    }
+}
+
+/* What the callback of a subscription got. */
+struct subscription {
+    int subscribed;         /* ssubscribe replies */
+    int messages;
+    int ended;              /* 1: sunsubscribe reply, -1: NULL */
+    char message[64];
+};
+
+static void subscription_callback(redisClusterAsyncContext *acc, void *r,
+    void *privdata)
+{
+    struct subscription *sub = privdata;
+    redisReply *reply = r;
+
+    (void)acc;
+
+    if(reply == NULL)
+    {
+        sub->ended = -1;
+        return;
+    }
+
+    if((reply->type != REDIS_REPLY_ARRAY && reply->type != REDIS_REPLY_PUSH) ||
+        reply->elements < 3 || reply->element[0]->type != REDIS_REPLY_STRING)
+    {
+        return;
+    }
+
+    if(!strcasecmp(reply->element[0]->str, "ssubscribe"))
+    {
+        sub->subscribed ++;
+    }
+    else if(!strcasecmp(reply->element[0]->str, "smessage"))
+    {
+        sub->messages ++;
+        snprintf(sub->message, sizeof(sub->message), "%s",
+            reply->element[2]->str);
+    }
+    else if(!strcasecmp(reply->element[0]->str, "sunsubscribe"))
+    {
+        sub->ended = 1;
+    }
+}
+
+static int publish(redisClusterContext *cc, const char *channel,
+    const char *message)
+{
+    redisReply *reply;
+    int ret;
+
+    reply = redisClusterCommand(cc, "SPUBLISH %s %s", channel, message);
+    ret = reply != NULL && reply->type == REDIS_REPLY_INTEGER &&
+        reply->integer == 1;
+    freeReplyObject(reply);
+
+    return ret;
+}
+
+static void test_sharded_pubsub(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisClusterContext *cc, *publisher;
+    redisClusterAsyncContext *acc;
+    struct subscription sub;
+    char channel[32];
+    int flags, slot;
+
+    for(flags = 0; flags <= MOCK_CLUSTER_RESP2; flags += MOCK_CLUSTER_RESP2)
+    {
+        mc = mock_cluster_start(3, flags);
+        mock_cluster_password(mc, "secret");
+        loop = redisEpollLoopCreate(0);
+        cc = context_init(mc);
+        redisClusterSetOptionResp3(cc);
+        redisClusterSetOptionAuthPassword(cc, "secret");
+        acc = context_async(cc, loop);
+        publisher = context_init(mc);
+        redisClusterSetOptionAuthPassword(publisher, "secret");
+        redisClusterConnect2(publisher);
+        key_on_node(mc, 0, "channel", channel, sizeof(channel));
+        slot = key_slot(channel);
+
+        if(flags)
+        {
+            test("Sharded pub/sub, RESP2: the subscription connection is "
+                "authenticated: ");
+        }
+        else
+        {
+            test("Sharded pub/sub, RESP3: the subscription connection is "
+                "authenticated: ");
+        }
+        memset(&sub, 0, sizeof(sub));
+        redisClusterAsyncSSubscribe(acc, subscription_callback, &sub, channel,
+            strlen(channel));
+        loop_run(loop, 1000, &sub.subscribed, 1);
+        test_cond(sub.subscribed == 1 && sub.ended == 0);
+
+        test("Sharded pub/sub: a message published is received: ");
+        test_cond(publish(publisher, channel, "hello") &&
+            (loop_run(loop, 1000, &sub.messages, 1), sub.messages == 1) &&
+            strcmp(sub.message, "hello") == 0);
+
+        test("Sharded pub/sub: subscribed again when the slot moves: ");
+        mock_cluster_move_slots(mc, slot, slot, 2);
+        loop_run(loop, 1000, &sub.subscribed, 2);
+        test_cond(sub.subscribed == 2 && sub.ended == 0 &&
+            publish(publisher, channel, "moved") &&
+            (loop_run(loop, 1000, &sub.messages, 2), sub.messages == 2) &&
+            strcmp(sub.message, "moved") == 0);
+
+        test("Sharded pub/sub: SUNSUBSCRIBE ends the subscription: ");
+        redisClusterAsyncSUnsubscribe(acc, channel, strlen(channel));
+        loop_run(loop, 1000, &sub.ended, 1);
+        test_cond(sub.ended == 1);
+
+        redisClusterFree(publisher);
+        redisClusterAsyncFree(acc);
+        redisEpollLoopFree(loop);
+        mock_cluster_stop(mc);
+    }
+}
+
+/* Ends the fetch test_shared_topology pretends another context runs, so
+ * that a refresh waiting for it does not wait forever. */
+static void *topology_fetch_end(void *arg)
+{
+    redisClusterTopology *t = arg;
+
+    usleep(500000);
+    pthread_mutex_lock(&t->lock);
+    t->refreshing = 0;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+static void test_shared_topology(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisClusterTopology *t;
+    redisClusterContext *cc, *fetcher;
+    redisClusterAsyncContext *acc;
+    struct mock_node_stats before, after;
+    struct result res;
+    pthread_t thread;
+    char key[32];
+    int64_t start, elapsed;
+    uint64_t version;
+    int ret;
+
+    mc = mock_cluster_start(3, 0);
+    loop = redisEpollLoopCreate(0);
+    t = redisClusterTopologyCreate();
+    cc = context_init(mc);
+    redisClusterSetOptionTopology(cc, t);
+    acc = context_async(cc, loop);
+    fetcher = context_init(mc);
+    redisClusterSetOptionTopology(fetcher, t);
+    redisClusterConnect2(fetcher);
+    version = redisClusterTopologyVersion(t);
+    key_on_node(mc, 0, "shared", key, sizeof(key));
+
+    test("Async shared topology: no wait while another context fetches: ");
+    pthread_mutex_lock(&t->lock);
+    t->refreshing = 1;
+    pthread_mutex_unlock(&t->lock);
+    pthread_create(&thread, NULL, topology_fetch_end, t);
+    start = redisEpollNow();
+    ret = cluster_update_route(acc->cc);
+    elapsed = redisEpollNow() - start;
+    pthread_join(thread, NULL);
+    test_cond(ret == REDIS_OK && elapsed < 100000 &&
+        acc->cc->topology_version == version);
+
+    test("Async shared topology: the route is picked up by the next command: ");
+    mock_cluster_move_slots(mc, key_slot(key), key_slot(key), 2);
+    cluster_update_route(fetcher);
+    mock_cluster_stats(mc, 0, &before);
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "SET %s v", key);
+    loop_run(loop, 1000, &res.calls, 1);
+    mock_cluster_stats(mc, 0, &after);
+    test_cond(res.calls == 1 && res.nulls == 0 &&
+        acc->cc->topology_version == version + 1 &&
+        after.commands == before.commands &&
+        context_node(acc->cc, mc, 2) == node_get_by_table(acc->cc,
+        (uint32_t)key_slot(key)));
+
+    redisClusterAsyncFree(acc);
+    redisClusterFree(fetcher);
+    redisClusterTopologyRelease(t);
+    redisEpollLoopFree(loop);
+    mock_cluster_stop(mc);
+}
+
+#define POOL_LOOPS 3
+#define POOL_THREADS 8
+#define POOL_CALLS 200
+
+/* Updated from the loop threads. */
+struct pool_result {
+    redisClusterAsyncPool *pool;
+    int calls;
+    int nulls;
+    int foreign;            /* callbacks run out of the loops */
+    int loops[POOL_LOOPS];
+    int chained;            /* replies of commands sent from a callback */
+    int moved;              /* of those, replies on another loop */
+};
+
+struct pool_worker {
+    struct pool_result *res;
+    pthread_t thread;
+    int id;
+    int refused;
+};
+
+static void pool_callback(redisClusterAsyncContext *acc, void *r,
+    void *privdata)
+{
+    struct pool_result *res = privdata;
+    int current;
+
+    (void)acc;
+
+    current = redisClusterAsyncPoolCurrent(res->pool);
+    if(current < 0)
+    {
+        __sync_fetch_and_add(&res->foreign, 1);
+    }
+    else
+    {
+        __sync_fetch_and_add(&res->loops[current], 1);
+    }
+
+    if(r == NULL)
+    {
+        __sync_fetch_and_add(&res->nulls, 1);
+    }
+
+    __sync_fetch_and_add(&res->calls, 1);
+}
+
+/* A command sent from a callback, and the loop it was sent from. */
+struct pool_chain {
+    struct pool_result *res;
+    int loop;
+};
+
+static void pool_chained_callback(redisClusterAsyncContext *acc, void *r,
+    void *privdata)
+{
+    struct pool_chain *chain = privdata;
+
+    (void)acc;
+
+    if(r == NULL ||
+        redisClusterAsyncPoolCurrent(chain->res->pool) != chain->loop)
+    {
+        __sync_fetch_and_add(&chain->res->moved, 1);
+    }
+
+    __sync_fetch_and_add(&chain->res->chained, 1);
+}
+
+static void pool_chain_callback(redisClusterAsyncContext *acc, void *r,
+    void *privdata)
+{
+    struct pool_chain *chain = privdata;
+
+    (void)acc;
+
+    chain->loop = redisClusterAsyncPoolCurrent(chain->res->pool);
+    if(r == NULL || redisClusterAsyncPoolCommand(chain->res->pool,
+        pool_chained_callback, chain, "GET pool.chain") != REDIS_OK)
+    {
+        __sync_fetch_and_add(&chain->res->moved, 1);
+        __sync_fetch_and_add(&chain->res->chained, 1);
+    }
+}
+
+static void *pool_worker_run(void *arg)
+{
+    struct pool_worker *w = arg;
+    int i;
+
+    for(i = 0; i < POOL_CALLS; i ++)
+    {
+        if(redisClusterAsyncPoolCommand(w->res->pool, pool_callback, w->res,
+            "SET pool%d.%d v", w->id, i) != REDIS_OK)
+        {
+            w->refused ++;
+        }
+    }
+
+    return NULL;
+}
+
+static void pool_wait(int *counter, int count, int ms)
+{
+    int64_t end = redisEpollNow() + ms*1000LL;
+
+    while(__sync_fetch_and_add(counter, 0) < count && redisEpollNow() < end)
+    {
+        usleep(1000);
+    }
+}
+
+static void test_pool(void)
+{
+    struct mock_cluster *mc;
+    struct pool_result res;
+    struct pool_worker workers[POOL_THREADS];
+    struct pool_chain chains[50];
+    int i, refused = 0, spread = 1;
+
+    mc = mock_cluster_start(3, 0);
+    memset(&res, 0, sizeof(res));
+
+    test("Pool: the loops connect to the cluster: ");
+    res.pool = redisClusterAsyncPoolCreate(mock_cluster_addrs(mc), POOL_LOOPS, 0);
+    test_cond(res.pool != NULL &&
+        redisClusterAsyncPoolSize(res.pool) == POOL_LOOPS &&
+        redisClusterAsyncPoolCurrent(res.pool) == -1);
+    if(res.pool == NULL)
+    {
+        mock_cluster_stop(mc);
+        return;
+    }
+
+    test("Pool: commands of several threads are answered on the loops: ");
+    for(i = 0; i < POOL_THREADS; i ++)
+    {
+        workers[i].res = &res;
+        workers[i].id = i;
+        workers[i].refused = 0;
+        pthread_create(&workers[i].thread, NULL, pool_worker_run, &workers[i]);
+    }
+    for(i = 0; i < POOL_THREADS; i ++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        refused += workers[i].refused;
+    }
+    pool_wait(&res.calls, POOL_THREADS*POOL_CALLS, 5000);
+    for(i = 0; i < POOL_LOOPS; i ++)
+    {
+        spread &= res.loops[i] > 0;
+    }
+    test_cond(refused == 0 && res.calls == POOL_THREADS*POOL_CALLS &&
+        res.nulls == 0 && res.foreign == 0 && spread);
+
+    test("Pool: a command sent from a callback stays on its loop: ");
+    for(i = 0; i < 50; i ++)
+    {
+        chains[i].res = &res;
+        chains[i].loop = -1;
+        redisClusterAsyncPoolCommand(res.pool, pool_chain_callback,
+            &chains[i], "SET pool.chain v");
+    }
+    pool_wait(&res.chained, 50, 5000);
+    test_cond(res.chained == 50 && res.moved == 0);
+
+    test("Pool: freeing it calls back every command queued: ");
+    memset(&res.loops, 0, sizeof(res.loops));
+    res.calls = res.nulls = 0;
+    for(i = 0; i < 1000; i ++)
+    {
+        redisClusterAsyncPoolCommand(res.pool, pool_callback, &res,
+            "SET pool.free%d v", i);
+    }
+    redisClusterAsyncPoolFree(res.pool);
+    test_cond(res.calls == 1000);
+
+    mock_cluster_stop(mc);
+}
+
+static void test_scripts(void)
+{
+    struct mock_cluster *mc;
+    redisEpollLoop *loop;
+    redisClusterAsyncContext *acc;
+    const char *script = "return redis.call('GET', KEYS[1])";
+    char sha[41], key[32];
+    struct result res;
+
+    mc = mock_cluster_start(3, 0);
+    loop = redisEpollLoopCreate(0);
+    acc = context_async(context_init(mc), loop);
+    redisClusterScriptRegister(acc->cc, script, strlen(script), sha);
+    key_on_node(mc, 0, "script", key, sizeof(key));
+
+    test("Async scripts: NOSCRIPT loads the script and sends it again: ");
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "EVALSHA %s 1 %s",
+        sha, key);
+    loop_run(loop, 1000, &res.calls, 1);
+    test_cond(res.calls == 1 && res.nulls == 0 && strcmp(res.str, script) == 0);
+
+    test("Async scripts: loaded again on a node that forgot it: ");
+    mock_cluster_script_flush(mc, -1);
+    memset(&res, 0, sizeof(res));
+    redisClusterAsyncCommand(acc, result_callback, &res, "EVALSHA %s 1 %s",
+        sha, key);
+    redisClusterAsyncCommand(acc, result_callback, &res, "EVALSHA %s 1 %s",
+        sha, key);
+    loop_run(loop, 1000, &res.calls, 2);
+    test_cond(res.calls == 2 && res.nulls == 0 && strcmp(res.str, script) == 0);
+
+    redisClusterAsyncFree(acc);
+    redisEpollLoopFree(loop);
+    mock_cluster_stop(mc);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    test_batch();
+    test_flow();
+    test_deadlines();
+    test_breaker();
+    test_health_check();
+    test_handshake();
+    test_sharded_pubsub();
+    test_shared_topology();
+    test_pool();
+    test_scripts();
+
+    if(fails)
+    {
+        printf("*** %d TESTS FAILED ***\n", fails);
+        return 1;
+    }
+
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
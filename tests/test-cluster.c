@@ -0,0 +1,1143 @@
+/*
+ * Tests of the cluster context against the cluster of mock-cluster.h, and
+ * of the parsers and helpers it relies on. The sources are included to
+ * reach their internals, the static functions among them.
+ */
+#include "hircluster.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "hirpipeline.h"
+#include "hisha1.h"
+#include "mock-cluster.h"
+
+/* The following lines make up our testing "framework" :) */
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+static redisReply *reply_parse(const char *resp, size_t len)
+{
+    redisReader *reader;
+    void *reply = NULL;
+
+    reader = redisReaderCreate();
+    if(redisReaderFeed(reader, resp, len) != REDIS_OK ||
+        redisReaderGetReply(reader, &reply) != REDIS_OK)
+    {
+        reply = NULL;
+    }
+    redisReaderFree(reader);
+
+    return reply;
+}
+
+/* A key whose slot node of mc serves, "<prefix><n>". */
+static void key_on_node(struct mock_cluster *mc, int node, const char *prefix,
+    char *key, size_t size)
+{
+    int n;
+
+    for(n = 0; ; n ++)
+    {
+        snprintf(key, size, "%s%d", prefix, n);
+        if(mock_cluster_slot_node(mc, keyHashSlot(key, (int)strlen(key))) == node)
+        {
+            return;
+        }
+    }
+}
+
+/* The node of nodes at addr; the keys of the dict are sds. */
+static cluster_node *nodes_get(dict *nodes, const char *addr)
+{
+    dictEntry *de;
+    sds key;
+
+    if(nodes == NULL)
+    {
+        return NULL;
+    }
+
+    key = sdsnew(addr);
+    de = dictFind(nodes, key);
+    sdsfree(key);
+
+    return de == NULL ? NULL : dictGetEntryVal(de);
+}
+
+static int key_slot(const char *key)
+{
+    return keyHashSlot((char *)key, (int)strlen(key));
+}
+
+/* The address cc routes the slot of key to. */
+static const char *key_addr(redisClusterContext *cc, const char *key)
+{
+    cluster_node *node;
+
+    node = node_get_by_table(cc, (uint32_t)key_slot(key));
+
+    return node == NULL ? "" : node->addr;
+}
+
+static redisClusterContext *context_init(struct mock_cluster *mc)
+{
+    redisClusterContext *cc;
+
+    cc = redisClusterContextInit();
+    redisClusterSetOptionAddNodes(cc, mock_cluster_addrs(mc));
+
+    return cc;
+}
+
+static redisClusterContext *context_connect(struct mock_cluster *mc)
+{
+    redisClusterContext *cc;
+
+    cc = context_init(mc);
+    if(redisClusterConnect2(cc) != REDIS_OK)
+    {
+        printf("connect: %s\n", cc->errstr);
+        redisClusterFree(cc);
+        exit(1);
+    }
+
+    return cc;
+}
+
+/* Whether the command gets a status or string reply equal to str. */
+static int command_is(redisClusterContext *cc, const char *str,
+    const char *format, ...)
+{
+    redisReply *reply;
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    reply = redisClustervCommand(cc, format, ap);
+    va_end(ap);
+
+    ret = reply != NULL && (reply->type == REDIS_REPLY_STATUS ||
+        reply->type == REDIS_REPLY_STRING) && strcmp(reply->str, str) == 0;
+    freeReplyObject(reply);
+
+    return ret;
+}
+
+#define PIPELINE_THREADS 16
+#define PIPELINE_CALLS 300
+
+struct pipeline_worker {
+    redisClusterPipeline *p;
+    pthread_t thread;
+    int id;
+    int bad;
+    int *finished;
+};
+
+static int reply_is(redisReply *reply, int type, const char *str)
+{
+    int ret;
+
+    ret = reply != NULL && reply->type == type &&
+        (str == NULL || strcmp(reply->str, str) == 0);
+    freeReplyObject(reply);
+
+    return ret;
+}
+
+/* Every caller checks it gets its own replies; the keyless PINGs fail to
+ * append and leave the rest of their batch to be queued again. */
+static void *pipeline_worker_run(void *arg)
+{
+    struct pipeline_worker *w = arg;
+    char key[32], value[32];
+    int i;
+
+    for(i = 0; i < PIPELINE_CALLS; i ++)
+    {
+        snprintf(key, sizeof(key), "pipe%d.%d", w->id, i % 50);
+        snprintf(value, sizeof(value), "%d.%d", w->id, i);
+
+        if(!reply_is(redisClusterPipelineCommand(w->p, "SET %s %s", key,
+            value), REDIS_REPLY_STATUS, "OK") ||
+            !reply_is(redisClusterPipelineCommand(w->p, "GET %s", key),
+            REDIS_REPLY_STRING, value))
+        {
+            w->bad ++;
+        }
+
+        if(i % 10 == 0 && redisClusterPipelineCommand(w->p, "PING") != NULL)
+        {
+            w->bad ++;
+        }
+    }
+
+    __sync_fetch_and_add(w->finished, 1);
+
+    return NULL;
+}
+
+static void test_pipeline(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc;
+    redisClusterPipeline *p;
+    struct pipeline_worker workers[PIPELINE_THREADS];
+    int i, bad = 0, finished = 0, moves = 0;
+
+    mc = mock_cluster_start(3, 0);
+
+    test("Pipeline: concurrent callers each get their own replies: ");
+    /* Under a slow build the slots may move several times per command. */
+    cc = context_connect(mc);
+    redisClusterSetOptionMaxRedirect(cc, 100);
+    p = redisClusterPipelineCreate(cc);
+    for(i = 0; i < PIPELINE_THREADS; i ++)
+    {
+        workers[i].p = p;
+        workers[i].id = i;
+        workers[i].bad = 0;
+        workers[i].finished = &finished;
+        pthread_create(&workers[i].thread, NULL, pipeline_worker_run,
+            &workers[i]);
+    }
+
+    /* Slots moving back and forth, for redirected replies in the batches. */
+    while(__sync_fetch_and_add(&finished, 0) < PIPELINE_THREADS)
+    {
+        mock_cluster_move_slots(mc, 0, 5000, moves ++ % 2);
+        usleep(10000);
+    }
+
+    for(i = 0; i < PIPELINE_THREADS; i ++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        bad += workers[i].bad;
+    }
+    test_cond(bad == 0 && moves > 0);
+
+    test("Pipeline: a keyless command fails with the error of the cluster: ");
+    test_cond(redisClusterPipelineCommand(p, "PING") == NULL &&
+        redisClusterPipelineGetError(p, NULL, 0) != 0);
+
+    redisClusterPipelineFree(p);
+    mock_cluster_stop(mc);
+}
+
+static void test_sha1(void)
+{
+    char hex[HISHA1_HEX_LEN + 1], *million;
+    unsigned char digest[HISHA1_DIGEST_LEN];
+    struct hisha1 ctx;
+    size_t i;
+
+    test("SHA1 of the empty string: ");
+    hisha1_hex("", 0, hex);
+    test_cond(strcmp(hex, "da39a3ee5e6b4b0d3255bfef95601890afd80709") == 0);
+
+    test("SHA1 of \"abc\": ");
+    hisha1_hex("abc", 3, hex);
+    test_cond(strcmp(hex, "a9993e364706816aba3e25717850c26c9cd0d89d") == 0);
+
+    test("SHA1 of a 448 bit message, padded over a second block: ");
+    hisha1_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56, hex);
+    test_cond(strcmp(hex, "84983e441c3bd26ebaae4aa1f95129e5e54670f1") == 0);
+
+    test("SHA1 of a million \"a\" hashed 7 bytes at a time: ");
+    million = malloc(1000000);
+    memset(million, 'a', 1000000);
+    hisha1_init(&ctx);
+    for(i = 0; i < 1000000; i += 7)
+    {
+        hisha1_update(&ctx, million + i, 1000000 - i < 7 ? 1000000 - i : 7);
+    }
+    hisha1_final(&ctx, digest);
+    free(million);
+    test_cond(memcmp(digest, "\x34\xaa\x97\x3c\xd4\xc4\xda\xa4\xf6\x1e"
+        "\xeb\x2b\xdb\xad\x27\x31\x65\x34\x01\x6f", HISHA1_DIGEST_LEN) == 0);
+
+    test("SHA1 of a script matches the digest of SCRIPT LOAD: ");
+    hisha1_hex("return 1", 8, hex);
+    test_cond(strcmp(hex, "e0e1f9fabfc9d4800c877a703b823ac0578ff8db") == 0);
+}
+
+/* Whether the pointer view of the table routes every slot like the index. */
+static int table_matches(redisClusterContext *cc)
+{
+    uint32_t k;
+
+    for(k = 0; k < REDIS_CLUSTER_SLOTS; k ++)
+    {
+        if(cc->table[k] != node_get_by_table(cc, k))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void test_scripts(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc;
+    struct mock_node_stats before, after;
+    const char *script = "return redis.call('GET', KEYS[1])";
+    char sha[41], key[32];
+    redisReply *reply;
+
+    mc = mock_cluster_start(3, 0);
+    cc = context_connect(mc);
+    key_on_node(mc, 1, "script", key, sizeof(key));
+
+    test("Scripts: EVALSHA of a registered script loads it on NOSCRIPT: ");
+    redisClusterScriptRegister(cc, script, strlen(script), sha);
+    mock_cluster_stats(mc, 1, &before);
+    reply = redisClusterCommand(cc, "EVALSHA %s 1 %s", sha, key);
+    mock_cluster_stats(mc, 1, &after);
+    test_cond(reply_is(reply, REDIS_REPLY_STRING, script) &&
+        after.commands == before.commands + 3);
+
+    test("Scripts: once loaded, EVALSHA is sent alone: ");
+    mock_cluster_stats(mc, 1, &before);
+    reply = redisClusterCommand(cc, "EVALSHA %s 1 %s", sha, key);
+    mock_cluster_stats(mc, 1, &after);
+    test_cond(reply_is(reply, REDIS_REPLY_STRING, script) &&
+        after.commands == before.commands + 1);
+
+    test("Scripts: loaded again on a node that forgot it: ");
+    mock_cluster_script_flush(mc, -1);
+    test_cond(reply_is(redisClusterCommand(cc, "EVALSHA %s 1 %s", sha, key),
+        REDIS_REPLY_STRING, script));
+
+    test("Scripts: and again on the node its slot moved to: ");
+    mock_cluster_move_slots(mc, key_slot(key), key_slot(key), 2);
+    test_cond(reply_is(redisClusterCommand(cc, "EVALSHA %s 1 %s", sha, key),
+        REDIS_REPLY_STRING, script));
+
+    test("Scripts: NOSCRIPT is returned for an unknown digest: ");
+    reply = redisClusterCommand(cc, "EVALSHA %040d 1 %s", 0, key);
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_ERROR &&
+        strncmp(reply->str, "NOSCRIPT", 8) == 0);
+    freeReplyObject(reply);
+
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+}
+
+static void test_slot_table(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc;
+    char key[32];
+
+    mc = mock_cluster_start(3, 0);
+    cc = context_connect(mc);
+    key_on_node(mc, 0, "table", key, sizeof(key));
+
+    test("Slot table: the pointer view follows the index: ");
+    test_cond(cc->node_count == 3 && table_matches(cc) &&
+        strcmp(cc->table[key_slot(key)]->addr,
+        mock_cluster_node_addr(mc, 0)) == 0);
+
+    test("Slot table: and is rewritten with it when slots move: ");
+    mock_cluster_move_slots(mc, key_slot(key), key_slot(key), 2);
+    test_cond(command_is(cc, "OK", "SET %s v", key) && table_matches(cc) &&
+        strcmp(cc->table[key_slot(key)]->addr,
+        mock_cluster_node_addr(mc, 2)) == 0);
+
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+}
+
+/* A member of a shard, a map under RESP3. */
+static sds shard_member(sds s, int map, int port, const char *role,
+    const char *health)
+{
+    s = sdscatprintf(s, map ? "%%7\r\n" : "*14\r\n");
+    s = sdscatprintf(s, "$2\r\nid\r\n$4\r\nn%d\r\n", port - 7000 + 100);
+    s = sdscatprintf(s, "$4\r\nport\r\n:%d\r\n", port);
+    s = sdscat(s, "$2\r\nip\r\n$9\r\n127.0.0.1\r\n");
+    s = sdscat(s, "$8\r\nendpoint\r\n$9\r\n127.0.0.1\r\n");
+    s = sdscatprintf(s, "$4\r\nrole\r\n$%zu\r\n%s\r\n", strlen(role), role);
+    s = sdscat(s, "$18\r\nreplication-offset\r\n:0\r\n");
+    s = sdscatprintf(s, "$6\r\nhealth\r\n$%zu\r\n%s\r\n", strlen(health), health);
+
+    return s;
+}
+
+static sds shard_header(sds s, int map, int start, int end, int members)
+{
+    s = sdscatprintf(s, map ? "%%2\r\n" : "*4\r\n");
+    s = sdscatprintf(s, "$5\r\nslots\r\n*2\r\n:%d\r\n:%d\r\n", start, end);
+    s = sdscatprintf(s, "$5\r\nnodes\r\n*%d\r\n", members);
+
+    return s;
+}
+
+static void test_shards_parse(void)
+{
+    const char *unknown = "-ERR unknown subcommand 'SHARDS'. Try CLUSTER HELP.\r\n";
+    const char *noauth = "-NOAUTH Authentication required.\r\n";
+    redisClusterContext *cc;
+    cluster_node *master, *slave;
+    cluster_slot *slot;
+    redisReply *reply;
+    dict *nodes;
+    sds s;
+    int map;
+
+    cc = redisClusterContextInit();
+
+    for(map = 0; map <= 1; map ++)
+    {
+        /* After a failover: the failed master is still listed, first. */
+        s = sdsnew("*2\r\n");
+        s = shard_header(s, map, 0, 8191, 3);
+        s = shard_member(s, map, 7000, "master", "fail");
+        s = shard_member(s, map, 7001, "master", "online");
+        s = shard_member(s, map, 7002, "replica", "loading");
+        s = shard_header(s, map, 8192, 16383, 2);
+        s = shard_member(s, map, 7003, "master", "online");
+        s = shard_member(s, map, 7004, "replica", "online");
+
+        reply = reply_parse(s, sdslen(s));
+        sdsfree(s);
+
+        nodes = reply == NULL ? NULL :
+            parse_cluster_shards(cc, reply, HIRCLUSTER_FLAG_ADD_SLAVE);
+
+        if(map)
+        {
+            test("CLUSTER SHARDS, RESP3: the online master serves the shard: ");
+        }
+        else
+        {
+            test("CLUSTER SHARDS: the online master serves the shard: ");
+        }
+        master = nodes_get(nodes, "127.0.0.1:7001");
+        slot = master == NULL || master->slots == NULL ||
+            listFirst(master->slots) == NULL ? NULL :
+            listNodeValue(listFirst(master->slots));
+        test_cond(nodes != NULL && dictSize(nodes) == 2 &&
+            nodes_get(nodes, "127.0.0.1:7000") == NULL && slot != NULL &&
+            slot->start == 0 && slot->end == 8191 && master->slaves == NULL);
+
+        test("CLUSTER SHARDS: only the online replicas are kept: ");
+        master = nodes_get(nodes, "127.0.0.1:7003");
+        slave = master == NULL || master->slaves == NULL ||
+            listLength(master->slaves) != 1 ? NULL :
+            listNodeValue(listFirst(master->slaves));
+        test_cond(slave != NULL && slave->port == 7004 &&
+            slave->role == REDIS_ROLE_SLAVE);
+
+        if(nodes != NULL)
+        {
+            dictRelease(nodes);
+        }
+        freeReplyObject(reply);
+    }
+
+    test("CLUSTER SHARDS: a shard with its master failed is not served: ");
+    s = sdsnew("*2\r\n");
+    s = shard_header(s, 0, 0, 8191, 1);
+    s = shard_member(s, 0, 7000, "master", "fail");
+    s = shard_header(s, 0, 8192, 16383, 1);
+    s = shard_member(s, 0, 7003, "master", "online");
+    reply = reply_parse(s, sdslen(s));
+    sdsfree(s);
+    nodes = parse_cluster_shards(cc, reply, 0);
+    test_cond(nodes != NULL && dictSize(nodes) == 1 &&
+        nodes_get(nodes, "127.0.0.1:7003") != NULL);
+    if(nodes != NULL)
+    {
+        dictRelease(nodes);
+    }
+    freeReplyObject(reply);
+
+    test("CLUSTER SHARDS: no master at all is an error: ");
+    s = sdsnew("*1\r\n");
+    s = shard_header(s, 0, 0, 16383, 1);
+    s = shard_member(s, 0, 7000, "master", "fail");
+    reply = reply_parse(s, sdslen(s));
+    sdsfree(s);
+    nodes = parse_cluster_shards(cc, reply, 0);
+    test_cond(nodes == NULL && cc->err != 0);
+    freeReplyObject(reply);
+
+    test("CLUSTER SHARDS: only an unknown subcommand means a server before 7: ");
+    reply = reply_parse(unknown, strlen(unknown));
+    map = reply != NULL && cluster_reply_unknown_subcommand(reply);
+    freeReplyObject(reply);
+    reply = reply_parse(noauth, strlen(noauth));
+    test_cond(map && reply != NULL && !cluster_reply_unknown_subcommand(reply));
+    freeReplyObject(reply);
+
+    redisClusterFree(cc);
+}
+
+static void test_route(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc;
+    char key[32];
+
+    mc = mock_cluster_start(3, MOCK_CLUSTER_SHARDS);
+    cc = context_connect(mc);
+    key_on_node(mc, 2, "route", key, sizeof(key));
+
+    test("Route from CLUSTER SHARDS: ");
+    test_cond(!cc->route_no_shards &&
+        strcmp(key_addr(cc, key), mock_cluster_node_addr(mc, 2)) == 0 &&
+        command_is(cc, "OK", "SET %s v", key) &&
+        command_is(cc, "v", "GET %s", key));
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+
+    mc = mock_cluster_start(3, 0);
+    cc = context_connect(mc);
+    key_on_node(mc, 1, "route", key, sizeof(key));
+
+    test("Route from CLUSTER NODES when CLUSTER SHARDS is unknown: ");
+    test_cond(cc->route_no_shards &&
+        strcmp(key_addr(cc, key), mock_cluster_node_addr(mc, 1)) == 0 &&
+        command_is(cc, "OK", "SET %s v", key));
+    redisClusterFree(cc);
+
+    test("Other errors leave CLUSTER SHARDS to be tried again: ");
+    mock_cluster_password(mc, "secret");
+    cc = context_init(mc);
+    test_cond(redisClusterConnect2(cc) != REDIS_OK && !cc->route_no_shards &&
+        strstr(cc->errstr, "NOAUTH") != NULL);
+    redisClusterFree(cc);
+
+    test("Route with a password: ");
+    cc = context_init(mc);
+    redisClusterSetOptionAuthPassword(cc, "secret");
+    test_cond(redisClusterConnect2(cc) == REDIS_OK &&
+        command_is(cc, "v", "GET %s", key));
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+}
+
+/* A listening socket whose backlog is filled by *filler: the next connects
+ * to it neither complete nor fail. Returns its port. */
+static int blackhole_open(int *fd, int *filler)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    struct pollfd pfd;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    *fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(*fd, (struct sockaddr *)&sa, sizeof(sa));
+    listen(*fd, 0);
+    getsockname(*fd, (struct sockaddr *)&sa, &len);
+
+    *filler = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(*filler, F_SETFL, O_NONBLOCK);
+    connect(*filler, (struct sockaddr *)&sa, sizeof(sa));
+    pfd.fd = *filler;
+    pfd.events = POLLOUT;
+    poll(&pfd, 1, 1000);
+
+    return ntohs(sa.sin_port);
+}
+
+/* Every master of cc has a live connection. */
+static int masters_connected(redisClusterContext *cc)
+{
+    dictIterator *it;
+    dictEntry *de;
+    cluster_node *node;
+    int ret = 1;
+
+    it = dictGetIterator(cc->nodes);
+    while((de = dictNext(it)) != NULL)
+    {
+        node = dictGetEntryVal(de);
+        ret &= node->con != NULL && node->con->err == 0;
+    }
+    dictReleaseIterator(it);
+
+    return ret;
+}
+
+static void test_connect(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc;
+    struct mock_node_stats before[3], after[3];
+    struct timeval tv;
+    char addrs[64], key[32];
+    int64_t start, elapsed;
+    int fd, filler, port, node, ret, once;
+
+    mc = mock_cluster_start(3, 0);
+    port = blackhole_open(&fd, &filler);
+
+    test("Parallel connect: a seed that never answers costs no timeout: ");
+    snprintf(addrs, sizeof(addrs), "127.0.0.1:%d,%s", port,
+        mock_cluster_node_addr(mc, 0));
+    cc = redisClusterContextInit();
+    redisClusterSetOptionAddNodes(cc, addrs);
+    tv.tv_sec = 2;
+    tv.tv_usec = 0;
+    redisClusterSetOptionConnectTimeout(cc, tv);
+    start = hi_usec_now();
+    ret = redisClusterConnect2(cc);
+    elapsed = hi_usec_now() - start;
+    test_cond(ret == REDIS_OK && elapsed < 1000000 &&
+        dictSize(cc->nodes) == 3);
+    redisClusterFree(cc);
+
+    test("Parallel connect: no seed answering fails at the timeout: ");
+    snprintf(addrs, sizeof(addrs), "127.0.0.1:%d", port);
+    cc = redisClusterContextInit();
+    redisClusterSetOptionAddNodes(cc, addrs);
+    tv.tv_sec = 0;
+    tv.tv_usec = 300000;
+    redisClusterSetOptionConnectTimeout(cc, tv);
+    start = hi_usec_now();
+    ret = redisClusterConnect2(cc);
+    elapsed = hi_usec_now() - start;
+    test_cond(ret != REDIS_OK && elapsed >= 250000 && elapsed < 1500000);
+    redisClusterFree(cc);
+
+    close(filler);
+    close(fd);
+
+    test("Warm-up: every master is connected with the route: ");
+    cc = context_init(mc);
+    redisClusterSetOptionWarmUp(cc);
+    test_cond(redisClusterConnect2(cc) == REDIS_OK && masters_connected(cc));
+    redisClusterFree(cc);
+
+    test("Warm-up: the connections are authenticated up front: ");
+    mock_cluster_password(mc, "secret");
+    cc = context_init(mc);
+    redisClusterSetOptionWarmUp(cc);
+    redisClusterSetOptionAuthPassword(cc, "secret");
+    ret = redisClusterConnect2(cc) == REDIS_OK && masters_connected(cc);
+    once = 1;
+    for(node = 0; node < 3; node ++)
+    {
+        key_on_node(mc, node, "warm", key, sizeof(key));
+        mock_cluster_stats(mc, node, &before[node]);
+        ret &= command_is(cc, "OK", "SET %s v", key);
+        mock_cluster_stats(mc, node, &after[node]);
+        once &= after[node].commands == before[node].commands + 1 &&
+            after[node].connections == before[node].connections;
+    }
+    test_cond(ret && once);
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+}
+
+static void test_topology_file(void)
+{
+    char path[] = "/tmp/hiredis-vip-test-topology-XXXXXX";
+    cluster_route_file_header header;
+    struct mock_cluster *mc;
+    struct mock_node_stats before, after;
+    redisClusterContext *cc, *from_file;
+    char key[32];
+    FILE *fp;
+    int fd, slot;
+
+    fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+
+    mc = mock_cluster_start(3, 0);
+    key_on_node(mc, 0, "topology", key, sizeof(key));
+    slot = key_slot(key);
+
+    test("The route fetched is saved to the topology file: ");
+    cc = context_init(mc);
+    redisClusterSetOptionTopologyFile(cc, path, 0);
+    test_cond(redisClusterConnect2(cc) == REDIS_OK && access(path, R_OK) == 0);
+    redisClusterFree(cc);
+
+    test("A context starts from the file without asking the cluster: ");
+    mock_cluster_stats(mc, -1, &before);
+    from_file = context_init(mc);
+    redisClusterSetOptionTopologyFile(from_file, path, 0);
+    fd = redisClusterConnect2(from_file);
+    mock_cluster_stats(mc, -1, &after);
+    test_cond(fd == REDIS_OK && after.connections == before.connections &&
+        strcmp(key_addr(from_file, key), mock_cluster_node_addr(mc, 0)) == 0);
+
+    test("A MOVED refreshes the route from the file and rewrites it: ");
+    mock_cluster_move_slots(mc, slot, slot, 2);
+    fd = command_is(from_file, "OK", "SET %s v", key) &&
+        strcmp(key_addr(from_file, key), mock_cluster_node_addr(mc, 2)) == 0;
+    redisClusterFree(from_file);
+    from_file = context_init(mc);
+    redisClusterSetOptionTopologyFile(from_file, path, 0);
+    test_cond(fd && redisClusterConnect2(from_file) == REDIS_OK &&
+        strcmp(key_addr(from_file, key), mock_cluster_node_addr(mc, 2)) == 0);
+    redisClusterFree(from_file);
+
+    test("A file older than max_age is not used: ");
+    fp = fopen(path, "r+b");
+    fd = fp != NULL && fread(&header, sizeof(header), 1, fp) == 1;
+    header.saved_at -= 3600;
+    fd = fd && fseek(fp, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, fp) == 1;
+    if(fp != NULL)
+    {
+        fclose(fp);
+    }
+    mock_cluster_move_slots(mc, slot, slot, 1);
+    mock_cluster_stats(mc, -1, &before);
+    from_file = context_init(mc);
+    redisClusterSetOptionTopologyFile(from_file, path, 60);
+    test_cond(fd && redisClusterConnect2(from_file) == REDIS_OK &&
+        (mock_cluster_stats(mc, -1, &after), after.connections > before.connections) &&
+        strcmp(key_addr(from_file, key), mock_cluster_node_addr(mc, 1)) == 0);
+    redisClusterFree(from_file);
+
+    test("A corrupted file is not used: ");
+    fp = fopen(path, "r+b");
+    fd = fp != NULL && fseek(fp, sizeof(header) + 1, SEEK_SET) == 0 &&
+        (slot = fgetc(fp)) != EOF && fseek(fp, sizeof(header) + 1, SEEK_SET) == 0 &&
+        fputc(slot ^ 0xff, fp) != EOF;
+    if(fp != NULL)
+    {
+        fclose(fp);
+    }
+    mock_cluster_stats(mc, -1, &before);
+    from_file = context_init(mc);
+    redisClusterSetOptionTopologyFile(from_file, path, 0);
+    test_cond(fd && redisClusterConnect2(from_file) == REDIS_OK &&
+        (mock_cluster_stats(mc, -1, &after), after.connections > before.connections) &&
+        strcmp(key_addr(from_file, key), mock_cluster_node_addr(mc, 1)) == 0);
+    redisClusterFree(from_file);
+
+    unlink(path);
+    mock_cluster_stop(mc);
+}
+
+#define TOPOLOGY_THREADS 8
+#define TOPOLOGY_CALLS 300
+
+struct topology_worker {
+    redisClusterContext *cc;
+    pthread_t thread;
+    int id;
+    int bad;
+    int *finished;
+};
+
+static void *topology_worker_run(void *arg)
+{
+    struct topology_worker *w = arg;
+    char key[32], value[32];
+    int i;
+
+    for(i = 0; i < TOPOLOGY_CALLS; i ++)
+    {
+        snprintf(key, sizeof(key), "shared%d.%d", w->id, i % 50);
+        snprintf(value, sizeof(value), "%d.%d", w->id, i);
+
+        if(!command_is(w->cc, "OK", "SET %s %s", key, value) ||
+            !command_is(w->cc, value, "GET %s", key))
+        {
+            w->bad ++;
+        }
+    }
+
+    __sync_fetch_and_add(w->finished, 1);
+
+    return NULL;
+}
+
+static void test_shared_topology(void)
+{
+    struct mock_cluster *mc;
+    redisClusterTopology *t;
+    redisClusterContext *cc, *other;
+    struct mock_node_stats before, after;
+    struct topology_worker workers[TOPOLOGY_THREADS];
+    char key[32];
+    int i, bad = 0, finished = 0, moves = 0;
+
+    mc = mock_cluster_start(3, 0);
+    t = redisClusterTopologyCreate();
+    key_on_node(mc, 0, "shared", key, sizeof(key));
+
+    test("Shared topology: the second context installs the first route: ");
+    cc = context_init(mc);
+    redisClusterSetOptionTopology(cc, t);
+    redisClusterConnect2(cc);
+    other = context_init(mc);
+    redisClusterSetOptionTopology(other, t);
+    redisClusterConnect2(other);
+    test_cond(redisClusterTopologyVersion(t) == 1 &&
+        cc->topology_version == 1 && other->topology_version == 1);
+
+    test("Shared topology: a route fetched by one is used by the other: ");
+    mock_cluster_move_slots(mc, key_slot(key), key_slot(key), 2);
+    command_is(cc, "OK", "SET %s v", key);
+    mock_cluster_stats(mc, 0, &before);
+    command_is(other, "v", "GET %s", key);
+    mock_cluster_stats(mc, 0, &after);
+    test_cond(redisClusterTopologyVersion(t) == 2 &&
+        other->topology_version == 2 &&
+        after.redirects == before.redirects &&
+        strcmp(key_addr(other, key), mock_cluster_node_addr(mc, 2)) == 0);
+    redisClusterFree(other);
+    redisClusterFree(cc);
+
+    test("Shared topology: contexts of several threads refresh together: ");
+    for(i = 0; i < TOPOLOGY_THREADS; i ++)
+    {
+        workers[i].cc = context_init(mc);
+        redisClusterSetOptionTopology(workers[i].cc, t);
+        redisClusterSetOptionMaxRedirect(workers[i].cc, 100);
+        redisClusterConnect2(workers[i].cc);
+        workers[i].id = i;
+        workers[i].bad = 0;
+        workers[i].finished = &finished;
+        pthread_create(&workers[i].thread, NULL, topology_worker_run,
+            &workers[i]);
+    }
+
+    while(__sync_fetch_and_add(&finished, 0) < TOPOLOGY_THREADS)
+    {
+        mock_cluster_move_slots(mc, 0, 5000, moves ++ % 2);
+        usleep(10000);
+    }
+
+    for(i = 0; i < TOPOLOGY_THREADS; i ++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        bad += workers[i].bad;
+        redisClusterFree(workers[i].cc);
+    }
+    test_cond(bad == 0 && moves > 0 && redisClusterTopologyVersion(t) > 2);
+
+    redisClusterTopologyRelease(t);
+    mock_cluster_stop(mc);
+}
+
+static void test_transactions(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc, *other;
+    redisClusterTransaction *tx;
+    redisReply *reply;
+    char key[32], key2[sizeof(key) + sizeof("{}.count")];
+    int i, slot;
+
+    mc = mock_cluster_start(3, 0);
+    cc = context_connect(mc);
+    other = context_connect(mc);
+    key_on_node(mc, 1, "tx", key, sizeof(key));
+    snprintf(key2, sizeof(key2), "{%s}.count", key);
+    slot = key_slot(key);
+
+    test("Transaction: MULTI/EXEC in one round trip: ");
+    tx = redisClusterTransactionCreate(cc);
+    redisClusterTransactionAppendCommand(tx, "SET %s v", key);
+    redisClusterTransactionAppendCommand(tx, "INCR %s", key2);
+    reply = redisClusterTransactionExec(tx);
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_ARRAY &&
+        reply->elements == 2 && reply->element[1]->type == REDIS_REPLY_INTEGER &&
+        reply->element[1]->integer == 1);
+    freeReplyObject(reply);
+
+    test("Transaction: keys of another slot are refused: ");
+    redisClusterTransactionAppendCommand(tx, "SET %s v", key);
+    test_cond(redisClusterTransactionAppendCommand(tx, "SET other v") != REDIS_OK);
+    redisClusterTransactionDiscard(tx);
+
+    test("Transaction: a watched key written meanwhile aborts EXEC: ");
+    redisClusterTransactionWatch(tx, key, strlen(key));
+    command_is(other, "OK", "SET %s changed", key);
+    redisClusterTransactionAppendCommand(tx, "SET %s v", key);
+    reply = redisClusterTransactionExec(tx);
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_NIL &&
+        command_is(cc, "changed", "GET %s", key));
+    freeReplyObject(reply);
+
+    test("Transaction: the slot moved, EXEC follows it: ");
+    mock_cluster_move_slots(mc, slot, slot, 2);
+    redisClusterTransactionAppendCommand(tx, "INCR %s", key2);
+    reply = redisClusterTransactionExec(tx);
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_ARRAY &&
+        reply->elements == 1 && reply->element[0]->integer == 2 &&
+        strcmp(key_addr(cc, key), mock_cluster_node_addr(mc, 2)) == 0);
+    freeReplyObject(reply);
+
+    test("Transaction: the watch holds over a route update: ");
+    redisClusterTransactionWatch(tx, key, strlen(key));
+    cluster_update_route(cc);
+    redisClusterTransactionAppendCommand(tx, "SET %s v", key);
+    reply = redisClusterTransactionExec(tx);
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_ARRAY);
+    freeReplyObject(reply);
+
+    test("Transaction: the watch is lost with its connection: ");
+    redisClusterTransactionWatch(tx, key, strlen(key));
+    mock_cluster_disconnect(mc, 2);
+    usleep(50000);
+    /* The next command finds the connection closed, the one after opens
+     * it again. */
+    for(i = 0; i < 3 && !command_is(cc, "v", "GET %s", key); i ++);
+    redisClusterTransactionAppendCommand(tx, "SET %s v", key);
+    reply = redisClusterTransactionExec(tx);
+    test_cond(i < 3 && reply == NULL &&
+        strstr(cc->errstr, "watched keys was lost") != NULL);
+
+    test("Transaction: and WATCH refuses to go on after it: ");
+    redisClusterTransactionWatch(tx, key, strlen(key));
+    mock_cluster_disconnect(mc, 2);
+    usleep(50000);
+    for(i = 0; i < 3 && !command_is(cc, "v", "GET %s", key); i ++);
+    test_cond(redisClusterTransactionWatch(tx, key2, strlen(key2)) != REDIS_OK &&
+        strstr(cc->errstr, "watched keys was lost") != NULL);
+    redisClusterTransactionDiscard(tx);
+
+    redisClusterTransactionFree(tx);
+    redisClusterFree(other);
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+}
+
+static void test_cache(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc, *other;
+    redisCacheStats stats;
+    redisCache *cache;
+    char key[32];
+    uint64_t flushes;
+    int slot;
+
+    mc = mock_cluster_start(3, 0);
+    cache = redisCacheCreate(1 << 20);
+    cc = context_init(mc);
+    redisClusterSetOptionCache(cc, cache);
+    redisClusterConnect2(cc);
+    other = context_connect(mc);
+    key_on_node(mc, 0, "cache", key, sizeof(key));
+    slot = key_slot(key);
+
+    test("Cache: a GET read again is served from cache: ");
+    command_is(other, "OK", "SET %s v1", key);
+    command_is(cc, "v1", "GET %s", key);
+    redisCacheGetStats(cache, &stats);
+    test_cond(command_is(cc, "v1", "GET %s", key) &&
+        (redisCacheGetStats(cache, &stats), stats.hits == 1 && stats.misses == 1));
+
+    test("Cache: a key written by another client is invalidated: ");
+    command_is(other, "OK", "SET %s v2", key);
+    test_cond(command_is(cc, "v2", "GET %s", key) &&
+        (redisCacheGetStats(cache, &stats), stats.invalidations == 1 &&
+        stats.hits == 1));
+
+    test("Cache: a route update moving no slot keeps the cache: ");
+    redisCacheGetStats(cache, &stats);
+    flushes = stats.flushes;
+    cluster_update_route(cc);
+    test_cond(command_is(cc, "v2", "GET %s", key) &&
+        (redisCacheGetStats(cache, &stats), stats.flushes == flushes &&
+        stats.hits == 2));
+
+    test("Cache: a route update moving slots flushes the cache: ");
+    mock_cluster_move_slots(mc, slot, slot, 1);
+    cluster_update_route(cc);
+    redisCacheGetStats(cache, &stats);
+    test_cond(stats.flushes == flushes + 1 && stats.entries == 0 &&
+        command_is(cc, "v2", "GET %s", key));
+
+    redisClusterFree(other);
+    redisClusterFree(cc);
+    redisCacheFree(cache);
+    mock_cluster_stop(mc);
+}
+
+static void test_resp3(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc;
+    redisContext *c;
+    redisReply *reply;
+    char key[32], *value;
+    int len;
+
+    mc = mock_cluster_start(3, 0);
+    key_on_node(mc, 0, "resp3", key, sizeof(key));
+
+    test("RESP3: HELLO 3 on the node connections: ");
+    cc = context_init(mc);
+    redisClusterSetOptionResp3(cc);
+    redisClusterConnect2(cc);
+    c = ctx_get_by_node(cc, node_get_by_table(cc, (uint32_t)key_slot(key)));
+    reply = c == NULL ? NULL : redisCommand(c, "CONFIG GET cluster-enabled");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_MAP &&
+        command_is(cc, "OK", "SET %s v", key));
+    freeReplyObject(reply);
+
+    test("RESP3: CONFIG GET answers a map: ");
+    value = cluster_config_get(cc, "cluster-node-timeout", &len);
+    test_cond(value != NULL && len == 5 && memcmp(value, "15000", 5) == 0);
+    free(value);
+    redisClusterFree(cc);
+
+    test("RESP3: HELLO 3 authenticates with the password: ");
+    mock_cluster_password(mc, "secret");
+    cc = context_init(mc);
+    redisClusterSetOptionResp3(cc);
+    redisClusterSetOptionAuthPassword(cc, "secret");
+    test_cond(redisClusterConnect2(cc) == REDIS_OK &&
+        command_is(cc, "v", "GET %s", key));
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+
+    mc = mock_cluster_start(3, MOCK_CLUSTER_RESP2);
+    mock_cluster_password(mc, "secret");
+    key_on_node(mc, 0, "resp3", key, sizeof(key));
+
+    test("RESP3 refused: RESP2 and AUTH instead: ");
+    cc = context_init(mc);
+    redisClusterSetOptionResp3(cc);
+    redisClusterSetOptionAuthPassword(cc, "secret");
+    test_cond(redisClusterConnect2(cc) == REDIS_OK &&
+        command_is(cc, "OK", "SET %s v", key) &&
+        command_is(cc, "v", "GET %s", key));
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+}
+
+static void test_uring(void)
+{
+    struct mock_cluster *mc;
+    redisClusterContext *cc;
+    redisUringContext *u;
+    redisContext *cs[2];
+    const redisContextFuncs *funcs;
+    redisReply *reply;
+    char key[32];
+    int i, node, ok, dummy;
+
+    u = redisCreateUringContext(0, 0, 0);
+    if(u == NULL)
+    {
+        printf("io_uring is not available: skipping its tests\n");
+        return;
+    }
+
+    mc = mock_cluster_start(3, 0);
+
+    test("io_uring: a flush of two contexts sends every command once: ");
+    for(node = 0; node < 2; node ++)
+    {
+        cs[node] = redisConnect("127.0.0.1", mock_cluster_node_port(mc, node));
+    }
+    redisInitiateUring(cs[0], u);
+    for(i = 0; i < 200; i ++)
+    {
+        redisAppendCommand(cs[0], "PING");
+        redisAppendCommand(cs[1], "PING");
+    }
+    ok = redisUringFlush(u, cs, 2) == REDIS_OK &&
+        sdslen(cs[0]->obuf) == 0 && sdslen(cs[1]->obuf) == 0;
+    for(i = 0; ok && i < 400; i ++)
+    {
+        reply = NULL;
+        ok = redisGetReply(cs[i % 2], (void **)&reply) == REDIS_OK &&
+            reply->type == REDIS_REPLY_STATUS;
+        freeReplyObject(reply);
+    }
+    test_cond(ok && redisUringFlush(u, cs, 2) == REDIS_OK);
+    redisFree(cs[0]);
+    redisFree(cs[1]);
+    redisFreeUringContext(u);
+
+    test("io_uring: the node connections go through the ring: ");
+    cc = context_init(mc);
+    ok = redisClusterSetOptionIoUring(cc) == REDIS_OK;
+    redisClusterConnect2(cc);
+    key_on_node(mc, 1, "uring", key, sizeof(key));
+    test_cond(ok && cc->uring != NULL &&
+        command_is(cc, "OK", "SET %s v", key) &&
+        command_is(cc, "v", "GET %s", key));
+
+    test("io_uring: pipelined commands on every node: ");
+    ok = 1;
+    for(node = 0; node < 3; node ++)
+    {
+        key_on_node(mc, node, "uring", key, sizeof(key));
+        ok &= redisClusterAppendCommand(cc, "SET %s %d", key, node) == REDIS_OK;
+        ok &= redisClusterAppendCommand(cc, "GET %s", key) == REDIS_OK;
+    }
+    for(i = 0; ok && i < 6; i ++)
+    {
+        reply = NULL;
+        ok = redisClusterGetReply(cc, (void **)&reply) == REDIS_OK &&
+            (i % 2 == 0 ? reply->type == REDIS_REPLY_STATUS :
+            reply->type == REDIS_REPLY_STRING && atoi(reply->str) == i / 2);
+        freeReplyObject(reply);
+    }
+    redisClusterReset(cc);
+    test_cond(ok);
+
+    test("io_uring: a connection the ring refuses keeps plain sockets: ");
+    cs[0] = redisConnect("127.0.0.1", mock_cluster_node_port(mc, 0));
+    funcs = cs[0]->funcs;
+    cs[0]->privctx = &dummy;
+    cluster_node_uring(cc, cs[0]);
+    reply = redisCommand(cs[0], "PING");
+    test_cond(cs[0]->err == 0 &&
+        cs[0]->funcs == funcs && reply != NULL &&
+        reply->type == REDIS_REPLY_STATUS);
+    freeReplyObject(reply);
+    cs[0]->privctx = NULL;
+    redisFree(cs[0]);
+
+    redisClusterFree(cc);
+    mock_cluster_stop(mc);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    test_pipeline();
+    test_sha1();
+    test_scripts();
+    test_slot_table();
+    test_shards_parse();
+    test_route();
+    test_connect();
+    test_topology_file();
+    test_shared_topology();
+    test_transactions();
+    test_cache();
+    test_resp3();
+    test_uring();
+
+    if(fails)
+    {
+        printf("*** %d TESTS FAILED ***\n", fails);
+        return 1;
+    }
+
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * Tests of the TLS connections, against a server run in process on a
+ * loopback port with a certificate made on the fly. The sources are
+ * included to reach their internals, the static functions among them.
+ */
+#include "ssl.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+/* The following lines make up our testing "framework" :) */
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+#define LARGE_LEN (1024*1024)
+
+/* Serves its connections one after the other. The commands are PING, ECHO
+ * and KEYUPDATE, which sends a TLS 1.3 key update asking for the one of the
+ * client before answering +OK. */
+struct tls_server {
+    SSL_CTX *ctx;
+    int fd;
+    int port;
+    pthread_t thread;
+};
+
+static void tls_server_reply(SSL *ssl, redisReply *req)
+{
+    sds out = sdsempty();
+    const char *name;
+
+    name = req->type == REDIS_REPLY_ARRAY && req->elements > 0 ?
+        req->element[0]->str : "";
+
+    if(!strcasecmp(name, "PING"))
+    {
+        out = sdscat(out, "+PONG\r\n");
+    }
+    else if(!strcasecmp(name, "ECHO") && req->elements == 2)
+    {
+        out = sdscatprintf(out, "$%zu\r\n", req->element[1]->len);
+        out = sdscatlen(out, req->element[1]->str, req->element[1]->len);
+        out = sdscat(out, "\r\n");
+    }
+    else if(!strcasecmp(name, "KEYUPDATE"))
+    {
+        SSL_key_update(ssl, SSL_KEY_UPDATE_REQUESTED);
+        out = sdscat(out, "+OK\r\n");
+    }
+    else
+    {
+        out = sdscat(out, "-ERR unknown command\r\n");
+    }
+
+    SSL_write(ssl, out, (int)sdslen(out));
+    sdsfree(out);
+}
+
+static void *tls_server_run(void *arg)
+{
+    struct tls_server *server = arg;
+    redisReader *reader;
+    void *req;
+    char buf[16*1024];
+    SSL *ssl;
+    int fd, n;
+
+    while((fd = accept(server->fd, NULL, NULL)) >= 0)
+    {
+        ssl = SSL_new(server->ctx);
+        SSL_set_fd(ssl, fd);
+        reader = redisReaderCreate();
+
+        if(SSL_accept(ssl) == 1)
+        {
+            while((n = SSL_read(ssl, buf, sizeof(buf))) > 0)
+            {
+                redisReaderFeed(reader, buf, n);
+                while(redisReaderGetReply(reader, &req) == REDIS_OK &&
+                    req != NULL)
+                {
+                    tls_server_reply(ssl, req);
+                    freeReplyObject(req);
+                }
+            }
+        }
+
+        redisReaderFree(reader);
+        SSL_free(ssl);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/* A self-signed certificate for the server, written to cafile for the
+ * clients to trust it. */
+static int tls_server_start(struct tls_server *server, const char *cafile)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    EVP_PKEY *pkey;
+    X509 *x509;
+    FILE *fp;
+
+    pkey = EVP_EC_gen("P-256");
+    x509 = X509_new();
+    X509_set_version(x509, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+        (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x509, X509_get_subject_name(x509));
+    X509_sign(x509, pkey, EVP_sha256());
+
+    fp = fopen(cafile, "w");
+    if(fp == NULL)
+    {
+        return -1;
+    }
+    PEM_write_X509(fp, x509);
+    fclose(fp);
+
+    server->ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(server->ctx, x509);
+    SSL_CTX_use_PrivateKey(server->ctx, pkey);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(bind(server->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        listen(server->fd, 16) < 0 ||
+        getsockname(server->fd, (struct sockaddr *)&sa, &len) < 0)
+    {
+        return -1;
+    }
+    server->port = ntohs(sa.sin_port);
+
+    return pthread_create(&server->thread, NULL, tls_server_run, server);
+}
+
+static void tls_server_stop(struct tls_server *server)
+{
+    shutdown(server->fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+    SSL_CTX_free(server->ctx);
+}
+
+static redisContext *tls_connect(struct tls_server *server,
+    redisSSLContext *ctx)
+{
+    redisContext *c;
+
+    c = redisConnect("127.0.0.1", server->port);
+    if(c == NULL || c->err || redisInitiateSSLWithContext(c, ctx) != REDIS_OK)
+    {
+        printf("connect: %s\n", c == NULL ? "?" : c->errstr);
+        exit(1);
+    }
+
+    return c;
+}
+
+static int command_is(redisContext *c, int type, const char *str,
+    const char *format, ...)
+{
+    redisReply *reply;
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    reply = redisvCommand(c, format, ap);
+    va_end(ap);
+
+    ret = reply != NULL && reply->type == type &&
+        (str == NULL || strcmp(reply->str, str) == 0);
+    freeReplyObject(reply);
+
+    return ret;
+}
+
+/* Everything the server does on a connection: a key update, and a value
+ * larger than the records and the socket buffers each way. */
+static int exchange(redisContext *c, const char *large)
+{
+    return command_is(c, REDIS_REPLY_STATUS, "PONG", "PING") &&
+        command_is(c, REDIS_REPLY_STATUS, "OK", "KEYUPDATE") &&
+        command_is(c, REDIS_REPLY_STRING, large, "ECHO %s", large) &&
+        command_is(c, REDIS_REPLY_STATUS, "PONG", "PING");
+}
+
+static void test_ktls(void)
+{
+    char cafile[] = "/tmp/hiredis-vip-test-ca-XXXXXX";
+    struct tls_server server;
+    redisSSLContext *ctx, *ktls_ctx;
+    redisContext *c;
+    char *large;
+    int fd, enabled, ktls;
+
+    fd = mkstemp(cafile);
+    close(fd);
+    if(tls_server_start(&server, cafile) != 0)
+    {
+        printf("server: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    large = malloc(LARGE_LEN + 1);
+    memset(large, 'x', LARGE_LEN);
+    large[LARGE_LEN] = '\0';
+
+    ctx = redisCreateSSLContext(cafile, NULL, NULL, NULL, NULL, NULL);
+    ktls_ctx = redisCreateSSLContext(cafile, NULL, NULL, NULL, NULL, NULL);
+    enabled = redisSSLContextEnableKTLS(ktls_ctx);
+
+    test("kTLS: off unless enabled: ");
+    c = tls_connect(&server, ctx);
+    test_cond(exchange(c, large) && redisSSLGetKTLS(c) == 0 &&
+        c->funcs == &redisContextSSLFuncs);
+    redisFree(c);
+
+#ifdef HIREDIS_USE_KTLS
+    test("kTLS: enabled, what the kernel does not take stays on OpenSSL: ");
+    c = tls_connect(&server, ktls_ctx);
+    ktls = redisSSLGetKTLS(c);
+    test_cond(enabled == REDIS_OK && exchange(c, large) &&
+        redisSSLGetKTLS(c) == ktls &&
+        c->funcs == (ktls ? &redisContextKTLSFuncs : &redisContextSSLFuncs));
+    redisFree(c);
+
+    test("kTLS: the directions not offloaded go through OpenSSL: ");
+    c = tls_connect(&server, ctx);
+    c->funcs = &redisContextKTLSFuncs;
+    test_cond(exchange(c, large));
+    redisFree(c);
+#else
+    test("kTLS: refused without the support of OpenSSL: ");
+    c = tls_connect(&server, ktls_ctx);
+    ktls = redisSSLGetKTLS(c);
+    test_cond(enabled == REDIS_ERR && exchange(c, large) && ktls == 0);
+    redisFree(c);
+#endif
+
+    free(large);
+    redisFreeSSLContext(ktls_ctx);
+    redisFreeSSLContext(ctx);
+    tls_server_stop(&server);
+    unlink(cafile);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    redisInitOpenSSL();
+
+    test_ktls();
+
+    if(fails)
+    {
+        printf("*** %d TESTS FAILED ***\n", fails);
+        return 1;
+    }
+
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
@@ -0,0 +1,498 @@
+#include "fmacros.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "hiredis.h"
+#include "async.h"
+#include "net.h"
+#include "hiuring.h"
+#include "hiredis_uring.h"
+
+#define URING_DEFAULT_ENTRIES   256
+#define URING_DEFAULT_NBUFS     64
+#define URING_DEFAULT_BUFSIZE   (1024*16)   /* what redisBufferRead() asks for */
+
+/* The low bit of the user_data tells sends from reads, a 0 user_data is used
+ * for cancel requests whose completion is not interesting. */
+#define URING_OP_RECV   0
+#define URING_OP_SEND   1
+#define URING_OP_MASK   1
+
+void __redisSetError(redisContext *c, int type, const char *str);
+
+struct redisUringContext {
+    struct hiuring *ring;
+    char *arena;            /* nbufs * bufsize bytes, registered as buffer 0 */
+    size_t bufsize;
+    unsigned nbufs;
+    unsigned char *used;    /* arena buffers handed out */
+    int fixed;              /* arena registered with the kernel */
+    long long timeout;      /* usec, -1 waits forever */
+};
+
+typedef struct redisUring {
+    redisUringContext *u;
+    char *buf;              /* read buffer, in the arena when index >= 0 */
+    int index;
+    size_t len;             /* bytes received into buf */
+    size_t pos;             /* bytes already handed to the reader */
+    int recv_inflight;
+    int recv_done;          /* recv_res holds a result not consumed yet */
+    int recv_res;
+    int send_inflight;
+    int send_res;
+} redisUring;
+
+static long long redisUringNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Dispatch every available completion to its connection. */
+static void redisUringReap(redisUringContext *u) {
+    struct hiuring_cqe cqes[64];
+    unsigned i, n;
+    redisUring *ru;
+
+    do {
+        n = hiuring_reap(u->ring, cqes, 64);
+        for (i = 0; i < n; i++) {
+            if (cqes[i].user_data == 0)
+                continue;
+
+            ru = (redisUring *)(uintptr_t)(cqes[i].user_data & ~(uint64_t)URING_OP_MASK);
+            if ((cqes[i].user_data & URING_OP_MASK) == URING_OP_SEND) {
+                ru->send_inflight = 0;
+                ru->send_res = cqes[i].res;
+            } else {
+                ru->recv_inflight = 0;
+                ru->recv_done = 1;
+                ru->recv_res = cqes[i].res;
+                if (cqes[i].res > 0) {
+                    ru->len = (size_t)cqes[i].res;
+                    ru->pos = 0;
+                }
+            }
+        }
+    } while (n == 64);
+}
+
+/* Submit what is queued and wait until *inflight is cleared. Returns 0,
+ * -ETIME when the deadline passed first, or another -errno. */
+static int redisUringWait(redisUringContext *u, int *inflight, long long timeout) {
+    long long deadline = timeout >= 0 ? redisUringNow() + timeout : -1;
+    long long left = -1;
+    int ret;
+
+    while (*inflight) {
+        if (deadline >= 0) {
+            left = deadline - redisUringNow();
+            if (left <= 0)
+                return -ETIME;
+        }
+
+        ret = hiuring_submit_and_wait(u->ring, 1, left);
+        if (ret < 0)
+            return ret;
+
+        redisUringReap(u);
+    }
+
+    return 0;
+}
+
+/* Queue a request, making room in the submission queue when it is full. */
+static int redisUringQueue(redisUringContext *u, int op, int fd, void *buf,
+                           size_t len, uint64_t user_data) {
+    int ret, retry;
+
+    for (retry = 0; retry < 2; retry++) {
+        if (op == URING_OP_SEND)
+            ret = hiuring_prep_send(u->ring, fd, buf, len, user_data | URING_OP_SEND);
+        else if (u->fixed && ((redisUring *)(uintptr_t)user_data)->index >= 0)
+            ret = hiuring_prep_read_fixed(u->ring, fd, buf, len, 0, user_data);
+        else
+            ret = hiuring_prep_recv(u->ring, fd, buf, len, user_data);
+
+        if (ret != -EBUSY)
+            return ret;
+
+        hiuring_submit(u->ring);
+        redisUringReap(u);
+    }
+
+    return -EBUSY;
+}
+
+static int redisUringQueueRecv(redisUring *ru, int fd) {
+    int ret;
+
+    ret = redisUringQueue(ru->u, URING_OP_RECV, fd, ru->buf, ru->u->bufsize,
+                          (uint64_t)(uintptr_t)ru);
+    if (ret == 0)
+        ru->recv_inflight = 1;
+    return ret;
+}
+
+static int redisUringQueueSend(redisUring *ru, redisContext *c) {
+    int ret;
+
+    ret = redisUringQueue(ru->u, URING_OP_SEND, c->fd, c->obuf, sdslen(c->obuf),
+                          (uint64_t)(uintptr_t)ru);
+    if (ret == 0)
+        ru->send_inflight = 1;
+    return ret;
+}
+
+/* Cancel an in-flight request and wait for it to go away, the kernel may
+ * still write to its buffer until then. */
+static void redisUringCancel(redisUring *ru, int op, int *inflight) {
+    uint64_t target = (uint64_t)(uintptr_t)ru | (uint64_t)op;
+
+    if (!*inflight)
+        return;
+
+    if (hiuring_prep_cancel(ru->u->ring, target, 0) == -EBUSY) {
+        hiuring_submit(ru->u->ring);
+        hiuring_prep_cancel(ru->u->ring, target, 0);
+    }
+    redisUringWait(ru->u, inflight, -1);
+}
+
+/* Wait for the socket to take more data after a send came back with EAGAIN,
+ * rather than sending again right away. The poll stands in for the send: it
+ * completes with the events in send_res. Returns 0 or a -errno. */
+static int redisUringWaitWritable(redisUring *ru, int fd) {
+    uint64_t user_data = (uint64_t)(uintptr_t)ru | URING_OP_SEND;
+    int ret;
+
+    if ((ret = hiuring_prep_poll_add(ru->u->ring, fd, HIURING_POLL_OUT, user_data)) == -EBUSY) {
+        hiuring_submit(ru->u->ring);
+        redisUringReap(ru->u);
+        ret = hiuring_prep_poll_add(ru->u->ring, fd, HIURING_POLL_OUT, user_data);
+    }
+    if (ret != 0)
+        return ret;
+
+    ru->send_inflight = 1;
+    ret = redisUringWait(ru->u, &ru->send_inflight, ru->u->timeout);
+    if (ret != 0) {
+        redisUringCancel(ru, URING_OP_SEND, &ru->send_inflight);
+        return ret;
+    }
+
+    return ru->send_res < 0 ? ru->send_res : 0;
+}
+
+static void redisUringSetIOError(redisContext *c, int res) {
+    if (res == -ETIME || res == -ETIMEDOUT) {
+        __redisSetError(c, REDIS_ERR_TIMEOUT, "io_uring timeout");
+    } else {
+        errno = -res;
+        __redisSetError(c, REDIS_ERR_IO, NULL);
+    }
+}
+
+/**
+ * Implementation of redisContextFuncs for io_uring connections.
+ */
+
+static void redisUringFree(void *privctx) {
+    redisUring *ru = privctx;
+
+    if (!ru) return;
+
+    redisUringCancel(ru, URING_OP_RECV, &ru->recv_inflight);
+    redisUringCancel(ru, URING_OP_SEND, &ru->send_inflight);
+
+    if (ru->index >= 0)
+        ru->u->used[ru->index] = 0;
+    else
+        hi_free(ru->buf);
+    hi_free(ru);
+}
+
+static ssize_t redisUringRead(redisContext *c, char *buf, size_t bufcap) {
+    redisUring *ru = c->privctx;
+    size_t n;
+    int ret;
+
+    /* Reconnected without redisInitiateUring(). */
+    if (ru == NULL)
+        return redisNetRead(c, buf, bufcap);
+
+    if (ru->pos < ru->len)
+        goto copy;
+
+    if (!ru->recv_done) {
+        if (!ru->recv_inflight && (ret = redisUringQueueRecv(ru, c->fd)) != 0) {
+            redisUringSetIOError(c, ret);
+            return -1;
+        }
+
+        if (c->flags & REDIS_BLOCK) {
+            ret = redisUringWait(ru->u, &ru->recv_inflight, ru->u->timeout);
+            if (ret != 0) {
+                redisUringCancel(ru, URING_OP_RECV, &ru->recv_inflight);
+                redisUringSetIOError(c, ret);
+                return -1;
+            }
+        } else {
+            hiuring_submit(ru->u->ring);
+            redisUringReap(ru->u);
+            if (!ru->recv_done)
+                return 0;
+        }
+    }
+
+    ru->recv_done = 0;
+    if (ru->recv_res == 0) {
+        __redisSetError(c, REDIS_ERR_EOF, "Server closed the connection");
+        return -1;
+    } else if (ru->recv_res < 0) {
+        if (ru->recv_res == -EAGAIN || ru->recv_res == -EINTR)
+            return 0;
+        redisUringSetIOError(c, ru->recv_res);
+        return -1;
+    }
+
+copy:
+    n = ru->len - ru->pos;
+    if (n > bufcap)
+        n = bufcap;
+    memcpy(buf, ru->buf + ru->pos, n);
+    ru->pos += n;
+    if (ru->pos == ru->len)
+        ru->pos = ru->len = 0;
+    return (ssize_t)n;
+}
+
+/* The kernel reads from c->obuf until the send completes, so even a non
+ * blocking write waits for it. Non blocking sockets complete right away. */
+static ssize_t redisUringWrite(redisContext *c) {
+    redisUring *ru = c->privctx;
+    int ret;
+
+    if (ru == NULL)
+        return redisNetWrite(c);
+
+    if ((ret = redisUringQueueSend(ru, c)) != 0) {
+        redisUringSetIOError(c, ret);
+        return -1;
+    }
+
+    ret = redisUringWait(ru->u, &ru->send_inflight, ru->u->timeout);
+    if (ret != 0) {
+        redisUringCancel(ru, URING_OP_SEND, &ru->send_inflight);
+        redisUringSetIOError(c, ret);
+        return -1;
+    }
+
+    if (ru->send_res < 0) {
+        ret = ru->send_res;
+        if (ret == -EAGAIN && (c->flags & REDIS_BLOCK))
+            ret = redisUringWaitWritable(ru, c->fd);
+        if (ret == 0 || ret == -EAGAIN || ret == -EINTR)
+            return 0;
+        redisUringSetIOError(c, ret);
+        return -1;
+    }
+    return ru->send_res;
+}
+
+redisContextFuncs redisContextUringFuncs = {
+    .free_privctx = redisUringFree,
+    .async_read = redisAsyncRead,
+    .async_write = redisAsyncWrite,
+    .read = redisUringRead,
+    .write = redisUringWrite
+};
+
+redisUringContext *redisCreateUringContext(unsigned entries, unsigned nbufs,
+        size_t bufsize) {
+    redisUringContext *u;
+    struct iovec iov;
+
+    if (entries == 0) entries = URING_DEFAULT_ENTRIES;
+    if (nbufs == 0) nbufs = URING_DEFAULT_NBUFS;
+    if (bufsize == 0) bufsize = URING_DEFAULT_BUFSIZE;
+
+    u = hi_calloc(1, sizeof(*u));
+    if (u == NULL)
+        return NULL;
+
+    u->ring = hiuring_create(entries);
+    u->arena = hi_malloc(nbufs * bufsize);
+    u->used = hi_calloc(nbufs, 1);
+    if (u->ring == NULL || u->arena == NULL || u->used == NULL) {
+        redisFreeUringContext(u);
+        return NULL;
+    }
+
+    u->nbufs = nbufs;
+    u->bufsize = bufsize;
+    u->timeout = -1;
+
+    /* Without the registration (RLIMIT_MEMLOCK, old kernel) the arena is
+     * still used, with plain recv requests. */
+    iov.iov_base = u->arena;
+    iov.iov_len = nbufs * bufsize;
+    u->fixed = hiuring_register_buffers(u->ring, &iov, 1) == 0;
+
+    return u;
+}
+
+void redisFreeUringContext(redisUringContext *u) {
+    if (u == NULL)
+        return;
+
+    if (u->ring)
+        hiuring_destroy(u->ring);
+    hi_free(u->arena);
+    hi_free(u->used);
+    hi_free(u);
+}
+
+void redisUringSetTimeout(redisUringContext *u, const struct timeval tv) {
+    u->timeout = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int redisInitiateUring(redisContext *c, redisUringContext *u) {
+    redisUring *ru;
+    unsigned i;
+
+    if (!c || !u)
+        return REDIS_ERR;
+
+    if (c->privctx) {
+        __redisSetError(c, REDIS_ERR_OTHER, "redisContext was already associated");
+        return REDIS_ERR;
+    }
+
+    ru = hi_calloc(1, sizeof(*ru));
+    if (ru == NULL) {
+        __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
+
+    ru->u = u;
+    ru->index = -1;
+    for (i = 0; i < u->nbufs; i++) {
+        if (!u->used[i]) {
+            u->used[i] = 1;
+            ru->index = (int)i;
+            ru->buf = u->arena + i * u->bufsize;
+            break;
+        }
+    }
+
+    /* More connections than registered buffers. */
+    if (ru->buf == NULL && (ru->buf = hi_malloc(u->bufsize)) == NULL) {
+        hi_free(ru);
+        __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+        return REDIS_ERR;
+    }
+
+    c->funcs = &redisContextUringFuncs;
+    c->privctx = ru;
+
+    return REDIS_OK;
+}
+
+/* The kernel reads from the output buffer of a context until its send
+ * completes: once a send is queued, the buffer is only handed back after
+ * its completion, even when the flush of another context failed. A failed
+ * context gets the error, the others are flushed as usual. */
+int redisUringFlush(redisUringContext *u, redisContext **cs, size_t n) {
+    redisUring *ru;
+    size_t i, pending;
+    int ret, wdone, status = REDIS_OK;
+
+    for (;;) {
+        pending = 0;
+
+        for (i = 0; i < n; i++) {
+            redisContext *c = cs[i];
+
+            if (c->err || !(c->flags & REDIS_BLOCK) || sdslen(c->obuf) == 0)
+                continue;
+
+            if (c->funcs != &redisContextUringFuncs || c->privctx == NULL) {
+                do {
+                    if (redisBufferWrite(c, &wdone) == REDIS_ERR) {
+                        status = REDIS_ERR;
+                        break;
+                    }
+                } while (!wdone);
+                continue;
+            }
+
+            ru = c->privctx;
+            if ((ret = redisUringQueueSend(ru, c)) != 0) {
+                redisUringSetIOError(c, ret);
+                status = REDIS_ERR;
+                continue;
+            }
+            pending++;
+
+            /* Replies are read ahead into the buffer of the connection. */
+            if (!ru->recv_inflight && !ru->recv_done && ru->pos == ru->len)
+                redisUringQueueRecv(ru, c->fd);
+        }
+
+        if (pending == 0)
+            return status;
+
+        for (i = 0; i < n; i++) {
+            redisContext *c = cs[i];
+
+            if (c->funcs != &redisContextUringFuncs || (ru = c->privctx) == NULL ||
+                !ru->send_inflight)
+                continue;
+
+            ret = redisUringWait(u, &ru->send_inflight, u->timeout);
+            if (ret != 0) {
+                redisUringCancel(ru, URING_OP_SEND, &ru->send_inflight);
+                redisUringSetIOError(c, ret);
+                status = REDIS_ERR;
+            }
+        }
+
+        /* Every send is over: consume what each one wrote, so that nothing
+         * is sent twice by the next flush. */
+        for (i = 0; i < n; i++) {
+            redisContext *c = cs[i];
+
+            if (c->funcs != &redisContextUringFuncs || (ru = c->privctx) == NULL ||
+                c->err || !(c->flags & REDIS_BLOCK) || sdslen(c->obuf) == 0)
+                continue;
+
+            if (ru->send_res < 0) {
+                ret = ru->send_res;
+                if (ret == -EAGAIN)
+                    ret = redisUringWaitWritable(ru, c->fd);
+                if (ret == 0 || ret == -EINTR)
+                    continue;
+                redisUringSetIOError(c, ret);
+                status = REDIS_ERR;
+                continue;
+            }
+
+            if (ru->send_res == (int)sdslen(c->obuf)) {
+                sdsfree(c->obuf);
+                c->obuf = sdsempty();
+                if (c->obuf == NULL) {
+                    __redisSetError(c, REDIS_ERR_OOM, "Out of memory");
+                    status = REDIS_ERR;
+                }
+            } else {
+                sdsrange(c->obuf, ru->send_res, -1);
+            }
+        }
+    }
+}